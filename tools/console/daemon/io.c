@@ -37,6 +37,7 @@
 #include <termios.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -50,6 +51,10 @@
 #include <sys/ioctl.h>
 #include <libutil.h>
 #endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 #include <xen-tools/common-macros.h>
 
 /* Each 10 bits takes ~ 3 digits, plus one, plus one for nul terminator. */
@@ -60,6 +65,9 @@
 /* Duration of each time period in ms */
 #define RATE_LIMIT_PERIOD 200
 
+/* Number of log lines written with a single writev() */
+#define LOG_BATCH_LINES 64
+
 extern int log_reload;
 extern int log_guest;
 extern int log_hv;
@@ -80,6 +88,25 @@ static struct pollfd  *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
 
+#ifdef USE_EPOLL
+/*
+ * Where available the descriptors are kept in an epoll set instead of the
+ * pollfd array above, which then isn't rebuilt for every iteration of the
+ * main loop.  A descriptor's registration is only changed when the events
+ * it is waited for change.
+ */
+static int epoll_fd = -1;
+
+#define EPOLL_MAX_EVENTS 256
+#endif
+
+/* State of one descriptor waited for in the main loop. */
+struct pollent {
+	int idx;	/* Index in the pollfd array, or -1. */
+	short events;	/* Events registered with epoll. */
+	short revents;	/* Events reported by epoll. */
+};
+
 struct buffer {
 	char *data;
 	size_t consumed;
@@ -91,7 +118,7 @@ struct buffer {
 struct console {
 	const char *ttyname;
 	int master_fd;
-	int master_pollfd_idx;
+	struct pollent master_poll;
 	int slave_fd;
 	int log_fd;
 	struct buffer buffer;
@@ -99,7 +126,7 @@ struct console {
 	const char *log_suffix;
 	int ring_ref;
 	xenevtchn_handle *xce_handle;
-	int xce_pollfd_idx;
+	struct pollent xce_poll;
 	int event_count;
 	long long next_period;
 	xenevtchn_port_or_error_t local_port;
@@ -265,6 +292,44 @@ static int write_all(int fd, const char* buf, size_t len)
 	return 0;
 }
 
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret;
+
+	if (replace_escape) {
+		for (; iovcnt; iov++, iovcnt--)
+			if (write_all(fd, iov->iov_base, iov->iov_len))
+				return -1;
+		return 0;
+	}
+
+	while (iovcnt) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		/* Skip what has been written, which may end mid-vector. */
+		while (iovcnt && ret >= (ssize_t)iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write data, prefixing each line with a timestamp.  The timestamps and
+ * lines are collected in an iovec array, so a whole batch of lines is
+ * written with one system call.
+ */
 static int write_with_timestamp(int fd, const char *data, size_t sz,
 				int *needts)
 {
@@ -273,6 +338,8 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 	const struct tm *tmnow = localtime(&now);
 	size_t tslen = strftime(ts, sizeof(ts), "[%Y-%m-%d %H:%M:%S] ", tmnow);
 	const char *last_byte = data + sz - 1;
+	struct iovec iov[2 * LOG_BATCH_LINES];
+	int iovcnt = 0;
 
 	while (data <= last_byte) {
 		const char *nl = memchr(data, '\n', last_byte + 1 - data);
@@ -280,9 +347,20 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		if (!found_nl)
 			nl = last_byte;
 
-		if ((*needts && write_all(fd, ts, tslen))
-		    || write_all(fd, data, nl + 1 - data))
-			return -1;
+		if (iovcnt > ARRAY_SIZE(iov) - 2) {
+			if (writev_all(fd, iov, iovcnt))
+				return -1;
+			iovcnt = 0;
+		}
+
+		if (*needts) {
+			iov[iovcnt].iov_base = ts;
+			iov[iovcnt].iov_len = tslen;
+			iovcnt++;
+		}
+		iov[iovcnt].iov_base = (void *)data;
+		iov[iovcnt].iov_len = nl + 1 - data;
+		iovcnt++;
 
 		*needts = found_nl;
 		data = nl + 1;
@@ -293,7 +371,7 @@ static int write_with_timestamp(int fd, const char *data, size_t sz,
 		}
 	}
 
-	return 0;
+	return iovcnt ? writev_all(fd, iov, iovcnt) : 0;
 }
 
 static inline bool buffer_available(struct console *con)
@@ -482,9 +560,37 @@ static int create_console_log(struct console *con)
 	return fd;
 }
 
+/* Stop waiting for events on fd, which is about to be closed. */
+static void pollent_del(int fd, struct pollent *pe)
+{
+#ifdef USE_EPOLL
+	if (pe->events && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+		dolog(LOG_ERR, "epoll_ctl failed for fd %d: %d (%s)",
+		      fd, errno, strerror(errno));
+	pe->events = 0;
+#endif
+	pe->revents = 0;
+}
+
+/* Events reported for a descriptor in the last iteration of the main loop. */
+static short pollent_revents(struct pollent *pe)
+{
+	if (pe->idx != -1)
+		return fds[pe->idx].revents;
+
+	return pe->revents;
+}
+
+static void pollent_reset(struct pollent *pe)
+{
+	pe->idx = -1;
+	pe->revents = 0;
+}
+
 static void console_close_tty(struct console *con)
 {
 	if (con->master_fd != -1) {
+		pollent_del(con->master_fd, &con->master_poll);
 		close(con->master_fd);
 		con->master_fd = -1;
 	}
@@ -743,8 +849,10 @@ static int console_create_ring(struct console *con)
 
 	con->local_port = -1;
 	con->remote_port = -1;
-	if (con->xce_handle != NULL)
+	if (con->xce_handle != NULL) {
+		pollent_del(xenevtchn_fd(con->xce_handle), &con->xce_poll);
 		xenevtchn_close(con->xce_handle);
+	}
 
 	/* Opening evtchn independently for each console is a bit
 	 * wasteful, but that's how the code is structured... */
@@ -820,13 +928,13 @@ static int console_init(struct console *con, struct domain *dom, void **data)
 	}
 
 	con->master_fd = -1;
-	con->master_pollfd_idx = -1;
+	con->master_poll.idx = -1;
 	con->slave_fd = -1;
 	con->log_fd = -1;
 	con->ring_ref = -1;
 	con->local_port = -1;
 	con->remote_port = -1;
-	con->xce_pollfd_idx = -1;
+	con->xce_poll.idx = -1;
 	con->next_period = ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + RATE_LIMIT_PERIOD;
 	con->d = dom;
 	con->ttyname = (*con_type)->ttyname;
@@ -937,8 +1045,10 @@ static void cleanup_domain(struct domain *d)
 
 static void console_close_evtchn(struct console *con)
 {
-	if (con->xce_handle != NULL)
+	if (con->xce_handle != NULL) {
+		pollent_del(xenevtchn_fd(con->xce_handle), &con->xce_poll);
 		xenevtchn_close(con->xce_handle);
+	}
 
 	con->xce_handle = NULL;
 }
@@ -1121,17 +1231,16 @@ static void handle_ring_read(struct console *con)
 
 static void handle_console_ring(struct console *con)
 {
+	short revents = pollent_revents(&con->xce_poll);
+
 	if (con->event_count < RATE_LIMIT_ALLOWANCE) {
 		if (con->xce_handle != NULL &&
-		    con->xce_pollfd_idx != -1 &&
-		    !(fds[con->xce_pollfd_idx].revents &
-		      ~(POLLIN|POLLOUT|POLLPRI)) &&
-		    (fds[con->xce_pollfd_idx].revents &
-		     POLLIN))
+		    !(revents & ~(POLLIN|POLLOUT|POLLPRI)) &&
+		    (revents & POLLIN))
 			handle_ring_read(con);
 	}
 
-	con->xce_pollfd_idx = -1;
+	pollent_reset(&con->xce_poll);
 }
 
 static void handle_xs(void)
@@ -1252,6 +1361,61 @@ fail:
 	return -1;
 }
 
+/*
+ * Wait for events on fd in the next iteration of the main loop, or stop
+ * waiting for it if events is 0.
+ */
+static void pollent_set(int fd, short events, struct pollent *pe)
+{
+#ifdef USE_EPOLL
+	struct epoll_event ev = { .events = events, .data.ptr = pe };
+	int op;
+
+	if (epoll_fd != -1) {
+		if (events == pe->events)
+			return;
+
+		if (!pe->events)
+			op = EPOLL_CTL_ADD;
+		else if (!events)
+			op = EPOLL_CTL_DEL;
+		else
+			op = EPOLL_CTL_MOD;
+
+		if (epoll_ctl(epoll_fd, op, fd, &ev)) {
+			dolog(LOG_ERR, "epoll_ctl failed, ignoring fd %d: %d (%s)",
+			      fd, errno, strerror(errno));
+			return;
+		}
+		pe->events = events;
+		return;
+	}
+#endif
+
+	if (events)
+		pe->idx = set_fds(fd, events);
+}
+
+static int wait_fds(int timeout)
+{
+#ifdef USE_EPOLL
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct pollent *pe;
+	int i, ret;
+
+	if (epoll_fd != -1) {
+		ret = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+		for (i = 0; i < ret; i++) {
+			pe = events[i].data.ptr;
+			pe->revents = events[i].events;
+		}
+		return ret;
+	}
+#endif
+
+	return poll(fds, nr_fds, timeout);
+}
+
 static void reset_fds(void)
 {
 	nr_fds = 0;
@@ -1262,6 +1426,7 @@ static void reset_fds(void)
 static void maybe_add_console_evtchn_fd(struct console *con, void *data)
 {
 	long long next_timeout = *((long long *)data);
+	short events = 0;
 
 	if (con->event_count >= RATE_LIMIT_ALLOWANCE) {
 		/* Determine if we're going to be the next time slice to expire */
@@ -1269,13 +1434,14 @@ static void maybe_add_console_evtchn_fd(struct console *con, void *data)
 		    con->next_period < next_timeout)
 			next_timeout = con->next_period;
 	} else if (con->xce_handle != NULL) {
-		if (buffer_available(con)) {
-			int evtchn_fd = xenevtchn_fd(con->xce_handle);
-			con->xce_pollfd_idx = set_fds(evtchn_fd,
-						      POLLIN|POLLPRI);
-		}
+		if (buffer_available(con))
+			events = POLLIN|POLLPRI;
 	}
 
+	if (con->xce_handle != NULL)
+		pollent_set(xenevtchn_fd(con->xce_handle), events,
+			    &con->xce_poll);
+
 	*((long long *)data) = next_timeout;
 }
 
@@ -1290,36 +1456,37 @@ static void maybe_add_console_tty_fd(struct console *con)
 			events |= POLLOUT;
 
 		if (events)
-			con->master_pollfd_idx =
-				set_fds(con->master_fd, events|POLLPRI);
+			events |= POLLPRI;
+
+		pollent_set(con->master_fd, events, &con->master_poll);
 	}
 }
 
 static void handle_console_tty(struct console *con)
 {
-	if (con->master_fd != -1 && con->master_pollfd_idx != -1) {
-		if (fds[con->master_pollfd_idx].revents &
-		    ~(POLLIN|POLLOUT|POLLPRI))
+	short revents = pollent_revents(&con->master_poll);
+
+	if (con->master_fd != -1 && revents) {
+		if (revents & ~(POLLIN|POLLOUT|POLLPRI))
 			console_handle_broken_tty(con, domain_is_valid(con->d->domid));
 		else {
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLIN)
+			if (revents & POLLIN)
 				handle_tty_read(con);
-			if (fds[con->master_pollfd_idx].revents &
-			    POLLOUT)
+			if (revents & POLLOUT)
 				handle_tty_write(con);
 		}
 	}
-	con->master_pollfd_idx = -1;
+	pollent_reset(&con->master_poll);
 }
 
 void handle_io(void)
 {
 	int ret;
 	xenevtchn_port_or_error_t log_hv_evtchn = -1;
-	int xce_pollfd_idx = -1;
-	int xs_pollfd_idx = -1;
+	struct pollent xce_poll = { .idx = -1 };
+	struct pollent xs_poll = { .idx = -1 };
 	xenevtchn_handle *xce_handle = NULL;
+	short revents;
 
 	if (log_hv) {
 		xce_handle = xenevtchn_open(NULL, 0);
@@ -1355,6 +1522,13 @@ void handle_io(void)
 		goto out;
 	}
 
+#ifdef USE_EPOLL
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		dolog(LOG_WARNING, "epoll not available, using poll: %d (%s)",
+		      errno, strerror(errno));
+#endif
+
 	enum_domains();
 
 	for (;;) {
@@ -1365,11 +1539,11 @@ void handle_io(void)
 
 		reset_fds();
 
-		xs_pollfd_idx = set_fds(xs_fileno(xs), POLLIN|POLLPRI);
+		pollent_set(xs_fileno(xs), POLLIN|POLLPRI, &xs_poll);
 
 		if (log_hv)
-			xce_pollfd_idx = set_fds(xenevtchn_fd(xce_handle),
-						 POLLIN|POLLPRI);
+			pollent_set(xenevtchn_fd(xce_handle), POLLIN|POLLPRI,
+				    &xce_poll);
 
 		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
 			break;
@@ -1396,7 +1570,7 @@ void handle_io(void)
 			poll_timeout = (int)duration;
 		}
 
-		ret = poll(fds, nr_fds, next_timeout ? poll_timeout : -1);
+		ret = wait_fds(next_timeout ? poll_timeout : -1);
 
 		if (log_reload) {
 			int saved_errno = errno;
@@ -1417,32 +1591,32 @@ void handle_io(void)
 			break;
 		}
 
-		if (log_hv && xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+		if (log_hv) {
+			revents = pollent_revents(&xce_poll);
+			if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
 				dolog(LOG_ERR,
 				      "Failure in poll xce_handle: %d (%s)",
 				      errno, strerror(errno));
 				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN)
+			} else if (revents & POLLIN)
 				handle_hv_logs(xce_handle, false);
 
-			xce_pollfd_idx = -1;
+			pollent_reset(&xce_poll);
 		}
 
 		if (ret <= 0)
 			continue;
 
-		if (xs_pollfd_idx != -1) {
-			if (fds[xs_pollfd_idx].revents & ~(POLLIN|POLLOUT|POLLPRI)) {
-				dolog(LOG_ERR,
-				      "Failure in poll xs_handle: %d (%s)",
-				      errno, strerror(errno));
-				break;
-			} else if (fds[xs_pollfd_idx].revents & POLLIN)
-				handle_xs();
+		revents = pollent_revents(&xs_poll);
+		if (revents & ~(POLLIN|POLLOUT|POLLPRI)) {
+			dolog(LOG_ERR,
+			      "Failure in poll xs_handle: %d (%s)",
+			      errno, strerror(errno));
+			break;
+		} else if (revents & POLLIN)
+			handle_xs();
 
-			xs_pollfd_idx = -1;
-		}
+		pollent_reset(&xs_poll);
 
 		for (d = dom_head; d; d = n) {
 
@@ -1463,6 +1637,13 @@ void handle_io(void)
 	free(fds);
 	current_array_size = 0;
 
+#ifdef USE_EPOLL
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+#endif
+
  out:
 	if (log_hv_fd != -1) {
 		close(log_hv_fd);
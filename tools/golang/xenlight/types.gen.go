@@ -37,6 +37,7 @@ ErrorQmpCommandNotFound Error = -29
 ErrorQmpDeviceNotActive Error = -30
 ErrorQmpDeviceNotFound Error = -31
 ErrorQemuApi Error = -32
+ErrorPostcopyFailed Error = -33
 )
 
 type DomainType int
@@ -186,6 +187,13 @@ SchedulerRtds Scheduler = 8
 SchedulerNull Scheduler = 9
 )
 
+type CpupoolGran int
+const(
+CpupoolGranCpu CpupoolGran = 0
+CpupoolGranCore CpupoolGran = 1
+CpupoolGranSocket CpupoolGran = 2
+)
+
 type ShutdownReason int
 const(
 ShutdownReasonUnknown ShutdownReason = -1
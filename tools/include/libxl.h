@@ -1430,6 +1430,32 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_CREATEINFO_XEND_SUSPEND_EVTCHN_COMPAT
 
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_POSTCOPY
+ *
+ * If this is defined, libxl_domain_suspend_postcopy() is available and
+ * libxl_domain_create_restore() accepts the post-copy streams it writes.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_POSTCOPY 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_SUSPEND_COMPRESS
+ *
+ * If this is defined, libxl_domain_suspend() and
+ * libxl_domain_suspend_postcopy() accept LIBXL_SUSPEND_PIPELINE and
+ * LIBXL_SUSPEND_COMPRESS.
+ */
+#define LIBXL_HAVE_DOMAIN_SUSPEND_COMPRESS 1
+
+/*
+ * LIBXL_HAVE_CPUPOOL_SET_GRANULARITY
+ *
+ * If this is defined, libxl_cpupool_set_granularity() is available to
+ * change the scheduling granularity of a cpupool, also while it has cpus
+ * and domains assigned.
+ */
+#define LIBXL_HAVE_CPUPOOL_SET_GRANULARITY 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1792,6 +1818,37 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/*
+ * Encode and write page data from several threads, eliding zero pages.
+ * The receiving side must understand PAGE_DATA_ENCODED records.
+ */
+#define LIBXL_SUSPEND_PIPELINE 4
+/*
+ * Compress page data, if libxenguest was built with a compressor.
+ * Implies LIBXL_SUSPEND_PIPELINE.
+ */
+#define LIBXL_SUSPEND_COMPRESS 8
+
+/*
+ * Live migrate a domain using post-copy: after a bounded number of
+ * pre-copy iterations the domain is suspended, its vcpu and device
+ * state is sent, and it resumes at the destination while the rest of
+ * its memory is pulled across on demand.  recv_fd is the back channel
+ * from the destination, on which its page requests arrive.  Only HVM
+ * guests are supported.  LIBXL_SUSPEND_LIVE is implied.
+ *
+ * On the receiving side libxl_domain_create_restore() runs the domain
+ * while its memory arrives, and returns it paused once the migration
+ * has completed.
+ *
+ * ERROR_POSTCOPY_FAILED means the migration failed after the domain had
+ * been started at the destination; it must not be resumed here.
+ */
+int libxl_domain_suspend_postcopy(libxl_ctx *ctx, uint32_t domid,
+                                  int send_fd, int recv_fd,
+                                  int flags, /* LIBXL_SUSPEND_* */
+                                  const libxl_asyncop_how *ao_how)
+                                  LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
@@ -2742,6 +2799,14 @@ int libxl_cpupool_cpuremove_cpumap(libxl_ctx *ctx, uint32_t poolid,
                                    const libxl_bitmap *cpumap);
 int libxl_cpupool_movedomain(libxl_ctx *ctx, uint32_t poolid, uint32_t domid);
 int libxl_cpupool_info(libxl_ctx *ctx, libxl_cpupoolinfo *info, uint32_t poolid);
+/*
+ * If the cpupool has cpus assigned, its cpus and domains are moved to a
+ * temporary cpupool with the new granularity and back.  This isn't possible
+ * for cpupool 0, which always has cpu 0 assigned.  The vcpu affinities and
+ * scheduling parameters of the domains are restored after the move.
+ */
+int libxl_cpupool_set_granularity(libxl_ctx *ctx, uint32_t poolid,
+                                  libxl_cpupool_gran gran);
 
 int libxl_domid_valid_guest(uint32_t domid);
 
@@ -2005,6 +2005,13 @@ int xc_mem_paging_prep(xc_interface *xch, uint32_t domain_id, uint64_t gfn);
 int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                        uint64_t gfn, void *buffer);
 
+/*
+ * Enter @nr gfns starting at @gfn into the paged-out state, evicting any
+ * memory backing them.  Used by post-copy restore before the guest runs.
+ */
+int xc_mem_paging_populate_evicted(xc_interface *xch, uint32_t domain_id,
+                                   uint64_t gfn, uint32_t nr);
+
 /** 
  * Access tracking operations.
  * Supported only on Intel EPT 64 bit processors.
@@ -26,6 +26,25 @@
 
 #define XCFLAGS_LIVE      (1 << 0)
 #define XCFLAGS_DEBUG     (1 << 1)
+#define XCFLAGS_COMPRESS  (1 << 2)
+/*
+ * Post-copy live migration (HVM only).  When precopy stops, the pages still
+ * dirty are not sent before the guest is resumed at the destination.  They
+ * are pushed in the background, and fetched on demand when the guest faults
+ * on them, with the receiver reporting faults over the back channel.
+ */
+#define XCFLAGS_POSTCOPY  (1 << 3)
+/*
+ * Number of threads encoding and writing page data, 0 for none.  Any non-zero
+ * value (implied by XCFLAGS_COMPRESS) makes the stream use PAGE_DATA_ENCODED
+ * records, which elide zero pages.
+ */
+#define XCFLAGS_WORKERS_SHIFT 8
+#define XCFLAGS_WORKERS_MASK  (0xffU << XCFLAGS_WORKERS_SHIFT)
+#define XCFLAGS_WORKERS(n)    \
+    (((uint32_t)(n) << XCFLAGS_WORKERS_SHIFT) & XCFLAGS_WORKERS_MASK)
+#define XCFLAGS_GET_WORKERS(f) \
+    (((f) & XCFLAGS_WORKERS_MASK) >> XCFLAGS_WORKERS_SHIFT)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -439,6 +458,13 @@ struct precopy_stats
     unsigned int iteration;
     unsigned long total_written;
     long dirty_count; /* -1 if unknown */
+
+    /* Measured over the last iteration, in pages per second.  0 if unknown. */
+    unsigned long dirty_rate;       /* Rate the guest dirtied memory at. */
+    unsigned long bandwidth;        /* Rate memory was sent at. */
+
+    /* Milliseconds to send dirty_count pages at bandwidth.  -1 if unknown. */
+    long predicted_downtime;
 };
 
 /*
@@ -467,6 +493,12 @@ struct save_callbacks {
 #define XGS_POLICY_CONTINUE_PRECOPY 0  /* Remain in the precopy phase. */
 #define XGS_POLICY_STOP_AND_COPY    1  /* Immediately suspend and transmit the
                                         * remaining dirty pages. */
+#define XGS_POLICY_POSTCOPY         2  /* Immediately suspend, and resume the
+                                        * guest at the destination before
+                                        * transmitting the remaining dirty
+                                        * pages.  Requires XCFLAGS_POSTCOPY,
+                                        * which also turns STOP_AND_COPY into
+                                        * POSTCOPY. */
     precopy_policy_t precopy_policy;
 
     /*
@@ -506,6 +538,18 @@ struct save_callbacks {
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
+    /*
+     * Post-copy only.  Called once the POSTCOPY_TRANSITION record has been
+     * written, for the caller to write the remaining state the destination
+     * needs to resume the guest.  Page data for the guest's outstanding
+     * pages follows in the stream afterwards.
+     *
+     * returns:
+     * 0: terminate the migration with an error
+     * 1: continue with the post-copy phase
+     */
+    int (*postcopy_transition)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void *data;
 };
@@ -534,6 +578,24 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags, struct save_callbacks *callbacks,
                    xc_stream_type_t stream_type, int recv_fd);
 
+/*
+ * The precopy policy used by xc_domain_save() when no precopy_policy callback
+ * is provided: stop once fewer than 50 pages are dirty, or after 5 rounds.
+ */
+int xc_precopy_policy_simple(struct precopy_stats stats);
+
+/*
+ * An adaptive precopy policy, for precopy_policy callbacks to opt in to.
+ *
+ * Precopy continues until the remaining dirty memory is predicted to be sent
+ * in at most @downtime_target milliseconds (0 for the default), or stops
+ * early if the guest dirties memory faster than it can be sent, leaving
+ * further iterations pointless.  It may run up to 30 rounds.
+ */
+#define XC_PRECOPY_DOWNTIME_DEFAULT 300
+int xc_precopy_policy_adaptive(struct precopy_stats stats,
+                               unsigned int downtime_target);
+
 /* callbacks provided by xc_domain_restore */
 struct restore_callbacks {
     /*
@@ -583,6 +645,19 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Post-copy only.  Called once a POSTCOPY_TRANSITION record has been
+     * found in the stream, and the guest's outstanding pages have been set
+     * up to be fetched on demand.  restore_results() has been called.  The
+     * caller reads its remaining state from the stream, and resumes the
+     * guest, while libxenguest goes on to serve the guest's page faults.
+     *
+     * returns:
+     * 0: terminate processing
+     * 1: continue with the post-copy phase
+     */
+    int (*postcopy_transition)(void *data);
+
     /* to be provided as the last argument to each callback function */
     void *data;
 };
@@ -170,6 +170,40 @@ bool xs_set_permissions(struct xs_handle *h, xs_transaction_t t,
 			const char *path, struct xs_permissions *perms,
 			unsigned int num_perms);
 
+/* One operation of a request sent via xs_multi(). */
+struct xs_multi_op {
+	/* XS_READ, XS_WRITE, XS_MKDIR, XS_RM, XS_DIRECTORY, XS_GET_PERMS,
+	 * XS_SET_PERMS or XS_GET_DOMAIN_PATH (path is the domid then). */
+	enum xsd_sockmsg_type type;
+	const char *path;
+	/* XS_WRITE: value to write. */
+	const void *data;
+	unsigned int len;
+	/* XS_SET_PERMS: permissions to set. */
+	struct xs_permissions *perms;
+	unsigned int num_perms;
+
+	/* Set by xs_multi(): 0 or an errno value. */
+	int error;
+	/* Set by xs_multi() for successful operations returning data: the
+	 * raw reply as for xs_read(), i.e. malloced and nul terminated, with
+	 * reply_len not including the nul. Call free() after use. */
+	void *reply;
+	unsigned int reply_len;
+};
+
+/* Perform multiple operations with a single request to xenstored.
+ * The operations are done in order, the first failing one stops the
+ * processing; the ones not done get their error set to ECANCELED.
+ * Without a transaction (t == XBT_NULL) the request is atomic: either all
+ * modifications are done, or none of them.
+ * Returns false if any operation or the request itself failed, with errno
+ * set accordingly (ENOSYS if xenstored doesn't support XS_MULTI, E2BIG if
+ * the request or the replies exceed XENSTORE_PAYLOAD_MAX).
+ */
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops);
+
 /* Watch a node for changes (poll on fd to detect, or call read_watch()).
  * When the node (or any child) changes, fd will become readable.
  * Token is returned when watch is read, to allow matching.
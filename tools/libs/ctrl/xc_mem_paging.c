@@ -119,6 +119,20 @@ int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                                gfn, buffer);
 }
 
+int xc_mem_paging_populate_evicted(xc_interface *xch, uint32_t domain_id,
+                                   uint64_t gfn, uint32_t nr)
+{
+    xen_mem_paging_op_t mpo;
+
+    memset(&mpo, 0, sizeof(mpo));
+
+    mpo.op      = XENMEM_paging_op_populate_evicted;
+    mpo.domain  = domain_id;
+    mpo.nr      = nr;
+    mpo.gfn     = gfn;
+
+    return xc_memory_op(xch, XENMEM_paging_op, &mpo, sizeof(mpo));
+}
 
 /*
  * Local variables:
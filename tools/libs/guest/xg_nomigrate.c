@@ -39,6 +39,17 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return -1;
 }
 
+int xc_precopy_policy_simple(struct precopy_stats stats)
+{
+    return XGS_POLICY_ABORT;
+}
+
+int xc_precopy_policy_adaptive(struct precopy_stats stats,
+                               unsigned int downtime_target)
+{
+    return XGS_POLICY_ABORT;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+
+#include <xenctrl.h>
+
+#include "xg_sr_codec.h"
+#include "xg_sr_stream_format.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+bool page_codec_supported(uint16_t codec)
+{
+    switch ( codec )
+    {
+    case PAGE_CODEC_NONE:
+        return true;
+
+#ifdef HAVE_ZSTD
+    case PAGE_CODEC_ZSTD:
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned int i;
+
+    for ( i = 0; i < XC_PAGE_SIZE / sizeof(*p); i += 4 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] )
+            return false;
+
+    return true;
+}
+
+uint32_t encode_page(struct xc_sr_codec *c, uint16_t codec,
+                     const void *page, void *dst)
+{
+    if ( page_is_zero(page) )
+        return 0;
+
+#ifdef HAVE_ZSTD
+    if ( codec == PAGE_CODEC_ZSTD )
+    {
+        size_t len;
+
+        if ( !c->cctx )
+            c->cctx = ZSTD_createCCtx();
+
+        /*
+         * Anything not fitting in less than a page is sent verbatim, as is
+         * everything if we can't get a compression context.
+         */
+        if ( c->cctx )
+        {
+            len = ZSTD_compressCCtx(c->cctx, dst, XC_PAGE_SIZE - 1,
+                                    page, XC_PAGE_SIZE, 1);
+            if ( !ZSTD_isError(len) && len )
+                return len;
+        }
+    }
+#endif
+
+    return XC_PAGE_SIZE;
+}
+
+int decode_page(struct xc_sr_codec *c, uint16_t codec,
+                const void *src, uint32_t len, void *page)
+{
+    if ( len == 0 )
+    {
+        memset(page, 0, XC_PAGE_SIZE);
+        return 0;
+    }
+
+    if ( len == XC_PAGE_SIZE )
+    {
+        memcpy(page, src, XC_PAGE_SIZE);
+        return 0;
+    }
+
+    switch ( codec )
+    {
+#ifdef HAVE_ZSTD
+    case PAGE_CODEC_ZSTD:
+        if ( !c->dctx && !(c->dctx = ZSTD_createDCtx()) )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if ( ZSTD_decompressDCtx(c->dctx, page, XC_PAGE_SIZE,
+                                 src, len) != XC_PAGE_SIZE )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+#endif
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+void cleanup_page_codec(struct xc_sr_codec *c)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(c->cctx);
+    ZSTD_freeDCtx(c->dctx);
+#endif
+    c->cctx = c->dctx = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
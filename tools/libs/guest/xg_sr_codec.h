@@ -0,0 +1,51 @@
+#ifndef __CODEC__H
+#define __CODEC__H
+
+/*
+ * Encoding of the pages of PAGE_DATA_ENCODED records.  This has no
+ * dependencies on the rest of the migration code, so that it can be tested
+ * on its own.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-thread state for encoding and decoding the pages of PAGE_DATA_ENCODED
+ * records.  Must be zero-initialised, and cleaned up after use.
+ */
+struct xc_sr_codec
+{
+    void *cctx, *dctx;
+};
+
+/* Can this build of libxenguest encode and decode pages with 'codec'? */
+bool page_codec_supported(uint16_t codec);
+
+/*
+ * Encode a page for a PAGE_DATA_ENCODED record.  Returns 0 if the page is all
+ * zeroes, XC_PAGE_SIZE if it is to be sent verbatim, or otherwise the length of
+ * the compressed data written to 'dst', which must have room for a page.
+ */
+uint32_t encode_page(struct xc_sr_codec *c, uint16_t codec,
+                     const void *page, void *dst);
+
+/*
+ * Decode 'len' octets of a page from a PAGE_DATA_ENCODED record into 'page'.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int decode_page(struct xc_sr_codec *c, uint16_t codec,
+                const void *src, uint32_t len, void *page);
+
+void cleanup_page_codec(struct xc_sr_codec *c);
+
+#endif
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -8,6 +8,7 @@
 #include "xc_bitops.h"
 
 #include "xg_sr_stream_format.h"
+#include "xg_sr_codec.h"
 
 /* String representation of Domain Header types. */
 const char *dhdr_type_to_str(uint32_t type);
@@ -96,6 +97,15 @@ struct xc_sr_save_ops
      */
     int (*check_vm_state)(struct xc_sr_context *ctx);
 
+    /**
+     * Post-copy only (and optional for guest types which can't use it).  Set
+     * in the bitmap the pfns which must be sent before the guest resumes at
+     * the destination, rather than fetched on demand, e.g. pages which the
+     * toolstack or backends map without coping with them being paged out.
+     */
+    void (*postcopy_eager_pfns)(struct xc_sr_context *ctx,
+                                unsigned long *bitmap);
+
     /**
      * Clean up the local environment.  Will be called exactly once, either
      * after a successful save, or upon encountering an error.
@@ -246,6 +256,24 @@ struct xc_sr_context
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Pipelined mode: page data is encoded and written by worker
+             * threads as PAGE_DATA_ENCODED records.  Off if nr_workers is 0.
+             */
+            unsigned int nr_workers;
+            uint16_t codec;
+            struct xc_sr_save_pipeline *pipeline;
+
+            /*
+             * Post-copy mode.  Once the guest has been resumed at the
+             * destination (postcopy_active), postcopy_pfns tracks the pages
+             * which haven't been sent yet.
+             */
+            bool postcopy;
+            bool postcopy_active;
+            unsigned long *postcopy_pfns;
+            unsigned long nr_postcopy_pfns;
         } save;
 
         struct /* Restore data. */
@@ -297,6 +325,12 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Threads decoding PAGE_DATA_ENCODED records, set up on demand. */
+            struct xc_sr_decode_pool *decode_pool;
+
+            /* Post-copy state, set up by a POSTCOPY_BEGIN record. */
+            struct xc_sr_postcopy *postcopy;
         } restore;
     };
 
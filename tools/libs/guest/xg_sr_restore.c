@@ -1,6 +1,12 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xg_sr_common.h"
 
@@ -303,6 +309,50 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned int count,
     return rc;
 }
 
+/*
+ * Validate the pfn array of a PAGE_DATA or PAGE_DATA_ENCODED record, splitting
+ * it into pfns and types, and count the pages expected to have data.
+ */
+static int parse_page_data_pfns(struct xc_sr_context *ctx, unsigned int count,
+                                const uint64_t *rec_pfns, xen_pfn_t *pfns,
+                                uint32_t *types, unsigned int *pages_of_data)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t pfn;
+    uint32_t type;
+    unsigned int i;
+
+    *pages_of_data = 0;
+
+    for ( i = 0; i < count; ++i )
+    {
+        pfn = rec_pfns[i] & PAGE_DATA_PFN_MASK;
+        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        {
+            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
+            return -1;
+        }
+
+        type = (rec_pfns[i] & PAGE_DATA_TYPE_MASK) >> 32;
+        if ( !is_known_page_type(type) )
+        {
+            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
+                  type, pfn, i);
+            return -1;
+        }
+
+        if ( page_type_has_stream_data(type) )
+            /* NOTAB and all L1 through L4 tables (including pinned) should
+             * have a page worth of data in the record. */
+            (*pages_of_data)++;
+
+        pfns[i] = pfn;
+        types[i] = type;
+    }
+
+    return 0;
+}
+
 /*
  * Validate a PAGE_DATA record from the stream, and pass the results to
  * process_page_data() to actually perform the legwork.
@@ -311,11 +361,11 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned int i, pages_of_data = 0;
+    unsigned int pages_of_data = 0;
     int rc = -1;
 
-    xen_pfn_t *pfns = NULL, pfn;
-    uint32_t *types = NULL, type;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
 
     /*
      * v2 compatibility only exists for x86 streams.  This is a bit of a
@@ -371,45 +421,333 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    for ( i = 0; i < pages->count; ++i )
+    if ( parse_page_data_pfns(ctx, pages->count, pages->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
     {
-        pfn = pages->pfn[i] & PAGE_DATA_PFN_MASK;
-        if ( !ctx->restore.ops.pfn_is_valid(ctx, pfn) )
+        ERROR("PAGE_DATA record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    rc = process_page_data(ctx, pages->count, pfns, types,
+                           &pages->pfn[pages->count]);
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Threads decoding the pages of PAGE_DATA_ENCODED records.  The pages of each
+ * record are split evenly between the calling thread and the pool.
+ */
+#define MAX_DECODE_THREADS 8
+
+struct xc_sr_decode_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    uint64_t generation;
+    unsigned int pending;
+    bool exiting;
+
+    /* The record being decoded. */
+    uint16_t codec;
+    unsigned int nr_pages;
+    const uint32_t *lengths;
+    /* Offset of each page's encoded data into 'src'. */
+    const size_t *offsets;
+    const void *src;
+    void *dst;
+    bool failed;
+
+    /* Codec state for the calling thread. */
+    struct xc_sr_codec codec_state;
+
+    unsigned int nr_threads;
+    struct xc_sr_decode_thread
+    {
+        struct xc_sr_decode_pool *pool;
+        unsigned int idx;
+        pthread_t thread;
+    } threads[];
+};
+
+/* Decode this thread's share of the pages.  Share 0 is the caller's. */
+static bool decode_share(struct xc_sr_decode_pool *pool, unsigned int idx,
+                         struct xc_sr_codec *codec)
+{
+    unsigned int nr = pool->nr_threads + 1;
+    unsigned int i = (uint64_t)pool->nr_pages * idx / nr;
+    unsigned int end = (uint64_t)pool->nr_pages * (idx + 1) / nr;
+
+    for ( ; i < end; ++i )
+        if ( decode_page(codec, pool->codec, pool->src + pool->offsets[i],
+                         pool->lengths[i], pool->dst + i * PAGE_SIZE) )
+            return false;
+
+    return true;
+}
+
+static void *decode_worker(void *arg)
+{
+    struct xc_sr_decode_thread *t = arg;
+    struct xc_sr_decode_pool *pool = t->pool;
+    struct xc_sr_codec codec = { 0 };
+    uint64_t seen = 0;
+    bool ok;
+
+    pthread_mutex_lock(&pool->lock);
+    for ( ; ; )
+    {
+        while ( pool->generation == seen && !pool->exiting )
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        if ( pool->exiting )
+            break;
+
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        ok = decode_share(pool, t->idx, &codec);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( !ok )
+            pool->failed = true;
+        if ( --pool->pending == 0 )
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    cleanup_page_codec(&codec);
+
+    return NULL;
+}
+
+static void cleanup_decode_pool(struct xc_sr_context *ctx)
+{
+    struct xc_sr_decode_pool *pool = ctx->restore.decode_pool;
+    unsigned int i;
+
+    if ( !pool )
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for ( i = 0; i < pool->nr_threads; ++i )
+        pthread_join(pool->threads[i].thread, NULL);
+
+    cleanup_page_codec(&pool->codec_state);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    ctx->restore.decode_pool = NULL;
+}
+
+static int setup_decode_pool(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_decode_pool *pool;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i, nr = 0;
+    int rc;
+
+    if ( cpus > 1 )
+        nr = cpus - 1 > MAX_DECODE_THREADS ? MAX_DECODE_THREADS : cpus - 1;
+
+    pool = calloc(1, sizeof(*pool) + nr * sizeof(pool->threads[0]));
+    if ( !pool )
+    {
+        ERROR("Unable to allocate page decoding pool");
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    ctx->restore.decode_pool = pool;
+
+    for ( i = 0; i < nr; ++i )
+    {
+        pool->threads[i].pool = pool;
+        pool->threads[i].idx = i + 1;
+
+        rc = pthread_create(&pool->threads[i].thread, NULL,
+                            decode_worker, &pool->threads[i]);
+        if ( rc )
         {
-            ERROR("pfn %#"PRIpfn" (index %u) outside domain maximum", pfn, i);
-            goto err;
+            /* Carry on with fewer threads. */
+            errno = rc;
+            PERROR("Unable to create page decoding thread %u", i);
+            break;
         }
+        pool->nr_threads++;
+    }
 
-        type = (pages->pfn[i] & PAGE_DATA_TYPE_MASK) >> 32;
-        if ( !is_known_page_type(type) )
+    return 0;
+}
+
+static int decode_pages(struct xc_sr_context *ctx, uint16_t codec,
+                        unsigned int nr_pages, const uint32_t *lengths,
+                        const size_t *offsets, const void *src, void *dst)
+{
+    struct xc_sr_decode_pool *pool = ctx->restore.decode_pool;
+    bool ok;
+
+    if ( !pool && setup_decode_pool(ctx) )
+        return -1;
+    pool = ctx->restore.decode_pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->codec = codec;
+    pool->nr_pages = nr_pages;
+    pool->lengths = lengths;
+    pool->offsets = offsets;
+    pool->src = src;
+    pool->dst = dst;
+    pool->failed = false;
+    pool->pending = pool->nr_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    ok = decode_share(pool, 0, &pool->codec_state);
+
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->pending )
+        pthread_cond_wait(&pool->done, &pool->lock);
+    ok = ok && !pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * Validate a PAGE_DATA_ENCODED record from the stream, decode its pages and
+ * pass the results to process_page_data().
+ */
+static int handle_page_data_encoded(struct xc_sr_context *ctx,
+                                    struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_encoded_header *pages = rec->data;
+    unsigned int i, pages_of_data = 0;
+    size_t lengths_sz, offset, *offsets = NULL;
+    const uint32_t *lengths;
+    void *page_data = NULL;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( !ctx->restore.seen_static_data_end )
+    {
+        ERROR("No STATIC_DATA_END seen");
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*pages) )
+    {
+        ERROR("PAGE_DATA_ENCODED record truncated: length %u, min %zu",
+              rec->length, sizeof(*pages));
+        goto err;
+    }
+
+    if ( pages->count < 1 )
+    {
+        ERROR("Expected at least 1 pfn in PAGE_DATA_ENCODED record");
+        goto err;
+    }
+
+    if ( !page_codec_supported(pages->codec) )
+    {
+        ERROR("Unsupported codec %u in PAGE_DATA_ENCODED record",
+              pages->codec);
+        goto err;
+    }
+
+    if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
+    {
+        ERROR("PAGE_DATA_ENCODED record (length %u) too short to contain %u"
+              " pfns worth of information", rec->length, pages->count);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    if ( parse_page_data_pfns(ctx, pages->count, pages->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    lengths_sz = ROUNDUP(pages_of_data * sizeof(*lengths), REC_ALIGN_ORDER);
+    offset = sizeof(*pages) + (sizeof(uint64_t) * pages->count) + lengths_sz;
+    if ( rec->length < offset )
+    {
+        ERROR("PAGE_DATA_ENCODED record (length %u) too short to contain %u"
+              " page lengths", rec->length, pages_of_data);
+        goto err;
+    }
+
+    lengths = (const void *)&pages->pfn[pages->count];
+    offsets = malloc(pages_of_data * sizeof(*offsets));
+    page_data = malloc(pages_of_data * PAGE_SIZE);
+    if ( pages_of_data && (!offsets || !page_data) )
+    {
+        ERROR("Unable to allocate enough memory to decode %u pages",
+              pages_of_data);
+        goto err;
+    }
+
+    for ( i = 0; i < pages_of_data; ++i )
+    {
+        if ( lengths[i] > PAGE_SIZE )
         {
-            ERROR("Unknown type %#"PRIx32" for pfn %#"PRIpfn" (index %u)",
-                  type, pfn, i);
+            ERROR("Page %u of PAGE_DATA_ENCODED record has length %u",
+                  i, lengths[i]);
             goto err;
         }
 
-        if ( page_type_has_stream_data(type) )
-            /* NOTAB and all L1 through L4 tables (including pinned) should
-             * have a page worth of data in the record. */
-            pages_of_data++;
+        offsets[i] = offset;
+        offset += lengths[i];
+    }
 
-        pfns[i] = pfn;
-        types[i] = type;
+    if ( rec->length != offset )
+    {
+        ERROR("PAGE_DATA_ENCODED record wrong size: length %u, expected %zu",
+              rec->length, offset);
+        goto err;
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    if ( pages_of_data &&
+         decode_pages(ctx, pages->codec, pages_of_data, lengths, offsets,
+                      rec->data, page_data) )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
-              (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
+        ERROR("Failed to decode PAGE_DATA_ENCODED record");
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    rc = process_page_data(ctx, pages->count, pfns, types, page_data);
  err:
+    free(page_data);
+    free(offsets);
     free(types);
     free(pfns);
 
@@ -490,76 +828,694 @@ static int send_checkpoint_dirty_pfn_list(struct xc_sr_context *ctx)
     return rc;
 }
 
-static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
-static int handle_checkpoint(struct xc_sr_context *ctx)
+/*
+ * Post-copy.  The pfns listed in POSTCOPY_PFNS records are paged out of the
+ * guest at the transition, using the mem_paging interface, and the guest is
+ * resumed.  Its faults on them arrive as requests on the paging ring, and
+ * are passed back to the sender as POSTCOPY_FAULT records.  The pages come
+ * in as POSTCOPY_PAGE_DATA records, either answering faults or pushed in the
+ * background, and are paged straight back in.
+ */
+struct xc_sr_postcopy
+{
+    unsigned long p2m_size;
+
+    /* Pfns still to arrive, and those the sender has been asked for. */
+    unsigned long *pending;
+    unsigned long *requested;
+    unsigned long nr_pending;
+
+    /* Set once the guest has been handed back to the caller to resume. */
+    bool transitioned;
+
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    xenevtchn_handle *xce;
+    evtchn_port_t port;
+
+    /* Requests waiting for their page to arrive. */
+    vm_event_request_t *waiting;
+    unsigned int nr_waiting, max_waiting;
+};
+
+static void cleanup_postcopy(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    int rc = 0, ret;
-    unsigned int i;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
 
-    if ( ctx->stream_type == XC_STREAM_PLAIN )
+    if ( !pc )
+        return;
+
+    if ( pc->ring_page )
     {
-        ERROR("Found checkpoint in non-checkpointed stream");
-        rc = -1;
-        goto err;
+        xenforeignmemory_unmap(xch->fmem, pc->ring_page, 1);
+        if ( xc_mem_paging_disable(xch, ctx->domid) )
+            PERROR("Failed to disable paging");
     }
 
-    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
-    switch ( ret )
-    {
-    case XGR_CHECKPOINT_SUCCESS:
-        break;
+    if ( pc->xce )
+        xenevtchn_close(pc->xce);
 
-    case XGR_CHECKPOINT_FAILOVER:
-        if ( ctx->restore.buffer_all_records )
-            rc = BROKEN_CHANNEL;
-        else
-            /* We don't have a consistent state */
-            rc = -1;
-        goto err;
+    free(pc->waiting);
+    free(pc->requested);
+    free(pc->pending);
+    free(pc);
+    ctx->restore.postcopy = NULL;
+}
 
-    default: /* Other fatal error */
-        rc = -1;
-        goto err;
-    }
+static int handle_postcopy_begin(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_begin *begin = rec->data;
+    struct xc_sr_postcopy *pc;
 
-    if ( ctx->restore.buffer_all_records )
+    if ( ctx->restore.postcopy )
     {
-        IPRINTF("All records buffered");
+        ERROR("Multiple %s records found", rec_type_to_str(rec->type));
+        return -1;
+    }
 
-        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
-        {
-            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
-            if ( rc )
-                goto err;
-        }
-        ctx->restore.buffered_rec_num = 0;
-        IPRINTF("All records processed");
+    if ( ctx->stream_type != XC_STREAM_PLAIN ||
+         ctx->restore.guest_type != DHDR_TYPE_X86_HVM )
+    {
+        ERROR("Post-copy is only supported for plain streams of HVM guests");
+        return -1;
     }
-    else
-        ctx->restore.buffer_all_records = true;
 
-    if ( ctx->stream_type == XC_STREAM_COLO )
+    if ( rec->length != sizeof(*begin) )
     {
-#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
-    do {                                                    \
-        if ( ret == 1 )                                     \
-            rc = 0; /* Success */                           \
-        else                                                \
-        {                                                   \
-            if ( ret == 2 )                                 \
-                rc = BROKEN_CHANNEL;                        \
-            else                                            \
-                rc = -1; /* Some unspecified error */       \
-            goto err;                                       \
-        }                                                   \
-    } while (0)
+        ERROR("%s record wrong size: length %u, expected %zu",
+              rec_type_to_str(rec->type), rec->length, sizeof(*begin));
+        return -1;
+    }
 
-        /* COLO */
+    pc = calloc(1, sizeof(*pc));
+    if ( !pc )
+        goto oom;
 
-        /* We need to resume guest */
-        rc = ctx->restore.ops.stream_complete(ctx);
-        if ( rc )
+    ctx->restore.postcopy = pc;
+    pc->p2m_size = begin->p2m_size;
+    pc->pending = bitmap_alloc(pc->p2m_size);
+    pc->requested = bitmap_alloc(pc->p2m_size);
+    if ( !pc->pending || !pc->requested )
+        goto oom;
+
+    return 0;
+
+ oom:
+    ERROR("Unable to allocate memory for post-copy state");
+    return -1;
+}
+
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct xc_sr_rec_postcopy_pfns *pfns = rec->data;
+    unsigned int i;
+
+    if ( !pc || pc->transitioned )
+    {
+        ERROR("Unexpected %s record", rec_type_to_str(rec->type));
+        return -1;
+    }
+
+    if ( rec->length < sizeof(*pfns) ||
+         rec->length != sizeof(*pfns) + pfns->count * sizeof(*pfns->pfn) )
+    {
+        ERROR("%s record wrong size: length %u",
+              rec_type_to_str(rec->type), rec->length);
+        return -1;
+    }
+
+    for ( i = 0; i < pfns->count; ++i )
+    {
+        if ( pfns->pfn[i] >= pc->p2m_size ||
+             !ctx->restore.ops.pfn_is_valid(ctx, pfns->pfn[i]) )
+        {
+            ERROR("pfn %#"PRIx64" (index %u) outside domain maximum",
+                  pfns->pfn[i], i);
+            return -1;
+        }
+
+        if ( !test_and_set_bit(pfns->pfn[i], pc->pending) )
+            ++pc->nr_pending;
+    }
+
+    return 0;
+}
+
+/*
+ * Set up the paging ring, and page out the pending pfns.  Whatever data they
+ * have in the guest is stale.
+ */
+static int postcopy_evict_pending(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    uint32_t port;
+    unsigned long pfn, end;
+    int rc;
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN, &port);
+    if ( !pc->ring_page )
+    {
+        switch ( errno )
+        {
+        case ENODEV:
+            ERROR("Post-copy requires Hardware Assisted Paging");
+            break;
+        case EMLINK:
+            ERROR("Post-copy not supported while iommu passthrough is enabled");
+            break;
+        case EXDEV:
+            ERROR("Post-copy not supported in a PoD guest");
+            break;
+        default:
+            PERROR("Failed to enable paging");
+            break;
+        }
+        return -1;
+    }
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    rc = xenevtchn_bind_interdomain(pc->xce, ctx->domid, port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind event channel");
+        return -1;
+    }
+    pc->port = rc;
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   XC_PAGE_SIZE);
+
+    for ( pfn = 0; pfn < pc->p2m_size; pfn = end )
+    {
+        if ( !test_bit(pfn, pc->pending) )
+        {
+            end = pfn + 1;
+            continue;
+        }
+
+        for ( end = pfn + 1;
+              end < pc->p2m_size && end - pfn < UINT32_MAX &&
+                  test_bit(end, pc->pending);
+              ++end )
+            ;
+
+        if ( xc_mem_paging_populate_evicted(xch, ctx->domid, pfn,
+                                            end - pfn) )
+        {
+            PERROR("Failed to page out pfns %#lx-%#lx", pfn, end - 1);
+            return -1;
+        }
+    }
+
+    DPRINTF("Post-copy: %lu pages to fetch after the guest resumes",
+            pc->nr_pending);
+
+    return 0;
+}
+
+static void postcopy_put_response(struct xc_sr_postcopy *pc,
+                                  const vm_event_request_t *req)
+{
+    vm_event_response_t rsp = {
+        .version = VM_EVENT_INTERFACE_VERSION,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+        .reason = req->reason,
+        .u.mem_paging = req->u.mem_paging,
+    };
+    RING_IDX rsp_prod = pc->back_ring.rsp_prod_pvt;
+
+    memcpy(RING_GET_RESPONSE(&pc->back_ring, rsp_prod), &rsp, sizeof(rsp));
+    pc->back_ring.rsp_prod_pvt = rsp_prod + 1;
+    RING_PUSH_RESPONSES(&pc->back_ring);
+}
+
+/*
+ * A pending pfn has arrived, or been dropped by the guest.  Resume whoever
+ * is waiting for it.
+ */
+static void postcopy_pfn_done(struct xc_sr_postcopy *pc, xen_pfn_t pfn)
+{
+    unsigned int i;
+
+    clear_bit(pfn, pc->pending);
+    --pc->nr_pending;
+
+    for ( i = 0; i < pc->nr_waiting; )
+    {
+        if ( pc->waiting[i].u.mem_paging.gfn != pfn )
+        {
+            ++i;
+            continue;
+        }
+
+        postcopy_put_response(pc, &pc->waiting[i]);
+        pc->waiting[i] = pc->waiting[--pc->nr_waiting];
+    }
+}
+
+static int postcopy_wait_for(struct xc_sr_context *ctx,
+                             const vm_event_request_t *req)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    vm_event_request_t *waiting;
+    unsigned int max;
+
+    if ( pc->nr_waiting == pc->max_waiting )
+    {
+        max = pc->max_waiting ? pc->max_waiting * 2 : 16;
+        waiting = realloc(pc->waiting, max * sizeof(*waiting));
+        if ( !waiting )
+        {
+            ERROR("Unable to allocate memory for paging requests");
+            return -1;
+        }
+
+        pc->waiting = waiting;
+        pc->max_waiting = max;
+    }
+
+    pc->waiting[pc->nr_waiting++] = *req;
+
+    return 0;
+}
+
+/*
+ * Consume the requests on the paging ring.  Faults on pfns not yet asked for
+ * are sent back to the sender in a single POSTCOPY_FAULT record.
+ */
+static int postcopy_handle_ring(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    vm_event_back_ring_t *back_ring = &pc->back_ring;
+    struct xc_sr_rhdr rhdr = { .type = REC_TYPE_POSTCOPY_FAULT };
+    struct xc_sr_rec_postcopy_pfns *fault;
+    struct iovec iov[2];
+    vm_event_request_t req;
+    RING_IDX rsp_prod = back_ring->rsp_prod_pvt;
+    xen_pfn_t pfn;
+    int rc = -1;
+
+    fault = malloc(sizeof(*fault) +
+                   RING_SIZE(back_ring) * sizeof(*fault->pfn));
+    if ( !fault )
+    {
+        ERROR("Unable to allocate memory for a fault record");
+        return -1;
+    }
+    fault->count = 0;
+    fault->_res1 = 0;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(back_ring, back_ring->req_cons),
+               sizeof(req));
+        back_ring->req_cons++;
+        back_ring->sring->req_event = back_ring->req_cons + 1;
+
+        if ( req.version != VM_EVENT_INTERFACE_VERSION ||
+             req.reason != VM_EVENT_REASON_MEM_PAGING )
+        {
+            ERROR("Unexpected paging request: version %#x, reason %u",
+                  req.version, req.reason);
+            goto out;
+        }
+
+        pfn = req.u.mem_paging.gfn;
+
+        if ( pfn >= pc->p2m_size || !test_bit(pfn, pc->pending) )
+        {
+            /* Paged in already.  Resume the vcpu if it is waiting. */
+            if ( (req.flags & VM_EVENT_FLAG_VCPU_PAUSED) ||
+                 (req.u.mem_paging.flags & MEM_PAGING_EVICT_FAIL) )
+                postcopy_put_response(pc, &req);
+            continue;
+        }
+
+        if ( req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE )
+        {
+            /* Freed by the guest.  Any page data arriving is dropped. */
+            postcopy_put_response(pc, &req);
+            postcopy_pfn_done(pc, pfn);
+            continue;
+        }
+
+        if ( postcopy_wait_for(ctx, &req) )
+            goto out;
+
+        if ( !test_and_set_bit(pfn, pc->requested) )
+            fault->pfn[fault->count++] = pfn;
+    }
+
+    if ( fault->count )
+    {
+        rhdr.length = sizeof(*fault) + fault->count * sizeof(*fault->pfn);
+        iov[0].iov_base = &rhdr;
+        iov[0].iov_len = sizeof(rhdr);
+        iov[1].iov_base = fault;
+        iov[1].iov_len = rhdr.length;
+
+        if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+        {
+            PERROR("Failed to write %s record",
+                   rec_type_to_str(REC_TYPE_POSTCOPY_FAULT));
+            goto out;
+        }
+    }
+
+    rc = 0;
+
+ out:
+    if ( back_ring->rsp_prod_pvt != rsp_prod &&
+         xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify the paging event channel");
+        rc = -1;
+    }
+
+    free(fault);
+    return rc;
+}
+
+/*
+ * Validate a POSTCOPY_PAGE_DATA record, and page its pages into the guest.
+ */
+static int handle_postcopy_page_data(struct xc_sr_context *ctx,
+                                     struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned int i, pages_of_data = 0;
+    RING_IDX rsp_prod = pc->back_ring.rsp_prod_pvt;
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+    void *page_data;
+    int rc = -1;
+
+    if ( rec->length < sizeof(*pages) || pages->count < 1 ||
+         rec->length < sizeof(*pages) + pages->count * sizeof(uint64_t) )
+    {
+        ERROR("%s record truncated: length %u",
+              rec_type_to_str(rec->type), rec->length);
+        goto err;
+    }
+
+    pfns = malloc(pages->count * sizeof(*pfns));
+    types = malloc(pages->count * sizeof(*types));
+    if ( !pfns || !types )
+    {
+        ERROR("Unable to allocate enough memory for %u pfns",
+              pages->count);
+        goto err;
+    }
+
+    if ( parse_page_data_pfns(ctx, pages->count, pages->pfn, pfns, types,
+                              &pages_of_data) )
+        goto err;
+
+    if ( rec->length != (sizeof(*pages) +
+                         (sizeof(uint64_t) * pages->count) +
+                         (PAGE_SIZE * pages_of_data)) )
+    {
+        ERROR("%s record wrong size: length %u, expected "
+              "%zu + %zu + %lu", rec_type_to_str(rec->type), rec->length,
+              sizeof(*pages), (sizeof(uint64_t) * pages->count),
+              (PAGE_SIZE * pages_of_data));
+        goto err;
+    }
+
+    page_data = &pages->pfn[pages->count];
+
+    for ( i = 0; i < pages->count; ++i )
+    {
+        if ( !page_type_has_stream_data(types[i]) )
+            continue;
+
+        /* Dropped by the guest since the sender was asked for it. */
+        if ( pfns[i] >= pc->p2m_size || !test_bit(pfns[i], pc->pending) )
+        {
+            page_data += PAGE_SIZE;
+            continue;
+        }
+
+        if ( ctx->restore.ops.localise_page(ctx, types[i], page_data) )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        if ( xc_mem_paging_load(xch, ctx->domid, pfns[i], page_data) &&
+             errno != ENOENT )
+        {
+            PERROR("Failed to page in pfn %#"PRIpfn, pfns[i]);
+            goto err;
+        }
+
+        postcopy_pfn_done(pc, pfns[i]);
+        page_data += PAGE_SIZE;
+    }
+
+    rc = 0;
+
+ err:
+    if ( pc->back_ring.rsp_prod_pvt != rsp_prod &&
+         xenevtchn_notify(pc->xce, pc->port) )
+    {
+        PERROR("Failed to notify the paging event channel");
+        rc = -1;
+    }
+
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Serve the guest's faults, and take in page data, until the END record.
+ */
+static int postcopy_serve(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    struct xc_sr_rhdr end = { .type = REC_TYPE_END };
+    struct pollfd pfds[2] = {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+    };
+    struct xc_sr_record rec;
+    xenevtchn_port_or_error_t port;
+    int rc;
+
+    for ( ; ; )
+    {
+        rc = postcopy_handle_ring(ctx);
+        if ( rc )
+            return rc;
+
+        rc = poll(pfds, ARRAY_SIZE(pfds), -1);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll the stream and paging event channel");
+            return -1;
+        }
+
+        if ( pfds[1].revents )
+        {
+            port = xenevtchn_pending(pc->xce);
+            if ( port < 0 || xenevtchn_unmask(pc->xce, port) )
+            {
+                PERROR("Failed to handle the paging event channel");
+                return -1;
+            }
+        }
+
+        if ( !pfds[0].revents )
+            continue;
+
+        rc = read_record(ctx, ctx->fd, &rec);
+        if ( rc )
+            return rc;
+
+        if ( rec.type == REC_TYPE_END )
+            break;
+
+        if ( rec.type != REC_TYPE_POSTCOPY_PAGE_DATA )
+        {
+            ERROR("Unexpected %s record in the post-copy phase",
+                  rec_type_to_str(rec.type));
+            free(rec.data);
+            return -1;
+        }
+
+        rc = handle_postcopy_page_data(ctx, &rec);
+        free(rec.data);
+        if ( rc )
+            return rc;
+    }
+
+    if ( pc->nr_pending )
+    {
+        ERROR("Stream ended with %lu pages still to arrive", pc->nr_pending);
+        return -1;
+    }
+
+    /* Requests raced with the last pages.  Resume any waiting vcpus. */
+    rc = postcopy_handle_ring(ctx);
+    if ( rc )
+        return rc;
+
+    if ( write_exact(ctx->restore.send_back_fd, &end, sizeof(end)) )
+    {
+        PERROR("Failed to acknowledge the end of the stream");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The sender has finished sending the guest's state, other than its pending
+ * pages.  Page them out, have the caller resume the guest, and serve its
+ * faults on them.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_postcopy *pc = ctx->restore.postcopy;
+    int rc;
+
+    if ( !pc || pc->transitioned )
+    {
+        ERROR("Unexpected %s record",
+              rec_type_to_str(REC_TYPE_POSTCOPY_TRANSITION));
+        return -1;
+    }
+
+    if ( !ctx->restore.callbacks->postcopy_transition )
+    {
+        ERROR("Post-copy stream, but no postcopy_transition() callback");
+        return -1;
+    }
+
+    rc = postcopy_evict_pending(ctx);
+    if ( rc )
+        return rc;
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                            ctx->restore.console_gfn,
+                                            ctx->restore.callbacks->data);
+
+    pc->transitioned = true;
+
+    if ( !ctx->restore.callbacks->postcopy_transition(
+             ctx->restore.callbacks->data) )
+    {
+        ERROR("restore callback postcopy_transition() failed");
+        return -1;
+    }
+
+    IPRINTF("Post-copy: guest resumed, %lu pages to fetch", pc->nr_pending);
+
+    return postcopy_serve(ctx);
+}
+
+static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec);
+static int handle_checkpoint(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    int rc = 0, ret;
+    unsigned int i;
+
+    if ( ctx->stream_type == XC_STREAM_PLAIN )
+    {
+        ERROR("Found checkpoint in non-checkpointed stream");
+        rc = -1;
+        goto err;
+    }
+
+    ret = ctx->restore.callbacks->checkpoint(ctx->restore.callbacks->data);
+    switch ( ret )
+    {
+    case XGR_CHECKPOINT_SUCCESS:
+        break;
+
+    case XGR_CHECKPOINT_FAILOVER:
+        if ( ctx->restore.buffer_all_records )
+            rc = BROKEN_CHANNEL;
+        else
+            /* We don't have a consistent state */
+            rc = -1;
+        goto err;
+
+    default: /* Other fatal error */
+        rc = -1;
+        goto err;
+    }
+
+    if ( ctx->restore.buffer_all_records )
+    {
+        IPRINTF("All records buffered");
+
+        for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
+        {
+            rc = process_record(ctx, &ctx->restore.buffered_records[i]);
+            if ( rc )
+                goto err;
+        }
+        ctx->restore.buffered_rec_num = 0;
+        IPRINTF("All records processed");
+    }
+    else
+        ctx->restore.buffer_all_records = true;
+
+    if ( ctx->stream_type == XC_STREAM_COLO )
+    {
+#define HANDLE_CALLBACK_RETURN_VALUE(ret)                   \
+    do {                                                    \
+        if ( ret == 1 )                                     \
+            rc = 0; /* Success */                           \
+        else                                                \
+        {                                                   \
+            if ( ret == 2 )                                 \
+                rc = BROKEN_CHANNEL;                        \
+            else                                            \
+                rc = -1; /* Some unspecified error */       \
+            goto err;                                       \
+        }                                                   \
+    } while (0)
+
+        /* COLO */
+
+        /* We need to resume guest */
+        rc = ctx->restore.ops.stream_complete(ctx);
+        if ( rc )
             goto err;
 
         ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
@@ -657,6 +1613,10 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_PAGE_DATA_ENCODED:
+        rc = handle_page_data_encoded(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -670,6 +1630,18 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_static_data_end(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_BEGIN:
+        rc = handle_postcopy_begin(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
@@ -739,6 +1711,9 @@ static void cleanup(struct xc_sr_context *ctx)
     for ( i = 0; i < ctx->restore.buffered_rec_num; i++ )
         free(ctx->restore.buffered_records[i].data);
 
+    cleanup_decode_pool(ctx);
+    cleanup_postcopy(ctx);
+
     if ( ctx->stream_type == XC_STREAM_COLO )
         xc_hypercall_buffer_free_pages(
             xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->restore.p2m_size)));
@@ -806,8 +1781,22 @@ static int restore(struct xc_sr_context *ctx)
                 goto err;
         }
 
+        /* The post-copy phase takes the stream up to, and including END. */
+        if ( rec.type == REC_TYPE_POSTCOPY_TRANSITION )
+        {
+            IPRINTF("Restore successful");
+            goto done;
+        }
+
     } while ( rec.type != REC_TYPE_END );
 
+    if ( ctx->restore.postcopy )
+    {
+        ERROR("Stream ended before the post-copy transition");
+        rc = -1;
+        goto err;
+    }
+
  remus_failover:
     if ( ctx->stream_type == XC_STREAM_COLO )
     {
@@ -1,5 +1,8 @@
 #include <assert.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "xg_sr_common.h"
 
@@ -75,49 +78,120 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * Writes a POSTCOPY_BEGIN record into the stream.
+ */
+static int write_postcopy_begin_record(struct xc_sr_context *ctx)
+{
+    struct xc_sr_rec_postcopy_begin begin = {
+        .p2m_size = ctx->save.p2m_size,
+    };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_POSTCOPY_BEGIN,
+        .length = sizeof(begin),
+        .data = &begin,
+    };
+
+    return write_record(ctx, &rec);
+}
+
+/*
+ * Writes a POSTCOPY_TRANSITION record into the stream.
+ */
+static int write_postcopy_transition_record(struct xc_sr_context *ctx)
+{
+    struct xc_sr_record transition = { .type = REC_TYPE_POSTCOPY_TRANSITION };
+
+    return write_record(ctx, &transition);
+}
+
+/*
+ * A batch of pfns, with the pages holding their data mapped and normalised,
+ * ready to be written into the stream.
+ */
+struct xc_sr_save_batch
+{
+    unsigned int nr_pfns;
+    /* Number of pfns with page data. */
+    unsigned int nr_pages;
+    /* Type and pfn of each entry, as for the record. */
+    uint64_t *rec_pfns;
+    /* Page data for each pfn, or NULL.  Mapped gfns or local allocations. */
+    void **guest_data;
+    /* Locally allocated pages.  Need freeing. */
+    void **local_pages;
+    void *guest_mapping;
+    unsigned int nr_pages_mapped;
+
+    /* Pipelined mode only. */
+    struct xc_sr_save_batch *next;
+    uint64_t seq;
+    /* Encoded length of each page with data. */
+    uint32_t *lengths;
+    /* Compressed page data, pointed to by guest_data[] once encoded. */
+    void *encoded;
+};
+
+static void free_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    for ( i = 0; batch->local_pages && i < batch->nr_pfns; ++i )
+        free(batch->local_pages[i]);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->rec_pfns);
+    free(batch->lengths);
+    free(batch->encoded);
+    free(batch);
+}
+
+/*
+ * Prepares the batch of pfns constructed in ctx->save.batch_pfns for writing
+ * into the stream.
  *
  * This function:
  * - gets the types for each pfn in the batch.
  * - for each pfn with real data:
  *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
  */
-static int write_batch(struct xc_sr_context *ctx)
+static int map_batch(struct xc_sr_context *ctx,
+                     struct xc_sr_save_batch **batchp)
 {
     xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch;
     xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
     int *errors = NULL, rc = -1;
-    unsigned int i, p, nr_pages = 0, nr_pages_mapped = 0;
+    unsigned int i, p, nr_pages = 0;
     unsigned int nr_pfns = ctx->save.nr_batch_pfns;
     void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec = {
-        .type = REC_TYPE_PAGE_DATA,
-    };
 
     assert(nr_pfns != 0);
 
+    batch = calloc(1, sizeof(*batch));
+    if ( !batch )
+    {
+        ERROR("Unable to allocate a batch of %u pages", nr_pfns);
+        return -1;
+    }
+    batch->nr_pfns = nr_pfns;
+
     /* Mfns of the batch pfns. */
     mfns = malloc(nr_pfns * sizeof(*mfns));
     /* Types of the batch pfns. */
     types = malloc(nr_pfns * sizeof(*types));
     /* Errors from attempting to map the gfns. */
     errors = malloc(nr_pfns * sizeof(*errors));
-    /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
-    /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    batch->guest_data = calloc(nr_pfns, sizeof(*batch->guest_data));
+    batch->local_pages = calloc(nr_pfns, sizeof(*batch->local_pages));
+    batch->rec_pfns = malloc(nr_pfns * sizeof(*batch->rec_pfns));
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    if ( !mfns || !types || !errors || !batch->guest_data ||
+         !batch->local_pages || !batch->rec_pfns )
     {
         ERROR("Unable to allocate arrays for a batch of %u pages",
               nr_pfns);
@@ -161,14 +235,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(
+        batch->guest_mapping = xenforeignmemory_map(
             xch->fmem, ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -182,11 +256,11 @@ static int write_batch(struct xc_sr_context *ctx)
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
-                local_pages[i] = page;
+                batch->local_pages[i] = page;
 
             if ( rc )
             {
@@ -201,30 +275,64 @@ static int write_batch(struct xc_sr_context *ctx)
                     goto err;
             }
             else
-                guest_data[i] = page;
+                batch->guest_data[i] = page;
 
             rc = -1;
             ++p;
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    batch->nr_pages = nr_pages;
+
+    for ( i = 0; i < nr_pfns; ++i )
+        batch->rec_pfns[i] = ((uint64_t)(types[i]) << 32) |
+                             ctx->save.batch_pfns[i];
+
+    *batchp = batch;
+    batch = NULL;
+    rc = 0;
+
+ err:
+    if ( batch )
+        free_batch(ctx, batch);
+    free(errors);
+    free(types);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Writes a mapped batch of memory as a PAGE_DATA record into the stream, or
+ * as a POSTCOPY_PAGE_DATA record once the guest runs at the destination.
+ */
+static int write_page_data(struct xc_sr_context *ctx,
+                           struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i, nr_pfns = batch->nr_pfns, nr_pages = batch->nr_pages;
+    struct iovec *iov = NULL; int iovcnt = 0;
+    struct xc_sr_rec_page_data_header hdr = { 0 };
+    struct xc_sr_record rec = {
+        .type = (ctx->save.postcopy_active ? REC_TYPE_POSTCOPY_PAGE_DATA
+                                           : REC_TYPE_PAGE_DATA),
+    };
+    int rc = -1;
+
+    /* iovec[] for writev(). */
+    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    if ( !iov )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        ERROR("Unable to allocate iovec for a batch of %u pages", nr_pfns);
+        return -1;
     }
 
     hdr.count = nr_pfns;
 
     rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
+    rec.length += nr_pfns * sizeof(*batch->rec_pfns);
     rec.length += nr_pages * PAGE_SIZE;
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
-
     iov[0].iov_base = &rec.type;
     iov[0].iov_len = sizeof(rec.type);
 
@@ -234,8 +342,8 @@ static int write_batch(struct xc_sr_context *ctx)
     iov[2].iov_base = &hdr;
     iov[2].iov_len = sizeof(hdr);
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
 
     iovcnt = 4;
 
@@ -243,9 +351,9 @@ static int write_batch(struct xc_sr_context *ctx)
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
-            if ( guest_data[i] )
+            if ( batch->guest_data[i] )
             {
-                iov[iovcnt].iov_base = guest_data[i];
+                iov[iovcnt].iov_base = batch->guest_data[i];
                 iov[iovcnt].iov_len = PAGE_SIZE;
                 iovcnt++;
                 --nr_pages;
@@ -261,20 +369,388 @@ static int write_batch(struct xc_sr_context *ctx)
 
     /* Sanity check we have sent all the pages we expected to. */
     assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    rc = 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
     free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+
+    return rc;
+}
+
+/*
+ * Pipelined mode.  Batches are mapped in order by the main thread, and queued
+ * for a pool of workers which encode them, and write them into the stream as
+ * PAGE_DATA_ENCODED records, strictly in the order they were queued in.
+ */
+struct xc_sr_save_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Batches waiting for a worker. */
+    struct xc_sr_save_batch *head, **tail;
+    /* Batches queued and not yet written. */
+    unsigned int nr_queued, max_queued;
+    /* Sequence numbers of the next batch to queue, and to write. */
+    uint64_t next_seq, write_seq;
+
+    /* Set on the first failure.  Later batches are dropped. */
+    bool failed;
+    int error;
+    bool exiting;
+
+    unsigned int nr_threads;
+    pthread_t threads[];
+};
+
+static int encode_batch(struct xc_sr_context *ctx, struct xc_sr_codec *codec,
+                        struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned int i, p;
+    void *dst;
+
+    if ( !batch->nr_pages )
+        return 0;
+
+    batch->lengths = calloc(ROUNDUP(batch->nr_pages * sizeof(uint32_t),
+                                    REC_ALIGN_ORDER), 1);
+    if ( ctx->save.codec != PAGE_CODEC_NONE )
+        batch->encoded = malloc(batch->nr_pages * PAGE_SIZE);
+
+    if ( !batch->lengths ||
+         (ctx->save.codec != PAGE_CODEC_NONE && !batch->encoded) )
+    {
+        ERROR("Unable to allocate encoding buffers for %u pages",
+              batch->nr_pages);
+        return -1;
+    }
+
+    for ( i = 0, p = 0, dst = batch->encoded; i < batch->nr_pfns; ++i )
+    {
+        uint32_t len;
+
+        if ( !batch->guest_data[i] )
+            continue;
+
+        len = encode_page(codec, ctx->save.codec, batch->guest_data[i], dst);
+        batch->lengths[p++] = len;
+
+        if ( len == 0 )
+            batch->guest_data[i] = NULL;
+        else if ( len < PAGE_SIZE )
+        {
+            batch->guest_data[i] = dst;
+            dst += len;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes an encoded batch of memory as a PAGE_DATA_ENCODED record into the
+ * stream.
+ */
+static int write_page_data_encoded(struct xc_sr_context *ctx,
+                                   struct xc_sr_save_batch *batch)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+
+    xc_interface *xch = ctx->xch;
+    unsigned int i, p, nr_pfns = batch->nr_pfns;
+    size_t lengths_sz = ROUNDUP(batch->nr_pages * sizeof(*batch->lengths),
+                                REC_ALIGN_ORDER);
+    struct iovec *iov = NULL; int iovcnt = 0;
+    struct xc_sr_rec_page_data_encoded_header hdr = {
+        .count = nr_pfns,
+        .codec = ctx->save.codec,
+    };
+    struct xc_sr_record rec = {
+        .type = REC_TYPE_PAGE_DATA_ENCODED,
+    };
+    uint32_t padding;
+    int rc = -1;
+
+    /* iovec[] for writev(). */
+    iov = malloc((nr_pfns + 6) * sizeof(*iov));
+    if ( !iov )
+    {
+        ERROR("Unable to allocate iovec for a batch of %u pages", nr_pfns);
+        return -1;
+    }
+
+    rec.length = sizeof(hdr);
+    rec.length += nr_pfns * sizeof(*batch->rec_pfns);
+    rec.length += lengths_sz;
+
+    iov[0].iov_base = &rec.type;
+    iov[0].iov_len = sizeof(rec.type);
+
+    iov[1].iov_base = &rec.length;
+    iov[1].iov_len = sizeof(rec.length);
+
+    iov[2].iov_base = &hdr;
+    iov[2].iov_len = sizeof(hdr);
+
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = nr_pfns * sizeof(*batch->rec_pfns);
+
+    iov[4].iov_base = batch->lengths;
+    iov[4].iov_len = lengths_sz;
+
+    iovcnt = 5;
+
+    for ( i = 0, p = 0; i < nr_pfns && p < batch->nr_pages; ++i )
+    {
+        if ( !batch->guest_data[i] )
+        {
+            /* Zero pages have a length, but no data. */
+            if ( page_type_has_stream_data(batch->rec_pfns[i] >> 32) )
+                ++p;
+            continue;
+        }
+
+        iov[iovcnt].iov_base = batch->guest_data[i];
+        iov[iovcnt].iov_len = batch->lengths[p++];
+        rec.length += iov[iovcnt].iov_len;
+        iovcnt++;
+    }
+
+    padding = ROUNDUP(rec.length, REC_ALIGN_ORDER) - rec.length;
+    if ( padding )
+    {
+        iov[iovcnt].iov_base = (void *)zeroes;
+        iov[iovcnt].iov_len = padding;
+        iovcnt++;
+    }
+
+    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    {
+        PERROR("Failed to write encoded page data to stream");
+        goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(iov);
+
+    return rc;
+}
+
+static void *save_worker(void *arg)
+{
+    struct xc_sr_save_pipeline *pl = arg;
+    struct xc_sr_context *ctx = pl->ctx;
+    struct xc_sr_codec codec = { 0 };
+    struct xc_sr_save_batch *batch;
+    bool failed;
+    int rc, saved_errno;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        while ( !pl->head && !pl->exiting )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+
+        batch = pl->head;
+        if ( !batch )
+            break;
+
+        pl->head = batch->next;
+        if ( !pl->head )
+            pl->tail = &pl->head;
+        failed = pl->failed;
+        pthread_mutex_unlock(&pl->lock);
+
+        rc = failed ? -1 : encode_batch(ctx, &codec, batch);
+
+        pthread_mutex_lock(&pl->lock);
+        while ( pl->write_seq != batch->seq )
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        failed = pl->failed;
+        pthread_mutex_unlock(&pl->lock);
+
+        /* Only the thread holding the next batch in sequence writes. */
+        if ( !rc && !failed )
+            rc = write_page_data_encoded(ctx, batch);
+        saved_errno = errno;
+
+        free_batch(ctx, batch);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc && !pl->failed )
+        {
+            pl->failed = true;
+            pl->error = saved_errno;
+        }
+        pl->write_seq++;
+        pl->nr_queued--;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    cleanup_page_codec(&codec);
+
+    return NULL;
+}
+
+/* Hand a mapped batch over to the pipeline, which takes ownership of it. */
+static int queue_batch(struct xc_sr_context *ctx,
+                       struct xc_sr_save_batch *batch)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc = 0;
+
+    pthread_mutex_lock(&pl->lock);
+
+    while ( pl->nr_queued >= pl->max_queued && !pl->failed )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    if ( pl->failed )
+    {
+        errno = pl->error;
+        rc = -1;
+    }
+    else
+    {
+        batch->seq = pl->next_seq++;
+        batch->next = NULL;
+        *pl->tail = batch;
+        pl->tail = &batch->next;
+        pl->nr_queued++;
+        pthread_cond_broadcast(&pl->cond);
+        batch = NULL;
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    if ( batch )
+        free_batch(ctx, batch);
+
+    return rc;
+}
+
+/* Wait for all queued batches to be written into the stream. */
+static int drain_pipeline(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc = 0;
+
+    if ( !pl )
+        return 0;
+
+    pthread_mutex_lock(&pl->lock);
+
+    while ( pl->nr_queued )
+        pthread_cond_wait(&pl->cond, &pl->lock);
+
+    if ( pl->failed )
+    {
+        errno = pl->error;
+        rc = -1;
+    }
+
+    pthread_mutex_unlock(&pl->lock);
+
+    if ( rc )
+        PERROR("Failed to write page data to stream");
+
+    return rc;
+}
+
+static int setup_pipeline(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    unsigned int i;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl) + ctx->save.nr_workers * sizeof(pthread_t));
+    if ( !pl )
+    {
+        ERROR("Unable to allocate page data pipeline");
+        return -1;
+    }
+
+    pl->ctx = ctx;
+    pl->tail = &pl->head;
+    pl->max_queued = 2 * ctx->save.nr_workers;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    ctx->save.pipeline = pl;
+
+    for ( i = 0; i < ctx->save.nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->threads[i], NULL, save_worker, pl);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create page data worker %u", i);
+            return -1;
+        }
+        pl->nr_threads++;
+    }
+
+    DPRINTF("Pipelined page data: %u workers, codec %u",
+            pl->nr_threads, ctx->save.codec);
+
+    return 0;
+}
+
+static void cleanup_pipeline(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned int i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->lock);
+    pl->exiting = true;
+    /* Drop whatever is still queued after a failure. */
+    pl->failed = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_threads; ++i )
+        pthread_join(pl->threads[i], NULL);
+
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl);
+    ctx->save.pipeline = NULL;
+}
+
+/*
+ * Writes the batch of memory constructed in ctx->save.batch_pfns into the
+ * stream, either directly as a PAGE_DATA record or via the pipeline.  Pages
+ * sent after the post-copy transition are waited on by the guest, so are
+ * always written directly.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch;
+    int rc;
+
+    rc = map_batch(ctx, &batch);
+    if ( rc )
+        return rc;
+
+    if ( ctx->save.pipeline && !ctx->save.postcopy_active )
+        rc = queue_batch(ctx, batch);
+    else
+    {
+        rc = write_page_data(ctx, batch);
+        free_batch(ctx, batch);
+    }
+
+    if ( !rc )
+        ctx->save.nr_batch_pfns = 0;
 
     return rc;
 }
@@ -392,6 +868,10 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
     if ( rc )
         return rc;
 
+    rc = drain_pipeline(ctx);
+    if ( rc )
+        return rc;
+
     if ( written > entries )
         DPRINTF("Bitmap contained more entries than expected...");
 
@@ -480,7 +960,7 @@ static int update_progress_string(struct xc_sr_context *ctx, char **str)
 #define SPP_MAX_ITERATIONS      5
 #define SPP_TARGET_DIRTY_COUNT 50
 
-static int simple_precopy_policy(struct precopy_stats stats, void *user)
+int xc_precopy_policy_simple(struct precopy_stats stats)
 {
     return ((stats.dirty_count >= 0 &&
              stats.dirty_count < SPP_TARGET_DIRTY_COUNT) ||
@@ -489,6 +969,80 @@ static int simple_precopy_policy(struct precopy_stats stats, void *user)
         : XGS_POLICY_CONTINUE_PRECOPY;
 }
 
+/*
+ * The adaptive policy, which callers opt in to, proceeds to the stop-and-copy
+ * phase when there are fewer than 50 dirty pages, or when the remaining dirty
+ * pages are predicted to be sent within the downtime target.  It also gives
+ * up on converging, after a few rounds, once the guest dirties memory at
+ * least as fast as it can be sent, and unconditionally after 30 rounds.
+ */
+#define APP_MIN_ITERATIONS      5
+#define APP_MAX_ITERATIONS     30
+#define APP_TARGET_DIRTY_COUNT 50
+
+int xc_precopy_policy_adaptive(struct precopy_stats stats,
+                               unsigned int downtime_target)
+{
+    if ( !downtime_target )
+        downtime_target = XC_PRECOPY_DOWNTIME_DEFAULT;
+
+    /* Only decide with up to date figures, i.e. once per round. */
+    if ( stats.dirty_count < 0 )
+        return stats.iteration >= APP_MAX_ITERATIONS
+            ? XGS_POLICY_STOP_AND_COPY
+            : XGS_POLICY_CONTINUE_PRECOPY;
+
+    if ( stats.dirty_count < APP_TARGET_DIRTY_COUNT )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    if ( stats.predicted_downtime >= 0 &&
+         stats.predicted_downtime <= downtime_target )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    if ( stats.iteration >= APP_MIN_ITERATIONS && stats.bandwidth &&
+         stats.dirty_rate >= stats.bandwidth )
+        return XGS_POLICY_STOP_AND_COPY;
+
+    return stats.iteration >= APP_MAX_ITERATIONS
+        ? XGS_POLICY_STOP_AND_COPY
+        : XGS_POLICY_CONTINUE_PRECOPY;
+}
+
+static int default_precopy_policy(struct precopy_stats stats, void *user)
+{
+    return xc_precopy_policy_simple(stats);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Ask the precopy policy what to do next.  With XCFLAGS_POSTCOPY, stopping
+ * means switching to post-copy.
+ */
+static int precopy_decision(struct xc_sr_context *ctx,
+                            precopy_policy_t precopy_policy, void *data)
+{
+    xc_interface *xch = ctx->xch;
+    int decision = precopy_policy(ctx->save.stats, data);
+
+    if ( decision == XGS_POLICY_STOP_AND_COPY && ctx->save.postcopy )
+        decision = XGS_POLICY_POSTCOPY;
+    else if ( decision == XGS_POLICY_POSTCOPY && !ctx->save.postcopy )
+    {
+        ERROR("Precopy policy chose post-copy, which isn't enabled");
+        decision = XGS_POLICY_ABORT;
+    }
+
+    return decision;
+}
+
 /*
  * Send memory while guest is running.
  */
@@ -500,6 +1054,8 @@ static int send_memory_live(struct xc_sr_context *ctx)
     unsigned int x = 0;
     int rc;
     int policy_decision;
+    uint64_t sent_ns = 0, clean_ns, prev_clean_ns, elapsed;
+    unsigned long sent = 0;
 
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
@@ -515,28 +1071,45 @@ static int send_memory_live(struct xc_sr_context *ctx)
 
     ctx->save.stats = (struct precopy_stats){
         .dirty_count = ctx->save.p2m_size,
+        .predicted_downtime = -1,
     };
     policy_stats = &ctx->save.stats;
 
     if ( precopy_policy == NULL )
-        precopy_policy = simple_precopy_policy;
+        precopy_policy = default_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    prev_clean_ns = now_ns();
 
     for ( ; ; )
     {
-        policy_decision = precopy_policy(*policy_stats, data);
+        policy_decision = precopy_decision(ctx, precopy_policy, data);
         x++;
 
+        if ( policy_decision == XGS_POLICY_POSTCOPY )
+        {
+            /*
+             * Leave the pages still dirty to the post-copy phase.  The next
+             * logdirty clean overwrites the bitmap, so stash them now.
+             */
+            bitmap_or(ctx->save.deferred_pages, dirty_bitmap,
+                      ctx->save.p2m_size);
+            ctx->save.nr_deferred_pages += stats.dirty_count;
+            break;
+        }
+
         if ( stats.dirty_count > 0 && policy_decision != XGS_POLICY_ABORT )
         {
             rc = update_progress_string(ctx, &progress_str);
             if ( rc )
                 goto out;
 
+            sent_ns = now_ns();
             rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
+            sent_ns = now_ns() - sent_ns;
+            sent = stats.dirty_count;
         }
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
@@ -546,7 +1119,7 @@ static int send_memory_live(struct xc_sr_context *ctx)
         policy_stats->total_written += policy_stats->dirty_count;
         policy_stats->dirty_count   = -1;
 
-        policy_decision = precopy_policy(*policy_stats, data);
+        policy_decision = precopy_decision(ctx, precopy_policy, data);
 
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
             break;
@@ -563,6 +1136,25 @@ static int send_memory_live(struct xc_sr_context *ctx)
 
         policy_stats->dirty_count = stats.dirty_count;
 
+        /*
+         * The guest dirtied dirty_count pages since the previous bitmap
+         * clean, while we sent the pages dirty at that point.
+         */
+        clean_ns = now_ns();
+        elapsed = clean_ns - prev_clean_ns;
+        prev_clean_ns = clean_ns;
+
+        policy_stats->dirty_rate =
+            elapsed ? stats.dirty_count * 1000000000ULL / elapsed : 0;
+        if ( sent && sent_ns )
+            policy_stats->bandwidth = sent * 1000000000ULL / sent_ns;
+        policy_stats->predicted_downtime = policy_stats->bandwidth
+            ? stats.dirty_count * 1000ULL / policy_stats->bandwidth : -1;
+
+        DPRINTF("Precopy iteration %u: %u dirty, %lu pages/s dirtied, "
+                "%lu pages/s sent, predicted downtime %ldms", x,
+                stats.dirty_count, policy_stats->dirty_rate,
+                policy_stats->bandwidth, policy_stats->predicted_downtime);
     }
 
     if ( policy_decision == XGS_POLICY_ABORT )
@@ -693,6 +1285,293 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Suspend the domain and start post-copy.  Of the pages still dirty, only
+ * those without data and the ones named by postcopy_eager_pfns() are sent.
+ * The rest are listed in POSTCOPY_PFNS records, for the destination to
+ * fetch on demand, and are sent by send_postcopy_pages() once the guest has
+ * been resumed there.
+ */
+static int suspend_and_start_postcopy(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
+    struct xc_sr_rec_postcopy_pfns *hdr = NULL;
+    struct xc_sr_record rec = { .type = REC_TYPE_POSTCOPY_PFNS };
+    unsigned long *eager = NULL;
+    xen_pfn_t *pfns = NULL, *types = NULL;
+    xen_pfn_t p = 0;
+    unsigned int i, nr;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = suspend_domain(ctx);
+    if ( rc )
+        goto out;
+
+    if ( xc_logdirty_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             HYPERCALL_BUFFER(dirty_bitmap), ctx->save.p2m_size,
+             XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL, &stats) !=
+         ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        rc = -1;
+        goto out;
+    }
+
+    bitmap_or(dirty_bitmap, ctx->save.deferred_pages, ctx->save.p2m_size);
+    bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+    ctx->save.nr_deferred_pages = 0;
+
+    rc = -1;
+    eager = bitmap_alloc(ctx->save.p2m_size);
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    types = malloc(MAX_BATCH_SIZE * sizeof(*types));
+    hdr = malloc(sizeof(*hdr) + MAX_BATCH_SIZE * sizeof(*hdr->pfn));
+    if ( !eager || !pfns || !types || !hdr )
+    {
+        ERROR("Unable to allocate memory for post-copy pfns");
+        goto out;
+    }
+
+    if ( ctx->save.ops.postcopy_eager_pfns )
+        ctx->save.ops.postcopy_eager_pfns(ctx, eager);
+
+    xc_set_progress_prefix(xch, "Post-copy setup");
+
+    while ( p < ctx->save.p2m_size )
+    {
+        for ( nr = 0; p < ctx->save.p2m_size && nr < MAX_BATCH_SIZE; ++p )
+        {
+            if ( !test_bit(p, dirty_bitmap) )
+                continue;
+
+            pfns[nr] = p;
+            types[nr++] = ctx->save.ops.pfn_to_gfn(ctx, p);
+        }
+
+        if ( !nr )
+            break;
+
+        if ( xc_get_pfn_type_batch(xch, ctx->domid, nr, types) )
+        {
+            PERROR("Failed to get types for pfn batch");
+            goto out;
+        }
+
+        hdr->count = 0;
+        for ( i = 0; i < nr; ++i )
+        {
+            if ( test_bit(pfns[i], eager) ||
+                 !page_type_has_stream_data(types[i]) )
+            {
+                if ( add_to_batch(ctx, pfns[i]) )
+                    goto out;
+                continue;
+            }
+
+            set_bit(pfns[i], ctx->save.postcopy_pfns);
+            ++ctx->save.nr_postcopy_pfns;
+            hdr->pfn[hdr->count++] = pfns[i];
+        }
+
+        if ( !hdr->count )
+            continue;
+
+        rec.length = sizeof(*hdr) + hdr->count * sizeof(*hdr->pfn);
+        rec.data = hdr;
+        if ( write_record(ctx, &rec) )
+            goto out;
+    }
+
+    if ( flush_batch(ctx) || drain_pipeline(ctx) )
+        goto out;
+
+    DPRINTF("Post-copy: %lu pages left to send after the guest resumes",
+            ctx->save.nr_postcopy_pfns);
+    rc = 0;
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    free(hdr);
+    free(types);
+    free(pfns);
+    free(eager);
+    return rc;
+}
+
+/*
+ * Handle a POSTCOPY_FAULT record from the destination, sending the pages it
+ * names ahead of the background push.
+ */
+static int handle_postcopy_fault(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_postcopy_pfns *fault;
+    struct xc_sr_record rec;
+    unsigned int i;
+    int rc;
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    fault = rec.data;
+
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected %s record on the back channel, got %s",
+              rec_type_to_str(REC_TYPE_POSTCOPY_FAULT),
+              rec_type_to_str(rec.type));
+        goto out;
+    }
+
+    if ( rec.length < sizeof(*fault) ||
+         rec.length != sizeof(*fault) + fault->count * sizeof(*fault->pfn) )
+    {
+        ERROR("%s record wrong size: length %u",
+              rec_type_to_str(rec.type), rec.length);
+        goto out;
+    }
+
+    for ( i = 0; i < fault->count; ++i )
+    {
+        if ( fault->pfn[i] >= ctx->save.p2m_size )
+        {
+            ERROR("Fault on pfn %#"PRIx64" beyond p2m_size %#lx",
+                  fault->pfn[i], ctx->save.p2m_size);
+            goto out;
+        }
+
+        /* Already sent, if the fault crossed with the background push. */
+        if ( !test_and_clear_bit(fault->pfn[i], ctx->save.postcopy_pfns) )
+            continue;
+
+        --ctx->save.nr_postcopy_pfns;
+        if ( add_to_batch(ctx, fault->pfn[i]) )
+            goto out;
+    }
+
+    rc = flush_batch(ctx);
+
+ out:
+    free(rec.data);
+    return rc;
+}
+
+/* Pages pushed between checks for faults from the destination. */
+#define POSTCOPY_BACKGROUND_BATCH 64
+
+/*
+ * The post-copy phase.  The destination is told to resume the guest, after
+ * which its outstanding pages are pushed in pfn order, with any it faults
+ * on sent first.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long total = ctx->save.nr_postcopy_pfns;
+    xen_pfn_t cursor = 0;
+    unsigned int n;
+    int rc;
+
+    rc = write_postcopy_transition_record(ctx);
+    if ( rc )
+        return rc;
+
+    if ( !ctx->save.callbacks->postcopy_transition(ctx->save.callbacks->data) )
+    {
+        ERROR("save callback postcopy_transition() failed");
+        return -1;
+    }
+
+    ctx->save.postcopy_active = true;
+    xc_set_progress_prefix(xch, "Post-copy");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            PERROR("Failed to poll the back channel");
+            goto out;
+        }
+
+        if ( rc )
+        {
+            rc = handle_postcopy_fault(ctx);
+            if ( rc )
+                goto out;
+            continue;
+        }
+
+        /*
+         * Pages are only ever cleared from postcopy_pfns, so all those left
+         * are at or above the cursor.
+         */
+        for ( n = 0; n < POSTCOPY_BACKGROUND_BATCH &&
+                  cursor < ctx->save.p2m_size; ++cursor )
+        {
+            if ( !test_and_clear_bit(cursor, ctx->save.postcopy_pfns) )
+                continue;
+
+            --ctx->save.nr_postcopy_pfns;
+            ++n;
+            rc = add_to_batch(ctx, cursor);
+            if ( rc )
+                goto out;
+        }
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        xc_report_progress_step(xch, total - ctx->save.nr_postcopy_pfns,
+                                total);
+    }
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
+/*
+ * Wait for the destination to acknowledge the END record, dropping any
+ * faults which crossed with the last of the page data.
+ */
+static int wait_postcopy_end(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec;
+    uint32_t type;
+    int rc;
+
+    do {
+        rc = read_record(ctx, ctx->save.recv_fd, &rec);
+        if ( rc )
+            return rc;
+
+        type = rec.type;
+        free(rec.data);
+
+        if ( type != REC_TYPE_END && type != REC_TYPE_POSTCOPY_FAULT )
+        {
+            ERROR("Unexpected %s record on the back channel",
+                  rec_type_to_str(type));
+            return -1;
+        }
+    } while ( type != REC_TYPE_END );
+
+    return 0;
+}
+
 static int verify_frames(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -743,11 +1622,16 @@ static int send_domain_memory_live(struct xc_sr_context *ctx)
     if ( rc )
         goto out;
 
-    rc = suspend_and_send_dirty(ctx);
+    if ( ctx->save.postcopy )
+        rc = suspend_and_start_postcopy(ctx);
+    else
+        rc = suspend_and_send_dirty(ctx);
     if ( rc )
         goto out;
 
-    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN )
+    /* Most pages still have to be sent when post-copy is to start. */
+    if ( ctx->save.debug && ctx->stream_type == XC_STREAM_PLAIN &&
+         !ctx->save.postcopy )
     {
         rc = verify_frames(ctx);
         if ( rc )
@@ -815,6 +1699,25 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
+    if ( ctx->save.postcopy )
+    {
+        ctx->save.postcopy_pfns = bitmap_alloc(ctx->save.p2m_size);
+        if ( !ctx->save.postcopy_pfns )
+        {
+            ERROR("Unable to allocate memory for post-copy pfns");
+            rc = -1;
+            errno = ENOMEM;
+            goto err;
+        }
+    }
+
+    if ( ctx->save.nr_workers )
+    {
+        rc = setup_pipeline(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = 0;
 
  err:
@@ -828,6 +1731,8 @@ static void cleanup(struct xc_sr_context *ctx)
                                     &ctx->save.dirty_bitmap_hbuf);
 
 
+    cleanup_pipeline(ctx);
+
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0);
 
@@ -836,6 +1741,7 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    free(ctx->save.postcopy_pfns);
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
@@ -869,6 +1775,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    if ( ctx->save.postcopy )
+    {
+        rc = write_postcopy_begin_record(ctx);
+        if ( rc )
+            goto err;
+    }
+
     rc = ctx->save.ops.start_of_stream(ctx);
     if ( rc )
         goto err;
@@ -903,6 +1816,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_pages(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->stream_type != XC_STREAM_PLAIN )
         {
             /*
@@ -958,6 +1878,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    if ( ctx->save.postcopy )
+    {
+        rc = wait_postcopy_end(ctx);
+        if ( rc )
+            goto err;
+    }
+
     xc_report_progress_single(xch, "Complete");
     goto done;
 
@@ -994,6 +1921,19 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
     ctx.save.recv_fd = recv_fd;
+    ctx.save.nr_workers = XCFLAGS_GET_WORKERS(flags);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
+
+    if ( flags & XCFLAGS_COMPRESS )
+    {
+        if ( page_codec_supported(PAGE_CODEC_ZSTD) )
+            ctx.save.codec = PAGE_CODEC_ZSTD;
+        else
+            IPRINTF("Compression unavailable, sending page data uncompressed");
+
+        if ( !ctx.save.nr_workers )
+            ctx.save.nr_workers = 1;
+    }
 
     if ( xc_domain_getinfo_single(xch, dom, &ctx.dominfo) < 0 )
     {
@@ -1003,6 +1943,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
 
     hvm = ctx.dominfo.flags & XEN_DOMINF_hvm_guest;
 
+    if ( ctx.save.postcopy &&
+         (!ctx.save.live || !hvm || stream_type != XC_STREAM_PLAIN ||
+          recv_fd < 0) )
+    {
+        ERROR("Post-copy needs a live, plain stream of an HVM guest, and a "
+              "back channel");
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Sanity check stream_type-related parameters */
     switch ( stream_type )
     {
@@ -1015,6 +1965,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     case XC_STREAM_PLAIN:
         if ( hvm )
             assert(callbacks->switch_qemu_logdirty);
+        if ( ctx.save.postcopy )
+            assert(callbacks->postcopy_transition);
         break;
 
     default:
@@ -211,6 +211,44 @@ static int x86_hvm_end_of_checkpoint(struct xc_sr_context *ctx)
     return 0;
 }
 
+static void x86_hvm_postcopy_eager_pfns(struct xc_sr_context *ctx,
+                                        unsigned long *bitmap)
+{
+    xc_interface *xch = ctx->xch;
+    /*
+     * Special pages, which are mapped by the toolstack, backends and Xen
+     * itself, none of which retry when they find them paged out.
+     */
+    static const unsigned int params[] = {
+        HVM_PARAM_STORE_PFN,
+        HVM_PARAM_CONSOLE_PFN,
+        HVM_PARAM_IOREQ_PFN,
+        HVM_PARAM_BUFIOREQ_PFN,
+        HVM_PARAM_PAGING_RING_PFN,
+        HVM_PARAM_MONITOR_RING_PFN,
+        HVM_PARAM_SHARING_RING_PFN,
+        HVM_PARAM_IDENT_PT,
+    };
+    unsigned int i;
+    uint64_t value;
+
+    for ( i = 0; i < ARRAY_SIZE(params); i++ )
+    {
+        if ( xc_hvm_param_get(xch, ctx->domid, params[i], &value) )
+        {
+            DPRINTF("Unable to get HVM param %u", params[i]);
+            continue;
+        }
+
+        /* IDENT_PT is a guest physical address rather than a pfn. */
+        if ( params[i] == HVM_PARAM_IDENT_PT )
+            value >>= PAGE_SHIFT;
+
+        if ( value && value < ctx->save.p2m_size )
+            set_bit(value, bitmap);
+    }
+}
+
 static int x86_hvm_cleanup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -237,6 +275,7 @@ struct xc_sr_save_ops save_ops_x86_hvm =
     .start_of_checkpoint = x86_hvm_start_of_checkpoint,
     .end_of_checkpoint   = x86_hvm_end_of_checkpoint,
     .check_vm_state      = x86_hvm_check_vm_state,
+    .postcopy_eager_pfns = x86_hvm_postcopy_eager_pfns,
     .cleanup             = x86_hvm_cleanup,
 };
 
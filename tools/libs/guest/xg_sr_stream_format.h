@@ -76,6 +76,12 @@ struct xc_sr_rhdr
 #define REC_TYPE_STATIC_DATA_END            0x00000010U
 #define REC_TYPE_X86_CPUID_POLICY           0x00000011U
 #define REC_TYPE_X86_MSR_POLICY             0x00000012U
+#define REC_TYPE_PAGE_DATA_ENCODED          0x00000013U
+#define REC_TYPE_POSTCOPY_BEGIN             0x00000014U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000015U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000016U
+#define REC_TYPE_POSTCOPY_PAGE_DATA         0x00000017U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000018U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
@@ -90,6 +96,33 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* PAGE_DATA_ENCODED */
+struct xc_sr_rec_page_data_encoded_header
+{
+    uint32_t count;
+    uint16_t codec;
+    uint16_t _res1;
+    uint64_t pfn[0];
+    /* uint32_t length[N], padded to 8 octets, then the encoded pages. */
+};
+
+#define PAGE_CODEC_NONE     0x0000U
+#define PAGE_CODEC_ZSTD     0x0001U
+
+/* POSTCOPY_BEGIN */
+struct xc_sr_rec_postcopy_begin
+{
+    uint64_t p2m_size;
+};
+
+/* POSTCOPY_PFNS, POSTCOPY_FAULT */
+struct xc_sr_rec_postcopy_pfns
+{
+    uint32_t count;
+    uint32_t _res1;
+    uint64_t pfn[0];
+};
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
@@ -443,6 +443,280 @@ int libxl_cpupool_movedomain(libxl_ctx *ctx, uint32_t poolid, uint32_t domid)
     return 0;
 }
 
+static int cpupool_write_gran(libxl__gc *gc, uint32_t poolid,
+                              libxl_cpupool_gran gran)
+{
+    xenhypfs_handle *hypfs;
+    const char *path = GCSPRINTF("/cpupool/%u/sched-gran", poolid);
+    int rc = 0;
+
+    hypfs = xenhypfs_open(CTX->lg, 0);
+    if (!hypfs) {
+        LOGE(ERROR, "opening Xen hypfs");
+        return ERROR_FAIL;
+    }
+
+    if (xenhypfs_write(hypfs, path, libxl_cpupool_gran_to_string(gran)) < 0) {
+        LOGE(ERROR, "Error setting granularity of cpupool %u", poolid);
+        rc = ERROR_FAIL;
+    }
+
+    xenhypfs_close(hypfs);
+    return rc;
+}
+
+static void cpupool_move_cpus(libxl__gc *gc, uint32_t from, uint32_t to,
+                              const libxl_bitmap *cpumap)
+{
+    int cpu;
+
+    /*
+     * Removing a cpu removes all cpus of its scheduling resource, and adding
+     * a cpu needs all cpus of its (possibly differently sized) scheduling
+     * resource to be free, so failures are expected here.  The caller checks
+     * the result.
+     */
+    libxl_for_each_set_bit(cpu, *cpumap)
+        xc_cpupool_removecpu(CTX->xch, from, cpu);
+    libxl_for_each_set_bit(cpu, *cpumap)
+        xc_cpupool_addcpu(CTX->xch, to, cpu);
+}
+
+/* Move all cpus and domains of cpupool from to cpupool to. */
+static int cpupool_move_all(libxl__gc *gc, uint32_t from, uint32_t to)
+{
+    libxl_cpupoolinfo info;
+    libxl_dominfo *doms = NULL;
+    int nb_doms = 0, i, rc;
+
+    libxl_cpupoolinfo_init(&info);
+
+    rc = cpupool_info(gc, &info, from, true);
+    if (rc)
+        goto out;
+
+    /*
+     * The domains can't be moved to a cpupool without cpus, and the last cpu
+     * of a cpupool with domains can't be removed.  So move as many cpus as
+     * possible first, then the domains, then the remaining cpus.
+     */
+    cpupool_move_cpus(gc, from, to, &info.cpumap);
+
+    if (info.n_dom) {
+        doms = libxl_list_domain(CTX, &nb_doms);
+        if (!doms) {
+            rc = ERROR_FAIL;
+            goto out;
+        }
+
+        for (i = 0; i < nb_doms; i++) {
+            if (doms[i].cpupool != from)
+                continue;
+            if (xc_cpupool_movedomain(CTX->xch, to, doms[i].domid)) {
+                LOGED(ERROR, doms[i].domid,
+                      "Error moving domain to cpupool %u", to);
+                rc = ERROR_FAIL;
+                goto out;
+            }
+        }
+
+        cpupool_move_cpus(gc, from, to, &info.cpumap);
+    }
+
+    libxl_cpupoolinfo_dispose(&info);
+    libxl_cpupoolinfo_init(&info);
+    rc = cpupool_info(gc, &info, from, true);
+    if (rc)
+        goto out;
+
+    if (!libxl_bitmap_is_empty(&info.cpumap)) {
+        LOG(ERROR, "Could not move all cpus of cpupool %u to cpupool %u",
+            from, to);
+        rc = ERROR_FAIL;
+    }
+
+out:
+    libxl_dominfo_list_free(doms, nb_doms);
+    libxl_cpupoolinfo_dispose(&info);
+    return rc;
+}
+
+/*
+ * Moving a domain to another cpupool resets the affinities of its vcpus and
+ * its scheduling parameters, so they are saved before the moves done by
+ * libxl_cpupool_set_granularity() and restored afterwards.
+ */
+typedef struct {
+    uint32_t domid;
+    libxl_domain_sched_params sched;
+    libxl_vcpu_sched_params vcpu_sched; /* RTDS only */
+    libxl_vcpuinfo *vcpus;
+    int nr_vcpus;
+} cpupool_dom_state;
+
+static void cpupool_doms_dispose(cpupool_dom_state *doms, int nr_doms)
+{
+    int i;
+
+    for (i = 0; i < nr_doms; i++) {
+        libxl_domain_sched_params_dispose(&doms[i].sched);
+        libxl_vcpu_sched_params_dispose(&doms[i].vcpu_sched);
+        libxl_vcpuinfo_list_free(doms[i].vcpus, doms[i].nr_vcpus);
+    }
+}
+
+static int cpupool_doms_save(libxl__gc *gc, uint32_t poolid,
+                             cpupool_dom_state **doms_r, int *nr_doms_r)
+{
+    libxl_dominfo *info;
+    cpupool_dom_state *doms;
+    int nb_doms, nr_doms = 0, nr_cpus, i, rc = 0;
+
+    info = libxl_list_domain(CTX, &nb_doms);
+    if (!info)
+        return ERROR_FAIL;
+
+    doms = libxl__calloc(gc, nb_doms, sizeof(*doms));
+
+    for (i = 0; i < nb_doms; i++) {
+        cpupool_dom_state *d = &doms[nr_doms];
+
+        if (info[i].cpupool != poolid)
+            continue;
+
+        d->domid = info[i].domid;
+        libxl_domain_sched_params_init(&d->sched);
+        libxl_vcpu_sched_params_init(&d->vcpu_sched);
+        nr_doms++;
+
+        rc = libxl_domain_sched_params_get(CTX, d->domid, &d->sched);
+        if (!rc && d->sched.sched == LIBXL_SCHEDULER_RTDS)
+            rc = libxl_vcpu_sched_params_get_all(CTX, d->domid,
+                                                 &d->vcpu_sched);
+        if (rc) {
+            LOGD(ERROR, d->domid, "Error getting scheduling parameters");
+            break;
+        }
+
+        d->vcpus = libxl_list_vcpu(CTX, d->domid, &d->nr_vcpus, &nr_cpus);
+        if (!d->vcpus) {
+            LOGD(ERROR, d->domid, "Error getting vcpu affinities");
+            rc = ERROR_FAIL;
+            break;
+        }
+    }
+
+    libxl_dominfo_list_free(info, nb_doms);
+
+    if (rc) {
+        cpupool_doms_dispose(doms, nr_doms);
+        return rc;
+    }
+
+    *doms_r = doms;
+    *nr_doms_r = nr_doms;
+    return 0;
+}
+
+static int cpupool_doms_restore(libxl__gc *gc, cpupool_dom_state *doms,
+                                int nr_doms)
+{
+    int i, j, rc = 0;
+
+    for (i = 0; i < nr_doms; i++) {
+        cpupool_dom_state *d = &doms[i];
+
+        if (libxl_domain_sched_params_set(CTX, d->domid, &d->sched) ||
+            (d->sched.sched == LIBXL_SCHEDULER_RTDS &&
+             libxl_vcpu_sched_params_set_all(CTX, d->domid, &d->vcpu_sched))) {
+            LOGD(ERROR, d->domid, "Error restoring scheduling parameters");
+            rc = ERROR_FAIL;
+        }
+
+        for (j = 0; j < d->nr_vcpus; j++) {
+            if (libxl_set_vcpuaffinity(CTX, d->domid, d->vcpus[j].vcpuid,
+                                       &d->vcpus[j].cpumap,
+                                       &d->vcpus[j].cpumap_soft)) {
+                LOGD(ERROR, d->domid, "Error restoring affinity of vcpu %u",
+                     d->vcpus[j].vcpuid);
+                rc = ERROR_FAIL;
+            }
+        }
+    }
+
+    return rc;
+}
+
+int libxl_cpupool_set_granularity(libxl_ctx *ctx, uint32_t poolid,
+                                  libxl_cpupool_gran gran)
+{
+    GC_INIT(ctx);
+    libxl_cpupoolinfo info;
+    libxl_bitmap nocpus;
+    libxl_uuid uuid;
+    uint32_t tmpid = LIBXL_CPUPOOL_POOLID_ANY;
+    cpupool_dom_state *doms = NULL;
+    int nr_doms = 0;
+    int rc;
+
+    libxl_cpupoolinfo_init(&info);
+    libxl_bitmap_init(&nocpus);
+
+    rc = cpupool_info(gc, &info, poolid, true);
+    if (rc)
+        goto out;
+
+    /* Xen allows changing the granularity of cpupools without cpus only. */
+    if (libxl_bitmap_is_empty(&info.cpumap)) {
+        rc = cpupool_write_gran(gc, poolid, gran);
+        goto out;
+    }
+
+    if (poolid == 0) {
+        LOG(ERROR, "Granularity of cpupool 0 can't be changed while it has "
+            "cpus assigned");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    rc = libxl_cpu_bitmap_alloc(ctx, &nocpus, 0);
+    if (rc)
+        goto out;
+
+    rc = cpupool_doms_save(gc, poolid, &doms, &nr_doms);
+    if (rc)
+        goto out;
+
+    libxl_uuid_generate(&uuid);
+    rc = libxl_cpupool_create(ctx, GCSPRINTF("%s-gran", info.pool_name),
+                              info.sched, nocpus, &uuid, &tmpid);
+    if (rc)
+        goto out;
+
+    rc = cpupool_write_gran(gc, tmpid, gran);
+    if (!rc)
+        rc = cpupool_move_all(gc, poolid, tmpid);
+    if (!rc)
+        rc = cpupool_write_gran(gc, poolid, gran);
+
+    /* Move everything back, after failures, too. */
+    if (cpupool_move_all(gc, tmpid, poolid) && !rc)
+        rc = ERROR_FAIL;
+
+    if (libxl_cpupool_destroy(ctx, tmpid) && !rc)
+        rc = ERROR_FAIL;
+
+    if (cpupool_doms_restore(gc, doms, nr_doms) && !rc)
+        rc = ERROR_FAIL;
+
+out:
+    cpupool_doms_dispose(doms, nr_doms);
+    libxl_bitmap_dispose(&nocpus);
+    libxl_cpupoolinfo_dispose(&info);
+    GC_FREE;
+    return rc;
+}
+
 /*
  * Local variables:
  * mode: C
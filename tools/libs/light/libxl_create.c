@@ -1465,8 +1465,10 @@ static void domcreate_bootloader_done(libxl__egc *egc,
             break;
         case LIBXL_CHECKPOINTED_STREAM_REMUS:
             libxl__remus_restore_setup(egc, dcs);
-            /* fall through */
+            libxl__stream_read_start(egc, &dcs->srs);
+            break;
         case LIBXL_CHECKPOINTED_STREAM_NONE:
+            libxl__postcopy_restore_setup(egc, dcs);
             libxl__stream_read_start(egc, &dcs->srs);
         }
         return;
@@ -21,6 +21,9 @@
 
 /*========================= Domain save ============================*/
 
+/* Threads encoding page data for LIBXL_SUSPEND_PIPELINE/COMPRESS. */
+#define SAVE_PIPELINE_WORKERS 4
+
 static void stream_done(libxl__egc *egc,
                         libxl__stream_write_state *sws, int rc);
 static void domain_save_done(libxl__egc *egc,
@@ -375,6 +378,19 @@ int libxl__save_emulator_xenstore_data(libxl__domain_save_state *dss,
 
 /*----- main code for saving, in order of execution -----*/
 
+/*
+ * Downtime target, in milliseconds, for the precopy phase of live
+ * migrations.  Setting the environment variable LIBXL_PRECOPY_DOWNTIME_MS
+ * opts in to libxenguest's adaptive precopy policy; when unset, or 0, the
+ * default policy of at most 5 rounds is used.
+ */
+static unsigned int libxl__get_precopy_downtime(void)
+{
+    const char *env_downtime = getenv("LIBXL_PRECOPY_DOWNTIME_MS");
+
+    return env_downtime ? strtoul(env_downtime, NULL, 0) : 0;
+}
+
 void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 {
     STATE_AO_GC(dss->ao);
@@ -409,7 +425,11 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (rc) goto out;
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
-          | (debug ? XCFLAGS_DEBUG : 0);
+          | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->compress ? XCFLAGS_COMPRESS : 0);
+    if (dss->pipeline || dss->compress)
+        dss->xcflags |= XCFLAGS_WORKERS(SAVE_PIPELINE_WORKERS);
+    dss->precopy_downtime = libxl__get_precopy_downtime();
 
     /* Disallow saving a guest with vNUMA configured because migration
      * stream does not preserve node information.
@@ -437,6 +457,9 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     dss->sws.back_channel = false;
     dss->sws.completion_callback = stream_done;
 
+    if (dss->postcopy)
+        libxl__postcopy_setup(egc, dss);
+
     libxl__stream_write_start(egc, &dss->sws);
     return;
 
@@ -479,6 +502,12 @@ static void domain_save_done(libxl__egc *egc,
         return;
     }
 
+    if (rc && dss->postcopy_started) {
+        LOGD(ERROR, domid, "Post-copy migration failed after the domain was "
+             "started at the destination");
+        rc = ERROR_POSTCOPY_FAILED;
+    }
+
     dss->callback(egc, dss, rc);
 }
 
@@ -525,6 +525,8 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->pipeline = flags & LIBXL_SUSPEND_PIPELINE;
+    dss->compress = flags & LIBXL_SUSPEND_COMPRESS;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
@@ -539,6 +541,54 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend_postcopy(libxl_ctx *ctx, uint32_t domid,
+                                  int send_fd, int recv_fd, int flags,
+                                  const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, domid, ao_how);
+    int rc;
+
+    libxl_domain_type type = libxl__domain_type(gc, domid);
+    if (type == LIBXL_DOMAIN_TYPE_INVALID) {
+        rc = ERROR_FAIL;
+        goto out_err;
+    }
+
+    if (type != LIBXL_DOMAIN_TYPE_HVM) {
+        LOGD(ERROR, domid, "Post-copy migration is only supported for HVM guests");
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
+    libxl__domain_save_state *dss;
+    GCNEW(dss);
+
+    dss->ao = ao;
+    dss->callback = domain_suspend_cb;
+
+    dss->domid = domid;
+    dss->fd = send_fd;
+    dss->recv_fd = recv_fd;
+    dss->type = type;
+    dss->live = 1;
+    dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->pipeline = flags & LIBXL_SUSPEND_PIPELINE;
+    dss->compress = flags & LIBXL_SUSPEND_COMPRESS;
+    dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
+    dss->postcopy = true;
+
+    rc = libxl__fd_flags_modify_save(gc, dss->fd,
+                                     ~(O_NONBLOCK|O_NDELAY), 0,
+                                     &dss->fdfl);
+    if (rc < 0) goto out_err;
+
+    libxl__domain_save(egc, dss);
+    return AO_INPROGRESS;
+
+ out_err:
+    return AO_CREATE_FAIL(rc);
+}
+
 static void domain_suspend_empty_cb(libxl__egc *egc,
                               libxl__domain_suspend_state *dss, int rc)
 {
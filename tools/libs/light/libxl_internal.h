@@ -669,6 +669,8 @@ struct libxl__ctx {
     xentoollog_logger *lg;
     xc_interface *xch;
     struct xs_handle *xsh;
+    bool xs_multi_unsupported; /* xenstored lacks XS_MULTI */
+    bool xs_multi_probed; /* xenstored has processed an XS_MULTI request */
     libxl__gc nogc_gc;
 
     const libxl_event_hooks *event_hooks;
@@ -3652,11 +3654,16 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int pipeline;
+    int compress;
     int checkpointed_stream;
+    bool postcopy;
     const libxl_domain_remus_info *remus;
     /* private */
     int rc;
     int xcflags;
+    unsigned int precopy_downtime; /* ms, 0 for libxenguest's default */
+    bool postcopy_started; /* the destination may be running the guest */
     libxl__domain_suspend_state dsps;
     union {
         /* for Remus */
@@ -4200,6 +4207,21 @@ _hidden int libxl__destroy_qdisk_backend(libxl__gc *gc, uint32_t domid);
 /*----- Domain creation -----*/
 
 
+/*
+ * Post-copy restore: the domain is built and unpaused while libxc is
+ * still pulling its memory across, and dcs->callback is deferred until
+ * both the stream and the domain creation have finished.
+ */
+typedef struct libxl__postcopy_restore_state {
+    /* private to libxl_postcopy.c */
+    libxl__ev_immediate ei;
+    libxl__domain_create_cb *saved_cb;
+    libxl__dm_resume_state dmrs;
+    bool stream_done, create_done;
+    bool retained; /* domain built and not yet destroyed */
+    int rc;
+} libxl__postcopy_restore_state;
+
 struct libxl__domain_create_state {
     /* filled in by user */
     libxl__ao *ao;
@@ -4225,6 +4247,7 @@ struct libxl__domain_create_state {
         /* If we're not doing stubdom, we use only sdss.dm,
          * for the non-stubdom device model. */
     libxl__stream_read_state srs;
+    libxl__postcopy_restore_state pcrs;
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
@@ -4312,6 +4335,12 @@ _hidden void libxl__remus_teardown(libxl__egc *egc,
 _hidden void libxl__remus_restore_setup(libxl__egc *egc,
                                         libxl__domain_create_state *dcs);
 
+/* Post-copy setup */
+_hidden void libxl__postcopy_setup(libxl__egc *egc,
+                                   libxl__domain_save_state *dss);
+_hidden void libxl__postcopy_restore_setup(libxl__egc *egc,
+                                           libxl__domain_create_state *dcs);
+
 _hidden char *libxl__domid_history_path(libxl__gc *gc,
                                         const char *suffix);
 
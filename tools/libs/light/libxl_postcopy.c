@@ -0,0 +1,295 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include "libxl_internal.h"
+
+/*
+ * Post-copy live migration.
+ *
+ * libxc performs the pre-copy iterations as usual, then suspends the
+ * guest and sends its vcpu state together with the list of pages it has
+ * not sent yet.  At that point it calls postcopy_transition() on both
+ * sides:
+ *
+ *  - The sender writes a libxl checkpoint (the emulator records and
+ *    CHECKPOINT_END) so the destination has everything it needs to run
+ *    the guest, and then lets libxc push the outstanding pages.
+ *
+ *  - The receiver reads that checkpoint, lets libxc start serving page
+ *    faults, and builds the domain (device model, devices) exactly as
+ *    it would at the end of a normal restore.  The guest is unpaused as
+ *    soon as it has been built.  Once libxc and the rest of the stream
+ *    have finished the domain is paused again and handed back to the
+ *    caller of libxl_domain_create_restore(), like any other restored
+ *    domain.
+ */
+
+/*----- Save -----*/
+
+static void postcopy_save_transition_callback(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+    STATE_AO_GC(dss->ao);
+
+    libxl__stream_write_start_checkpoint(egc, &dss->sws);
+}
+
+static void postcopy_checkpoint_written(libxl__egc *egc,
+                                        libxl__stream_write_state *sws,
+                                        int rc)
+{
+    libxl__domain_save_state *dss = CONTAINER_OF(sws, *dss, sws);
+    STATE_AO_GC(dss->ao);
+
+    if (rc) {
+        LOGD(ERROR, dss->domid,
+             "Failed to send device model state for post-copy");
+        libxl__xc_domain_saverestore_async_callback_done(egc, &sws->shs, 0);
+        return;
+    }
+
+    dss->postcopy_started = true;
+    libxl__xc_domain_saverestore_async_callback_done(egc, &sws->shs, 1);
+}
+
+void libxl__postcopy_setup(libxl__egc *egc, libxl__domain_save_state *dss)
+{
+    /* Convenience aliases */
+    libxl__srm_save_autogen_callbacks *const callbacks =
+        &dss->sws.shs.callbacks.save.a;
+
+    dss->xcflags |= XCFLAGS_POSTCOPY;
+    dss->postcopy_started = false;
+    callbacks->postcopy_transition = postcopy_save_transition_callback;
+    dss->sws.checkpoint_callback = postcopy_checkpoint_written;
+}
+
+/*----- Restore -----*/
+
+static void postcopy_checkpoint_read(libxl__egc *egc,
+                                     libxl__stream_read_state *srs,
+                                     int ret);
+static void postcopy_build_domain(libxl__egc *egc, libxl__ev_immediate *ei);
+static void postcopy_domain_created(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs,
+                                    int rc, uint32_t domid);
+static void postcopy_domain_unpaused(libxl__egc *egc,
+                                     libxl__dm_resume_state *dmrs, int rc);
+static void postcopy_fail(libxl__egc *egc,
+                          libxl__domain_create_state *dcs, int rc);
+static void postcopy_stream_done(libxl__egc *egc,
+                                 libxl__stream_read_state *srs, int rc);
+static void postcopy_check_finished(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs);
+static void postcopy_domain_destroyed(libxl__egc *egc,
+                                      libxl__domain_destroy_state *dds,
+                                      int rc);
+
+static void postcopy_restore_transition_callback(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_create_state *dcs = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+    STATE_AO_GC(dcs->ao);
+
+    libxl__stream_read_start_checkpoint(egc, &dcs->srs);
+}
+
+static void postcopy_checkpoint_read(libxl__egc *egc,
+                                     libxl__stream_read_state *srs,
+                                     int ret)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+    STATE_AO_GC(dcs->ao);
+
+    if (ret != XGR_CHECKPOINT_SUCCESS) {
+        LOGD(ERROR, dcs->guest_domid,
+             "Failed to receive device model state for post-copy");
+        libxl__xc_domain_saverestore_async_callback_done(egc, &srs->shs, 0);
+        return;
+    }
+
+    /* libxc must be serving page requests before the guest can run. */
+    libxl__xc_domain_saverestore_async_callback_done(egc, &srs->shs, 1);
+
+    /*
+     * We are called from within the stream's checkpoint handling, which
+     * still has to be unwound before the domain can be built.
+     */
+    pcrs->ei.callback = postcopy_build_domain;
+    libxl__ev_immediate_register(egc, &pcrs->ei);
+}
+
+static void postcopy_build_domain(libxl__egc *egc, libxl__ev_immediate *ei)
+{
+    libxl__postcopy_restore_state *pcrs = CONTAINER_OF(ei, *pcrs, ei);
+    libxl__domain_create_state *dcs = CONTAINER_OF(pcrs, *dcs, pcrs);
+    libxl__stream_read_state *const srs = &dcs->srs;
+    void (*build)(libxl__egc *, libxl__stream_read_state *, int) =
+        srs->completion_callback;
+
+    /*
+     * As for COLO, build the domain while the stream is still running,
+     * and divert both the stream's completion and the domain creation's
+     * completion here, so the caller only hears about the restore once
+     * both have finished.
+     */
+    pcrs->saved_cb = dcs->callback;
+    dcs->callback = postcopy_domain_created;
+    srs->completion_callback = postcopy_stream_done;
+
+    build(egc, srs, 0);
+}
+
+static void postcopy_domain_created(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs,
+                                    int rc, uint32_t domid)
+{
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+    STATE_AO_GC(dcs->ao);
+
+    if (rc) {
+        /* The domain has already been destroyed. */
+        pcrs->create_done = true;
+        postcopy_fail(egc, dcs, rc);
+        return;
+    }
+
+    pcrs->dmrs.ao = ao;
+    pcrs->dmrs.domid = domid;
+    pcrs->dmrs.callback = postcopy_domain_unpaused;
+    libxl__domain_unpause(egc, &pcrs->dmrs);
+}
+
+static void postcopy_domain_unpaused(libxl__egc *egc,
+                                     libxl__dm_resume_state *dmrs, int rc)
+{
+    libxl__postcopy_restore_state *pcrs = CONTAINER_OF(dmrs, *pcrs, dmrs);
+    libxl__domain_create_state *dcs = CONTAINER_OF(pcrs, *dcs, pcrs);
+    STATE_AO_GC(dcs->ao);
+
+    pcrs->create_done = true;
+    pcrs->retained = true;
+
+    if (rc) {
+        LOGD(ERROR, dmrs->domid, "Failed to start domain during post-copy");
+        postcopy_fail(egc, dcs, rc);
+        return;
+    }
+
+    LOGD(DEBUG, dmrs->domid, "Domain running, waiting for post-copy");
+    postcopy_check_finished(egc, dcs);
+}
+
+static void postcopy_fail(libxl__egc *egc,
+                          libxl__domain_create_state *dcs, int rc)
+{
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+
+    if (!pcrs->rc)
+        pcrs->rc = rc;
+
+    /* Aborting the stream ends in postcopy_stream_done(). */
+    if (pcrs->stream_done)
+        postcopy_check_finished(egc, dcs);
+    else
+        libxl__stream_read_abort(egc, &dcs->srs, rc);
+}
+
+static void postcopy_stream_done(libxl__egc *egc,
+                                 libxl__stream_read_state *srs, int rc)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+
+    pcrs->stream_done = true;
+    if (rc && !pcrs->rc)
+        pcrs->rc = rc;
+
+    postcopy_check_finished(egc, dcs);
+}
+
+static void postcopy_check_finished(libxl__egc *egc,
+                                    libxl__domain_create_state *dcs)
+{
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+    STATE_AO_GC(dcs->ao);
+
+    /* Convenience aliases */
+    const uint32_t domid = dcs->guest_domid;
+
+    if (!pcrs->stream_done || !pcrs->create_done)
+        return;
+
+    dcs->callback = pcrs->saved_cb;
+
+    /* Hand the domain back paused, as for any other restore. */
+    if (!pcrs->rc && xc_domain_pause(CTX->xch, domid)) {
+        LOGED(ERROR, domid, "Pausing domain after post-copy");
+        pcrs->rc = ERROR_FAIL;
+    }
+
+    if (pcrs->rc && pcrs->retained) {
+        /* Some of its memory never arrived; the domain cannot continue. */
+        dcs->dds.ao = ao;
+        dcs->dds.domid = domid;
+        dcs->dds.callback = postcopy_domain_destroyed;
+        libxl__domain_destroy(egc, &dcs->dds);
+        return;
+    }
+
+    dcs->callback(egc, dcs, pcrs->rc, pcrs->rc ? INVALID_DOMID : domid);
+}
+
+static void postcopy_domain_destroyed(libxl__egc *egc,
+                                      libxl__domain_destroy_state *dds,
+                                      int rc)
+{
+    libxl__domain_create_state *dcs = CONTAINER_OF(dds, *dcs, dds);
+    STATE_AO_GC(dcs->ao);
+
+    if (rc)
+        LOGD(ERROR, dds->domid,
+             "unable to destroy domain following failed post-copy");
+
+    dcs->callback(egc, dcs, dcs->pcrs.rc, INVALID_DOMID);
+}
+
+void libxl__postcopy_restore_setup(libxl__egc *egc,
+                                   libxl__domain_create_state *dcs)
+{
+    /* Convenience aliases */
+    libxl__srm_restore_autogen_callbacks *const callbacks =
+        &dcs->srs.shs.callbacks.restore.a;
+    libxl__postcopy_restore_state *const pcrs = &dcs->pcrs;
+
+    pcrs->stream_done = false;
+    pcrs->create_done = false;
+    pcrs->retained = false;
+    pcrs->rc = 0;
+
+    callbacks->postcopy_transition = postcopy_restore_transition_callback;
+    dcs->srs.checkpoint_callback = postcopy_checkpoint_read;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -88,7 +88,7 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
 
     const unsigned long argnums[] = {
         dss->domid, dss->xcflags, cbflags,
-        dss->checkpointed_stream,
+        dss->checkpointed_stream, dss->precopy_downtime,
     };
 
     shs->ao = ao;
@@ -416,6 +416,22 @@ void libxl__srm_callout_callback_progress(const char *context,
     xtl_progress(CTX->lg, context, doing_what, done, total);
 }
 
+void libxl__srm_callout_callback_precopy_stats(unsigned iteration,
+                   unsigned long total_written, long dirty_count,
+                   unsigned long dirty_rate, unsigned long bandwidth,
+                   long predicted_downtime, void *user)
+{
+    libxl__save_helper_state *shs = user;
+    STATE_AO_GC(shs->ao);
+
+    LOGD(INFO, shs->domid,
+         "precopy iteration %u: %ld pages dirty, %lu sent so far, "
+         "dirtied at %lu pages/s, sent at %lu pages/s, "
+         "predicted downtime %ldms",
+         iteration, dirty_count, total_written, dirty_rate, bandwidth,
+         predicted_downtime);
+}
+
 int libxl__srm_callout_callback_complete(int retval, int errnoval,
                                          void *user)
 {
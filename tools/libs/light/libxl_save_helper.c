@@ -217,6 +217,26 @@ int helper_getreply(void *user)
 
 /*----- other callbacks -----*/
 
+static unsigned int precopy_downtime;
+
+static int precopy_policy(struct precopy_stats stats, void *user)
+{
+    /*
+     * The policy is asked twice per iteration, the second time without a
+     * dirty count.  Only report the first, when the figures are up to date.
+     */
+    if (stats.dirty_count >= 0)
+        helper_stub_precopy_stats(stats.iteration, stats.total_written,
+                                  stats.dirty_count, stats.dirty_rate,
+                                  stats.bandwidth, stats.predicted_downtime, 0);
+
+    /* A downtime target opts in to the adaptive policy. */
+    if (precopy_downtime)
+        return xc_precopy_policy_adaptive(stats, precopy_downtime);
+
+    return xc_precopy_policy_simple(stats);
+}
+
 static void startup(const char *op) {
     xtl_log(&logger,XTL_DEBUG,0,program,"starting %s",op);
 
@@ -251,9 +271,11 @@ int main(int argc, char **argv)
         uint32_t flags =                    strtoul(NEXTARG,0,10);
         unsigned cbflags =                  strtoul(NEXTARG,0,10);
         xc_stream_type_t stream_type =      strtoul(NEXTARG,0,10);
+        precopy_downtime =                  strtoul(NEXTARG,0,10);
         assert(!*++argv);
 
         helper_setcallbacks_save(&cb, cbflags);
+        cb.precopy_policy = precopy_policy;
 
         startup("save");
         setup_signals(save_signal_handler);
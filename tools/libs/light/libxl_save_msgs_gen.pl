@@ -23,10 +23,17 @@ our @msgs = (
                                              STRING doing_what),
                                             'unsigned long', 'done',
                                             'unsigned long', 'total'] ],
+    [ 's',      "precopy_stats",         [qw(unsigned iteration),
+                                            'unsigned long', 'total_written',
+                                            'long', 'dirty_count',
+                                            'unsigned long', 'dirty_rate',
+                                            'unsigned long', 'bandwidth',
+                                            'long', 'predicted_downtime'] ],
     [ 'srcxA',  "suspend", [] ],
     [ 'srcxA',  "postcopy", [] ],
     [ 'srcxA',  "checkpoint", [] ],
     [ 'srcxA',  "wait_checkpoint", [] ],
+    [ 'srcxA',  "postcopy_transition", [] ],
     [ 'scxA',   "switch_qemu_logdirty",  [qw(uint32_t domid
                                           unsigned enable)] ],
     [ 'rcxW',   "static_data_done",      [qw(unsigned missing)] ],
@@ -142,7 +149,7 @@ static void bytes_put(unsigned char *const buf, int *len,
 
 END
 
-foreach my $simpletype (qw(int uint16_t uint32_t unsigned), 'unsigned long', 'xen_pfn_t') {
+foreach my $simpletype (qw(int long uint16_t uint32_t unsigned), 'unsigned long', 'xen_pfn_t') {
     my $typeid = typeid($simpletype);
     $out_body{'callout'} .= <<END;
 static int ${typeid}_get(const unsigned char **msg,
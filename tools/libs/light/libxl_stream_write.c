@@ -375,6 +375,13 @@ void libxl__xc_domain_save_done(libxl__egc *egc, void *dss_void,
              * return value (Please refer to libxl__remus_teardown())
              */
             stream_complete(egc, stream, 0);
+        else if (dss->postcopy)
+            /*
+             * The emulator records went out in the post-copy transition
+             * checkpoint, before the guest was started at the
+             * destination.  Only the END record remains.
+             */
+            write_end_record(egc, stream);
         else
             write_emulator_xenstore_record(egc, stream);
     }
@@ -45,6 +45,70 @@ char **libxl__xs_kvs_of_flexarray(libxl__gc *gc, flexarray_t *array)
     return kvs;
 }
 
+/*
+ * Write all of kvs (and set their permissions) with a single xenstore
+ * request. Returns false if that wasn't possible, e.g. because xenstored
+ * doesn't support XS_MULTI or the request is too large.
+ */
+static bool xs_writev_multi(libxl__gc *gc, xs_transaction_t t,
+                            const char *dir, char *kvs[],
+                            struct xs_permissions *perms,
+                            unsigned int num_perms)
+{
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    struct xs_multi_op *ops;
+    unsigned int i, n = 0;
+    int saved_errno;
+    bool ok;
+
+    if (ctx->xs_multi_unsupported)
+        return false;
+
+    for (i = 0; kvs[i] != NULL; i += 2)
+        n += perms ? 2 : 1;
+
+    ops = libxl__calloc(gc, n, sizeof(*ops));
+    for (i = 0, n = 0; kvs[i] != NULL; i += 2) {
+        if (!kvs[i + 1])
+            continue;
+        ops[n].type = XS_WRITE;
+        ops[n].path = GCSPRINTF("%s/%s", dir, kvs[i]);
+        ops[n].data = kvs[i + 1];
+        ops[n].len = strlen(kvs[i + 1]);
+        n++;
+        if (perms) {
+            ops[n].type = XS_SET_PERMS;
+            ops[n].path = ops[n - 1].path;
+            ops[n].perms = perms;
+            ops[n].num_perms = num_perms;
+            n++;
+        }
+    }
+
+    if (!n)
+        return true;
+
+    ok = xs_multi(ctx->xsh, t, ops, n);
+    saved_errno = errno;
+
+    /* Replies to the operations done are returned even on failure. */
+    for (i = 0; i < n; i++)
+        free(ops[i].reply);
+
+    /*
+     * xenstored rejects unknown requests with ENOSYS or, e.g. oxenstored,
+     * with EINVAL.  EINVAL is only taken as such as long as no XS_MULTI
+     * request has been processed, i.e. got as far as its operations.
+     */
+    if (ok || ops[0].error != ECANCELED)
+        ctx->xs_multi_probed = true;
+    else if (saved_errno == ENOSYS ||
+             (saved_errno == EINVAL && !ctx->xs_multi_probed))
+        ctx->xs_multi_unsupported = true;
+
+    return ok;
+}
+
 int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                            const char *dir, char *kvs[],
                            struct xs_permissions *perms,
@@ -57,6 +121,10 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
     if (!kvs)
         return 0;
 
+    /* One round trip for all entries if possible, else one per entry. */
+    if (xs_writev_multi(gc, t, dir, kvs, perms, num_perms))
+        return 0;
+
     for (i = 0; kvs[i] != NULL; i += 2) {
         path = GCSPRINTF("%s/%s", dir, kvs[i]);
         if (path && kvs[i + 1]) {
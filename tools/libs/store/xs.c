@@ -833,6 +833,124 @@ unwind:
 	return false;
 }
 
+static bool multi_add(char *buf, unsigned int *off, const void *data,
+		      unsigned int len)
+{
+	if (len > XENSTORE_PAYLOAD_MAX - *off)
+		return false;
+	memcpy(buf + *off, data, len);
+	*off += len;
+	return true;
+}
+
+static bool multi_add_op(char *buf, unsigned int *off,
+			 const struct xs_multi_op *op)
+{
+	struct xsd_sockmsg hdr = { .type = op->type };
+	unsigned int hdr_off = *off, i;
+	char perm[MAX_STRLEN(unsigned int)+1];
+
+	if (!multi_add(buf, off, &hdr, sizeof(hdr)) ||
+	    !multi_add(buf, off, op->path, strlen(op->path) + 1))
+		return false;
+
+	switch (op->type) {
+	case XS_WRITE:
+		if (!multi_add(buf, off, op->data, op->len))
+			return false;
+		break;
+	case XS_SET_PERMS:
+		for (i = 0; i < op->num_perms; i++) {
+			if (!xenstore_perm_to_string(&op->perms[i], perm,
+						     sizeof(perm)) ||
+			    !multi_add(buf, off, perm, strlen(perm) + 1))
+				return false;
+		}
+		break;
+	default:
+		break;
+	}
+
+	hdr.len = *off - hdr_off - sizeof(hdr);
+	memcpy(buf + hdr_off, &hdr, sizeof(hdr));
+
+	return true;
+}
+
+bool xs_multi(struct xs_handle *h, xs_transaction_t t,
+	      struct xs_multi_op *ops, unsigned int num_ops)
+{
+	struct xsd_sockmsg hdr;
+	struct iovec iovec;
+	char *buf, *reply;
+	unsigned int i, off = 0, len;
+	int error = 0;
+
+	for (i = 0; i < num_ops; i++) {
+		ops[i].error = ECANCELED;
+		ops[i].reply = NULL;
+		ops[i].reply_len = 0;
+	}
+
+	buf = malloc(XENSTORE_PAYLOAD_MAX);
+	if (!buf)
+		return false;
+
+	for (i = 0; i < num_ops; i++) {
+		if (!multi_add_op(buf, &off, &ops[i])) {
+			free(buf);
+			errno = E2BIG;
+			return false;
+		}
+	}
+
+	iovec.iov_base = buf;
+	iovec.iov_len = off;
+	reply = xs_talkv(h, t, XS_MULTI, &iovec, 1, &len);
+	free_no_errno(buf);
+	if (!reply)
+		return false;
+
+	for (i = 0, off = 0; i < num_ops && len - off >= sizeof(hdr); i++) {
+		memcpy(&hdr, reply + off, sizeof(hdr));
+		off += sizeof(hdr);
+		if (hdr.len > len - off) {
+			error = EBADF;
+			break;
+		}
+
+		if (hdr.type == XS_ERROR) {
+			/* The error string is nul terminated. */
+			ops[i].error = get_error(reply + off);
+			error = ops[i].error;
+			break;
+		}
+
+		ops[i].reply = malloc(hdr.len + 1);
+		if (!ops[i].reply) {
+			ops[i].error = ENOMEM;
+			error = ENOMEM;
+			break;
+		}
+		memcpy(ops[i].reply, reply + off, hdr.len);
+		((char *)ops[i].reply)[hdr.len] = 0;
+		ops[i].reply_len = hdr.len;
+		ops[i].error = 0;
+		off += hdr.len;
+	}
+
+	free(reply);
+
+	if (!error && i < num_ops)
+		error = EBADF;
+	if (error) {
+		errno = error;
+		return false;
+	}
+
+	return true;
+}
+
 /* Always return false a functionality has been removed in Xen 4.9 */
 bool xs_restrict(struct xs_handle *h, unsigned domid)
 {
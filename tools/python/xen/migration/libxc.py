@@ -58,6 +58,12 @@ REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
 REC_TYPE_static_data_end            = 0x00000010
 REC_TYPE_x86_cpuid_policy           = 0x00000011
 REC_TYPE_x86_msr_policy             = 0x00000012
+REC_TYPE_page_data_encoded          = 0x00000013
+REC_TYPE_postcopy_begin             = 0x00000014
+REC_TYPE_postcopy_pfns              = 0x00000015
+REC_TYPE_postcopy_transition        = 0x00000016
+REC_TYPE_postcopy_page_data         = 0x00000017
+REC_TYPE_postcopy_fault             = 0x00000018
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -79,6 +85,12 @@ rec_type_to_str = {
     REC_TYPE_static_data_end            : "Static data end",
     REC_TYPE_x86_cpuid_policy           : "x86 CPUID policy",
     REC_TYPE_x86_msr_policy             : "x86 MSR policy",
+    REC_TYPE_page_data_encoded          : "Page data encoded",
+    REC_TYPE_postcopy_begin             : "Postcopy begin",
+    REC_TYPE_postcopy_pfns              : "Postcopy pfns",
+    REC_TYPE_postcopy_transition        : "Postcopy transition",
+    REC_TYPE_postcopy_page_data         : "Postcopy page data",
+    REC_TYPE_postcopy_fault             : "Postcopy fault",
 }
 
 # page_data
@@ -101,6 +113,17 @@ PAGE_DATA_TYPE_BROKEN        = (0xd << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (0xe << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (0xf << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# page_data_encoded
+PAGE_DATA_ENCODED_FORMAT     = "IHH"
+PAGE_CODEC_NONE              = 0x0000
+PAGE_CODEC_ZSTD              = 0x0001
+
+# postcopy_begin
+POSTCOPY_BEGIN_FORMAT        = "Q"
+
+# postcopy_pfns, postcopy_fault
+POSTCOPY_PFNS_FORMAT         = "II"
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -251,6 +274,26 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
+    def verify_page_data_pfns(self, pfns):
+        """ Verify a pfn array, returning the number of pages with data """
+        nr_pages = 0
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x" %
+                                  (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x" %
+                                  (idx, pfn & PAGE_DATA_TYPE_LTAB_MASK))
+
+            # We expect page data for each normal page or pagetable
+            if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
+                    <= PAGE_DATA_TYPE_L4TAB:
+                nr_pages += 1
+
+        return nr_pages
+
     def verify_record_page_data(self, content):
         """ Page Data record """
         minsz = calcsize(PAGE_DATA_FORMAT)
@@ -272,21 +315,7 @@ class VerifyLibxc(VerifyBase):
 
         pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
 
-        nr_pages = 0
-        for idx, pfn in enumerate(pfns):
-
-            if pfn & PAGE_DATA_PFN_RESZ_MASK:
-                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x" %
-                                  (idx, pfn & PAGE_DATA_PFN_RESZ_MASK))
-
-            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
-                raise RecordError("Invalid type value in pfn[%d]: 0x%016x" %
-                                  (idx, pfn & PAGE_DATA_TYPE_LTAB_MASK))
-
-            # We expect page data for each normal page or pagetable
-            if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
-                    <= PAGE_DATA_TYPE_L4TAB:
-                nr_pages += 1
+        nr_pages = self.verify_page_data_pfns(pfns)
 
         pagesz = nr_pages * 4096
         if len(content) != minsz + pfnsz + pagesz:
@@ -294,6 +323,56 @@ class VerifyLibxc(VerifyBase):
                               (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_record_page_data_encoded(self, content):
+        """ Page Data Encoded record """
+
+        if self.version < 3:
+            raise RecordError("Page data encoded record found in v2 stream")
+
+        minsz = calcsize(PAGE_DATA_ENCODED_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError(
+                "PAGE_DATA_ENCODED record must be at least %d bytes long"
+                % (minsz, ))
+
+        count, codec, res1 = unpack(PAGE_DATA_ENCODED_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError(
+                "Reserved bits set in PAGE_DATA_ENCODED record 0x%04x"
+                % (res1, ))
+
+        if codec not in (PAGE_CODEC_NONE, PAGE_CODEC_ZSTD):
+            raise RecordError("Unknown codec %u" % (codec, ))
+
+        pfnsz = count * 8
+        if (len(content) - minsz) < pfnsz:
+            raise RecordError("PAGE_DATA_ENCODED record must contain a pfn "
+                              "record for each count")
+
+        pfns = list(unpack("=%dQ" % (count, ), content[minsz:minsz + pfnsz]))
+
+        nr_pages = self.verify_page_data_pfns(pfns)
+
+        lensz = (nr_pages * 4 + 7) & ~7
+        if (len(content) - minsz - pfnsz) < lensz:
+            raise RecordError("PAGE_DATA_ENCODED record must contain a length "
+                              "for each page of data")
+
+        lengths = unpack("=%dI" % (nr_pages, ),
+                         content[minsz + pfnsz:minsz + pfnsz + nr_pages * 4])
+
+        for idx, length in enumerate(lengths):
+            if length > 4096:
+                raise RecordError("Page %d has length %u" % (idx, length))
+
+        datasz = sum(lengths)
+        if len(content) != minsz + pfnsz + lensz + datasz:
+            raise RecordError("Expected %u + %u + %u + %u, got %u" %
+                              (minsz, pfnsz, lensz, datasz, len(content)))
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -476,6 +555,48 @@ class VerifyLibxc(VerifyBase):
                               (contentsz, sz))
 
 
+    def verify_record_postcopy_begin(self, content):
+        """ postcopy begin record """
+
+        sz = calcsize(POSTCOPY_BEGIN_FORMAT)
+        if len(content) != sz:
+            raise RecordError("Postcopy begin: expected length of %d, got %d"
+                              % (sz, len(content)))
+
+
+    def verify_record_postcopy_pfns(self, content):
+        """ postcopy pfns record """
+
+        minsz = calcsize(POSTCOPY_PFNS_FORMAT)
+
+        if len(content) < minsz:
+            raise RecordError("Postcopy pfns record must be at least %d bytes "
+                              "long" % (minsz, ))
+
+        count, res1 = unpack(POSTCOPY_PFNS_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError(
+                "Reserved bits set in postcopy pfns record 0x%08x" % (res1, ))
+
+        if len(content) != minsz + count * 8:
+            raise RecordError("Expected %u + %u, got %u" %
+                              (minsz, count * 8, len(content)))
+
+
+    def verify_record_postcopy_transition(self, content):
+        """ postcopy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Postcopy transition record with non-zero "
+                              "length")
+
+
+    def verify_record_postcopy_fault(self, content):
+        """ postcopy fault record """
+        raise RecordError("Found postcopy fault record in stream")
+
+
 record_verifiers = {
     REC_TYPE_end:
         VerifyLibxc.verify_record_end,
@@ -525,4 +646,18 @@ record_verifiers = {
         VerifyLibxc.verify_record_x86_cpuid_policy,
     REC_TYPE_x86_msr_policy:
         VerifyLibxc.verify_record_x86_msr_policy,
+
+    REC_TYPE_page_data_encoded:
+        VerifyLibxc.verify_record_page_data_encoded,
+
+    REC_TYPE_postcopy_begin:
+        VerifyLibxc.verify_record_postcopy_begin,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_page_data:
+        VerifyLibxc.verify_record_page_data,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
     }
@@ -0,0 +1,216 @@
+/*
+ * Event channel benchmark, to be run in dom0 (or any domain allowed to bind
+ * interdomain event channels to itself).
+ *
+ * An interdomain event channel is set up between two ports of the calling
+ * domain.  A number of sender threads notify one end in a tight loop, as a
+ * driver domain would during an event storm, while a receiver thread
+ * consumes and unmasks events on the other end.  The rates of notifications
+ * and of events actually delivered (i.e. not coalesced) are reported.
+ *
+ * Threads can be pinned to vCPUs (-c), which in turn can be pinned to
+ * physical CPUs on the same or on different sockets, e.g. with
+ * "xl vcpu-pin", to compare the cost of sending events across sockets.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenevtchn.h>
+
+#define MAX_SENDERS 64
+
+static unsigned int nr_seconds = 5;
+static unsigned int nr_senders = 1;
+static int send_cpu = -1, recv_cpu = -1;
+static uint32_t domid;
+
+static xenevtchn_handle *send_xce, *recv_xce;
+static evtchn_port_t send_port, recv_port;
+
+static volatile bool stop;
+static uint64_t end_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if ( cpu < 0 )
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) )
+        warnx("failed to pin to CPU %d", cpu);
+}
+
+static void *sender_fn(void *arg)
+{
+    unsigned long *sent = arg;
+
+    pin(send_cpu);
+
+    do {
+        if ( xenevtchn_notify(send_xce, send_port) )
+        {
+            warn("notify port %u", send_port);
+            break;
+        }
+        (*sent)++;
+    } while ( now_ns() < end_ns );
+
+    return NULL;
+}
+
+static void *receiver_fn(void *arg)
+{
+    unsigned long *received = arg;
+    xenevtchn_port_or_error_t port;
+
+    pin(recv_cpu);
+
+    while ( !stop )
+    {
+        port = xenevtchn_pending(recv_xce);
+        if ( port < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            warn("pending");
+            break;
+        }
+
+        if ( port == recv_port )
+            (*received)++;
+
+        if ( xenevtchn_unmask(recv_xce, port) )
+        {
+            warn("unmask port %u", port);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d domid] [-s seconds] [-n senders] "
+            "[-c send-cpu,recv-cpu]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t senders[MAX_SENDERS], receiver;
+    unsigned long sent[MAX_SENDERS] = {}, received = 0, total = 0;
+    xenevtchn_port_or_error_t port;
+    unsigned int i;
+    uint64_t t0, t1;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "d:s:n:c:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            domid = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nr_senders = strtoul(optarg, NULL, 0);
+            if ( !nr_senders || nr_senders > MAX_SENDERS )
+                usage(argv[0]);
+            break;
+        case 'c':
+            if ( sscanf(optarg, "%d,%d", &send_cpu, &recv_cpu) != 2 )
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    send_xce = xenevtchn_open(NULL, 0);
+    recv_xce = xenevtchn_open(NULL, 0);
+    if ( !send_xce || !recv_xce )
+        err(1, "xenevtchn_open");
+
+    port = xenevtchn_bind_unbound_port(recv_xce, domid);
+    if ( port < 0 )
+        err(1, "bind unbound port");
+    recv_port = port;
+
+    port = xenevtchn_bind_interdomain(send_xce, domid, recv_port);
+    if ( port < 0 )
+        err(1, "bind interdomain port");
+    send_port = port;
+
+    printf("Event channel benchmark, d%u port %u -> %u, %u sender(s), %us\n",
+           domid, send_port, recv_port, nr_senders, nr_seconds);
+
+    if ( pthread_create(&receiver, NULL, receiver_fn, &received) )
+        err(1, "pthread_create");
+
+    t0 = now_ns();
+    end_ns = t0 + nr_seconds * 1000000000ULL;
+
+    for ( i = 0; i < nr_senders; i++ )
+        if ( pthread_create(&senders[i], NULL, sender_fn, &sent[i]) )
+            err(1, "pthread_create");
+
+    for ( i = 0; i < nr_senders; i++ )
+    {
+        pthread_join(senders[i], NULL);
+        total += sent[i];
+    }
+    t1 = now_ns();
+
+    /* Wake up the receiver for it to notice it has to stop. */
+    stop = true;
+    xenevtchn_notify(send_xce, send_port);
+    pthread_join(receiver, NULL);
+
+    printf("%-10s %14s %14s\n", "", "events", "events/s");
+    printf("%-10s %14lu %14.0f\n", "sent", total, total * 1e9 / (t1 - t0));
+    printf("%-10s %14lu %14.0f\n", "delivered", received,
+           received * 1e9 / (t1 - t0));
+
+    xenevtchn_unbind(send_xce, send_port);
+    xenevtchn_unbind(recv_xce, recv_port);
+    xenevtchn_close(send_xce);
+    xenevtchn_close(recv_xce);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
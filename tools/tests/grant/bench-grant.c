@@ -0,0 +1,403 @@
+/*
+ * Grant map/unmap benchmark, to be run in dom0 (or a driver domain allowed
+ * to create domains).
+ *
+ * An empty domain is created, and a number of its pages are granted to the
+ * calling domain by writing its grant table directly.  These grants are then
+ * mapped and unmapped through the gntdev driver in batches resembling those
+ * of common backends: netback mapping up to 64 read-only grants per request
+ * batch, and blkback mapping up to 11 segments per request.  The rate of
+ * map/unmap pairs shows the cost of the GNTTABOP_map_grant_ref and
+ * GNTTABOP_unmap_grant_ref paths, including IOMMU and TLB maintenance when
+ * the calling domain has its own IOMMU mappings (e.g. a PV dom0).
+ *
+ * With several threads (-t), each maps and unmaps its own share of the
+ * grants concurrently, showing how the hypervisor's maptrack handle
+ * allocation scales with the number of vCPUs of the calling domain.
+ *
+ * With -c, GNTTABOP_copy is measured instead: batches of segments of a given
+ * size are copied from a local buffer into consecutive grants, packing
+ * several segments into each granted page as netback does when receiving
+ * small packets on behalf of a guest.
+ */
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+#include <xengnttab.h>
+#include <xen-tools/common-macros.h>
+
+#define NR_GRANTS 1024
+#define NR_FRAMES ((NR_GRANTS * sizeof(grant_entry_v1_t) + XC_PAGE_SIZE - 1) / \
+                   XC_PAGE_SIZE)
+#define MAX_BATCH 64
+
+static const struct pattern {
+    const char *name;
+    unsigned int batch;
+    bool readonly;
+} patterns[] = {
+    { "netback",  64, true  },
+    { "blkback",  11, false },
+    { "single",    1, false },
+};
+
+static const struct copy_pattern {
+    const char *name;
+    unsigned int batch;
+    unsigned int len;
+} copy_patterns[] = {
+    { "small",    64,  128 },
+    { "mtu",      64, 1514 },
+    { "page",     16, 4096 },
+};
+
+#define MAX_THREADS 64
+
+static unsigned int nr_seconds = 5;
+static unsigned int nr_threads = 1;
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fh;
+
+struct worker {
+    pthread_t thread;
+    const void *pattern;
+    uint32_t domid;
+    unsigned int first;
+    uint64_t end;
+    unsigned long ops;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    const struct pattern *p = w->pattern;
+    unsigned int share = NR_GRANTS / nr_threads;
+    uint32_t refs[MAX_BATCH], domids[MAX_BATCH];
+    unsigned int i, ref = 0;
+    xengnttab_handle *gh;
+    void *addr;
+
+    gh = xengnttab_open(NULL, 0);
+    if ( !gh )
+    {
+        warn("xengnttab_open");
+        return NULL;
+    }
+
+    for ( i = 0; i < p->batch; i++ )
+        domids[i] = w->domid;
+
+    do {
+        for ( i = 0; i < p->batch; i++ )
+            refs[i] = w->first + ref++ % share;
+
+        addr = xengnttab_map_grant_refs(gh, p->batch, domids, refs,
+                                        p->readonly ? PROT_READ
+                                                    : PROT_READ | PROT_WRITE);
+        if ( !addr )
+        {
+            warn("map %u grants", p->batch);
+            break;
+        }
+
+        if ( xengnttab_unmap(gh, addr, p->batch) )
+        {
+            warn("unmap %u grants", p->batch);
+            break;
+        }
+
+        w->ops += p->batch;
+    } while ( now_ns() < w->end );
+
+    xengnttab_close(gh);
+
+    return NULL;
+}
+
+static void *copy_worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    const struct copy_pattern *p = w->pattern;
+    unsigned int share = NR_GRANTS / nr_threads;
+    xengnttab_grant_copy_segment_t segs[MAX_BATCH];
+    unsigned int i, ref = 0, offset = 0;
+    xengnttab_handle *gh;
+    char *buf;
+
+    buf = mmap(NULL, MAX_BATCH * XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( buf == MAP_FAILED )
+    {
+        warn("mmap");
+        return NULL;
+    }
+    memset(buf, 0x5a, MAX_BATCH * XC_PAGE_SIZE);
+
+    gh = xengnttab_open(NULL, 0);
+    if ( !gh )
+    {
+        warn("xengnttab_open");
+        goto out;
+    }
+
+    do {
+        for ( i = 0; i < p->batch; i++ )
+        {
+            if ( offset + p->len > XC_PAGE_SIZE )
+            {
+                ref++;
+                offset = 0;
+            }
+
+            segs[i] = (xengnttab_grant_copy_segment_t){
+                .source.virt = buf + i * XC_PAGE_SIZE,
+                .dest.foreign = {
+                    .ref = w->first + ref % share,
+                    .offset = offset,
+                    .domid = w->domid,
+                },
+                .len = p->len,
+                .flags = GNTCOPY_dest_gref,
+            };
+            offset += p->len;
+        }
+
+        if ( xengnttab_grant_copy(gh, p->batch, segs) )
+        {
+            warn("copy %u segments", p->batch);
+            break;
+        }
+
+        for ( i = 0; i < p->batch; i++ )
+            if ( segs[i].status != GNTST_okay )
+            {
+                warnx("copy segment %u: status %d", i, segs[i].status);
+                goto close;
+            }
+
+        w->ops += p->batch;
+    } while ( now_ns() < w->end );
+
+ close:
+    xengnttab_close(gh);
+ out:
+    munmap(buf, MAX_BATCH * XC_PAGE_SIZE);
+
+    return NULL;
+}
+
+/* Run @fn on all threads, returning the number of operations per second. */
+static double bench(void *(*fn)(void *), const void *pattern, uint32_t domid)
+{
+    struct worker workers[MAX_THREADS] = {};
+    unsigned long ops = 0;
+    unsigned int i;
+    uint64_t t0, end;
+
+    t0 = now_ns();
+    end = t0 + nr_seconds * 1000000000ULL;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].pattern = pattern;
+        workers[i].domid = domid;
+        workers[i].first = i * (NR_GRANTS / nr_threads);
+        workers[i].end = end;
+        if ( pthread_create(&workers[i].thread, NULL, fn, &workers[i]) )
+            err(1, "pthread_create");
+    }
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+
+    return ops * 1e9 / (now_ns() - t0);
+}
+
+static void bench_map(uint32_t domid)
+{
+    unsigned int i;
+
+    printf("Grant map/unmap benchmark, %u grants of d%u, %u thread(s), "
+           "%us each\n", NR_GRANTS, domid, nr_threads, nr_seconds);
+    printf("%-10s %6s %4s %14s\n", "pattern", "batch", "mode", "maps/s");
+
+    for ( i = 0; i < ARRAY_SIZE(patterns); i++ )
+    {
+        const struct pattern *p = &patterns[i];
+
+        printf("%-10s %6u %4s %14.0f\n", p->name, p->batch,
+               p->readonly ? "ro" : "rw", bench(worker_fn, p, domid));
+    }
+}
+
+static void bench_copy(uint32_t domid)
+{
+    unsigned int i;
+
+    printf("Grant copy benchmark, %u grants of d%u, %u thread(s), "
+           "%us each\n", NR_GRANTS, domid, nr_threads, nr_seconds);
+    printf("%-10s %6s %6s %14s %10s\n",
+           "pattern", "batch", "len", "copies/s", "MB/s");
+
+    for ( i = 0; i < ARRAY_SIZE(copy_patterns); i++ )
+    {
+        const struct copy_pattern *p = &copy_patterns[i];
+        double rate = bench(copy_worker_fn, p, domid);
+
+        printf("%-10s %6u %6u %14.0f %10.0f\n", p->name, p->batch, p->len,
+               rate, rate * p->len / 1e6);
+    }
+}
+
+static int setup_grants(uint32_t domid)
+{
+    xenforeignmemory_resource_handle *res;
+    grant_entry_v1_t *gnttab;
+    xen_pfn_t *gfns;
+    unsigned int i;
+    int rc;
+
+    gfns = calloc(NR_GRANTS, sizeof(*gfns));
+    if ( !gfns )
+        return -1;
+
+    for ( i = 0; i < NR_GRANTS; i++ )
+        gfns[i] = i;
+
+    rc = xc_domain_setmaxmem(xch, domid, -1);
+    if ( !rc )
+        rc = xc_domain_populate_physmap_exact(xch, domid, NR_GRANTS, 0, 0,
+                                              gfns);
+    if ( rc )
+    {
+        warn("populate d%u", domid);
+        goto out;
+    }
+
+    res = xenforeignmemory_map_resource(
+        fh, domid, XENMEM_resource_grant_table,
+        XENMEM_resource_grant_table_id_shared, 0, NR_FRAMES,
+        (void **)&gnttab, PROT_READ | PROT_WRITE, 0);
+    if ( !res )
+    {
+        warn("map grant table of d%u", domid);
+        rc = -1;
+        goto out;
+    }
+
+    /* Grant all pages to dom0, i.e. whoever maps them. */
+    for ( i = 0; i < NR_GRANTS; i++ )
+    {
+        gnttab[i].domid = 0;
+        gnttab[i].frame = gfns[i];
+        gnttab[i].flags = GTF_permit_access;
+    }
+
+    rc = xenforeignmemory_unmap_resource(fh, res);
+
+ out:
+    free(gfns);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c] [-s seconds] [-t threads]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct xen_domctl_createdomain create = {
+#if defined(__x86_64__) || defined(__i386__)
+        .max_vcpus = 1,
+#elif defined(__aarch64__) || defined(__arm__)
+        .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+        .max_vcpus = 1,
+#endif
+        .max_grant_frames = NR_FRAMES,
+        .grant_opts = XEN_DOMCTL_GRANT_version(1),
+    };
+    uint32_t domid = 0;
+    bool copy = false;
+    int opt, rc;
+
+    while ( (opt = getopt(argc, argv, "cs:t:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c':
+            copy = true;
+            break;
+        case 's':
+            nr_seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            if ( !nr_threads || nr_threads > MAX_THREADS )
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fh = xenforeignmemory_open(NULL, 0);
+
+    if ( !xch )
+        err(1, "xc_interface_open");
+    if ( !fh )
+        err(1, "xenforeignmemory_open");
+
+    if ( xc_domain_create(xch, &domid, &create) )
+        err(1, "xc_domain_create");
+
+    rc = setup_grants(domid);
+    if ( !rc )
+    {
+        if ( copy )
+            bench_copy(domid);
+        else
+            bench_map(domid);
+    }
+
+    if ( xc_domain_destroy(xch, domid) )
+        warn("xc_domain_destroy");
+
+    return !!rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
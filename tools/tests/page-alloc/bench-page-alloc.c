@@ -0,0 +1,248 @@
+/*
+ * Heap allocator scalability benchmark.
+ *
+ * Each worker thread owns a scratch domain and repeatedly populates and
+ * releases a window of single-page extents, which drives alloc_heap_pages()
+ * and free_heap_pages() for order-0 pages on whichever pCPU the worker's
+ * hypercalls land on.  The run is repeated for 1, 2, 4, ... workers so the
+ * aggregate rate shows how the allocator scales with the number of CPUs
+ * allocating concurrently.
+ */
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenctrl.h>
+#include <xen-tools/common-macros.h>
+
+#define WINDOW 256 /* Pages per hypercall. */
+
+static unsigned int nr_seconds = 5;
+static unsigned int max_threads;
+
+static struct xen_domctl_createdomain create = {
+    .flags = XEN_DOMCTL_CDF_hvm | XEN_DOMCTL_CDF_hap,
+    .max_vcpus = 1,
+    .max_grant_frames = 1,
+    .grant_opts = XEN_DOMCTL_GRANT_version(1),
+
+    .arch = {
+#if defined(__x86_64__) || defined(__i386__)
+        .emulation_flags = XEN_X86_EMU_LAPIC,
+#endif
+    },
+};
+
+struct worker {
+    pthread_t thread;
+    xc_interface *xch;
+    uint32_t domid;
+    unsigned long pages;
+    int error;
+};
+
+static pthread_barrier_t start_barrier;
+static volatile bool stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    xen_pfn_t gfns[WINDOW];
+    unsigned int i;
+
+    for ( i = 0; i < WINDOW; i++ )
+        gfns[i] = i;
+
+    pthread_barrier_wait(&start_barrier);
+
+    while ( !stop )
+    {
+        if ( xc_domain_populate_physmap_exact(w->xch, w->domid, WINDOW,
+                                              0, 0, gfns) ||
+             xc_domain_decrease_reservation_exact(w->xch, w->domid, WINDOW,
+                                                  0, gfns) )
+        {
+            w->error = errno;
+            break;
+        }
+
+        w->pages += WINDOW;
+    }
+
+    return NULL;
+}
+
+static int setup_worker(struct worker *w)
+{
+    w->xch = xc_interface_open(NULL, NULL, 0);
+    if ( !w->xch )
+        return -1;
+
+    if ( xc_domain_create(w->xch, &w->domid, &create) )
+        goto close;
+
+    /* Room for the p2m covering the window, plus slack. */
+    if ( xc_set_paging_mempool_size(w->xch, w->domid, 1 << 20) ||
+         xc_domain_setmaxmem(w->xch, w->domid, -1) )
+        goto destroy;
+
+    return 0;
+
+ destroy:
+    xc_domain_destroy(w->xch, w->domid);
+ close:
+    xc_interface_close(w->xch);
+    w->xch = NULL;
+
+    return -1;
+}
+
+static void teardown_worker(struct worker *w)
+{
+    if ( !w->xch )
+        return;
+
+    xc_domain_destroy(w->xch, w->domid);
+    xc_interface_close(w->xch);
+}
+
+static int run(unsigned int nr)
+{
+    struct worker *workers = calloc(nr, sizeof(*workers));
+    unsigned long total = 0;
+    unsigned int i, started = 0;
+    uint64_t t0, t1;
+    int rc = -1;
+
+    if ( !workers )
+        err(1, "calloc");
+
+    for ( i = 0; i < nr; i++ )
+        if ( setup_worker(&workers[i]) )
+        {
+            fprintf(stderr, "  Failed to set up worker %u: %d - %s\n",
+                    i, errno, strerror(errno));
+            goto out;
+        }
+
+    if ( pthread_barrier_init(&start_barrier, NULL, nr + 1) )
+        err(1, "pthread_barrier_init");
+
+    stop = false;
+    for ( i = 0; i < nr; i++, started++ )
+        if ( pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]) )
+            err(1, "pthread_create");
+
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    sleep(nr_seconds);
+    stop = true;
+
+    for ( i = 0; i < started; i++ )
+        pthread_join(workers[i].thread, NULL);
+    t1 = now_ns();
+
+    pthread_barrier_destroy(&start_barrier);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( workers[i].error )
+        {
+            fprintf(stderr, "  Worker %u failed: %d - %s\n", i,
+                    workers[i].error, strerror(workers[i].error));
+            goto out;
+        }
+        total += workers[i].pages;
+    }
+
+    /* Each page is allocated and freed once per iteration. */
+    printf("%8u %16.0f %16.0f\n", nr,
+           total * 2 * 1e9 / (t1 - t0),
+           total * 2 * 1e9 / (t1 - t0) / nr);
+    rc = 0;
+
+ out:
+    for ( i = 0; i < nr; i++ )
+        teardown_worker(&workers[i]);
+    free(workers);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-t max-threads] [-s seconds-per-step]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    xc_interface *xch;
+    xc_physinfo_t info = {};
+    unsigned int nr;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "t:s:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        err(1, "xc_interface_open");
+
+    if ( xc_physinfo(xch, &info) )
+        err(1, "xc_physinfo");
+
+    xc_interface_close(xch);
+
+    if ( !max_threads )
+        max_threads = info.nr_cpus;
+
+    printf("Heap allocator scaling, %u pages per hypercall, %us per step\n",
+           WINDOW, nr_seconds);
+    printf("%8s %16s %16s\n", "threads", "pages/s", "pages/s/thread");
+
+    for ( nr = 1; nr <= max_threads; nr <<= 1 )
+        if ( run(nr) )
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,184 @@
+/*
+ * Lock holder preemption benchmark, to be run inside a guest.
+ *
+ * A number of threads (by default twice the number of online CPUs of the
+ * guest) repeatedly take one of a few ticket spinlocks, do a little work
+ * with it held, and drop it again.  Waiters spin using PAUSE, so the
+ * hypervisor sees pause loop exits whenever the holder of a lock has been
+ * preempted.  Run in an overcommitted guest (more vCPUs than the pCPUs
+ * available to it, and other busy guests), the rate of lock acquisitions
+ * shows how well the hypervisor resolves lock holder preemption, e.g. by
+ * directed yield.
+ */
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_LOCKS 4
+#define HOLD_ITERATIONS 200
+
+static unsigned int nr_seconds = 10;
+static unsigned int nr_threads;
+
+/* Ticket locks, each on its own cache line. */
+static struct {
+    volatile uint32_t next;
+    volatile uint32_t owner;
+    uint64_t counter;
+} __attribute__((aligned(64))) locks[NR_LOCKS];
+
+struct worker {
+    pthread_t thread;
+    unsigned int idx;
+    unsigned long acquired;
+    uint64_t max_wait_ns;
+};
+
+static pthread_barrier_t start_barrier;
+static volatile bool stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile ( "pause" ::: "memory" );
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile ( "yield" ::: "memory" );
+#else
+    asm volatile ( "" ::: "memory" );
+#endif
+}
+
+static void lock(unsigned int l)
+{
+    uint32_t ticket = __atomic_fetch_add(&locks[l].next, 1, __ATOMIC_RELAXED);
+
+    while ( __atomic_load_n(&locks[l].owner, __ATOMIC_ACQUIRE) != ticket )
+        cpu_relax();
+}
+
+static void unlock(unsigned int l)
+{
+    __atomic_store_n(&locks[l].owner, locks[l].owner + 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int l, i;
+    uint64_t t0, t1;
+
+    pthread_barrier_wait(&start_barrier);
+
+    for ( l = w->idx % NR_LOCKS; !stop; l = (l + 1) % NR_LOCKS )
+    {
+        t0 = now_ns();
+        lock(l);
+        t1 = now_ns();
+
+        for ( i = 0; i < HOLD_ITERATIONS; i++ )
+            locks[l].counter++;
+
+        unlock(l);
+
+        w->acquired++;
+        if ( t1 - t0 > w->max_wait_ns )
+            w->max_wait_ns = t1 - t0;
+    }
+
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-s seconds]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    unsigned long total = 0;
+    uint64_t t0, t1, max_wait = 0;
+    unsigned int i;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "t:s:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            nr_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( !nr_threads )
+        nr_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+
+    workers = calloc(nr_threads, sizeof(*workers));
+    if ( !workers )
+        err(1, "calloc");
+
+    if ( pthread_barrier_init(&start_barrier, NULL, nr_threads + 1) )
+        err(1, "pthread_barrier_init");
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        workers[i].idx = i;
+        if ( pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]) )
+            err(1, "pthread_create");
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    sleep(nr_seconds);
+    stop = true;
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].acquired;
+        if ( workers[i].max_wait_ns > max_wait )
+            max_wait = workers[i].max_wait_ns;
+    }
+    t1 = now_ns();
+
+    pthread_barrier_destroy(&start_barrier);
+    free(workers);
+
+    printf("Spinlock contention, %u threads on %u locks, %us\n",
+           nr_threads, NR_LOCKS, nr_seconds);
+    printf("%16s %16s\n", "acquisitions/s", "max wait (us)");
+    printf("%16.0f %16.0f\n", total * 1e9 / (t1 - t0), max_wait / 1e3);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,134 @@
+/*
+ * Test harness environment for the timer code: a single cpu, with time and
+ * the timer hardware under the control of the test.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_TIMER_
+#define _TEST_TIMER_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xen-tools/common-macros.h>
+
+#define smp_wmb()
+#define prefetch(x) __builtin_prefetch(x)
+#define ASSERT(x) assert(x)
+#define BUG() assert(0)
+#define BUG_ON(x) assert(!(x))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define cf_check
+#define __init
+#define __read_mostly
+#define __cacheline_aligned __attribute__((__aligned__(64)))
+
+typedef bool bool_t;
+typedef int64_t s_time_t;
+#define STIME_MAX INT64_MAX
+
+#include "list.h"
+
+#define NR_CPUS 1
+#define smp_processor_id() 0U
+#define for_each_online_cpu(cpu) for ( (cpu) = 0; (cpu) < NR_CPUS; (cpu)++ )
+#define cpu_online(cpu) true
+#define cpumask_any(mask) 0U
+#define cpu_relax() ((void)0)
+
+#define DEFINE_PER_CPU(type, name) __typeof__(type) per_cpu__##name[NR_CPUS]
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) per_cpu__##name[NR_CPUS]
+#define per_cpu(var, cpu) (per_cpu__##var[cpu])
+#define this_cpu(var) per_cpu(var, smp_processor_id())
+
+#define read_atomic(p) (*(p))
+#define write_atomic(p, x) (*(p) = (x))
+
+/* Locks are only checked for being balanced. */
+typedef bool spinlock_t;
+#define spin_lock_init(l) (*(l) = false)
+#define spin_lock(l) ({ assert(!*(l)); *(l) = true; })
+#define spin_unlock(l) ({ assert(*(l)); *(l) = false; })
+#define spin_lock_irq(l) spin_lock(l)
+#define spin_unlock_irq(l) spin_unlock(l)
+#define spin_lock_irqsave(l, f) ({ (f) = 0; spin_lock(l); })
+#define spin_unlock_irqrestore(l, f) ({ (void)(f); spin_unlock(l); })
+#define local_irq_save(f) ((f) = 0)
+#define local_irq_restore(f) ((void)(f))
+
+#define DEFINE_RCU_READ_LOCK(x) int x
+#define rcu_read_lock(x) ((void)(x))
+#define rcu_read_unlock(x) ((void)(x))
+
+#define xzalloc(type) ((type *)calloc(1, sizeof(type)))
+#define xmalloc_array(type, n) ((type *)malloc(sizeof(type) * (n)))
+#define xfree(p) free(p)
+#define XFREE(p) do { free(p); (p) = NULL; } while ( 0 )
+
+#define ffs64(x) __builtin_ffsll(x)
+
+#define XENLOG_WARNING
+#define printk printf
+#define printk_once printf
+
+#define integer_param(name, var)
+#define register_keyhandler(key, fn, desc, diag) ((void)(fn))
+
+/* The test calls the softirq handler when it has been raised. */
+#define TIMER_SOFTIRQ 0
+extern bool softirq_raised;
+extern void (*timer_softirq)(void);
+#define open_softirq(nr, fn) (timer_softirq = (fn))
+#define raise_softirq(nr) (softirq_raised = true)
+#define cpu_raise_softirq(cpu, nr) raise_softirq(nr)
+
+extern s_time_t test_now;
+#define NOW() test_now
+
+/* CPU hotplug isn't exercised. */
+struct notifier_block {
+    int (*notifier_call)(struct notifier_block *, unsigned long, void *);
+    int priority;
+};
+#define NOTIFY_DONE 0
+#define CPU_UP_PREPARE 1
+#define CPU_UP_CANCELED 2
+#define CPU_DEAD 3
+#define CPU_RESUME_FAILED 4
+#define CPU_REMOVE 5
+#define register_cpu_notifier(nb) ((void)(nb))
+#define park_offline_cpus false
+#define system_state 0
+#define SYS_STATE_suspend 1
+
+#include "timer.h"
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,275 @@
+/*
+ * Unit tests and benchmark for the hypervisor's per-cpu timer queues.
+ *
+ * A set of timers with expiry times from a few microseconds up to beyond the
+ * reach of the timer wheel is armed, some of them are stopped or re-armed,
+ * and time is then advanced to each deadline programmed into the (emulated)
+ * timer hardware in turn.  Every timer must fire exactly once per arming, and
+ * only while armed, no earlier than its expiry time and no later than the
+ * timer slop after it.
+ *
+ * The benchmark measures the rate of set_timer() and stop_timer() calls with
+ * many timers armed, as well as the rate at which timers are expired, so the
+ * effect of changes to the timer code can be compared between builds.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "emul.h"
+
+#define NR_TEST_TIMERS  20000
+#define NR_BENCH_TIMERS 100000
+#define BENCH_OPS       2000000
+#define SLOP            50000 /* Default timer_slop. */
+
+bool softirq_raised;
+void (*timer_softirq)(void);
+s_time_t test_now;
+
+static s_time_t programmed;
+
+int reprogram_timer(s_time_t timeout)
+{
+    programmed = timeout;
+
+    return 1;
+}
+
+struct test_timer {
+    struct timer timer;
+    s_time_t expires;
+    bool armed;
+};
+
+static struct test_timer *timers;
+static unsigned int nr_armed;
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rnd(void)
+{
+    /* xorshift64 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+
+    return rnd_state;
+}
+
+/* Random timeout, mostly short, occasionally beyond the wheel's reach. */
+static s_time_t rnd_timeout(void)
+{
+    unsigned int r = rnd() % 100;
+
+    if ( r < 50 )
+        return rnd() % 100000000ULL;             /* 100ms */
+    if ( r < 80 )
+        return rnd() % 10000000000ULL;           /* 10s */
+    if ( r < 95 )
+        return rnd() % 3600000000000ULL;         /* 1h */
+
+    return rnd() % 36000000000000ULL;            /* 10h */
+}
+
+static void run_softirq(void)
+{
+    while ( softirq_raised )
+    {
+        softirq_raised = false;
+        timer_softirq();
+    }
+}
+
+/* Let time pass until the next deadline programmed, and handle it. */
+static void next_deadline(void)
+{
+    assert(programmed);
+    if ( programmed > test_now )
+        test_now = programmed;
+    softirq_raised = true;
+    run_softirq();
+}
+
+static void cf_check test_fn(void *data)
+{
+    struct test_timer *t = data;
+
+    if ( !t->armed || test_now < t->expires ||
+         test_now > t->expires + SLOP )
+    {
+        fprintf(stderr,
+                "timer %zu (armed %d) expiring at %"PRId64" fired at "
+                "%"PRId64"\n", t - timers, t->armed, t->expires, test_now);
+        exit(1);
+    }
+
+    t->armed = false;
+    nr_armed--;
+}
+
+static void arm(struct test_timer *t, s_time_t expires)
+{
+    if ( !t->armed )
+        nr_armed++;
+    t->armed = true;
+    t->expires = expires;
+    set_timer(&t->timer, expires);
+}
+
+static void disarm(struct test_timer *t)
+{
+    if ( t->armed )
+        nr_armed--;
+    t->armed = false;
+    stop_timer(&t->timer);
+}
+
+static void test_expiry(void)
+{
+    unsigned int i;
+
+    printf("Testing expiry of %u timers: ", NR_TEST_TIMERS);
+
+    for ( i = 0; i < NR_TEST_TIMERS; i++ )
+    {
+        init_timer(&timers[i].timer, test_fn, &timers[i], 0);
+        arm(&timers[i], test_now + rnd_timeout());
+    }
+    run_softirq();
+
+    /* Stop some, re-arm some, and let some time pass in between. */
+    for ( i = 0; i < NR_TEST_TIMERS; i++ )
+    {
+        switch ( rnd() % 4 )
+        {
+        case 0:
+            disarm(&timers[i]);
+            break;
+        case 1:
+            arm(&timers[i], test_now + rnd_timeout());
+            break;
+        }
+
+        if ( !(i % 1000) )
+            next_deadline();
+    }
+
+    while ( nr_armed )
+        next_deadline();
+
+    for ( i = 0; i < NR_TEST_TIMERS; i++ )
+    {
+        assert(!timer_is_active(&timers[i].timer));
+        kill_timer(&timers[i].timer);
+    }
+
+    printf("okay\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cf_check bench_fn(void *data)
+{
+}
+
+static void report(const char *name, unsigned long ops, uint64_t t0)
+{
+    printf("%-12s %12lu %12.0f\n", name, ops, ops * 1e9 / (now_ns() - t0));
+}
+
+static void bench(void)
+{
+    unsigned int i;
+    unsigned long ops = 0;
+    uint64_t t0;
+
+    printf("Timer benchmark, %u timers armed, expiring within 1s\n",
+           NR_BENCH_TIMERS);
+    printf("%-12s %12s %12s\n", "operation", "ops", "ops/s");
+
+    for ( i = 0; i < NR_BENCH_TIMERS; i++ )
+    {
+        init_timer(&timers[i].timer, bench_fn, NULL, 0);
+        set_timer(&timers[i].timer, test_now + rnd() % 1000000000ULL);
+    }
+    run_softirq();
+
+    /* Re-arm timers, as done e.g. by the scheduler and periodic timers. */
+    t0 = now_ns();
+    for ( i = 0; i < BENCH_OPS; i++ )
+        set_timer(&timers[rnd() % NR_BENCH_TIMERS].timer,
+                  test_now + rnd() % 1000000000ULL);
+    report("set", BENCH_OPS, t0);
+
+    /* Stop and re-arm timers. */
+    t0 = now_ns();
+    for ( i = 0; i < BENCH_OPS; i++ )
+    {
+        struct timer *t = &timers[rnd() % NR_BENCH_TIMERS].timer;
+
+        stop_timer(t);
+        set_timer(t, test_now + rnd() % 1000000000ULL);
+    }
+    report("stop+set", 2 * BENCH_OPS, t0);
+
+    /* Expire all timers. */
+    t0 = now_ns();
+    for ( i = 0; i < NR_BENCH_TIMERS; i++ )
+        ops += timer_is_active(&timers[i].timer);
+    while ( programmed )
+        next_deadline();
+    report("expire", ops, t0);
+
+    for ( i = 0; i < NR_BENCH_TIMERS; i++ )
+        kill_timer(&timers[i].timer);
+}
+
+int main(int argc, char **argv)
+{
+    timers = calloc(MAX(NR_TEST_TIMERS, NR_BENCH_TIMERS), sizeof(*timers));
+    if ( !timers )
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    timer_init();
+    test_now = 1000000000;
+
+    test_expiry();
+
+    memset(timers, 0, NR_TEST_TIMERS * sizeof(*timers));
+    bench();
+
+    free(timers);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,306 @@
+/*
+ * Xenstore throughput benchmark.
+ *
+ * A tree of nodes (a number of "domains", each with a small device tree
+ * below it) is created under a private path, and then a set of workloads
+ * is run against it for a fixed time each: plain reads, writes, directory
+ * listings and transactions reading and modifying a few nodes.  The rate
+ * of each workload is printed, so the effect of changes to xenstored's
+ * node store can be compared between builds.
+ *
+ * A second connection registers a large number of watches on other nodes
+ * before the workloads are started, so the cost of matching each
+ * modification against the registered watches is included, too.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xenstore.h>
+
+#include <xen-tools/common-macros.h>
+
+#define BENCH_PATH "xenstore-bench"
+#define NODES_PER_DOM 16
+#define TA_NODES 4
+#define MAX_TA_RETRIES 100
+
+static struct xs_handle *xsh, *wsh;
+static char *path;
+static unsigned int nr_doms = 256;
+static unsigned int nr_watches = 10000;
+static unsigned int nr_seconds = 2;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void node_path(char *buf, size_t len, unsigned int dom,
+                      unsigned int node)
+{
+    snprintf(buf, len, "%s/%u/device/vif/%u/state", path, dom, node);
+}
+
+static void dom_path(char *buf, size_t len, unsigned int dom)
+{
+    snprintf(buf, len, "%s/%u/device/vif", path, dom);
+}
+
+static int bench_read(unsigned long iter)
+{
+    char buf[256];
+    unsigned int len;
+    void *val;
+
+    node_path(buf, sizeof(buf), iter % nr_doms,
+              (iter / nr_doms) % NODES_PER_DOM);
+    val = xs_read(xsh, XBT_NULL, buf, &len);
+    if ( !val )
+        return errno;
+    free(val);
+
+    return 0;
+}
+
+static int bench_write(unsigned long iter)
+{
+    char buf[256], val[16];
+
+    node_path(buf, sizeof(buf), iter % nr_doms,
+              (iter / nr_doms) % NODES_PER_DOM);
+    snprintf(val, sizeof(val), "%lu", iter);
+
+    return xs_write(xsh, XBT_NULL, buf, val, strlen(val)) ? 0 : errno;
+}
+
+static int bench_directory(unsigned long iter)
+{
+    char buf[256];
+    unsigned int num;
+    char **dir;
+
+    dom_path(buf, sizeof(buf), iter % nr_doms);
+    dir = xs_directory(xsh, XBT_NULL, buf, &num);
+    if ( !dir )
+        return errno;
+    free(dir);
+
+    return 0;
+}
+
+static int bench_transaction(unsigned long iter)
+{
+    char buf[256], val[16];
+    unsigned int i, len, retries;
+    xs_transaction_t t;
+    void *old;
+
+    for ( retries = 0; retries < MAX_TA_RETRIES; retries++ )
+    {
+        t = xs_transaction_start(xsh);
+        if ( t == XBT_NULL )
+            return errno;
+
+        /* Read a few nodes of one domain and update the last one. */
+        for ( i = 0; i < TA_NODES; i++ )
+        {
+            node_path(buf, sizeof(buf), iter % nr_doms, i);
+            old = xs_read(xsh, t, buf, &len);
+            if ( !old )
+                goto fail;
+            free(old);
+        }
+
+        snprintf(val, sizeof(val), "%lu", iter);
+        if ( !xs_write(xsh, t, buf, val, strlen(val)) )
+            goto fail;
+
+        if ( xs_transaction_end(xsh, t, false) )
+            return 0;
+        if ( errno != EAGAIN )
+            return errno;
+    }
+
+    return EAGAIN;
+
+ fail:
+    xs_transaction_end(xsh, t, true);
+    return errno;
+}
+
+static const struct {
+    const char *name;
+    int (*func)(unsigned long iter);
+} workloads[] = {
+    { "read",        bench_read },
+    { "write",       bench_write },
+    { "directory",   bench_directory },
+    { "transaction", bench_transaction },
+};
+
+static int populate(void)
+{
+    char buf[256];
+    unsigned int dom, node;
+
+    for ( dom = 0; dom < nr_doms; dom++ )
+        for ( node = 0; node < NODES_PER_DOM; node++ )
+        {
+            node_path(buf, sizeof(buf), dom, node);
+            if ( !xs_write(xsh, XBT_NULL, buf, "4", 1) )
+                return errno;
+        }
+
+    return 0;
+}
+
+static int register_watches(void)
+{
+    char buf[256];
+    unsigned int i;
+
+    for ( i = 0; i < nr_watches; i++ )
+    {
+        snprintf(buf, sizeof(buf), "%s/watch/%u", path, i);
+        if ( !xs_watch(wsh, buf, "bench") )
+            return errno;
+    }
+
+    return 0;
+}
+
+static int run(unsigned int w)
+{
+    unsigned long iter;
+    uint64_t t0, t1, end;
+    int rc;
+
+    t0 = now_ns();
+    end = t0 + nr_seconds * 1000000000ULL;
+
+    for ( iter = 0; ; iter++ )
+    {
+        /* Don't read the clock for every single operation. */
+        if ( !(iter & 63) && now_ns() >= end )
+            break;
+
+        rc = workloads[w].func(iter);
+        if ( rc )
+        {
+            fprintf(stderr, "  %s failed: %d - %s\n", workloads[w].name,
+                    rc, strerror(rc));
+            return rc;
+        }
+    }
+
+    t1 = now_ns();
+
+    printf("%-12s %12lu %12.0f\n", workloads[w].name, iter,
+           iter * 1e9 / (t1 - t0));
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d domains] [-w watches] [-s seconds-per-workload]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char *dompath;
+    unsigned int w;
+    int opt, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "d:w:s:h")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd':
+            nr_doms = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            nr_watches = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            nr_seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( !nr_doms )
+        usage(argv[0]);
+
+    xsh = xs_open(0);
+    wsh = xs_open(0);
+    if ( !xsh || !wsh )
+        err(1, "xs_open");
+
+    dompath = xs_get_domain_path(xsh, 0);
+    if ( !dompath || asprintf(&path, "%s/%s", dompath, BENCH_PATH) < 0 )
+        err(1, "domain path");
+    free(dompath);
+
+    xs_rm(xsh, XBT_NULL, path);
+    rc = populate();
+    if ( rc )
+    {
+        fprintf(stderr, "Failed to create %u nodes: %d - %s\n",
+                nr_doms * NODES_PER_DOM, rc, strerror(rc));
+        goto out;
+    }
+
+    rc = register_watches();
+    if ( rc )
+    {
+        fprintf(stderr, "Failed to register %u watches: %d - %s\n",
+                nr_watches, rc, strerror(rc));
+        goto out;
+    }
+
+    printf("Xenstore throughput, %u domains with %u nodes each, %u watches, "
+           "%us per workload\n",
+           nr_doms, NODES_PER_DOM, nr_watches, nr_seconds);
+    printf("%-12s %12s %12s\n", "workload", "ops", "ops/s");
+
+    for ( w = 0; w < ARRAY_SIZE(workloads); w++ )
+    {
+        rc = run(w);
+        if ( rc )
+            break;
+    }
+
+ out:
+    xs_close(wsh);
+    xs_rm(xsh, XBT_NULL, path);
+    xs_close(xsh);
+
+    return rc ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
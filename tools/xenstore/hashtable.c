@@ -6,6 +6,7 @@
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <errno.h>
 #include <stdarg.h>
 #include "talloc.h"
 
@@ -172,7 +173,8 @@ int hashtable_add(struct hashtable *h, void *k, void *v)
     return 0;
 }
 
-void *hashtable_search(const struct hashtable *h, const void *k)
+static struct entry *hashtable_search_entry(const struct hashtable *h,
+                                            const void *k)
 {
     struct entry *e;
     unsigned int hashvalue, index;
@@ -182,12 +184,35 @@ void *hashtable_search(const struct hashtable *h, const void *k)
     while (NULL != e)
     {
         /* Check hash value to short circuit heavier comparison */
-        if ((hashvalue == e->h) && (h->eqfn(k, e->k))) return e->v;
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k))) return e;
         e = e->next;
     }
     return NULL;
 }
 
+void *hashtable_search(const struct hashtable *h, const void *k)
+{
+    struct entry *e = hashtable_search_entry(h, k);
+
+    return e ? e->v : NULL;
+}
+
+int hashtable_replace(struct hashtable *h, const void *k, void *v)
+{
+    struct entry *e = hashtable_search_entry(h, k);
+
+    if (NULL == e)
+        return ENOENT;
+
+    if (h->flags & HASHTABLE_FREE_VALUE)
+    {
+        talloc_free(e->v);
+        talloc_steal(e, v);
+    }
+    e->v = v;
+    return 0;
+}
+
 void
 hashtable_remove(struct hashtable *h, const void *k)
 {
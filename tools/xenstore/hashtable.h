@@ -63,6 +63,22 @@ hashtable_add(struct hashtable *h, void *k, void *v);
 void *
 hashtable_search(const struct hashtable *h, const void *k);
 
+/*****************************************************************************
+ * hashtable_replace
+
+ * @name        hashtable_replace
+ * @param   h   the hashtable to search
+ * @param   k   the key of the entry to change - does not claim ownership
+ * @param   v   the new value to associate with the key
+ * @return      zero for success, ENOENT if the key isn't found
+ *
+ * If the hashtable was created with HASHTABLE_FREE_VALUE the old value is
+ * freed and ownership of the new one is claimed.
+ */
+
+int
+hashtable_replace(struct hashtable *h, const void *k, void *v);
+
 /*****************************************************************************
  * hashtable_remove
    
@@ -20,6 +20,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -53,7 +57,7 @@
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
 #include "xenstored_lu.h"
-#include "tdb.h"
+#include "hashtable.h"
 
 #ifndef NO_SOCKETS
 #if defined(HAVE_SYSTEMD)
@@ -72,6 +76,23 @@ static unsigned int current_array_size;
 static unsigned int nr_fds;
 static unsigned int delayed_requests;
 
+#ifdef USE_EPOLL
+/*
+ * Where available the file descriptors are kept in an epoll set, which is
+ * only updated when a descriptor is added or removed, or when a connection
+ * starts or stops having output pending.  The pollfd array above is rebuilt
+ * for every iteration of the main loop and is only used as a fallback.
+ */
+static int epoll_fd = -1;
+
+#define EPOLL_MAX_EVENTS 64
+#endif
+
+/* Events seen on the daemon's own file descriptors. */
+static unsigned int sock_revents;
+static unsigned int reopen_log_revents;
+static unsigned int xce_revents;
+
 static int sock = -1;
 
 int orig_argc;
@@ -85,9 +106,22 @@ bool keep_orphans = false;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
 unsigned int trace_flags = TRACE_OBJ | TRACE_IO;
 
+/*
+ * The node data base: one record (struct xs_tdb_record_hdr followed by the
+ * permissions, data and children) per node, indexed by its name (see
+ * transaction_prepend() for the names of transaction specific nodes).
+ *
+ * Records are never modified once stored, and they are reference counted
+ * via talloc: the data base holds one link to each record per name it is
+ * stored under, and each struct node read from it holds another one. This
+ * allows read_node() to hand out the data and children without copying
+ * them, and transactions to take snapshots of nodes by just linking the
+ * same record under the transaction specific name.
+ */
+static struct hashtable *nodes;
+
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
 unsigned int timeout_watch_event_msec = 20000;
@@ -421,11 +455,86 @@ int delay_request(struct connection *conn, struct buffered_data *in,
 	return 0;
 }
 
+#ifdef USE_EPOLL
+static int epoll_update(int op, int fd, unsigned int events, void *ptr)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = ptr };
+
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+#endif
+
+static unsigned int conn_poll_events(struct connection *conn)
+{
+	unsigned int events = POLLIN | POLLPRI;
+
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+
+	return events;
+}
+
+/* Add a socket connection to the epoll set, if in use. */
+static bool conn_poll_add(struct connection *conn)
+{
+#ifdef USE_EPOLL
+	unsigned int events = conn_poll_events(conn);
+
+	if (epoll_fd < 0 || conn->fd < 0)
+		return true;
+
+	if (epoll_update(EPOLL_CTL_ADD, conn->fd, events, conn)) {
+		syslog(LOG_ERR, "epoll_ctl failed, dropping fd %d: %m\n",
+		       conn->fd);
+		return false;
+	}
+	conn->poll_events = events;
+#endif
+
+	return true;
+}
+
+/*
+ * Update a socket connection's interest in POLLOUT after its list of
+ * pending output has changed.
+ */
+static void conn_poll_update(struct connection *conn)
+{
+#ifdef USE_EPOLL
+	unsigned int events;
+
+	if (epoll_fd < 0 || !conn->poll_events)
+		return;
+
+	events = conn_poll_events(conn);
+	if (events == conn->poll_events)
+		return;
+
+	if (epoll_update(EPOLL_CTL_MOD, conn->fd, events, conn))
+		syslog(LOG_ERR, "epoll_ctl failed for fd %d: %m\n", conn->fd);
+	else
+		conn->poll_events = events;
+#endif
+}
+
+static void conn_poll_del(struct connection *conn)
+{
+#ifdef USE_EPOLL
+	if (epoll_fd < 0 || !conn->poll_events)
+		return;
+
+	epoll_update(EPOLL_CTL_DEL, conn->fd, 0, NULL);
+	conn->poll_events = 0;
+#endif
+}
+
 static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
 	struct buffered_data *req;
 
+	conn_poll_del(conn);
+
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
 		struct pollfd pfd;
@@ -512,6 +621,11 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 {
 	struct connection *conn;
 	uint64_t msecs;
+	bool use_poll = true;
+
+#ifdef USE_EPOLL
+	use_poll = epoll_fd < 0;
+#endif
 
 	if (fds)
 		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
@@ -520,15 +634,17 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 	/* In case of delayed requests pause for max 1 second. */
 	*ptimeout = delayed_requests ? 1000 : -1;
 
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
+	if (use_poll) {
+		if (sock != -1)
+			*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
+		if (reopen_log_pipe[0] != -1)
+			reopen_log_pipe0_pollfd_idx =
+				set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
 
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
+		if (xce_handle != NULL)
+			xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
+						POLLIN|POLLPRI);
+	}
 
 	msecs = get_now_msec();
 	wrl_log_periodic(msecs);
@@ -542,10 +658,9 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 			     !list_empty(&conn->out_list)))
 				*ptimeout = 0;
 		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
+			if (use_poll)
+				conn->pollfd_idx = set_fd(conn->fd,
+							  conn_poll_events(conn));
 			/*
 			 * For stalled connection, we want to process the
 			 * pending command as soon as live-update has aborted.
@@ -556,34 +671,133 @@ static void initialize_fds(int *p_sock_pollfd_idx, int *ptimeout)
 	}
 }
 
-void set_tdb_key(const char *name, TDB_DATA *key)
+/*
+ * Add one of the daemon's own file descriptors to the epoll set, if in use.
+ * Events for it are reported in *revents.
+ */
+static int poll_add_fd(int fd, unsigned int *revents)
 {
-	/*
-	 * Dropping const is fine here, as the key will never be modified
-	 * by TDB.
-	 */
-	key->dptr = (char *)name;
-	key->dsize = strlen(name);
+#ifdef USE_EPOLL
+	if (epoll_fd >= 0 && fd != -1)
+		return epoll_update(EPOLL_CTL_ADD, fd, POLLIN | POLLPRI,
+				    revents);
+#endif
+
+	return 0;
 }
 
-static void get_acc_data(TDB_DATA *key, struct node_account_data *acc)
+static void init_epoll(void)
 {
-	TDB_DATA old_data;
-	struct xs_tdb_record_hdr *hdr;
+#ifdef USE_EPOLL
+	struct connection *conn, *tmp;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		syslog(LOG_WARNING, "epoll not available, using poll: %m\n");
+		return;
+	}
+
+	if (poll_add_fd(sock, &sock_revents) ||
+	    poll_add_fd(reopen_log_pipe[0], &reopen_log_revents) ||
+	    (xce_handle != NULL &&
+	     poll_add_fd(xenevtchn_fd(xce_handle), &xce_revents))) {
+		syslog(LOG_WARNING, "epoll_ctl failed, using poll: %m\n");
+		close(epoll_fd);
+		epoll_fd = -1;
+		return;
+	}
+
+	/* Socket connections might have been restored by live update. */
+	list_for_each_entry_safe(conn, tmp, &connections, list)
+		if (!conn_poll_add(conn))
+			talloc_free(conn);
+#endif
+}
+
+/*
+ * Wait for events and record them in the *_revents variables or, for socket
+ * connections, in the connection itself.
+ */
+static int wait_for_events(int sock_pollfd_idx, int timeout)
+{
+#ifdef USE_EPOLL
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	struct connection *conn;
+	void *ptr;
+	int i, n;
+
+	if (epoll_fd >= 0) {
+		n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+		for (i = 0; i < n; i++) {
+			ptr = events[i].data.ptr;
+			if (ptr == &sock_revents || ptr == &reopen_log_revents ||
+			    ptr == &xce_revents) {
+				*(unsigned int *)ptr = events[i].events;
+			} else {
+				conn = ptr;
+				conn->poll_revents = events[i].events;
+			}
+		}
+
+		return n;
+	}
+#endif
+
+	if (poll(fds, nr_fds, timeout) < 0)
+		return -1;
+
+	if (sock_pollfd_idx != -1)
+		sock_revents = fds[sock_pollfd_idx].revents;
+	if (reopen_log_pipe0_pollfd_idx != -1)
+		reopen_log_revents = fds[reopen_log_pipe0_pollfd_idx].revents;
+	if (xce_pollfd_idx != -1)
+		xce_revents = fds[xce_pollfd_idx].revents;
+
+	return 0;
+}
+
+static size_t db_record_size(const struct xs_tdb_record_hdr *hdr)
+{
+	return sizeof(*hdr) + hdr->num_perms * sizeof(hdr->perms[0]) +
+	       hdr->datalen + hdr->childlen;
+}
+
+/*
+ * Get the data base record of a node. The record must not be modified, and
+ * it is valid only until the data base is modified next, unless the caller
+ * takes a reference of its own.
+ * If it fails, returns NULL and sets errno.
+ */
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size)
+{
+	const struct xs_tdb_record_hdr *hdr;
+
+	hdr = hashtable_search(nodes, db_name);
+	if (!hdr) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	*size = db_record_size(hdr);
+	trace_tdb("read %s size %zu\n", db_name, *size + strlen(db_name));
+
+	return hdr;
+}
+
+static void get_acc_data(const char *db_name, struct node_account_data *acc)
+{
+	const struct xs_tdb_record_hdr *hdr;
+	size_t size;
 
 	if (acc->memory < 0) {
-		old_data = tdb_fetch(tdb_ctx, *key);
+		hdr = db_fetch(db_name, &size);
 		/* No check for error, as the node might not exist. */
-		if (old_data.dptr == NULL) {
+		if (hdr == NULL) {
 			acc->memory = 0;
 		} else {
-			trace_tdb("read %s size %zu\n", key->dptr,
-				  old_data.dsize + key->dsize);
-			hdr = (void *)old_data.dptr;
-			acc->memory = old_data.dsize;
+			acc->memory = size;
 			acc->domid = hdr->perms[0].id;
 		}
-		talloc_free(old_data.dptr);
 	}
 }
 
@@ -593,19 +807,28 @@ static void get_acc_data(TDB_DATA *key, struct node_account_data *acc)
  * count prepended (e.g. 123/local/domain/...). So testing for the node's
  * key not to start with "/" or "@" is sufficient.
  */
-static unsigned int get_acc_domid(struct connection *conn, TDB_DATA *key,
+static unsigned int get_acc_domid(struct connection *conn, const char *db_name,
 				  unsigned int domid)
 {
-	return (!conn || key->dptr[0] == '/' || key->dptr[0] == '@')
+	return (!conn || db_name[0] == '/' || db_name[0] == '@')
 	       ? domid : conn->id;
 }
 
-int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
-		 struct node_account_data *acc, bool no_quota_check)
+/*
+ * Store a record under db_name, replacing any record stored there before.
+ * The caller must have linked the record to the data base already, on
+ * failure this link is dropped.
+ */
+static int db_store(struct connection *conn, const char *db_name,
+		    struct xs_tdb_record_hdr *hdr,
+		    struct node_account_data *acc, bool no_quota_check)
 {
-	struct xs_tdb_record_hdr *hdr = (void *)data->dptr;
 	struct node_account_data old_acc = {};
 	unsigned int old_domid, new_domid;
+	size_t size = db_record_size(hdr);
+	size_t name_len = strlen(db_name);
+	struct xs_tdb_record_hdr *old;
+	char *name;
 	int ret;
 
 	if (!acc)
@@ -613,9 +836,9 @@ int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
 	else
 		old_acc = *acc;
 
-	get_acc_data(key, &old_acc);
-	old_domid = get_acc_domid(conn, key, old_acc.domid);
-	new_domid = get_acc_domid(conn, key, hdr->perms[0].id);
+	get_acc_data(db_name, &old_acc);
+	old_domid = get_acc_domid(conn, db_name, old_acc.domid);
+	new_domid = get_acc_domid(conn, db_name, hdr->perms[0].id);
 
 	/*
 	 * Don't check for ENOENT, as we want to be able to switch orphaned
@@ -623,43 +846,86 @@ int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
 	 */
 	if (old_acc.memory)
 		domain_memory_add_nochk(conn, old_domid,
-					-old_acc.memory - key->dsize);
-	ret = domain_memory_add(conn, new_domid,
-				data->dsize + key->dsize, no_quota_check);
-	if (ret) {
-		/* Error path, so no quota check. */
-		if (old_acc.memory)
-			domain_memory_add_nochk(conn, old_domid,
-						old_acc.memory + key->dsize);
-		return ret;
-	}
+					-old_acc.memory - name_len);
+	ret = domain_memory_add(conn, new_domid, size + name_len,
+				no_quota_check);
+	if (ret)
+		goto err_acc;
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, *data, TDB_REPLACE) != 0) {
-		domain_memory_add_nochk(conn, new_domid,
-					-data->dsize - key->dsize);
-		/* Error path, so no quota check. */
-		if (old_acc.memory)
-			domain_memory_add_nochk(conn, old_domid,
-						old_acc.memory + key->dsize);
-		errno = EIO;
-		return errno;
+	old = hashtable_search(nodes, db_name);
+	if (old) {
+		hashtable_replace(nodes, db_name, hdr);
+		talloc_unlink(nodes, old);
+	} else {
+		name = talloc_strdup(nodes, db_name);
+		if (!name || hashtable_add(nodes, name, hdr)) {
+			talloc_free(name);
+			domain_memory_add_nochk(conn, new_domid,
+						-size - name_len);
+			ret = ENOMEM;
+			goto err_acc;
+		}
 	}
-	trace_tdb("store %s size %zu\n", key->dptr, data->dsize + key->dsize);
+	trace_tdb("store %s size %zu\n", db_name, size + name_len);
 
 	if (acc) {
 		/* Don't use new_domid, as it might be a transaction node. */
 		acc->domid = hdr->perms[0].id;
-		acc->memory = data->dsize;
+		acc->memory = size;
 	}
 
 	return 0;
+
+ err_acc:
+	/* Error path, so no quota check. */
+	if (old_acc.memory)
+		domain_memory_add_nochk(conn, old_domid,
+					old_acc.memory + name_len);
+	talloc_unlink(nodes, hdr);
+	errno = ret;
+	return ret;
+}
+
+/*
+ * Store a new record (allocated by the caller) under db_name. The data base
+ * takes ownership of the record, even in case of failure.
+ */
+int db_write(struct connection *conn, const char *db_name, void *data,
+	     struct node_account_data *acc, bool no_quota_check)
+{
+	talloc_steal(nodes, data);
+
+	return db_store(conn, db_name, data, acc, no_quota_check);
+}
+
+/*
+ * Make the record currently stored under from available under db_name,
+ * too, without copying it.
+ */
+int db_link(struct connection *conn, const char *db_name, const char *from,
+	    struct node_account_data *acc)
+{
+	struct xs_tdb_record_hdr *hdr;
+
+	hdr = hashtable_search(nodes, from);
+	if (!hdr) {
+		errno = ENOENT;
+		return errno;
+	}
+
+	if (!talloc_reference(nodes, hdr)) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	return db_store(conn, db_name, hdr, acc, true);
 }
 
-int do_tdb_delete(struct connection *conn, TDB_DATA *key,
-		  struct node_account_data *acc)
+int db_delete(struct connection *conn, const char *db_name,
+	      struct node_account_data *acc)
 {
 	struct node_account_data tmp_acc;
+	struct xs_tdb_record_hdr *hdr;
 	unsigned int domid;
 
 	if (!acc) {
@@ -667,17 +933,21 @@ int do_tdb_delete(struct connection *conn, TDB_DATA *key,
 		acc->memory = -1;
 	}
 
-	get_acc_data(key, acc);
+	get_acc_data(db_name, acc);
 
-	if (tdb_delete(tdb_ctx, *key)) {
-		errno = EIO;
-		return errno;
+	if (acc->memory) {
+		domid = get_acc_domid(conn, db_name, acc->domid);
+		domain_memory_add_nochk(conn, domid,
+					-acc->memory - strlen(db_name));
 	}
-	trace_tdb("delete %s\n", key->dptr);
 
-	if (acc->memory) {
-		domid = get_acc_domid(conn, key, acc->domid);
-		domain_memory_add_nochk(conn, domid, -acc->memory - key->dsize);
+	trace_tdb("delete %s\n", db_name);
+
+	/* Removing the entry might free db_name, so it must come last. */
+	hdr = hashtable_search(nodes, db_name);
+	if (hdr) {
+		hashtable_remove(nodes, db_name);
+		talloc_unlink(nodes, hdr);
 	}
 
 	return 0;
@@ -690,9 +960,10 @@ int do_tdb_delete(struct connection *conn, TDB_DATA *key,
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name)
 {
-	TDB_DATA key, data;
-	struct xs_tdb_record_hdr *hdr;
+	const char *db_name;
+	const struct xs_tdb_record_hdr *hdr;
 	struct node *node;
+	size_t size;
 	int err;
 
 	node = talloc(ctx, struct node);
@@ -707,38 +978,43 @@ struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 
-	transaction_prepend(conn, name, &key);
+	db_name = transaction_prepend(conn, name);
 
-	data = tdb_fetch(tdb_ctx, key);
+	hdr = db_fetch(db_name, &size);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
-			node->generation = NO_GENERATION;
-			err = access_node(conn, node, NODE_ACCESS_READ, NULL);
-			errno = err ? : ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+	if (hdr == NULL) {
+		node->generation = NO_GENERATION;
+		err = access_node(conn, node, NODE_ACCESS_READ, NULL);
+		errno = err ? : ENOENT;
 		goto error;
 	}
 
-	trace_tdb("read %s size %zu\n", key.dptr, data.dsize + key.dsize);
-
 	node->parent = NULL;
-	talloc_steal(node, data.dptr);
+
+	/* Keep the record alive for as long as the node refers to it. */
+	if (!talloc_reference(node, hdr)) {
+		errno = ENOMEM;
+		goto error;
+	}
 
 	/* Datalen, childlen, number of permissions */
-	hdr = (void *)data.dptr;
 	node->generation = hdr->generation;
 	node->perms.num = hdr->num_perms;
 	node->datalen = hdr->datalen;
 	node->childlen = hdr->childlen;
 
-	/* Permissions are struct xs_permissions. */
-	node->perms.p = hdr->perms;
+	/*
+	 * Permissions are struct xs_permissions. They are small and get
+	 * adjusted in place, so they are the only part being copied.
+	 */
+	node->perms.p = talloc_memdup(node, hdr->perms,
+				      hdr->num_perms * sizeof(hdr->perms[0]));
+	if (!node->perms.p) {
+		errno = ENOMEM;
+		goto error;
+	}
 	node->acc.domid = get_node_owner(node);
-	node->acc.memory = data.dsize;
+	node->acc.memory = size;
 	if (domain_adjust_node_perms(node))
 		goto error;
 
@@ -747,7 +1023,7 @@ struct node *read_node(struct connection *conn, const void *ctx,
 		node->acc.memory = 0;
 
 	/* Data is binary blob (usually ascii, no nul). */
-	node->data = node->perms.p + hdr->num_perms;
+	node->data = (void *)(hdr->perms + hdr->num_perms);
 	/* Children is strings, nul separated. */
 	node->children = node->data + node->datalen;
 
@@ -773,33 +1049,32 @@ static bool read_node_can_propagate_errno(void)
 	return errno == ENOMEM || errno == ENOSPC;
 }
 
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
-		   bool no_quota_check)
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node, bool no_quota_check)
 {
-	TDB_DATA data;
+	size_t size;
 	void *p;
 	struct xs_tdb_record_hdr *hdr;
 
 	if (domain_adjust_node_perms(node))
 		return errno;
 
-	data.dsize = sizeof(*hdr)
+	size = sizeof(*hdr)
 		+ node->perms.num * sizeof(node->perms.p[0])
 		+ node->datalen + node->childlen;
 
 	/* Call domain_max_chk() in any case in order to record max values. */
-	if (domain_max_chk(conn, ACC_NODESZ, data.dsize) && !no_quota_check) {
+	if (domain_max_chk(conn, ACC_NODESZ, size) && !no_quota_check) {
 		errno = ENOSPC;
 		return errno;
 	}
 
-	data.dptr = talloc_size(node, data.dsize);
-	if (!data.dptr) {
+	hdr = talloc_size(node, size);
+	if (!hdr) {
 		errno = ENOMEM;
 		return errno;
 	}
 
-	hdr = (void *)data.dptr;
 	hdr->generation = node->generation;
 	hdr->num_perms = node->perms.num;
 	hdr->datalen = node->datalen;
@@ -812,25 +1087,25 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	if (do_tdb_write(conn, key, &data, &node->acc, no_quota_check))
+	if (db_write(conn, db_name, hdr, &node->acc, no_quota_check))
 		return EIO;
 
 	return 0;
 }
 
 /*
- * Write the node. If the node is written, caller can find the key used in
- * node->key. This can later be used if the change needs to be reverted.
+ * Write the node. If the node is written, caller can find the name used in
+ * node->db_name. This can later be used if the change needs to be reverted.
  */
 static int write_node(struct connection *conn, struct node *node,
 		      bool no_quota_check)
 {
 	int ret;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &node->key))
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &node->db_name))
 		return errno;
 
-	ret = write_node_raw(conn, &node->key, node, no_quota_check);
+	ret = write_node_raw(conn, node->db_name, node, no_quota_check);
 	if (ret && conn && conn->transaction) {
 		/*
 		 * Reverting access_node() is hard, so just fail the
@@ -1026,6 +1301,35 @@ static void send_error(struct connection *conn, int error)
 			  strlen(xsd_errors[i].errstring) + 1);
 }
 
+struct multi_reply {
+	char *buffer;
+	unsigned int len;
+	/* An operation has failed: don't process the following ones. */
+	bool op_failed;
+	/* The request as a whole has failed. */
+	int error;
+};
+
+static void multi_add_reply(struct multi_reply *multi,
+			    enum xsd_sockmsg_type type,
+			    const void *data, unsigned int len)
+{
+	struct xsd_sockmsg hdr = { .type = type, .len = len };
+	unsigned int total = multi->len + sizeof(hdr) + len;
+
+	if (type == XS_ERROR)
+		multi->op_failed = true;
+
+	if (total > XENSTORE_PAYLOAD_MAX) {
+		multi->error = E2BIG;
+		return;
+	}
+
+	memcpy(multi->buffer + multi->len, &hdr, sizeof(hdr));
+	memcpy(multi->buffer + multi->len + sizeof(hdr), data, len);
+	multi->len = total;
+}
+
 void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		const void *data, unsigned int len)
 {
@@ -1036,6 +1340,12 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 	/* Commit accounting now, as later errors won't undo any changes. */
 	acc_commit(conn);
 
+	/* Replies of XS_MULTI operations are collected in a single reply. */
+	if (conn->multi) {
+		multi_add_reply(conn->multi, type, data, len);
+		return;
+	}
+
 	if ( len > XENSTORE_PAYLOAD_MAX ) {
 		send_error(conn, E2BIG);
 		return;
@@ -1074,6 +1384,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 	list_add_tail(&bdata->list, &conn->out_list);
 	bdata->on_out_list = true;
 	domain_outstanding_inc(conn);
+	conn_poll_update(conn);
 }
 
 /*
@@ -1141,6 +1452,7 @@ void send_event(struct buffered_data *req, struct connection *conn,
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
 	bdata->on_out_list = true;
+	conn_poll_update(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -1447,7 +1759,7 @@ static void destroy_node_rm(struct connection *conn, struct node *node)
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	do_tdb_delete(conn, &node->key, &node->acc);
+	db_delete(conn, node->db_name, &node->acc);
 }
 
 static int destroy_node(struct connection *conn, struct node *node)
@@ -1513,8 +1825,8 @@ static struct node *create_node(struct connection *conn, const void *ctx,
 
 err:
 	/*
-	 * We failed to update TDB for some of the nodes. Undo any work that
-	 * have already been done.
+	 * We failed to update the data base for some of the nodes. Undo any
+	 * work that has already been done.
 	 */
 	for (j = node; j != i; j = j->parent)
 		destroy_node(conn, j);
@@ -1596,19 +1908,22 @@ static int do_mkdir(const void *ctx, struct connection *conn,
 	return 0;
 }
 
-/* Delete memory using memmove. */
-static void memdel(void *mem, unsigned off, unsigned len, unsigned total)
-{
-	memmove(mem + off, mem + off + len, total - off - len);
-}
-
+/* Remove the child name at offset from the children list of node. */
 static int remove_child_entry(struct connection *conn, struct node *node,
 			      size_t offset)
 {
-	size_t childlen = strlen(node->children + offset);
+	size_t childlen = strlen(node->children + offset) + 1;
+	char *children;
 
-	memdel(node->children, offset, childlen + 1, node->childlen);
-	node->childlen -= childlen + 1;
+	/* The children might be part of the data base record: don't modify. */
+	children = talloc_array(node, char, node->childlen - childlen);
+	if (!children)
+		return ENOMEM;
+	memcpy(children, node->children, offset);
+	memcpy(children + offset, node->children + offset + childlen,
+	       node->childlen - offset - childlen);
+	node->children = children;
+	node->childlen -= childlen;
 
 	return write_node(conn, node, true);
 }
@@ -1636,10 +1951,10 @@ static int delnode_sub(const void *ctx, struct connection *conn,
 	const char *root = arg;
 	bool watch_exact;
 	int ret;
-	TDB_DATA key;
+	const char *db_name;
 
 	/* Any error here will probably be repeated for all following calls. */
-	ret = access_node(conn, node, NODE_ACCESS_DELETE, &key);
+	ret = access_node(conn, node, NODE_ACCESS_DELETE, &db_name);
 	if (ret > 0)
 		return WALK_TREE_SUCCESS_STOP;
 
@@ -1647,7 +1962,7 @@ static int delnode_sub(const void *ctx, struct connection *conn,
 		return WALK_TREE_ERROR_STOP;
 
 	/* In case of error stop the walk. */
-	if (!ret && do_tdb_delete(conn, &key, &node->acc))
+	if (!ret && db_delete(conn, db_name, &node->acc))
 		return WALK_TREE_ERROR_STOP;
 
 	/*
@@ -1945,6 +2260,9 @@ int walk_node_tree(const void *ctx, struct connection *conn, const char *root,
 	return ret < 0 ? ret : WALK_TREE_OK;
 }
 
+static int do_multi(const void *ctx, struct connection *conn,
+		    struct buffered_data *in);
+
 static struct {
 	const char *str;
 	int (*func)(const void *ctx, struct connection *conn,
@@ -1952,12 +2270,16 @@ static struct {
 	unsigned int flags;
 #define XS_FLAG_NOTID		(1U << 0)	/* Ignore transaction id. */
 #define XS_FLAG_PRIV		(1U << 1)	/* Privileged domain only. */
+#define XS_FLAG_MULTI		(1U << 2)	/* Allowed in XS_MULTI. */
 } const wire_funcs[XS_TYPE_COUNT] = {
 	[XS_CONTROL]           =
 	    { "CONTROL",       do_control,      XS_FLAG_PRIV },
-	[XS_DIRECTORY]         = { "DIRECTORY",         send_directory },
-	[XS_READ]              = { "READ",              do_read },
-	[XS_GET_PERMS]         = { "GET_PERMS",         do_get_perms },
+	[XS_DIRECTORY]         =
+	    { "DIRECTORY",     send_directory,  XS_FLAG_MULTI },
+	[XS_READ]              =
+	    { "READ",          do_read,         XS_FLAG_MULTI },
+	[XS_GET_PERMS]         =
+	    { "GET_PERMS",     do_get_perms,    XS_FLAG_MULTI },
 	[XS_WATCH]             =
 	    { "WATCH",         do_watch,        XS_FLAG_NOTID },
 	[XS_UNWATCH]           =
@@ -1968,11 +2290,16 @@ static struct {
 	    { "INTRODUCE",     do_introduce,    XS_FLAG_PRIV },
 	[XS_RELEASE]           =
 	    { "RELEASE",       do_release,      XS_FLAG_PRIV },
-	[XS_GET_DOMAIN_PATH]   = { "GET_DOMAIN_PATH",   do_get_domain_path },
-	[XS_WRITE]             = { "WRITE",             do_write },
-	[XS_MKDIR]             = { "MKDIR",             do_mkdir },
-	[XS_RM]                = { "RM",                do_rm },
-	[XS_SET_PERMS]         = { "SET_PERMS",         do_set_perms },
+	[XS_GET_DOMAIN_PATH]   =
+	    { "GET_DOMAIN_PATH", do_get_domain_path, XS_FLAG_MULTI },
+	[XS_WRITE]             =
+	    { "WRITE",         do_write,        XS_FLAG_MULTI },
+	[XS_MKDIR]             =
+	    { "MKDIR",         do_mkdir,        XS_FLAG_MULTI },
+	[XS_RM]                =
+	    { "RM",            do_rm,           XS_FLAG_MULTI },
+	[XS_SET_PERMS]         =
+	    { "SET_PERMS",     do_set_perms,    XS_FLAG_MULTI },
 	[XS_WATCH_EVENT]       = { "WATCH_EVENT",       NULL },
 	[XS_ERROR]             = { "ERROR",             NULL },
 	[XS_IS_DOMAIN_INTRODUCED] =
@@ -1983,8 +2310,97 @@ static struct {
 	    { "SET_TARGET",    do_set_target,   XS_FLAG_PRIV },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
 	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_MULTI]             = { "MULTI",             do_multi },
 };
 
+/*
+ * XS_MULTI: the payload is a sequence of operations, each one being a
+ * struct xsd_sockmsg header followed by the operation's payload. The
+ * operations are processed in order, and their replies are returned in the
+ * same format. Processing stops at the first failing operation, whose
+ * reply is an XS_ERROR one.
+ * Without a transaction specified by the caller the operations are done in
+ * an internal transaction, which is committed only if all operations have
+ * succeeded, so either all or none of the modifications are done.
+ */
+static int do_multi(const void *ctx, struct connection *conn,
+		    struct buffered_data *in)
+{
+	struct multi_reply *multi;
+	struct buffered_data *op;
+	struct xsd_sockmsg hdr;
+	bool internal_ta = false;
+	unsigned int off;
+	int ret = 0;
+
+	multi = talloc_zero(ctx, struct multi_reply);
+	if (!multi)
+		return ENOMEM;
+	multi->buffer = talloc_array(multi, char, XENSTORE_PAYLOAD_MAX);
+	if (!multi->buffer)
+		return ENOMEM;
+
+	if (!conn->transaction) {
+		conn->transaction = transaction_start(ctx, conn);
+		if (!conn->transaction)
+			return errno;
+		internal_ta = true;
+	}
+
+	conn->multi = multi;
+
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr)) {
+			ret = EINVAL;
+			break;
+		}
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    hdr.type >= XS_TYPE_COUNT ||
+		    !(wire_funcs[hdr.type].flags & XS_FLAG_MULTI)) {
+			ret = EINVAL;
+			break;
+		}
+
+		op = talloc_zero(ctx, struct buffered_data);
+		if (!op) {
+			ret = ENOMEM;
+			break;
+		}
+		op->hdr.msg = hdr;
+		op->buffer = in->buffer + off + sizeof(hdr);
+		op->used = hdr.len;
+
+		ret = wire_funcs[hdr.type].func(ctx, conn, op);
+		talloc_free(op);
+		if (ret) {
+			send_error(conn, ret);
+			ret = 0;
+		}
+		if (multi->op_failed || multi->error)
+			break;
+	}
+
+	conn->multi = NULL;
+	if (!ret)
+		ret = multi->error;
+
+	if (internal_ta) {
+		if (!ret)
+			ret = transaction_end(ctx, conn,
+					      !multi->op_failed);
+		else
+			transaction_end(ctx, conn, false);
+	}
+
+	if (ret)
+		return ret;
+
+	send_reply(conn, XS_MULTI, multi->buffer, multi->len);
+
+	return 0;
+}
+
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	if ((unsigned int)type < ARRAY_SIZE(wire_funcs) && wire_funcs[type].str)
@@ -2173,6 +2589,8 @@ static void handle_output(struct connection *conn)
 	/* Ignore the connection if an error occured */
 	if (!write_messages(conn))
 		ignore_connection(conn, XENSTORE_ERROR_RINGIDX);
+	else
+		conn_poll_update(conn);
 }
 
 struct connection *new_connection(const struct interface_funcs *funcs)
@@ -2257,15 +2675,17 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 
 static bool socket_can_process(struct connection *conn, int mask)
 {
-	if (conn->pollfd_idx == -1)
-		return false;
+	unsigned int revents = conn->poll_revents;
+
+	if (conn->pollfd_idx != -1)
+		revents = fds[conn->pollfd_idx].revents;
 
-	if (fds[conn->pollfd_idx].revents & ~(POLLIN | POLLOUT)) {
+	if (revents & ~(POLLIN | POLLOUT)) {
 		talloc_free(conn);
 		return false;
 	}
 
-	return (fds[conn->pollfd_idx].revents & mask);
+	return (revents & mask);
 }
 
 static bool socket_can_write(struct connection *conn)
@@ -2298,6 +2718,8 @@ static void accept_connection(int sock)
 	if (conn) {
 		conn->fd = fd;
 		conn->id = dom0_domid;
+		if (!conn_poll_add(conn))
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -2326,43 +2748,29 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
+unsigned int hash_from_key_fn(const void *k)
 {
-	va_list ap;
-	char *s;
-	int saved_errno = errno;
+	const char *str = k;
+	unsigned int hash = 5381;
+	char c;
 
-	va_start(ap, fmt);
-	s = talloc_vasprintf(NULL, fmt, ap);
-	va_end(ap);
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
 
-	if (s) {
-		trace("TDB: %s\n", s);
-		syslog(LOG_ERR, "TDB: %s",  s);
-		if (verbose)
-			xprintf("TDB: %s", s);
-		talloc_free(s);
-	} else {
-		trace("talloc failure during logging\n");
-		syslog(LOG_ERR, "talloc failure during logging\n");
-	}
+	return hash;
+}
 
-	errno = saved_errno;
+int keys_equal_fn(const void *key1, const void *key2)
+{
+	return 0 == strcmp(key1, key2);
 }
 
 void setup_structure(bool live_update)
 {
-	char *tdbname;
-
-	tdbname = talloc_strdup(talloc_autofree_context(), "/dev/mem");
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
-
-	tdb_ctx = tdb_open_ex(tdbname, 7919, TDB_INTERNAL | TDB_NOLOCK,
-			      O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+	nodes = create_hashtable(NULL, "nodes", hash_from_key_fn, keys_equal_fn,
+				 HASHTABLE_FREE_KEY);
+	if (!nodes)
+		barf_perror("Could not create node data base");
 
 	if (live_update)
 		manual_node("/", NULL);
@@ -2376,24 +2784,6 @@ void setup_structure(bool live_update)
 	}
 }
 
-static unsigned int hash_from_key_fn(const void *k)
-{
-	const char *str = k;
-	unsigned int hash = 5381;
-	char c;
-
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + (unsigned int)c;
-
-	return hash;
-}
-
-
-static int keys_equal_fn(const void *key1, const void *key2)
-{
-	return 0 == strcmp(key1, key2);
-}
-
 int remember_string(struct hashtable *hash, const char *str)
 {
 	char *k = talloc_strdup(NULL, str);
@@ -2453,12 +2843,11 @@ static int check_store_enoent(const void *ctx, struct connection *conn,
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(const void *key, void *val, void *private)
 {
 	struct hashtable *reachable = private;
 	char *slash;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
+	char *name = talloc_strdup(NULL, key);
 
 	if (!name) {
 		log("clean_store: ENOMEM");
@@ -2473,7 +2862,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			do_tdb_delete(NULL, &key, NULL);
+			db_delete(NULL, key, NULL);
 		}
 	}
 
@@ -2489,7 +2878,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct check_store_data *data)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, data->reachable);
+	hashtable_iterate(nodes, clean_store_, data->reachable);
 	domain_check_acc(data->domains);
 }
 
@@ -2950,6 +3339,7 @@ int main(int argc, char *argv[])
 	check_store();
 
 	/* Get ready to listen to the tools. */
+	init_epoll();
 	initialize_fds(&sock_pollfd_idx, &timeout);
 
 #if defined(XEN_SYSTEMD_ENABLED)
@@ -2963,46 +3353,50 @@ int main(int argc, char *argv[])
 	for (;;) {
 		struct connection *conn, *next;
 
-		if (poll(fds, nr_fds, timeout) < 0) {
+		if (wait_for_events(sock_pollfd_idx, timeout) < 0) {
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
 
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
+		if (reopen_log_revents) {
+			if (reopen_log_revents & ~POLLIN) {
 				close(reopen_log_pipe[0]);
 				close(reopen_log_pipe[1]);
 				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
+				if (poll_add_fd(reopen_log_pipe[0],
+						&reopen_log_revents))
+					barf_perror("epoll_ctl failed");
+			} else if (reopen_log_revents & POLLIN) {
 				char c;
 				if (read(reopen_log_pipe[0], &c, 1) != 1)
 					barf_perror("read failed");
 				reopen_log();
 			}
 			reopen_log_pipe0_pollfd_idx = -1;
+			reopen_log_revents = 0;
 		}
 
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
+		if (sock_revents) {
+			if (sock_revents & ~POLLIN) {
 				barf_perror("sock poll failed");
 				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
+			} else if (sock_revents & POLLIN) {
 				accept_connection(sock);
 				sock_pollfd_idx = -1;
 			}
+			sock_revents = 0;
 		}
 
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
+		if (xce_revents) {
+			if (xce_revents & ~POLLIN) {
 				barf_perror("xce_handle poll failed");
 				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
+			} else if (xce_revents & POLLIN) {
 				handle_event();
 				xce_pollfd_idx = -1;
 			}
+			xce_revents = 0;
 		}
 
 		/*
@@ -3036,6 +3430,7 @@ int main(int argc, char *argv[])
 				continue;
 
 			conn->pollfd_idx = -1;
+			conn->poll_revents = 0;
 		}
 
 		if (delayed_requests) {
@@ -3415,7 +3810,6 @@ void read_state_node(const void *ctx, const void *state)
 {
 	const struct xs_state_node *sn = state;
 	struct node *node, *parent;
-	TDB_DATA key;
 	char *name, *parentname;
 	unsigned int i;
 	struct connection conn = { .id = priv_domid };
@@ -3468,13 +3862,11 @@ void read_state_node(const void *ctx, const void *state)
 		if (add_child(node, parent, name))
 			barf("allocation error restoring node");
 
-		set_tdb_key(parentname, &key);
-		if (write_node_raw(NULL, &key, parent, true))
+		if (write_node_raw(NULL, parentname, parent, true))
 			barf("write parent error restoring node");
 	}
 
-	set_tdb_key(name, &key);
-	if (write_node_raw(NULL, &key, node, true))
+	if (write_node_raw(NULL, name, node, true))
 		barf("write node error restoring node");
 
 	if (domain_nbentry_inc(&conn, get_node_owner(node)))
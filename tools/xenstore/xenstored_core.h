@@ -33,7 +33,6 @@
 #include "xenstore_lib.h"
 #include "xenstore_state.h"
 #include "list.h"
-#include "tdb.h"
 #include "hashtable.h"
 
 #ifndef O_CLOEXEC
@@ -110,6 +109,8 @@ struct interface_funcs {
 	bool (*can_read)(struct connection *);
 };
 
+struct multi_reply;
+
 struct connection
 {
 	struct list_head list;
@@ -118,6 +119,9 @@ struct connection
 	int fd;
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
+	/* Events registered with and last reported by epoll. */
+	unsigned int poll_events;
+	unsigned int poll_revents;
 
 	/* Who am I? Domid of connection. */
 	unsigned int id;
@@ -161,6 +165,13 @@ struct connection
 	/* My watches. */
 	struct list_head watches;
 
+	/* Replies of the XS_MULTI request being processed (NULL if none). */
+	struct multi_reply *multi;
+
+	/* Result of the watch permission check, valid for watch_fire_seq. */
+	uint64_t watch_fire_seq;
+	bool watch_fire_permitted;
+
 	/* Methods for communicating over this connection. */
 	const struct interface_funcs *funcs;
 
@@ -181,8 +192,8 @@ struct node_account_data {
 
 struct node {
 	const char *name;
-	/* Key used to update TDB */
-	TDB_DATA key;
+	/* Name of the node's record in the data base. */
+	const char *db_name;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -194,6 +205,12 @@ struct node {
 	/* Permissions. */
 	struct node_perms perms;
 
+	/*
+	 * Contents and children might point into the data base record the
+	 * node has been read from, which is shared: never modify them in
+	 * place, but replace them.
+	 */
+
 	/* Contents. */
 	unsigned int datalen;
 	void *data;
@@ -236,11 +253,11 @@ static inline unsigned int get_node_owner(const struct node *node)
 	return node->perms.p[0].id;
 }
 
-/* Write a node to the tdb data base. */
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node,
-		   bool no_quota_check);
+/* Write a node to the data base. */
+int write_node_raw(struct connection *conn, const char *db_name,
+		   struct node *node, bool no_quota_check);
 
-/* Get a node from the tdb data base. */
+/* Get a node from the data base. */
 struct node *read_node(struct connection *conn, const void *ctx,
 		       const char *name);
 
@@ -308,7 +325,6 @@ do {						\
 		trace("tdb: " __VA_ARGS__);	\
 } while (0)
 
-extern TDB_CONTEXT *tdb_ctx;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -356,11 +372,17 @@ extern xengnttab_handle **xgt_handle;
 
 int remember_string(struct hashtable *hash, const char *str);
 
-void set_tdb_key(const char *name, TDB_DATA *key);
-int do_tdb_write(struct connection *conn, TDB_DATA *key, TDB_DATA *data,
-		 struct node_account_data *acc, bool no_quota_check);
-int do_tdb_delete(struct connection *conn, TDB_DATA *key,
-		  struct node_account_data *acc);
+/* Hash table functions for tables indexed by strings. */
+unsigned int hash_from_key_fn(const void *k);
+int keys_equal_fn(const void *key1, const void *key2);
+
+const struct xs_tdb_record_hdr *db_fetch(const char *db_name, size_t *size);
+int db_write(struct connection *conn, const char *db_name, void *data,
+	     struct node_account_data *acc, bool no_quota_check);
+int db_link(struct connection *conn, const char *db_name, const char *from,
+	    struct node_account_data *acc);
+int db_delete(struct connection *conn, const char *db_name,
+	      struct node_account_data *acc);
 
 void conn_free_buffered_data(struct connection *conn);
 
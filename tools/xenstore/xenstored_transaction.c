@@ -40,7 +40,7 @@
  * Some notes regarding detection and handling of transaction conflicts:
  *
  * Basic source of reference is the 'generation' count. Each writing access
- * (either normal write or in a transaction) to the tdb data base will set
+ * (either normal write or in a transaction) to the data base will set
  * the node specific generation count to the global generation count.
  * For being able to identify a transaction the transaction specific generation
  * count is initialized with the global generation count when starting the
@@ -196,20 +196,34 @@ static char *transaction_get_node_name(void *ctx, struct transaction *trans,
  * Prepend the transaction to name if node has been modified in the current
  * transaction.
  */
-void transaction_prepend(struct connection *conn, const char *name,
-			 TDB_DATA *key)
+const char *transaction_prepend(struct connection *conn, const char *name)
 {
 	struct accessed_node *i;
 
 	if (conn && conn->transaction) {
 		i = find_accessed_node(conn->transaction, name);
-		if (i) {
-			set_tdb_key(i->trans_name, key);
-			return;
-		}
+		if (i)
+			return i->trans_name;
 	}
 
-	set_tdb_key(name, key);
+	return name;
+}
+
+/*
+ * Check whether the permissions of a node just read from the global data base
+ * are still those of its record, i.e. domain_adjust_node_perms() didn't mark
+ * any of them to be ignored.
+ */
+static bool node_perms_match_record(const struct node *node)
+{
+	const struct xs_tdb_record_hdr *hdr;
+	size_t size;
+
+	hdr = db_fetch(node->name, &size);
+
+	return hdr && hdr->num_perms == node->perms.num &&
+	       !memcmp(hdr->perms, node->perms.p,
+		       node->perms.num * sizeof(*node->perms.p));
 }
 
 /*
@@ -219,19 +233,19 @@ void transaction_prepend(struct connection *conn, const char *name,
  * node->generation).
  *
  * Accesses in a transaction will be added to the list of accessed nodes
- * if not already done. Read type accesses will copy the node to the
- * transaction specific data base part, write type accesses go there
- * anyway.
+ * if not already done. Read type accesses will link the node's data base
+ * record to the transaction specific data base part (the record is shared,
+ * not copied, unless its permissions needed adjusting), write type accesses
+ * go there anyway.
  *
- * If not NULL, key will be supplied with name and length of name of the node
- * to be accessed in the data base.
+ * If not NULL, db_name will be set to the name of the node to be accessed in
+ * the data base.
  */
 int access_node(struct connection *conn, struct node *node,
-		enum node_access_type type, TDB_DATA *key)
+		enum node_access_type type, const char **db_name)
 {
 	struct accessed_node *i = NULL;
 	struct transaction *trans;
-	TDB_DATA local_key;
 	int ret;
 	bool introduce = false;
 
@@ -243,8 +257,8 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (!conn || !conn->transaction) {
 		/* They're changing the global database. */
-		if (key)
-			set_tdb_key(node->name, key);
+		if (db_name)
+			*db_name = node->name;
 		return 0;
 	}
 
@@ -275,22 +289,28 @@ int access_node(struct connection *conn, struct node *node,
 
 		introduce = true;
 		i->ta_node = false;
-		/* acc.memory < 0 means "unknown, get size from TDB". */
+		/* acc.memory < 0 means "unknown, get size from data base". */
 		node->acc.memory = -1;
 
 		/*
 		 * Additional transaction-specific node for read type. We only
 		 * have to verify read nodes if we didn't write them.
 		 *
-		 * The node is created and written to DB here to distinguish
-		 * from the write types.
+		 * The node is linked into the DB here to distinguish from the
+		 * write types. It has just been read from the global data
+		 * base, so its record can be shared, unless reading it has
+		 * adjusted its permissions: then the adjusted copy must be
+		 * written, as it will be committed with a new generation.
 		 */
 		if (type == NODE_ACCESS_READ) {
 			i->generation = node->generation;
 			i->check_gen = true;
 			if (node->generation != NO_GENERATION) {
-				set_tdb_key(i->trans_name, &local_key);
-				ret = write_node_raw(conn, &local_key, node, true);
+				ret = node_perms_match_record(node)
+				      ? db_link(conn, i->trans_name,
+						node->name, NULL)
+				      : write_node_raw(conn, i->trans_name,
+						       node, true);
 				if (ret)
 					goto err;
 				i->ta_node = true;
@@ -307,8 +327,8 @@ int access_node(struct connection *conn, struct node *node,
 		/* Nothing to delete. */
 		return -1;
 
-	if (key) {
-		set_tdb_key(i->trans_name, key);
+	if (db_name) {
+		*db_name = i->trans_name;
 		if (type == NODE_ACCESS_WRITE)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
@@ -360,25 +380,15 @@ static int finalize_transaction(struct connection *conn,
 				struct transaction *trans, bool *is_corrupt)
 {
 	struct accessed_node *i, *n;
-	TDB_DATA key, ta_key, data;
-	struct xs_tdb_record_hdr *hdr;
+	const struct xs_tdb_record_hdr *hdr;
+	struct xs_tdb_record_hdr *new;
+	size_t size;
 	uint64_t gen;
 
 	list_for_each_entry_safe(i, n, &trans->accessed, list) {
 		if (i->check_gen) {
-			set_tdb_key(i->node, &key);
-			data = tdb_fetch(tdb_ctx, key);
-			hdr = (void *)data.dptr;
-			if (!data.dptr) {
-				if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-					return EIO;
-				gen = NO_GENERATION;
-			} else {
-				trace_tdb("read %s size %zu\n", key.dptr,
-					  key.dsize + data.dsize);
-				gen = hdr->generation;
-			}
-			talloc_free(data.dptr);
+			hdr = db_fetch(i->node, &size);
+			gen = hdr ? hdr->generation : NO_GENERATION;
 			if (i->generation != gen)
 				return EAGAIN;
 		}
@@ -386,8 +396,7 @@ static int finalize_transaction(struct connection *conn,
 		/* Entries for unmodified nodes can be removed early. */
 		if (!i->modified) {
 			if (i->ta_node) {
-				set_tdb_key(i->trans_name, &ta_key);
-				if (do_tdb_delete(conn, &ta_key, NULL))
+				if (db_delete(conn, i->trans_name, NULL))
 					return EIO;
 			}
 			list_del(&i->list);
@@ -396,19 +405,15 @@ static int finalize_transaction(struct connection *conn,
 	}
 
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		set_tdb_key(i->node, &key);
 		if (i->ta_node) {
-			set_tdb_key(i->trans_name, &ta_key);
-			data = tdb_fetch(tdb_ctx, ta_key);
-			if (data.dptr) {
-				trace_tdb("read %s size %zu\n", ta_key.dptr,
-					  ta_key.dsize + data.dsize);
-				hdr = (void *)data.dptr;
-				hdr->generation = ++generation;
-				*is_corrupt |= do_tdb_write(conn, &key, &data,
-							    NULL, true);
-				talloc_free(data.dptr);
-				if (do_tdb_delete(conn, &ta_key, NULL))
+			hdr = db_fetch(i->trans_name, &size);
+			/* Records are shared, so update a private copy. */
+			new = hdr ? talloc_memdup(NULL, hdr, size) : NULL;
+			if (new) {
+				new->generation = ++generation;
+				*is_corrupt |= db_write(conn, i->node, new,
+							NULL, true);
+				if (db_delete(conn, i->trans_name, NULL))
 					*is_corrupt = true;
 			} else {
 				*is_corrupt = true;
@@ -421,7 +426,7 @@ static int finalize_transaction(struct connection *conn,
 			 */
 			*is_corrupt |= (i->generation == NO_GENERATION)
 				       ? false
-				       : do_tdb_delete(conn, &key, NULL);
+				       : db_delete(conn, i->node, NULL);
 		}
 		if (i->fire_watch)
 			fire_watches(conn, trans, i->node, NULL, i->watch_exact,
@@ -438,15 +443,12 @@ static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 	struct accessed_node *i;
-	TDB_DATA key;
 
 	wrl_ntransactions--;
 	trace_destroy(trans, "transaction");
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		if (i->ta_node) {
-			set_tdb_key(i->trans_name, &key);
-			do_tdb_delete(trans->conn, &key, NULL);
-		}
+		if (i->ta_node)
+			db_delete(trans->conn, i->trans_name, NULL);
 		list_del(&i->list);
 		talloc_free(i);
 	}
@@ -468,23 +470,32 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
-int do_transaction_start(const void *ctx, struct connection *conn,
-			 struct buffered_data *in)
+/*
+ * Start a new transaction of conn. It is not made the current transaction
+ * of conn (conn->transaction).
+ * Returns NULL and sets errno on failure.
+ */
+struct transaction *transaction_start(const void *ctx, struct connection *conn)
 {
 	struct transaction *trans, *exists;
-	char id_str[20];
 
 	/* We don't support nested transactions. */
-	if (conn->transaction)
-		return EBUSY;
+	if (conn->transaction) {
+		errno = EBUSY;
+		return NULL;
+	}
 
-	if (domain_transaction_get(conn) > hard_quotas[ACC_TRANS].val)
-		return ENOSPC;
+	if (domain_transaction_get(conn) > hard_quotas[ACC_TRANS].val) {
+		errno = ENOSPC;
+		return NULL;
+	}
 
 	/* Attach transaction to ctx for autofree until it's complete */
 	trans = talloc_zero(ctx, struct transaction);
-	if (!trans)
-		return ENOMEM;
+	if (!trans) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	trace_create(trans, "transaction");
 	INIT_LIST_HEAD(&trans->accessed);
@@ -509,27 +520,36 @@ int do_transaction_start(const void *ctx, struct connection *conn,
 	domain_transaction_inc(conn);
 	wrl_ntransactions++;
 
+	return trans;
+}
+
+int do_transaction_start(const void *ctx, struct connection *conn,
+			 struct buffered_data *in)
+{
+	struct transaction *trans;
+	char id_str[20];
+
+	trans = transaction_start(ctx, conn);
+	if (!trans)
+		return errno;
+
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
 
 	return 0;
 }
 
-int do_transaction_end(const void *ctx, struct connection *conn,
-		       struct buffered_data *in)
+/*
+ * End the current transaction of conn, committing it if requested.
+ * Returns 0 or an error code.
+ */
+int transaction_end(const void *ctx, struct connection *conn, bool commit)
 {
-	const char *arg = onearg(in);
-	struct transaction *trans;
+	struct transaction *trans = conn->transaction;
 	bool is_corrupt = false;
 	bool chk_quota;
 	int ret;
 
-	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
-		return EINVAL;
-
-	if ((trans = conn->transaction) == NULL)
-		return ENOENT;
-
 	conn->transaction = NULL;
 	list_del(&trans->list);
 	domain_transaction_dec(conn);
@@ -541,7 +561,7 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 	/* Attach transaction to ctx for auto-cleanup */
 	talloc_steal(ctx, trans);
 
-	if (streq(arg, "T")) {
+	if (commit) {
 		if (trans->fail)
 			return ENOMEM;
 		ret = acc_fix_domains(&trans->changed_domains, chk_quota,
@@ -560,6 +580,26 @@ int do_transaction_end(const void *ctx, struct connection *conn,
 		if (is_corrupt)
 			corrupt(conn, "transaction inconsistency");
 	}
+
+	return 0;
+}
+
+int do_transaction_end(const void *ctx, struct connection *conn,
+		       struct buffered_data *in)
+{
+	const char *arg = onearg(in);
+	int ret;
+
+	if (!arg || (!streq(arg, "T") && !streq(arg, "F")))
+		return EINVAL;
+
+	if (conn->transaction == NULL)
+		return ENOENT;
+
+	ret = transaction_end(ctx, conn, streq(arg, "T"));
+	if (ret)
+		return ret;
+
 	send_ack(conn, XS_TRANSACTION_END);
 
 	return 0;
@@ -30,12 +30,17 @@
 #include "utils.h"
 #include "xenstored_domain.h"
 #include "xenstored_transaction.h"
+#include "hashtable.h"
 
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path (see watch_index). */
+	struct list_head index_list;
+	struct connection *conn;
+
 	/* Offset into path for skipping prefix (used for relative paths). */
 	unsigned int prefix_len;
 
@@ -43,23 +48,19 @@ struct watch
 	char *node;
 };
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+/*
+ * All watches of all connections, indexed by the watched path. A node being
+ * modified needs to look only at the watches of the node itself and of its
+ * parents, instead of checking each watch of each connection.
+ */
+struct watch_list
 {
-	unsigned int len = strlen(parent);
-
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
-
-	if (strncmp(child, parent, len) != 0)
-		return false;
+	struct list_head watches;
+};
+static struct hashtable *watch_index;
 
-	return child[len] == '/' || child[len] == '\0';
-}
+/* Incremented for each call of fire_watches(). */
+static uint64_t watch_fire_seq;
 
 static const char *get_watch_path(const struct watch *watch, const char *name)
 {
@@ -111,6 +112,35 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 	return perm & XS_PERM_READ;
 }
 
+/* Send events for all watches on path, which is name or one of its parents. */
+static void fire_watch_list(const void *ctx, struct buffered_data *req,
+			    const char *path, const char *name,
+			    struct node *node, struct node_perms *perms)
+{
+	struct watch_list *wl;
+	struct watch *watch;
+	struct connection *i;
+
+	wl = hashtable_search(watch_index, path);
+	if (!wl)
+		return;
+
+	list_for_each_entry(watch, &wl->watches, index_list) {
+		i = watch->conn;
+
+		/* Permissions are checked only once per connection. */
+		if (i->watch_fire_seq != watch_fire_seq) {
+			i->watch_fire_seq = watch_fire_seq;
+			i->watch_fire_permitted =
+				watch_permitted(i, ctx, name, node, perms);
+		}
+
+		if (i->watch_fire_permitted)
+			send_event(req, i, get_watch_path(watch, name),
+				   watch->token);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -121,9 +151,8 @@ static bool watch_permitted(struct connection *conn, const void *ctx,
 void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		  struct node *node, bool exact, struct node_perms *perms)
 {
-	struct connection *i;
 	struct buffered_data *req;
-	struct watch *watch;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches, but queue them. */
 	if (conn && conn->transaction) {
@@ -131,32 +160,76 @@ void fire_watches(struct connection *conn, const void *ctx, const char *name,
 		return;
 	}
 
+	if (!watch_index)
+		return;
+
 	req = domain_is_unprivileged(conn) ? conn->in : NULL;
+	watch_fire_seq++;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		if (!watch_permitted(i, ctx, name, node, perms))
-			continue;
-
-		list_for_each_entry(watch, &i->watches, list) {
-			if (exact) {
-				if (streq(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			} else {
-				if (is_child(name, watch->node))
-					send_event(req, i,
-						   get_watch_path(watch, name),
-						   watch->token);
-			}
-		}
+	/* Create an event for each watch on the node itself. */
+	fire_watch_list(ctx, req, name, name, node, perms);
+	if (exact)
+		return;
+
+	/*
+	 * And for each watch on one of its parents. A watch on / is a watch
+	 * on everything, including the special @ nodes.
+	 */
+	path = talloc_strdup(ctx, name);
+	if (!path)
+		return;
+	while ((slash = strrchr(path, '/')) && slash != path) {
+		*slash = 0;
+		fire_watch_list(ctx, req, path, name, node, perms);
 	}
+	if (!streq(name, "/"))
+		fire_watch_list(ctx, req, "/", name, node, perms);
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+	struct watch_list *wl;
+
+	trace_destroy(watch, "watch");
+
+	/* Drop the list of watches on this path with its last watch. */
+	list_del(&watch->index_list);
+	wl = hashtable_search(watch_index, watch->node);
+	if (wl && list_empty(&wl->watches))
+		hashtable_remove(watch_index, watch->node);
+
+	return 0;
+}
+
+static int index_watch(struct watch *watch)
+{
+	struct watch_list *wl;
+	char *path;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(NULL, "watches",
+					       hash_from_key_fn, keys_equal_fn,
+					       HASHTABLE_FREE_KEY |
+					       HASHTABLE_FREE_VALUE);
+		if (!watch_index)
+			return ENOMEM;
+	}
+
+	wl = hashtable_search(watch_index, watch->node);
+	if (!wl) {
+		wl = talloc(NULL, struct watch_list);
+		path = talloc_strdup(wl, watch->node);
+		if (!wl || !path || hashtable_add(watch_index, path, wl)) {
+			talloc_free(wl);
+			return ENOMEM;
+		}
+		INIT_LIST_HEAD(&wl->watches);
+	}
+
+	list_add_tail(&watch->index_list, &wl->watches);
+
 	return 0;
 }
 
@@ -192,10 +265,14 @@ static struct watch *add_watch(struct connection *conn, char *path, char *token,
 	watch = talloc(conn, struct watch);
 	if (!watch)
 		goto nomem;
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, path);
 	watch->token = talloc_strdup(watch, token);
 	if (!watch->node || !watch->token)
 		goto nomem;
+	if (index_watch(watch))
+		goto nomem;
+	talloc_set_destructor(watch, destroy_watch);
 	if (domain_memory_add(conn, conn->id, strlen(path) + strlen(token),
 			      no_quota_check))
 		goto nomem;
@@ -204,7 +281,6 @@ static struct watch *add_watch(struct connection *conn, char *path, char *token,
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
-	talloc_set_destructor(watch, destroy_watch);
 
 	return watch;
 
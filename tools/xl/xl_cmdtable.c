@@ -174,7 +174,12 @@ const struct cmd_spec cmd_table[] = {
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
       "-p              Do not unpause domain after migrating it.\n"
-      "-D              Preserve the domain id"
+      "-D              Preserve the domain id\n"
+      "--postcopy      Start the domain on <host> before all of its memory has\n"
+      "                been copied, and transfer the rest on demand (HVM only).\n"
+      "--pipeline      Encode and send memory from several threads, skipping\n"
+      "                zero pages.\n"
+      "--compress      Compress memory sent to <host> (implies --pipeline)."
     },
     { "restore",
       &main_restore, 0, 1,
@@ -478,6 +483,11 @@ const struct cmd_spec cmd_table[] = {
       "Renames a CPU pool",
       "<CPU Pool> <new name>",
     },
+    { "cpupool-set-gran",
+      &main_cpupoolsetgran, 0, 1,
+      "Sets the scheduling granularity of a CPU pool",
+      "<CPU Pool> <cpu|core|socket>",
+    },
     { "cpupool-cpu-add",
       &main_cpupoolcpuadd, 0, 1,
       "Adds a CPU to a CPU pool",
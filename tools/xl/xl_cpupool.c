@@ -355,6 +355,38 @@ int main_cpupoolrename(int argc, char **argv)
     return EXIT_SUCCESS;
 }
 
+int main_cpupoolsetgran(int argc, char **argv)
+{
+    int opt;
+    const char *pool;
+    libxl_cpupool_gran gran;
+    uint32_t poolid;
+
+    SWITCH_FOREACH_OPT(opt, "", NULL, "cpupool-set-gran", 2) {
+        /* No options */
+    }
+
+    pool = argv[optind++];
+
+    if (libxl_cpupool_qualifier_to_cpupoolid(ctx, pool, &poolid, NULL) ||
+        !libxl_cpupoolid_is_valid(ctx, poolid)) {
+        fprintf(stderr, "unknown cpupool '%s'\n", pool);
+        return EXIT_FAILURE;
+    }
+
+    if (libxl_cpupool_gran_from_string(argv[optind], &gran)) {
+        fprintf(stderr, "unknown granularity '%s'\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (libxl_cpupool_set_granularity(ctx, poolid, gran)) {
+        fprintf(stderr, "Can't set granularity of cpupool '%s'\n", pool);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
 int main_cpupoolcpuadd(int argc, char **argv)
 {
     int opt;
@@ -177,7 +177,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, int preserve_domid,
-                           const char *rune, int debug,
+                           const char *rune, int flags, int postcopy,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -186,7 +186,7 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
     char *away_domname;
     char rc_buf;
     uint8_t *config_data;
-    int config_len, flags = LIBXL_SUSPEND_LIVE;
+    int config_len;
 
     save_domain_core_begin(domid, preserve_domid, override_config_file,
                            &config_data, &config_len);
@@ -204,14 +204,19 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
 
     xtl_stdiostream_adjust_flags(logger, XTL_STDIOSTREAM_HIDE_PROGRESS, 0);
 
-    if (debug)
-        flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    flags |= LIBXL_SUSPEND_LIVE;
+    if (postcopy)
+        rc = libxl_domain_suspend_postcopy(ctx, domid, send_fd, recv_fd,
+                                           flags, NULL);
+    else
+        rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
         if (rc == ERROR_GUEST_TIMEDOUT)
             goto failed_suspend;
+        else if (rc == ERROR_POSTCOPY_FAILED)
+            goto failed_badly;
         else
             goto failed_resume;
     }
@@ -266,6 +271,13 @@ static void migrate_domain(uint32_t domid, int preserve_domid,
         fprintf(stderr, "migration sender: Target reports startup failure"
                 " (status code %d).\n", rc_buf);
 
+        if (postcopy) {
+            /* The guest has run at the target; our copy is stale. */
+            fprintf(stderr, "Migration failed due to problems at target"
+                    " after post-copy; not resuming at sender.\n");
+            exit(EXIT_FAILURE);
+        }
+
         rc = migrate_read_fixedmessage(recv_fd, migrate_permission_to_go,
                                        sizeof(migrate_permission_to_go),
                                        "permission for sender to resume",
@@ -538,10 +550,13 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
-    int preserve_domid = 0;
+    int preserve_domid = 0, postcopy = 0, flags = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"postcopy", 0, 0, 0x300},
+        {"pipeline", 0, 0, 0x400},
+        {"compress", 0, 0, 0x500},
         COMMON_LONG_OPTS
     };
 
@@ -571,6 +586,15 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --postcopy */
+        postcopy = 1;
+        break;
+    case 0x400: /* --pipeline */
+        flags |= LIBXL_SUSPEND_PIPELINE;
+        break;
+    case 0x500: /* --compress */
+        flags |= LIBXL_SUSPEND_COMPRESS;
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -602,7 +626,11 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, preserve_domid, rune, debug, config_filename);
+    if (debug)
+        flags |= LIBXL_SUSPEND_DEBUG;
+
+    migrate_domain(domid, preserve_domid, rune, flags, postcopy,
+                   config_filename);
     return EXIT_SUCCESS;
 }
 
@@ -655,6 +655,8 @@ void update_last_cx_stat(struct acpi_processor_power *power,
     power->last_state = cx;
     power->last_state_update_tick = ticks;
     spin_unlock(&power->stat_lock);
+
+    write_atomic(&per_cpu(cpu_idle_latency, power->cpu), cx->latency);
 }
 
 void update_idle_stats(struct acpi_processor_power *power,
@@ -664,6 +666,8 @@ void update_idle_stats(struct acpi_processor_power *power,
     int64_t sleep_ticks = alternative_call(ticks_elapsed, before, after);
     /* Interrupts are disabled */
 
+    write_atomic(&per_cpu(cpu_idle_latency, power->cpu), 0);
+
     spin_lock(&power->stat_lock);
 
     cx->usage++;
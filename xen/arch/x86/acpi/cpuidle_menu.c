@@ -26,6 +26,7 @@
 #include <xen/lib.h>
 #include <xen/types.h>
 #include <xen/acpi.h>
+#include <xen/sched.h>
 #include <xen/timer.h>
 #include <xen/cpuidle.h>
 #include <asm/irq.h>
@@ -70,6 +71,11 @@
  * For this reason we keep an array of 6 independent factors, that gets
  * indexed based on the magnitude of the expected duration
  *
+ * The corrected estimate is then capped by what the scheduler expects (see
+ * sched_expected_idle_time()): wakeups of vcpus don't show up in the timers
+ * of an idle cpu, but the scheduler knows how often they happen on the
+ * cpu's runqueue.
+ *
  * Limiting Performance Impact
  * ---------------------------
  * C states, especially those with large exit latencies, can have a real
@@ -189,7 +195,7 @@ static int cf_check menu_select(struct acpi_processor_power *power)
 {
     struct menu_device *data = &this_cpu(menu_devices);
     int i;
-    s_time_t    io_interval;
+    s_time_t    io_interval, sched_us;
 
     /*  TBD: Change to 0 if C0(polling mode) support is added later*/
     data->last_state_idx = CPUIDLE_DRIVER_STATE_START;
@@ -218,6 +224,15 @@ static int cf_check menu_select(struct acpi_processor_power *power)
             data->expected_us * data->correction_factor[data->bucket],
             RESOLUTION * DECAY);
 
+    /*
+     * The scheduler may expect this cpu to be needed again well before the
+     * next timer, e.g. because units are waking up frequently on its
+     * runqueue.
+     */
+    sched_us = sched_expected_idle_time() / 1000;
+    if (sched_us < data->predicted_us)
+        data->predicted_us = sched_us;
+
     /* find the deepest idle state that satisfies our constraints */
     for ( i = CPUIDLE_DRIVER_STATE_START + 1; i < power->count; i++ )
     {
@@ -482,6 +482,51 @@ static void generic_identify(struct cpuinfo_x86 *c)
 		      c->x86_capability[FEATURESET_m10Ah]);
 }
 
+/*
+ * Identify the last level cache of the CPU, using the deterministic cache
+ * parameters leaf (4 on Intel, 0x8000001d on AMD and Hygon): the logical
+ * processors sharing a cache are the ones whose APIC IDs only differ in the
+ * bits needed to number them.  Without that information, the whole socket
+ * is assumed to share one cache.
+ */
+static void detect_llc(struct cpuinfo_x86 *c)
+{
+	unsigned int eax, ebx, ecx, edx, leaf, i, level = 0, sharing = 0;
+
+	c->llc_id = c->phys_proc_id;
+
+	if (c->x86_vendor & (X86_VENDOR_AMD | X86_VENDOR_HYGON)) {
+		if (!cpu_has(c, X86_FEATURE_TOPOEXT))
+			return;
+		leaf = 0x8000001d;
+	} else if (c->x86_vendor == X86_VENDOR_INTEL && c->cpuid_level >= 4)
+		leaf = 4;
+	else
+		return;
+
+	for (i = 0; i < 16; i++) {
+		cpuid_count(leaf, i, &eax, &ebx, &ecx, &edx);
+
+		/* Cache type 0: no more caches. */
+		if (!(eax & 0x1f))
+			break;
+
+		if (((eax >> 5) & 7) >= level) {
+			level = (eax >> 5) & 7;
+			sharing = ((eax >> 14) & 0xfff) + 1;
+		}
+	}
+
+	if (!sharing)
+		return;
+
+	c->llc_id = phys_pkg_id(c->apicid, get_count_order(sharing));
+
+	if (opt_cpu_info)
+		printk("CPU: L%u cache ID: %u (shared by up to %u threads)\n",
+		       level, c->llc_id, sharing);
+}
+
 /*
  * This does the hard work of actually picking apart the CPU stuff...
  */
@@ -521,6 +566,7 @@ void identify_cpu(struct cpuinfo_x86 *c)
 	if (this_cpu->c_init)
 		this_cpu->c_init(c);
 
+	detect_llc(c);
 
    	if (c == &boot_cpu_data && !opt_pku)
 		setup_clear_cpu_cap(X86_FEATURE_PKU);
@@ -5,6 +5,7 @@
  * Copyright (c) 2006, Xiaowei Yang, Intel Corporation.
  */
 
+#include <xen/param.h>
 #include <xen/sched.h>
 #include <xen/time.h>
 #include <asm/hvm/vpt.h>
@@ -16,6 +17,14 @@
 #define mode_is(d, name) \
     ((d)->arch.hvm.params[HVM_PARAM_TIMER_MODE] == HVMPTM_##name)
 
+/* Maximum delay (in us) of periodic timers, to coalesce their expiries. */
+static unsigned int __ro_after_init opt_vpt_slack;
+integer_param("vpt-slack", opt_vpt_slack);
+
+/* Don't keep the tick alarm running for preempted vCPUs. */
+static bool __ro_after_init opt_vpt_freeze_preempted;
+boolean_param("vpt-freeze-preempted", opt_vpt_freeze_preempted);
+
 void hvm_init_guest_time(struct domain *d)
 {
     struct pl_time *pl = d->arch.hvm.pl_time;
@@ -194,12 +203,34 @@ static void pt_process_missed_ticks(struct periodic_time *pt)
 
     missed_ticks = missed_ticks / (s_time_t) pt->period + 1;
     if ( mode_is(pt->vcpu->domain, no_missed_ticks_pending) )
-        pt->do_not_freeze = !pt->pending_intr_nr;
+        pt->do_not_freeze = !opt_vpt_freeze_preempted && !pt->pending_intr_nr;
     else
         pt->pending_intr_nr += missed_ticks;
     pt->scheduled += missed_ticks * pt->period;
 }
 
+/*
+ * Arm the timer for the next tick of @pt.  With vpt-slack, periodic timers
+ * are delayed to the next multiple of a power of two not exceeding the slack
+ * nor a quarter of the period, so that the ticks of all vCPUs and sources
+ * fall onto common points in time and need fewer host timer interrupts.
+ * pt->scheduled isn't changed, so the delays don't accumulate.
+ */
+static void pt_set_timer(struct periodic_time *pt)
+{
+    s_time_t expires = pt->scheduled;
+    uint64_t slack;
+
+    if ( opt_vpt_slack && !pt->one_shot )
+    {
+        slack = min_t(uint64_t, MICROSECS(opt_vpt_slack), pt->period / 4);
+        slack = 1UL << (flsl(slack) - 1);
+        expires = (expires + slack - 1) & ~(slack - 1);
+    }
+
+    set_timer(&pt->timer, expires);
+}
+
 static void pt_freeze_time(struct vcpu *v)
 {
     if ( !mode_is(v->domain, delay_for_missed_ticks) )
@@ -251,7 +282,7 @@ void pt_restore_timer(struct vcpu *v)
         if ( pt->pending_intr_nr == 0 )
         {
             pt_process_missed_ticks(pt);
-            set_timer(&pt->timer, pt->scheduled);
+            pt_set_timer(pt);
         }
     }
 
@@ -292,7 +323,7 @@ static void pt_irq_fired(struct vcpu *v, struct periodic_time *pt)
         pt->last_plt_gtime = hvm_get_guest_time(v);
         pt_process_missed_ticks(pt);
         pt->pending_intr_nr = 0; /* 'collapse' all missed ticks */
-        set_timer(&pt->timer, pt->scheduled);
+        pt_set_timer(pt);
     }
     else
     {
@@ -301,7 +332,7 @@ static void pt_irq_fired(struct vcpu *v, struct periodic_time *pt)
         {
             pt_process_missed_ticks(pt);
             if ( pt->pending_intr_nr == 0 )
-                set_timer(&pt->timer, pt->scheduled);
+                pt_set_timer(pt);
         }
     }
 
@@ -544,7 +575,7 @@ void create_periodic_time(
     pt->priv = data;
 
     init_timer(&pt->timer, pt_timer_fn, pt, v->processor);
-    set_timer(&pt->timer, pt->scheduled);
+    pt_set_timer(pt);
 
     pt_vcpu_lock(v);
     pt->on_list = 1;
@@ -9,6 +9,7 @@
 
 
 #include <asm/p2m.h>
+#include <xen/event.h>
 #include <xen/guest_access.h>
 #include <xen/vm_event.h>
 #include <xsm/xsm.h>
@@ -426,6 +427,92 @@ static int prepare(struct domain *d, gfn_t gfn,
     return ret;
 }
 
+/*
+ * populate_evicted - Mark a range of guest pages as paged-out without a pager
+ * round trip
+ * @d: guest domain
+ * @gfn: first guest page of the range
+ *
+ * populate_evicted() puts a gfn into the paged-out state regardless of whether
+ * it is currently backed by memory.  It is used by a restoring toolstack for
+ * post-copy migration: gfns whose contents have not arrived yet are entered
+ * as paged-out before the guest is unpaused, so the first guest access raises
+ * a paging request which the toolstack satisfies with the page's contents.
+ *
+ * - a gfn already in the paged-out state is left alone
+ * - a hole (never populated) is entered as paged-out
+ * - a populated gfn is evicted, subject to the same conditions as nominate()
+ *   followed by evict()
+ */
+static int populate_evicted(struct domain *d, gfn_t gfn)
+{
+    struct page_info *page = NULL;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    mfn_t mfn;
+    int ret = -EBUSY;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &p2mt, &a, 0, NULL, NULL);
+
+    if ( p2mt == p2m_ram_paged )
+    {
+        ret = 0;
+        goto out;
+    }
+
+    if ( (p2mt == p2m_invalid || p2mt == p2m_mmio_dm) && !mfn_valid(mfn) )
+    {
+        ret = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
+                            p2m_ram_paged, p2m->default_access);
+        if ( !ret )
+            atomic_inc(&d->paged_pages);
+        goto out;
+    }
+
+    if ( !mfn_valid(mfn) || !p2m_is_pageable(p2mt) || is_iomem_page(mfn) )
+        goto out;
+
+    page = mfn_to_page(mfn);
+    if ( unlikely(!get_page(page, d)) )
+    {
+        page = NULL;
+        goto out;
+    }
+
+    if ( (page->count_info & (PGC_count_mask | PGC_allocated)) !=
+         (2 | PGC_allocated) )
+        goto out;
+
+    if ( (page->u.inuse.type_info & PGT_count_mask) != 0 )
+        goto out;
+
+    /*
+     * Remove the mapping before dropping the allocation reference, so the
+     * page stays the guest's if that fails.
+     */
+    ret = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
+                        p2m_ram_paged, a);
+    if ( ret )
+        goto out;
+
+    put_page_alloc_ref(page);
+
+    scrub_one_page(page);
+
+    atomic_inc(&d->paged_pages);
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+
+    if ( page )
+        put_page(page);
+
+    return ret;
+}
+
 int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
 {
     int rc;
@@ -464,6 +551,34 @@ int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
             copyback = 1;
         break;
 
+    case XENMEM_paging_op_populate_evicted:
+        rc = -EINVAL;
+        if ( !mpo.nr || mpo.gfn + mpo.nr < mpo.gfn )
+            break;
+
+        for ( ; ; )
+        {
+            rc = populate_evicted(d, _gfn(mpo.gfn));
+            if ( rc )
+                break;
+
+            ++mpo.gfn;
+            if ( !--mpo.nr )
+                break;
+
+            if ( hypercall_preempt_check() )
+            {
+                if ( __copy_to_guest(arg, &mpo, 1) )
+                    rc = -EFAULT;
+                else
+                    rc = hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                       "lh", XENMEM_paging_op,
+                                                       arg);
+                break;
+            }
+        }
+        break;
+
     default:
         rc = -ENOSYS;
         break;
@@ -56,6 +56,10 @@ CHECK_gnttab_swap_grant_ref;
 CHECK_gnttab_cache_flush;
 #undef xen_gnttab_cache_flush
 
+#define xen_gnttab_revalidate gnttab_revalidate
+CHECK_gnttab_revalidate;
+#undef xen_gnttab_revalidate
+
 int compat_grant_table_op(
     unsigned int cmd, XEN_GUEST_HANDLE_PARAM(void) cmp_uop, unsigned int count)
 {
@@ -117,6 +121,10 @@ int compat_grant_table_op(
     CASE(cache_flush);
 #endif
 
+#ifndef CHECK_gnttab_revalidate
+    CASE(revalidate);
+#endif
+
 #undef CASE
     default:
         return do_grant_table_op(cmd, cmp_uop, count);
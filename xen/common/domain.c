@@ -992,7 +992,10 @@ int domain_kill(struct domain *d)
         if ( cpupool_move_domain(d, cpupool0) )
             return -ERESTART;
         for_each_vcpu ( d, v )
+        {
             unmap_vcpu_info(v);
+            unmap_runstate_area(v);
+        }
         d->is_dying = DOMDYING_dead;
         /* Mem event cleanup has to go here because the rings 
          * have to be put before we call put_domain. */
@@ -1214,8 +1217,13 @@ void domain_destroy(struct domain *d)
     rcu_assign_pointer(*pd, d->next_in_hashbucket);
     spin_unlock(&domlist_update_lock);
 
-    /* Schedule RCU asynchronous completion of domain destroy. */
+    /*
+     * Schedule RCU asynchronous completion of domain destroy.  The toolstack
+     * is waiting for the domain to go away, so don't let the grace period
+     * take its time.
+     */
     call_rcu(&d->rcu, complete_domain_destroy);
+    rcu_expedite();
 }
 
 void vcpu_pause(struct vcpu *v)
@@ -1446,6 +1454,7 @@ int domain_soft_reset(struct domain *d, bool resuming)
     {
         set_xen_guest_handle(runstate_guest(v), NULL);
         unmap_vcpu_info(v);
+        unmap_runstate_area(v);
     }
 
     rc = arch_domain_soft_reset(d);
@@ -1597,6 +1606,117 @@ void unmap_vcpu_info(struct vcpu *v)
     put_page_and_type(mfn_to_page(mfn));
 }
 
+/*
+ * Map a guest page holding a runstate area, which is then updated via
+ * update_runstate_area() alongside a virtually addressed one.  The vcpu
+ * must not be running on another cpu.
+ */
+int map_runstate_area(struct vcpu *v, paddr_t gaddr)
+{
+    struct domain *d = v->domain;
+    unsigned int offset = PAGE_OFFSET(gaddr);
+    unsigned int size = sizeof(struct vcpu_runstate_info);
+    unsigned int align = alignof(struct vcpu_runstate_info);
+    struct page_info *page;
+    void *mapping;
+
+#ifdef CONFIG_COMPAT
+    if ( has_32bit_shinfo(d) )
+    {
+        size = sizeof(struct compat_vcpu_runstate_info);
+        align = alignof(struct compat_vcpu_runstate_info);
+    }
+#endif
+
+    if ( offset > PAGE_SIZE - size || (offset & (align - 1)) )
+        return -ENXIO;
+
+    page = get_page_from_gfn(d, paddr_to_pfn(gaddr), NULL, P2M_UNSHARE);
+    if ( !page )
+        return -EINVAL;
+
+    if ( !get_page_type(page, PGT_writable_page) )
+    {
+        put_page(page);
+        return -EINVAL;
+    }
+
+    mapping = __map_domain_page_global(page);
+    if ( mapping == NULL )
+    {
+        put_page_and_type(page);
+        return -ENOMEM;
+    }
+
+    unmap_runstate_area(v);
+
+    v->runstate_pg = page;
+    v->runstate_map = mapping + offset;
+
+    return 0;
+}
+
+/*
+ * Unmap the runstate area page.  This is used when the area is moved or
+ * unregistered, and from domain_kill() and domain_soft_reset().
+ */
+void unmap_runstate_area(struct vcpu *v)
+{
+    struct page_info *page = v->runstate_pg;
+
+    if ( !page )
+        return;
+
+    unmap_domain_page_global((void *)
+                             ((unsigned long)v->runstate_map & PAGE_MASK));
+
+    v->runstate_map = NULL;
+    v->runstate_pg = NULL;
+
+    put_page_and_type(page);
+}
+
+/* Write the runstate into the area registered by physical address. */
+static void update_runstate_map(struct vcpu *v,
+                                const struct vcpu_runstate_info *runstate)
+{
+    bool flag = VM_ASSIST(v->domain, runstate_update_flag);
+
+#ifdef CONFIG_COMPAT
+    if ( has_32bit_shinfo(v->domain) )
+    {
+        struct compat_vcpu_runstate_info *map = v->runstate_map, info;
+
+        XLAT_vcpu_runstate_info(&info, runstate);
+        if ( flag )
+        {
+            map->state_entry_time = info.state_entry_time |
+                                    XEN_RUNSTATE_UPDATE;
+            smp_wmb();
+        }
+        map->state = info.state;
+        memcpy(map->time, info.time, sizeof(map->time));
+        smp_wmb();
+        map->state_entry_time = info.state_entry_time;
+    }
+    else
+#endif
+    {
+        struct vcpu_runstate_info *map = v->runstate_map;
+
+        if ( flag )
+        {
+            map->state_entry_time = runstate->state_entry_time |
+                                    XEN_RUNSTATE_UPDATE;
+            smp_wmb();
+        }
+        map->state = runstate->state;
+        memcpy(map->time, runstate->time, sizeof(map->time));
+        smp_wmb();
+        map->state_entry_time = runstate->state_entry_time;
+    }
+}
+
 int default_initialise_vcpu(struct vcpu *v, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     struct vcpu_guest_context *ctxt;
@@ -1629,6 +1749,9 @@ bool update_runstate_area(struct vcpu *v)
     void __user *guest_handle = NULL;
     struct vcpu_runstate_info runstate;
 
+    if ( v->runstate_map )
+        update_runstate_map(v, &v->runstate);
+
     if ( guest_handle_is_null(runstate_guest(v)) )
         return true;
 
@@ -1861,6 +1984,37 @@ long common_vcpu_op(int cmd, struct vcpu *v, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case VCPUOP_register_runstate_phys_area:
+    {
+        struct vcpu_register_runstate_memory_area area;
+        struct vcpu_runstate_info runstate;
+
+        rc = -EFAULT;
+        if ( copy_from_guest(&area, arg, 1) )
+            break;
+
+        domain_lock(d);
+        /* Run this command on yourself or on other offline VCPUS. */
+        if ( (v != current) && !(v->pause_flags & VPF_down) )
+            rc = -EINVAL;
+        else if ( area.addr.p == ~0ULL )
+        {
+            unmap_runstate_area(v);
+            rc = 0;
+        }
+        else
+            rc = map_runstate_area(v, area.addr.p);
+        domain_unlock(d);
+
+        if ( !rc && v->runstate_map )
+        {
+            vcpu_runstate_get(v, &runstate);
+            update_runstate_map(v, &runstate);
+        }
+
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -163,7 +163,7 @@ static void cf_check evtchn_fifo_set_pending(
 {
     struct domain *d = v->domain;
     unsigned int port;
-    event_word_t *word;
+    event_word_t *word, w;
     unsigned long flags;
     bool check_pollers = false;
     struct evtchn_fifo_queue *q, *old_q;
@@ -183,6 +183,25 @@ static void cf_check evtchn_fifo_set_pending(
         return;
     }
 
+    /*
+     * An event which is already pending and either linked or masked needs
+     * nothing doing: it is visibly pending to the guest, which will either
+     * find it on a queue or re-raise it when unmasking.  This is what most
+     * sends find during event storms, so avoid taking the queue locks, which
+     * would serialize such senders against one another and against senders
+     * of other events of the same queue.
+     *
+     * The guest may unlink the event concurrently, but it checks PENDING
+     * only after having done so (or clears PENDING itself), so the send is
+     * merely coalesced with the delivery in progress, just like it would be
+     * with the locks held.  Any other sender having set LINKED is still
+     * going to notify the guest if needed.
+     */
+    w = read_atomic(word);
+    if ( (w & (1U << EVTCHN_FIFO_PENDING)) &&
+         (w & ((1U << EVTCHN_FIFO_LINKED) | (1U << EVTCHN_FIFO_MASKED))) )
+        return;
+
     /*
      * Lock all queues related to the event channel (in case of a queue change
      * this might be two).
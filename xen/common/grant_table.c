@@ -37,6 +37,7 @@
 #include <xen/domain_page.h>
 #include <xen/iommu.h>
 #include <xen/paging.h>
+#include <xen/perfc.h>
 #include <xen/keyhandler.h>
 #include <xen/radix-tree.h>
 #include <xen/vmap.h>
@@ -96,6 +97,14 @@ struct grant_table {
      * protected by @lock, not @maptrack_lock.
      */
     struct radix_tree_root maptrack_tree;
+    /*
+     * Generation of GTF_persistent grants, advanced on every
+     * GNTTABOP_revoke_persistent.  Persistent mappings of this domain's
+     * grants record the generation they were last validated in.  Taken from
+     * gnttab_persistent_gen, so it is never shared with another grant table,
+     * also not with one of an earlier domain with the same domid.
+     */
+    atomic_t              persistent_gen;
 
     /* Domain to which this struct grant_table belongs. */
     struct domain *domain;
@@ -269,6 +278,16 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/*
+ * IOMMU mappings of granted frames are updated by map and unmap operations
+ * without flushing the IOTLB each time.  Instead, the range of dfns touched
+ * is accumulated here, and flushed once for a batch of operations.
+ */
+struct gnttab_iommu_flush {
+    unsigned long start, end;   /* [start, end) */
+    unsigned int flags;         /* IOMMU_FLUSHF_* */
+};
+
 
 /*
  * Tracks a mapping of another domain's grant reference. Each domain has a
@@ -276,10 +295,11 @@ struct gnttab_unmap_common {
  */
 struct grant_mapping {
     grant_ref_t ref;        /* grant ref */
-    uint16_t flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
+    uint16_t flags;         /* 0-5: GNTMAP_* ; 6-15: unused */
     domid_t  domid;         /* granting domain */
     uint32_t vcpu;          /* vcpu which created the grant mapping */
-    uint32_t pad;           /* round size to a power of 2 */
+    uint32_t gen;           /* GNTMAP_persistent: generation validated in */
+                            /* (size must remain a power of 2) */
 };
 
 /* Number of grant table frames. Caller must hold d's grant table lock. */
@@ -403,6 +423,9 @@ static inline void act_set_gfn(struct active_grant_entry *act, gfn_t gfn)
 
 static DEFINE_PERCPU_RWLOCK_GLOBAL(grant_rwlock);
 
+/* Source of grant_table.persistent_gen, across all grant tables. */
+static atomic_t gnttab_persistent_gen;
+
 static inline void grant_read_lock(struct grant_table *gt)
 {
     percpu_read_lock(grant_rwlock, &gt->lock);
@@ -429,6 +452,56 @@ static inline void gnttab_flush_tlb(const struct domain *d)
         arch_flush_tlb_mask(d->dirty_cpumask);
 }
 
+static void gnttab_iommu_flush_add(struct gnttab_iommu_flush *flush,
+                                   mfn_t mfn, unsigned int flush_flags)
+{
+    /* We're not translated, so dfns and mfns are the same things. */
+    unsigned long dfn = mfn_x(mfn);
+
+    if ( !flush_flags )
+        return;
+
+    if ( !flush->flags )
+    {
+        flush->start = dfn;
+        flush->end = dfn + 1;
+    }
+    else
+    {
+        flush->start = min(flush->start, dfn);
+        flush->end = max(flush->end, dfn + 1);
+    }
+
+    flush->flags |= flush_flags;
+}
+
+static int gnttab_iommu_flush(struct domain *d,
+                              struct gnttab_iommu_flush *flush)
+{
+    int rc;
+
+    if ( !flush->flags )
+        return 0;
+
+    rc = iommu_iotlb_flush(d, _dfn(flush->start), flush->end - flush->start,
+                           flush->flags);
+    flush->flags = 0;
+
+    return rc;
+}
+
+/*
+ * Flush CPU TLBs and IOTLB after a batch of unmap operations, before the
+ * references to the unmapped frames are dropped.
+ */
+static int gnttab_flush_unmap_batch(struct domain *d,
+                                    struct gnttab_iommu_flush *flush)
+{
+    gnttab_flush_tlb(d);
+
+    return gnttab_iommu_flush(d, flush);
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -530,30 +603,36 @@ static int get_paged_frame(unsigned long gfn, mfn_t *mfn,
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
+/*
+ * Maximum number of maptrack frames allocated in one go.  Growth is
+ * proportional to the number of frames already in use, so that a domain
+ * with many active mappings takes the maptrack lock rarely.
+ */
+#define MAPTRACK_MAX_GROW 16U
+
+/*
+ * Each vCPU owns a private free list, consumed by the vCPU itself, and a
+ * lock-free stack of entries freed back to it by any vCPU.  Once the private
+ * list is exhausted, the whole stack is moved over to it in one go.
+ */
 static inline grant_handle_t
 _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 {
-    unsigned int head, next;
+    unsigned int head;
 
     spin_lock(&v->maptrack_freelist_lock);
 
-    /* No maptrack pages allocated for this VCPU yet? */
     head = v->maptrack_head;
+    if ( head == MAPTRACK_TAIL )
+        head = xchg(&v->maptrack_remote, MAPTRACK_TAIL);
+
     if ( unlikely(head == MAPTRACK_TAIL) )
     {
         spin_unlock(&v->maptrack_freelist_lock);
         return INVALID_MAPTRACK_HANDLE;
     }
 
-    /*
-     * Always keep one entry in the free list to make it easier to
-     * add free entries to the tail.
-     */
-    next = maptrack_entry(t, head).ref;
-    if ( unlikely(next == MAPTRACK_TAIL) )
-        head = INVALID_MAPTRACK_HANDLE;
-    else
-        v->maptrack_head = next;
+    v->maptrack_head = maptrack_entry(t, head).ref;
 
     spin_unlock(&v->maptrack_freelist_lock);
 
@@ -561,17 +640,50 @@ _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
+ * Transfer a chain of free entries taken off another VCPU's stack to @curr,
+ * returning the first entry and adding the others to @curr's free list.
+ */
+static grant_handle_t adopt_maptrack_chain(struct grant_table *t,
+                                           struct vcpu *curr,
+                                           grant_handle_t handle)
+{
+    unsigned int tail = handle;
+
+    for ( ; ; )
+    {
+        struct grant_mapping *mt = &maptrack_entry(t, tail);
+
+        mt->vcpu = curr->vcpu_id;
+        if ( mt->ref == MAPTRACK_TAIL )
+            break;
+        tail = mt->ref;
+    }
+
+    if ( tail != handle )
+    {
+        spin_lock(&curr->maptrack_freelist_lock);
+        maptrack_entry(t, tail).ref = curr->maptrack_head;
+        curr->maptrack_head = maptrack_entry(t, handle).ref;
+        spin_unlock(&curr->maptrack_freelist_lock);
+    }
+
+    return handle;
+}
+
+/*
+ * Try to "steal" free maptrack entries from another VCPU.
  *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
+ * Stolen entries are transferred to the thief, so the number of
+ * entries for each VCPU should tend to the usage pattern.  Entries
+ * freed back to the victim are all taken at once, and only if there
+ * are none a single entry is taken from the victim's own free list.
  *
  * To avoid having to atomically count the number of free entries on
  * each VCPU and to avoid two VCPU repeatedly stealing entries from
  * each other, the initial victim VCPU is selected randomly.
  */
 static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+                                            struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
     unsigned int first, i;
@@ -580,11 +692,17 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     first = i = get_random() % currd->max_vcpus;
 
     do {
-        if ( currd->vcpu[i] )
+        struct vcpu *v = currd->vcpu[i];
+
+        if ( v )
         {
             grant_handle_t handle;
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
+            handle = xchg(&v->maptrack_remote, MAPTRACK_TAIL);
+            if ( handle != MAPTRACK_TAIL )
+                return adopt_maptrack_chain(t, curr, handle);
+
+            handle = _get_maptrack_handle(t, v);
             if ( handle != INVALID_MAPTRACK_HANDLE )
             {
                 maptrack_entry(t, handle).vcpu = curr->vcpu_id;
@@ -606,24 +724,15 @@ put_maptrack_handle(
     struct grant_table *t, grant_handle_t handle)
 {
     struct domain *currd = current->domain;
-    struct vcpu *v;
-    unsigned int tail;
+    struct grant_mapping *mt = &maptrack_entry(t, handle);
+    struct vcpu *v = currd->vcpu[mt->vcpu];
+    unsigned int head = ACCESS_ONCE(v->maptrack_remote), prev;
 
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
-
-    spin_lock(&v->maptrack_freelist_lock);
-
-    tail = v->maptrack_tail;
-    v->maptrack_tail = handle;
-
-    /* 3. Update the old tail entry to point to the new entry. */
-    maptrack_entry(t, tail).ref = handle;
-
-    spin_unlock(&v->maptrack_freelist_lock);
+    /* Push the entry onto the stack of the VCPU owning it. */
+    do {
+        mt->ref = prev = head;
+        head = cmpxchg(&v->maptrack_remote, prev, handle);
+    } while ( head != prev );
 }
 
 static inline grant_handle_t
@@ -631,9 +740,9 @@ get_maptrack_handle(
     struct grant_table *lgt)
 {
     struct vcpu          *curr = current;
-    unsigned int          i;
+    unsigned int          i, nr, grow;
     grant_handle_t        handle;
-    struct grant_mapping *new_mt = NULL;
+    struct grant_mapping *new_mt;
 
     handle = _get_maptrack_handle(lgt, curr);
     if ( likely(handle != INVALID_MAPTRACK_HANDLE) )
@@ -643,63 +752,54 @@ get_maptrack_handle(
 
     /*
      * If we've run out of handles and still have frame headroom, try
-     * allocating a new maptrack frame.  If there is no headroom, or we're
-     * out of memory, try stealing an entry from another VCPU (in case the
+     * allocating new maptrack frames.  If there is no headroom, or we're
+     * out of memory, try stealing entries from another VCPU (in case the
      * guest isn't mapping across its VCPUs evenly).
      */
-    if ( nr_maptrack_frames(lgt) < lgt->max_maptrack_frames )
+    nr = nr_maptrack_frames(lgt);
+    grow = min(max(nr / 4, 1U), MAPTRACK_MAX_GROW);
+    grow = min(grow, lgt->max_maptrack_frames - nr);
+
+    for ( i = 0; i < grow; i++ )
+    {
         new_mt = alloc_xenheap_page();
+        if ( !new_mt )
+            break;
+        clear_page(new_mt);
+        lgt->maptrack[nr + i] = new_mt;
+    }
+    grow = i;
 
-    if ( !new_mt )
+    if ( !grow )
     {
         spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                curr->maptrack_head = handle;
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
         return steal_maptrack_handle(lgt, curr);
     }
 
-    clear_page(new_mt);
-
     /*
      * Use the first new entry and add the remaining entries to the
      * head of the free list.
      */
     handle = lgt->maptrack_limit;
 
-    for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
+    for ( i = 0; i < grow * MAPTRACK_PER_PAGE; i++ )
     {
-        BUILD_BUG_ON(sizeof(new_mt->ref) < sizeof(handle));
-        new_mt[i].ref = handle + i + 1;
-        new_mt[i].vcpu = curr->vcpu_id;
-    }
+        struct grant_mapping *mt =
+            &lgt->maptrack[nr + i / MAPTRACK_PER_PAGE][i % MAPTRACK_PER_PAGE];
 
-    /* Set tail directly if this is the first page for the local vCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
+        BUILD_BUG_ON(sizeof(mt->ref) < sizeof(handle));
+        BUILD_BUG_ON(MAPTRACK_PER_PAGE & (MAPTRACK_PER_PAGE - 1));
+        mt->ref = handle + i + 1;
+        mt->vcpu = curr->vcpu_id;
+    }
 
-    lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     smp_wmb();
-    lgt->maptrack_limit += MAPTRACK_PER_PAGE;
+    lgt->maptrack_limit += grow * MAPTRACK_PER_PAGE;
 
     spin_unlock(&lgt->maptrack_lock);
 
     spin_lock(&curr->maptrack_freelist_lock);
-    new_mt[i - 1].ref = curr->maptrack_head;
+    maptrack_entry(lgt, handle + i - 1).ref = curr->maptrack_head;
     curr->maptrack_head = handle + 1;
     spin_unlock(&curr->maptrack_freelist_lock);
 
@@ -993,7 +1093,7 @@ union maptrack_node {
 
 static void
 map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+    struct gnttab_map_grant_ref *op, struct gnttab_iommu_flush *flush)
 {
     struct domain *ld, *rd, *owner = NULL;
     struct grant_table *lgt, *rgt;
@@ -1008,6 +1108,7 @@ map_grant_ref(
     struct grant_mapping *mt;
     grant_entry_header_t *shah;
     uint16_t *status;
+    uint32_t       gen = 0;
 
     ld = current->domain;
 
@@ -1089,6 +1190,23 @@ map_grant_ref(
         goto act_release_out;
     }
 
+    if ( op->flags & GNTMAP_persistent )
+    {
+        /*
+         * Read the generation before checking the flag, so a racing
+         * GNTTABOP_revoke_persistent is noticed by GNTTABOP_revalidate.
+         */
+        gen = atomic_read(&rgt->persistent_gen);
+        smp_rmb();
+        if ( !(ACCESS_ONCE(shah->flags) & GTF_persistent) )
+        {
+            gdprintk(XENLOG_WARNING, "Grant %#x of d%d is not persistent\n",
+                     ref, rgt->domain->domain_id);
+            rc = GNTST_general_error;
+            goto act_release_out;
+        }
+    }
+
     /* Make sure we do not access memory speculatively */
     status = evaluate_nospec(rgt->gt_version == 1) ? &shah->flags
                                                    : &status_entry(rgt, ref);
@@ -1244,7 +1362,7 @@ map_grant_ref(
         };
         int err;
         void **slot = NULL;
-        unsigned int kind;
+        unsigned int kind, flush_flags = 0;
 
         grant_write_lock(lgt);
 
@@ -1283,7 +1401,8 @@ map_grant_ref(
         else
             kind = 0;
         if ( err ||
-             (kind && iommu_legacy_map(ld, _dfn(mfn_x(mfn)), mfn, 1, kind)) )
+             (kind && iommu_map(ld, _dfn(mfn_x(mfn)), mfn, 1, kind,
+                                &flush_flags)) )
         {
             if ( !err )
             {
@@ -1301,6 +1420,8 @@ map_grant_ref(
             rc = GNTST_general_error;
         }
 
+        gnttab_iommu_flush_add(flush, mfn, flush_flags);
+
         grant_write_unlock(lgt);
 
         if ( rc != GNTST_okay )
@@ -1316,6 +1437,7 @@ map_grant_ref(
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
+    mt->gen   = gen;
     smp_wmb();
     write_atomic(&mt->flags, op->flags);
 
@@ -1361,29 +1483,45 @@ static long
 gnttab_map_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_map_grant_ref_t) uop, unsigned int count)
 {
-    int i;
+    int i, rc;
+    long ret = 0;
     struct gnttab_map_grant_ref op;
+    struct gnttab_iommu_flush flush = {};
 
     for ( i = 0; i < count; i++ )
     {
         if ( i && hypercall_preempt_check() )
-            return i;
+        {
+            ret = i;
+            break;
+        }
 
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            ret = -EFAULT;
+            break;
+        }
 
-        map_grant_ref(&op);
+        map_grant_ref(&op, &flush);
 
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            ret = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    /* One IOTLB flush for all mappings added, before returning. */
+    rc = gnttab_iommu_flush(current->domain, &flush);
+    if ( unlikely(rc) && ret >= 0 )
+        ret = rc;
+
+    return ret;
 }
 
 static void
 unmap_common(
-    struct gnttab_unmap_common *op)
+    struct gnttab_unmap_common *op, struct gnttab_iommu_flush *flush)
 {
     domid_t          dom;
     struct domain   *ld, *rd;
@@ -1539,6 +1677,7 @@ unmap_common(
     {
         void **slot;
         union maptrack_node node;
+        unsigned int flush_flags = 0;
         int err = 0;
 
         grant_write_lock(lgt);
@@ -1551,10 +1690,16 @@ unmap_common(
             BUG();
 
         if ( !node.raw )
-            err = iommu_legacy_unmap(ld, _dfn(mfn_x(op->mfn)), 1);
+            err = iommu_unmap(ld, _dfn(mfn_x(op->mfn)), 1, 0, &flush_flags);
         else if ( !(flags & GNTMAP_readonly) && !node.cnt.wr )
-            err = iommu_legacy_map(ld, _dfn(mfn_x(op->mfn)), op->mfn, 1,
-                                   IOMMUF_readable);
+            err = iommu_map(ld, _dfn(mfn_x(op->mfn)), op->mfn, 1,
+                            IOMMUF_readable, &flush_flags);
+
+        /*
+         * The frame's references are dropped only by unmap_common_complete(),
+         * after the batch has been flushed.
+         */
+        gnttab_iommu_flush_add(flush, op->mfn, flush_flags);
 
         if ( err )
             ;
@@ -1656,7 +1801,7 @@ unmap_common_complete(struct gnttab_unmap_common *op)
 static void
 unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
-    struct gnttab_unmap_common *common)
+    struct gnttab_unmap_common *common, struct gnttab_iommu_flush *flush)
 {
     common->host_addr = op->host_addr;
     common->dev_bus_addr = op->dev_bus_addr;
@@ -1668,7 +1813,7 @@ unmap_grant_ref(
     common->rd = NULL;
     common->mfn = INVALID_MFN;
 
-    unmap_common(common);
+    unmap_common(common, flush);
     op->status = common->status;
 }
 
@@ -1677,9 +1822,10 @@ static long
 gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_grant_ref op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct gnttab_iommu_flush flush = {};
 
     while ( count != 0 )
     {
@@ -1690,18 +1836,21 @@ gnttab_unmap_grant_ref(
         {
             if ( unlikely(__copy_from_guest(&op, uop, 1)) )
                 goto fault;
-            unmap_grant_ref(&op, &common[i]);
+            unmap_grant_ref(&op, &common[i], &flush);
             ++partial_done;
             if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
                 goto fault;
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_unmap_batch(current->domain, &flush);
 
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1712,7 +1861,7 @@ gnttab_unmap_grant_ref(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    gnttab_flush_unmap_batch(current->domain, &flush);
 
     for ( i = 0; i < partial_done; i++ )
         unmap_common_complete(&common[i]);
@@ -1722,7 +1871,7 @@ fault:
 static void
 unmap_and_replace(
     struct gnttab_unmap_and_replace *op,
-    struct gnttab_unmap_common *common)
+    struct gnttab_unmap_common *common, struct gnttab_iommu_flush *flush)
 {
     common->host_addr = op->host_addr;
     common->new_addr = op->new_addr;
@@ -1734,7 +1883,7 @@ unmap_and_replace(
     common->rd = NULL;
     common->mfn = INVALID_MFN;
 
-    unmap_common(common);
+    unmap_common(common, flush);
     op->status = common->status;
 }
 
@@ -1742,9 +1891,10 @@ static long
 gnttab_unmap_and_replace(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc;
     struct gnttab_unmap_and_replace op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    struct gnttab_iommu_flush flush = {};
 
     while ( count != 0 )
     {
@@ -1755,18 +1905,21 @@ gnttab_unmap_and_replace(
         {
             if ( unlikely(__copy_from_guest(&op, uop, 1)) )
                 goto fault;
-            unmap_and_replace(&op, &common[i]);
+            unmap_and_replace(&op, &common[i], &flush);
             ++partial_done;
             if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
                 goto fault;
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_unmap_batch(current->domain, &flush);
 
         for ( i = 0; i < partial_done; i++ )
             unmap_common_complete(&common[i]);
 
+        if ( unlikely(rc) )
+            return rc;
+
         count -= c;
         done += c;
 
@@ -1777,7 +1930,7 @@ gnttab_unmap_and_replace(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    gnttab_flush_unmap_batch(current->domain, &flush);
 
     for ( i = 0; i < partial_done; i++ )
         unmap_common_complete(&common[i]);
@@ -2007,6 +2160,8 @@ int grant_table_init(struct domain *d, int max_grant_frames,
     gt->max_maptrack_frames = max_maptrack_frames;
     gt->max_version = max_grant_version;
 
+    atomic_set(&gt->persistent_gen, atomic_inc_return(&gnttab_persistent_gen));
+
     /* Install the structure early to simplify the error path. */
     gt->domain = d;
     d->grant_table = gt;
@@ -2863,25 +3018,40 @@ struct gnttab_copy_buf {
     bool_t have_type;
 };
 
+/*
+ * Number of source and destination buffers kept claimed (and mapped) across
+ * the ops of a batch.  Backends like netback copy many small segments from
+ * and to a handful of frames, in interleaved order.
+ */
+#define GNTTAB_COPY_NR_BUFS 4
+
+/* The source or destination side of a batch of copy ops. */
+struct gnttab_copy_side {
+    struct domain *domain;
+    domid_t domid;
+    unsigned int next;      /* Buffer to re-use on a miss. */
+    struct gnttab_copy_buf bufs[GNTTAB_COPY_NR_BUFS];
+};
+
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct gnttab_copy_side *side)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    side->domain = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !side->domain )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
+    side->domid = domid;
 
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_side *src,
+                                       struct gnttab_copy_side *dest)
 {
     if ( src->domain )
     {
@@ -2896,8 +3066,8 @@ static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_side *src,
+                                    struct gnttab_copy_side *dest)
 {
     int rc;
 
@@ -2947,6 +3117,14 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+static void gnttab_copy_release_bufs(struct gnttab_copy_side *side)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(side->bufs); i++ )
+        gnttab_copy_release_buf(&side->bufs[i]);
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -3017,6 +3195,47 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
     return p->u.gmfn == b->ptr.u.gmfn;
 }
 
+/*
+ * Find the buffer claimed for @ptr among those of @side, or claim it in
+ * place of the least recently claimed one.
+ */
+static int gnttab_copy_get_buf(const struct gnttab_copy *op,
+                               const struct gnttab_copy_ptr *ptr,
+                               struct gnttab_copy_side *side,
+                               unsigned int gref_flag,
+                               struct gnttab_copy_buf **bufp)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+    int rc;
+
+    for ( i = 0; i < ARRAY_SIZE(side->bufs); i++ )
+    {
+        buf = &side->bufs[i];
+        if ( gnttab_copy_buf_valid(ptr, buf, op->flags & gref_flag) )
+        {
+            perfc_incr(gnttab_copy_buf_hit);
+            *bufp = buf;
+            return GNTST_okay;
+        }
+    }
+
+    perfc_incr(gnttab_copy_buf_claim);
+
+    buf = &side->bufs[side->next];
+    side->next = (side->next + 1) % ARRAY_SIZE(side->bufs);
+
+    gnttab_copy_release_buf(buf);
+    buf->domain = side->domain;
+    rc = gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+    if ( rc )
+        return rc;
+
+    *bufp = buf;
+
+    return GNTST_okay;
+}
+
 static int gnttab_copy_buf(const struct gnttab_copy *op,
                            struct gnttab_copy_buf *dest,
                            const struct gnttab_copy_buf *src)
@@ -3056,16 +3275,19 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_side *dest,
+                           struct gnttab_copy_side *src)
 {
+    struct gnttab_copy_buf *dbuf, *sbuf;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    perfc_incr(gnttab_copy);
+
+    if ( !src->domain || op->source.domid != src->domid ||
+         !dest->domain || op->dest.domid != dest->domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
+        gnttab_copy_release_bufs(src);
+        gnttab_copy_release_bufs(dest);
         gnttab_copy_unlock_domains(src, dest);
 
         rc = gnttab_copy_lock_domains(op, src, dest);
@@ -3073,27 +3295,16 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
-    {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->source, src, GNTCOPY_source_gref,
+                             &sbuf);
+    if ( rc )
+        goto out;
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
-    {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
-    }
+    rc = gnttab_copy_get_buf(op, &op->dest, dest, GNTCOPY_dest_gref, &dbuf);
+    if ( rc )
+        goto out;
 
-    rc = gnttab_copy_buf(op, dest, src);
+    rc = gnttab_copy_buf(op, dbuf, sbuf);
  out:
     return rc;
 }
@@ -3111,8 +3322,8 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_side src = {};
+    struct gnttab_copy_side dest = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -3137,8 +3348,8 @@ static long gnttab_copy(
         }
         if ( rc != GNTST_okay )
         {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
+            gnttab_copy_release_bufs(&src);
+            gnttab_copy_release_bufs(&dest);
         }
 
         op.status = rc;
@@ -3151,8 +3362,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
+    gnttab_copy_release_bufs(&src);
+    gnttab_copy_release_bufs(&dest);
     gnttab_copy_unlock_domains(&src, &dest);
 
     return rc;
@@ -3516,6 +3727,112 @@ gnttab_swap_grant_ref(XEN_GUEST_HANDLE_PARAM(gnttab_swap_grant_ref_t) uop,
     return 0;
 }
 
+static int16_t
+revalidate_mapping(grant_handle_t handle)
+{
+    struct domain *ld = current->domain, *rd;
+    struct grant_table *lgt = ld->grant_table, *rgt;
+    struct active_grant_entry *act;
+    struct grant_mapping *map;
+    unsigned int flags, gen;
+    grant_ref_t ref;
+    domid_t dom;
+    int16_t rc = GNTST_okay;
+
+    if ( unlikely(handle >= lgt->maptrack_limit) )
+        return GNTST_bad_handle;
+
+    smp_rmb();
+    map = &maptrack_entry(lgt, handle);
+
+    flags = read_atomic(&map->flags);
+    if ( unlikely(!(flags & GNTMAP_persistent)) )
+        return GNTST_bad_handle;
+
+    smp_rmb();
+    dom = map->domid;
+    rd = rcu_lock_domain_by_id(dom);
+    if ( unlikely(!rd) )
+        return GNTST_bad_domain;
+
+    rgt = rd->grant_table;
+
+    /* Nothing revoked since the mapping was last validated? */
+    gen = atomic_read(&rgt->persistent_gen);
+    if ( likely(read_atomic(&map->gen) == gen) )
+        goto out;
+
+    smp_rmb();
+    grant_read_lock(rgt);
+
+    /* See unmap_common() for why map->ref needs checking. */
+    ref = map->ref;
+    if ( unlikely(ref >= nr_grant_entries(rgt)) )
+    {
+        rc = GNTST_bad_handle;
+        goto unlock_out;
+    }
+
+    act = active_entry_acquire(rgt, ref);
+
+    if ( unlikely(read_atomic(&map->flags) != flags) ||
+         unlikely(map->domid != dom) || unlikely(map->ref != ref) )
+        rc = GNTST_bad_handle;
+    /*
+     * A mapping of another domain's grant, e.g. of an earlier domain with
+     * the same domid, can't be backed by this domain's active entry.
+     */
+    else if ( unlikely(!act->pin) || unlikely(act->domid != ld->domain_id) )
+        rc = GNTST_revoked;
+    else if ( ACCESS_ONCE(shared_entry_header(rgt, ref)->flags) &
+              GTF_persistent )
+        write_atomic(&map->gen, gen);
+    else
+        rc = GNTST_revoked;
+
+    active_entry_release(act);
+
+ unlock_out:
+    grant_read_unlock(rgt);
+ out:
+    rcu_unlock_domain(rd);
+
+    return rc;
+}
+
+static long
+gnttab_revalidate(XEN_GUEST_HANDLE_PARAM(gnttab_revalidate_t) uop,
+                  unsigned int count)
+{
+    unsigned int i;
+    gnttab_revalidate_t op;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( i && hypercall_preempt_check() )
+            return i;
+        if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+            return -EFAULT;
+        op.status = revalidate_mapping(op.handle);
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            return -EFAULT;
+        guest_handle_add_offset(uop, 1);
+    }
+    return 0;
+}
+
+static long
+gnttab_revoke_persistent(void)
+{
+    struct grant_table *gt = current->domain->grant_table;
+
+    /* Order the guest's clearing of GTF_persistent before the update. */
+    smp_mb();
+    atomic_set(&gt->persistent_gen, atomic_inc_return(&gnttab_persistent_gen));
+
+    return 0;
+}
+
 static int _cache_flush(const gnttab_cache_flush_t *cflush, grant_ref_t *cur_ref)
 {
     struct domain *d, *owner;
@@ -3786,6 +4103,26 @@ long do_grant_table_op(
         break;
     }
 
+    case GNTTABOP_revalidate:
+    {
+        XEN_GUEST_HANDLE_PARAM(gnttab_revalidate_t) reval =
+            guest_handle_cast(uop, gnttab_revalidate_t);
+
+        if ( unlikely(!guest_handle_okay(reval, count)) )
+            goto out;
+        rc = gnttab_revalidate(reval, count);
+        if ( rc > 0 )
+        {
+            guest_handle_add_offset(reval, rc);
+            uop = guest_handle_cast(reval, void);
+        }
+        break;
+    }
+
+    case GNTTABOP_revoke_persistent:
+        rc = count ? -EINVAL : gnttab_revoke_persistent();
+        break;
+
     default:
         rc = -ENOSYS;
         break;
@@ -4030,7 +4367,7 @@ void grant_table_init_vcpu(struct vcpu *v)
 {
     spin_lock_init(&v->maptrack_freelist_lock);
     v->maptrack_head = MAPTRACK_TAIL;
-    v->maptrack_tail = MAPTRACK_TAIL;
+    v->maptrack_remote = MAPTRACK_TAIL;
 }
 
 #ifdef CONFIG_MEM_SHARING
@@ -23,6 +23,7 @@
 #include <xen/param.h>
 #include <xen/perfc.h>
 #include <xen/sched.h>
+#include <xen/tasklet.h>
 #include <xen/trace.h>
 #include <xen/types.h>
 #include <asm/current.h>
@@ -154,6 +155,267 @@ static void increase_reservation(struct memop_args *a)
     a->nr_done = i;
 }
 
+/*
+ * Populating the memory of a large domain under construction is dominated by
+ * scrubbing and assigning its pages.  Such requests get split across idle
+ * CPUs of the domain's cpupool on the node(s) the memory is to come from:
+ * each worker allocates (and hence scrubs) and maps its share of a batch of
+ * extents from a tasklet, with the calling CPU taking a share as well.  The
+ * outcome of every batch is then folded into the request's progress, as if
+ * the extents had been populated one by one.
+ */
+static unsigned int __read_mostly opt_populate_workers = 16;
+integer_param("populate-workers", opt_populate_workers);
+
+/* Minimum size of a request to be split, in pages. */
+#define POPULATE_PAR_MIN_PAGES    (1U << 14)
+/* Amount of work for each CPU per batch, in pages. */
+#define POPULATE_PAR_BATCH_PAGES  (1U << 13)
+
+struct populate_batch {
+    struct domain *domain;
+    unsigned int extent_order;
+    unsigned int memflags;
+    const xen_pfn_t *gpfns;
+    atomic_t pending;
+};
+
+struct populate_worker {
+    struct tasklet tasklet;
+    struct populate_batch *batch;
+    unsigned int cpu;
+    unsigned int start, end;   /* Extents [start, end) of the batch. */
+    unsigned int done;         /* Extents populated, counting from start. */
+    bool need_tlbflush;
+    uint32_t tlbflush_timestamp;
+};
+
+static void populate_extents(struct populate_worker *w)
+{
+    const struct populate_batch *b = w->batch;
+    struct domain *d = b->domain;
+    unsigned int i, j;
+
+    for ( i = w->start; i < w->end; i++ )
+    {
+        struct page_info *page = alloc_domheap_pages(d, b->extent_order,
+                                                     b->memflags);
+
+        if ( unlikely(!page) )
+        {
+            gdprintk(XENLOG_INFO,
+                     "Could not allocate order=%u extent: id=%d memflags=%#x\n",
+                     b->extent_order, d->domain_id, b->memflags);
+            break;
+        }
+
+        if ( unlikely(b->memflags & MEMF_no_tlbflush) )
+        {
+            for ( j = 0; j < (1U << b->extent_order); j++ )
+                accumulate_tlbflush(&w->need_tlbflush, &page[j],
+                                    &w->tlbflush_timestamp);
+        }
+
+        if ( guest_physmap_add_page(d, _gfn(b->gpfns[i]), page_to_mfn(page),
+                                    b->extent_order) )
+            break;
+    }
+
+    w->done = i - w->start;
+}
+
+static void cf_check populate_worker_fn(void *data)
+{
+    struct populate_worker *w = data;
+
+    populate_extents(w);
+
+    smp_mb();
+    atomic_dec(&w->batch->pending);
+}
+
+static bool populate_parallel_ok(const struct memop_args *a)
+{
+    const struct domain *d = a->domain;
+
+    return opt_populate_workers && !d->creation_finished &&
+           paging_mode_translate(d) && !is_domain_direct_mapped(d) &&
+           !is_domain_using_staticmem(d) &&
+           !(a->memflags & MEMF_populate_on_demand) &&
+           ((unsigned long)(a->nr_extents - a->nr_done) << a->extent_order) >=
+           POPULATE_PAR_MIN_PAGES;
+}
+
+/*
+ * Returns false if no CPU could be found to help, in which case nothing was
+ * done.  Otherwise a->nr_done and a->preempted are updated like the serial
+ * loop in populate_physmap() would.
+ */
+static bool populate_physmap_parallel(struct memop_args *a,
+                                      bool *need_tlbflush,
+                                      uint32_t *tlbflush_timestamp)
+{
+    struct domain *d = a->domain;
+    nodeid_t node = MEMF_get_node(a->memflags);
+    unsigned int per_worker = max(POPULATE_PAR_BATCH_PAGES >> a->extent_order,
+                                  1U);
+    unsigned int cpu, n, nr_workers = 0;
+    struct populate_batch batch = {
+        .domain = d,
+        .extent_order = a->extent_order,
+        .memflags = a->memflags,
+    };
+    struct populate_worker *workers = NULL;
+    xen_pfn_t *gpfns = NULL;
+    cpumask_var_t mask;
+
+    if ( !d->cpupool || !alloc_cpumask_var(&mask) )
+        return false;
+
+    if ( node != NUMA_NO_NODE )
+        cpumask_copy(mask, &node_to_cpumask(node));
+    else
+    {
+        cpumask_clear(mask);
+        for_each_node_mask ( n, d->node_affinity )
+            cpumask_or(mask, mask, &node_to_cpumask(n));
+    }
+    /* Don't steal time from CPUs of other cpupools. */
+    cpumask_and(mask, mask, cpupool_valid_cpus(d->cpupool));
+    __cpumask_clear_cpu(smp_processor_id(), mask);
+
+    for_each_cpu ( cpu, mask )
+    {
+        if ( !sched_cpu_is_idle(cpu) )
+            __cpumask_clear_cpu(cpu, mask);
+        else if ( ++nr_workers == opt_populate_workers )
+            break;
+    }
+
+    if ( !nr_workers )
+        goto fail;
+
+    /* Worker 0 is the calling CPU. */
+    workers = xzalloc_array(struct populate_worker, nr_workers + 1);
+    gpfns = xmalloc_array(xen_pfn_t, (nr_workers + 1) * per_worker);
+    if ( !workers || !gpfns )
+        goto fail;
+
+    workers[0].cpu = smp_processor_id();
+    n = 1;
+    for_each_cpu ( cpu, mask )
+    {
+        if ( n > nr_workers )
+            break;
+        workers[n++].cpu = cpu;
+    }
+
+    batch.gpfns = gpfns;
+
+    while ( a->nr_done < a->nr_extents )
+    {
+        unsigned int todo = min(a->nr_extents - a->nr_done,
+                                (nr_workers + 1) * per_worker);
+        unsigned int share = DIV_ROUND_UP(todo, nr_workers + 1);
+        unsigned int i, j, failed = todo;
+
+        if ( unlikely(__copy_from_guest_offset(gpfns, a->extent_list,
+                                               a->nr_done, todo)) )
+            break;
+
+        atomic_set(&batch.pending, 0);
+
+        for ( n = 0; n <= nr_workers; n++ )
+        {
+            struct populate_worker *w = &workers[n];
+
+            w->batch = &batch;
+            w->start = min(n * share, todo);
+            w->end = min(w->start + share, todo);
+            w->done = 0;
+
+            if ( !n || w->start == w->end )
+                continue;
+
+            atomic_inc(&batch.pending);
+            tasklet_init(&w->tasklet, populate_worker_fn, w);
+            tasklet_schedule_on_cpu(&w->tasklet, w->cpu);
+        }
+
+        populate_extents(&workers[0]);
+
+        while ( atomic_read(&batch.pending) )
+        {
+            process_pending_softirqs();
+            cpu_relax();
+        }
+
+        for ( n = 0; n <= nr_workers; n++ )
+        {
+            struct populate_worker *w = &workers[n];
+
+            if ( n && w->start != w->end )
+                tasklet_kill(&w->tasklet);
+
+            if ( w->need_tlbflush &&
+                 (!*need_tlbflush ||
+                  w->tlbflush_timestamp > *tlbflush_timestamp) )
+            {
+                *need_tlbflush = true;
+                *tlbflush_timestamp = w->tlbflush_timestamp;
+            }
+            w->need_tlbflush = false;
+
+            if ( failed == todo && w->start + w->done < w->end )
+                failed = w->start + w->done;
+        }
+
+        if ( unlikely(failed < todo) )
+        {
+            /*
+             * Extents are reported as populated in order.  Take back what
+             * workers past the failure populated.
+             */
+            for ( n = 0; n <= nr_workers; n++ )
+            {
+                const struct populate_worker *w = &workers[n];
+
+                if ( w->start <= failed )
+                    continue;
+
+                for ( i = w->start; i < w->start + w->done; i++ )
+                    for ( j = 0; j < (1U << a->extent_order); j++ )
+                        if ( guest_remove_page(d, gpfns[i] + j) )
+                            domain_crash(d);
+            }
+
+            a->nr_done += failed;
+            break;
+        }
+
+        a->nr_done += todo;
+
+        if ( a->nr_done < a->nr_extents && hypercall_preempt_check() )
+        {
+            a->preempted = 1;
+            break;
+        }
+    }
+
+    xfree(gpfns);
+    xfree(workers);
+    free_cpumask_var(mask);
+
+    return true;
+
+ fail:
+    xfree(gpfns);
+    xfree(workers);
+    free_cpumask_var(mask);
+
+    return false;
+}
+
 static void populate_physmap(struct memop_args *a)
 {
     struct page_info *page;
@@ -192,6 +454,13 @@ static void populate_physmap(struct memop_args *a)
         a->memflags |= MEMF_no_icache_flush;
     }
 
+    if ( populate_parallel_ok(a) &&
+         populate_physmap_parallel(a, &need_tlbflush, &tlbflush_timestamp) )
+    {
+        i = a->nr_done;
+        goto out;
+    }
+
     for ( i = a->nr_done; i < a->nr_extents; i++ )
     {
         mfn_t mfn;
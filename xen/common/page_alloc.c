@@ -120,6 +120,7 @@
  *   regions within it.
  */
 
+#include <xen/cpu.h>
 #include <xen/domain_page.h>
 #include <xen/event.h>
 #include <xen/init.h>
@@ -470,6 +471,12 @@ static long total_avail_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+static struct page_info *pcp_alloc_page(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d, bool *need_tlbflush, uint32_t *tlbflush_timestamp);
+static bool pcp_free_page(struct page_info *pg);
+static unsigned long pcp_drain_all(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -550,7 +557,12 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      */
     claim = pages - domain_tot_pages(d);
     if ( claim > avail_pages )
-        goto out;
+    {
+        /* Pages sitting in per-CPU caches don't count; reclaim them. */
+        avail_pages += pcp_drain_all();
+        if ( claim > avail_pages )
+            goto out;
+    }
 
     /* yay, claim fits in available memory, stake the claim, success! */
     d->outstanding_pages = claim;
@@ -948,6 +960,11 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
+    if ( !order &&
+         (pg = pcp_alloc_page(zone_lo, zone_hi, memflags, d, &need_tlbflush,
+                              &tlbflush_timestamp)) != NULL )
+        goto out;
+
     spin_lock(&heap_lock);
 
     /*
@@ -1064,6 +1081,7 @@ static struct page_info *alloc_heap_pages(
         }
     }
 
+ out:
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
@@ -1440,41 +1458,17 @@ static bool mark_page_free(struct page_info *pg, mfn_t mfn)
     return pg_offlined;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order, bool need_scrub)
+/*
+ * Merge the free 2^@order chunk at @pg with its buddies as far as possible
+ * and put the result on the heap.  Returns the head of the merged chunk.
+ */
+static struct page_info *merge_free_buddy(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order)
 {
     unsigned long mask;
-    mfn_t mfn = page_to_mfn(pg);
-    unsigned int i, node = mfn_to_nid(mfn);
-    unsigned int zone = page_to_zone(pg);
-    bool pg_offlined = false;
 
-    ASSERT(order <= MAX_ORDER);
-
-    spin_lock(&heap_lock);
-
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
-            pg_offlined = true;
-
-        if ( need_scrub )
-        {
-            pg[i].count_info |= PGC_need_scrub;
-            poison_one_page(&pg[i]);
-        }
-    }
-
-    avail[node][zone] += 1 << order;
-    total_avail_pages += 1 << order;
-    if ( need_scrub )
-    {
-        node_need_scrub[node] += 1 << order;
-        pg->u.free.first_dirty = 0;
-    }
-    else
-        pg->u.free.first_dirty = INVALID_DIRTY_IDX;
+    ASSERT(spin_is_locked(&heap_lock));
 
     /* Merge chunks as far as possible. */
     while ( order < MAX_ORDER )
@@ -1533,6 +1527,49 @@ static void free_heap_pages(
 
     page_list_add_scrub(pg, node, zone, order, pg->u.free.first_dirty);
 
+    return pg;
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool need_scrub)
+{
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned int i, node = mfn_to_nid(mfn);
+    unsigned int zone = page_to_zone(pg);
+    bool pg_offlined = false;
+
+    ASSERT(order <= MAX_ORDER);
+
+    if ( !order && !need_scrub && pcp_free_page(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( mark_page_free(&pg[i], mfn_add(mfn, i)) )
+            pg_offlined = true;
+
+        if ( need_scrub )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            poison_one_page(&pg[i]);
+        }
+    }
+
+    avail[node][zone] += 1 << order;
+    total_avail_pages += 1 << order;
+    if ( need_scrub )
+    {
+        node_need_scrub[node] += 1 << order;
+        pg->u.free.first_dirty = 0;
+    }
+    else
+        pg->u.free.first_dirty = INVALID_DIRTY_IDX;
+
+    pg = merge_free_buddy(pg, node, zone, order);
+
     if ( pg_offlined )
         reserve_offlined_page(pg);
 
@@ -1540,6 +1577,391 @@ static void free_heap_pages(
 }
 
 
+/*************************
+ * PER-CPU PAGE CACHES
+ *
+ * Order-0 allocations and frees are the vast majority of heap operations.
+ * To keep them off heap_lock, each CPU keeps a small cache of free pages
+ * from its own node, refilled from and drained to the buddy lists in
+ * batches.
+ *
+ * Cached pages are in PGC_state_free, never need scrubbing, and carry an
+ * impossible order so that they are never merged into a neighbouring buddy.
+ * They are removed from avail[] and total_avail_pages while cached, hence
+ * outstanding claims are only ever staked against memory in the buddy
+ * lists, and allocating from a cache can never eat into claimed memory.
+ *
+ * Lock order: heap_lock -> pcp->lock.  The fast paths only take the latter.
+ */
+
+#define PCP_ORDER (~0U)
+
+struct pcp_cache {
+    spinlock_t lock;
+    nodeid_t node;
+    unsigned int count;
+    struct page_list_head list;
+};
+
+static DEFINE_PER_CPU(struct pcp_cache, pcp_cache);
+static cpumask_t pcp_cpumask;
+
+static unsigned int __initdata opt_pcp_cache = 64;
+integer_param("pcp-cache", opt_pcp_cache);
+
+/* Zero until the boot CPU's cache is set up, or if caching is disabled. */
+static unsigned int __read_mostly pcp_high;
+static unsigned int __read_mostly pcp_batch;
+
+/* Return up to @nr pages from @cpu's cache to the buddy lists. */
+static unsigned int pcp_drain(unsigned int cpu, unsigned int nr)
+{
+    struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+    unsigned int drained = 0;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    spin_lock(&pcp->lock);
+
+    while ( drained < nr && pcp->count )
+    {
+        struct page_info *pg = page_list_last(&pcp->list);
+        unsigned int node = page_to_nid(pg), zone = page_to_zone(pg);
+
+        /* Offlining removes pages from caches while holding heap_lock. */
+        ASSERT(page_state_is(pg, free));
+        ASSERT(pg->u.free.first_dirty == INVALID_DIRTY_IDX);
+
+        page_list_del(pg, &pcp->list);
+        pcp->count--;
+        PFN_ORDER(pg) = 0;
+        avail[node][zone]++;
+        total_avail_pages++;
+        merge_free_buddy(pg, node, zone, 0);
+        drained++;
+    }
+
+    spin_unlock(&pcp->lock);
+
+    return drained;
+}
+
+/* Return all cached pages to the buddy lists. */
+static unsigned long pcp_drain_all(void)
+{
+    unsigned int cpu;
+    unsigned long drained = 0;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    for_each_cpu ( cpu, &pcp_cpumask )
+        drained += pcp_drain(cpu, UINT_MAX);
+
+    return drained;
+}
+
+/*
+ * Move up to pcp_batch clean pages from the local node's buddy lists into
+ * @pcp, leaving claimed memory alone.  Called with heap_lock and pcp->lock
+ * held.
+ */
+static void pcp_refill(struct pcp_cache *pcp, unsigned int zone_lo,
+                       unsigned int zone_hi)
+{
+    unsigned int n;
+
+    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(spin_is_locked(&pcp->lock));
+
+    for ( n = 0; n < pcp_batch; n++ )
+    {
+        struct page_info *pg;
+        unsigned int zone, buddy_order;
+
+        if ( outstanding_claims + 1 > total_avail_pages )
+            break;
+
+        pg = get_free_buddy(zone_lo, zone_hi, 0,
+                            MEMF_node(pcp->node) | MEMF_exact_node, NULL);
+        if ( !pg )
+            break;
+
+        zone = page_to_zone(pg);
+        buddy_order = PFN_ORDER(pg);
+
+        /* Leave anything needing a scrub to the slow path. */
+        if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+        {
+            page_list_add_scrub(pg, pcp->node, zone, buddy_order,
+                                pg->u.free.first_dirty);
+            break;
+        }
+
+        while ( buddy_order-- )
+        {
+            page_list_add_scrub(pg, pcp->node, zone, buddy_order,
+                                INVALID_DIRTY_IDX);
+            pg += 1U << buddy_order;
+        }
+
+        ASSERT(avail[pcp->node][zone]);
+        avail[pcp->node][zone]--;
+        total_avail_pages--;
+
+        PFN_ORDER(pg) = PCP_ORDER;
+        page_list_add_tail(pg, &pcp->list);
+        pcp->count++;
+    }
+
+    if ( n )
+        check_low_mem_virq();
+}
+
+/* Take the first page of @pcp's cache that suits the request. */
+static struct page_info *pcp_take(struct pcp_cache *pcp, unsigned int zone_lo,
+                                  unsigned int zone_hi)
+{
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&pcp->lock));
+
+    page_list_for_each ( pg, &pcp->list )
+    {
+        unsigned int zone = page_to_zone(pg);
+
+        if ( zone < zone_lo || zone > zone_hi )
+            continue;
+
+        /*
+         * A page may have been offlined under our feet, in which case
+         * offline_page() will come and take it off the list.
+         */
+        if ( cmpxchg(&pg->count_info, PGC_state_free,
+                     PGC_state_inuse) != PGC_state_free )
+            continue;
+
+        page_list_del(pg, &pcp->list);
+        pcp->count--;
+
+        return pg;
+    }
+
+    return NULL;
+}
+
+static struct page_info *pcp_alloc_page(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags,
+    struct domain *d, bool *need_tlbflush, uint32_t *tlbflush_timestamp)
+{
+    struct pcp_cache *pcp = &this_cpu(pcp_cache);
+    nodeid_t node = MEMF_get_node(memflags);
+    struct page_info *pg;
+
+    if ( !pcp_high )
+        return NULL;
+
+    if ( node != NUMA_NO_NODE ? node != pcp->node
+                              : d && !nodemask_test(pcp->node, &d->node_affinity) )
+        return NULL;
+
+    spin_lock(&pcp->lock);
+    pg = pcp_take(pcp, zone_lo, zone_hi);
+    spin_unlock(&pcp->lock);
+
+    if ( !pg )
+    {
+        spin_lock(&heap_lock);
+        spin_lock(&pcp->lock);
+        pcp_refill(pcp, zone_lo, zone_hi);
+        pg = pcp_take(pcp, zone_lo, zone_hi);
+        spin_unlock(&pcp->lock);
+        spin_unlock(&heap_lock);
+
+        if ( !pg )
+            return NULL;
+    }
+
+    if ( d != NULL )
+        d->last_alloc_node = pcp->node;
+
+    if ( !(memflags & MEMF_no_tlbflush) )
+        accumulate_tlbflush(need_tlbflush, pg, tlbflush_timestamp);
+
+    /* Initialise fields which have other uses for free pages. */
+    pg->u.inuse.type_info = PGT_TYPE_INFO_INITIALIZER;
+    page_set_owner(pg, NULL);
+
+    if ( !(memflags & MEMF_no_scrub) )
+        check_one_page(pg);
+
+    return pg;
+}
+
+static bool pcp_free_page(struct page_info *pg)
+{
+    struct pcp_cache *pcp = &this_cpu(pcp_cache);
+    mfn_t mfn = page_to_mfn(pg);
+    unsigned long x;
+    bool need_tlbflush, drain;
+
+    if ( !pcp_high || page_to_nid(pg) != pcp->node ||
+         page_to_zone(pg) == MEMZONE_XEN )
+        return false;
+
+    spin_lock(&pcp->lock);
+
+    /*
+     * Pages being offlined (or which are broken) go via free_heap_pages().
+     * The state change needs to be atomic with respect to offline_page(),
+     * which doesn't hold our lock.
+     */
+    x = ACCESS_ONCE(pg->count_info);
+    if ( (x & (PGC_state | PGC_broken)) != PGC_state_inuse ||
+         cmpxchg(&pg->count_info, x, PGC_state_free) != x )
+    {
+        spin_unlock(&pcp->lock);
+        return false;
+    }
+
+    /* See mark_page_free(). */
+    need_tlbflush = (page_get_owner(pg) != NULL);
+    pg->u.free.need_tlbflush = need_tlbflush;
+    if ( need_tlbflush )
+        page_set_tlbflush_timestamp(pg);
+    pg->u.free.first_dirty = INVALID_DIRTY_IDX;
+    pg->u.free.scrub_state = BUDDY_NOT_SCRUBBING;
+
+    page_set_owner(pg, NULL);
+    set_gpfn_from_mfn(mfn_x(mfn), INVALID_M2P_ENTRY);
+
+    PFN_ORDER(pg) = PCP_ORDER;
+    page_list_add(pg, &pcp->list);
+    drain = ++pcp->count > pcp_high;
+
+    spin_unlock(&pcp->lock);
+
+    if ( drain )
+    {
+        spin_lock(&heap_lock);
+        pcp_drain(smp_processor_id(), pcp_batch);
+        spin_unlock(&heap_lock);
+    }
+
+    return true;
+}
+
+/*
+ * offline_page() found the formerly free page @pg outside of the buddy lists,
+ * so it is likely sitting in some CPU's cache.  Retire it from there.  If it
+ * can't be found, it has been retired already.
+ */
+static void pcp_reclaim_offlined(struct page_info *pg)
+{
+    unsigned int cpu;
+
+    ASSERT(spin_is_locked(&heap_lock));
+    ASSERT(page_state_is(pg, offlined));
+
+    for_each_cpu ( cpu, &pcp_cpumask )
+    {
+        struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+        struct page_info *pos;
+        bool found = false;
+
+        spin_lock(&pcp->lock);
+        page_list_for_each ( pos, &pcp->list )
+        {
+            if ( pos != pg )
+                continue;
+
+            page_list_del(pg, &pcp->list);
+            pcp->count--;
+            found = true;
+            break;
+        }
+        spin_unlock(&pcp->lock);
+
+        if ( found )
+        {
+            PFN_ORDER(pg) = 0;
+            page_list_add_tail(pg, test_bit(_PGC_broken, &pg->count_info) ?
+                                   &page_broken_list : &page_offlined_list);
+            return;
+        }
+    }
+}
+
+static unsigned long pcp_cached_pages(int node)
+{
+    unsigned int cpu;
+    unsigned long total = 0;
+
+    for_each_cpu ( cpu, &pcp_cpumask )
+    {
+        const struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+
+        if ( node < 0 || pcp->node == node )
+            total += ACCESS_ONCE(pcp->count);
+    }
+
+    return total;
+}
+
+static int cf_check pcp_cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct pcp_cache *pcp = &per_cpu(pcp_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        /* Only initialise the cache once. */
+        if ( !cpumask_test_cpu(cpu, &pcp_cpumask) )
+        {
+            spin_lock_init(&pcp->lock);
+            INIT_PAGE_LIST_HEAD(&pcp->list);
+            cpumask_set_cpu(cpu, &pcp_cpumask);
+        }
+        ASSERT(!pcp->count);
+        pcp->node = cpu_to_node(cpu);
+        break;
+
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        spin_lock(&heap_lock);
+        pcp_drain(cpu, UINT_MAX);
+        spin_unlock(&heap_lock);
+        break;
+
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block pcp_cpu_nfb = {
+    .notifier_call = pcp_cpu_callback
+};
+
+static int __init cf_check pcp_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    if ( !opt_pcp_cache )
+        return 0;
+
+    pcp_cpu_callback(&pcp_cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&pcp_cpu_nfb);
+
+    pcp_batch = max(opt_pcp_cache / 4, 1U);
+    pcp_high = opt_pcp_cache;
+
+    return 0;
+}
+presmp_initcall(pcp_init);
+
 /*
  * Following rules applied for page offline:
  * Once a page is broken, it can't be assigned anymore
@@ -1651,7 +2073,13 @@ int offline_page(mfn_t mfn, int broken, uint32_t *status)
 
     if ( page_state_is(pg, offlined) )
     {
-        reserve_heap_page(pg);
+        /*
+         * A page which was free but isn't in the heap sits in a per-CPU
+         * cache.  A page offlined before is on the offlined/broken lists.
+         */
+        if ( reserve_heap_page(pg) < 0 &&
+             (old_info & PGC_state) == PGC_state_free )
+            pcp_reclaim_offlined(pg);
 
         spin_unlock(&heap_lock);
 
@@ -2576,12 +3004,13 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + pcp_cached_pages(-1);
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
 {
-    return avail_heap_pages(MEMZONE_XEN, NR_ZONES -1, nodeid);
+    return avail_heap_pages(MEMZONE_XEN, NR_ZONES -1, nodeid) +
+           pcp_cached_pages(nodeid);
 }
 
 
@@ -2610,6 +3039,8 @@ static void cf_check pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Per-CPU caches: %lukB free\n",
+           pcp_cached_pages(-1) << (PAGE_SHIFT-10));
 }
 
 static __init int cf_check pagealloc_keyhandler_init(void)
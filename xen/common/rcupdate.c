@@ -48,19 +48,43 @@
 
 DEFINE_PER_CPU(unsigned int, rcu_lock_cnt);
 
+/*
+ * Quiescent states are reported hierarchically: CPUs are grouped into nodes
+ * of RCU_FANOUT consecutive CPU numbers, each with its own lock and mask of
+ * CPUs still to pass through a quiescent state for the current grace period.
+ * Only the last CPU of a node to do so reports to the global control block,
+ * by decrementing the number of nodes the grace period is waiting for.  This
+ * way CPUs contend on the global lock only when starting or completing a
+ * grace period, instead of on every quiescent state.
+ */
+#define RCU_FANOUT    16
+#define RCU_NR_NODES  DIV_ROUND_UP(NR_CPUS, RCU_FANOUT)
+
+struct rcu_node {
+    spinlock_t    lock;
+    long          batch;   /* Grace period qsmask refers to */
+    unsigned long qsmask;  /* CPUs (relative to first) still to report */
+    unsigned int  first;   /* First CPU of this node */
+} __cacheline_aligned;
+
+static struct rcu_node rcu_nodes[RCU_NR_NODES];
+
 /* Global control variables for rcupdate callback mechanism. */
 static struct rcu_ctrlblk {
     long cur;           /* Current batch number.                      */
     long completed;     /* Number of the last completed batch         */
     int  next_pending;  /* Is the next batch already waiting?         */
+    long expedited;     /* Last batch to be expedited                 */
 
     spinlock_t  lock __cacheline_aligned;
-    cpumask_t   cpumask; /* CPUs that need to switch in order ... */
-    cpumask_t   idle_cpumask; /* ... unless they are already idle */
+    atomic_t    nodes_pending; /* Nodes with CPUs that need to switch ... */
+    cpumask_t   idle_cpumask;  /* ... unless they are already idle */
     /* for current batch to proceed.        */
+    cpumask_t   expedite_cpumask; /* CPUs waiting for expedited batches */
 } __cacheline_aligned rcu_ctrlblk = {
     .cur = -300,
     .completed = -300,
+    .expedited = -300,
     .lock = SPIN_LOCK_UNLOCKED,
 };
 
@@ -93,6 +117,7 @@ struct rcu_data {
 
     bool            process_callbacks;
     bool            barrier_active;
+    bool            expedite;         /* rcu_expedite() called */
 };
 
 /*
@@ -245,10 +270,56 @@ static inline int rcu_batch_before(long a, long b)
     return (a - b) < 0;
 }
 
+static inline unsigned int rcu_nr_nodes(void)
+{
+    return DIV_ROUND_UP(nr_cpu_ids, RCU_FANOUT);
+}
+
+static inline struct rcu_node *rcu_node_of(unsigned int cpu)
+{
+    return &rcu_nodes[cpu / RCU_FANOUT];
+}
+
+/* Bits of @mask for the CPUs of @rnp, relative to the node's first CPU. */
+static inline unsigned long rcu_node_bits(const struct rcu_node *rnp,
+                                          const cpumask_t *mask)
+{
+    return (cpumask_bits(mask)[rnp->first / BITS_PER_LONG] >>
+            (rnp->first % BITS_PER_LONG)) & ((1UL << RCU_FANOUT) - 1);
+}
+
+/*
+ * Collect the CPUs the current grace period is still waiting for.  This is
+ * racy, so the result is only good as a hint whom to kick.
+ */
+static void rcu_pending_cpus(cpumask_t *cpumask)
+{
+    unsigned int i, bit;
+
+    cpumask_clear(cpumask);
+    for ( i = 0; i < rcu_nr_nodes(); i++ )
+    {
+        const struct rcu_node *rnp = &rcu_nodes[i];
+        unsigned long qsmask = read_atomic(&rnp->qsmask);
+
+        for_each_set_bit ( bit, &qsmask, RCU_FANOUT )
+            __cpumask_set_cpu(rnp->first + bit, cpumask);
+    }
+}
+
+/* Make the CPUs the current grace period is waiting for report promptly. */
+static void rcu_kick_pending_cpus(void)
+{
+    cpumask_t cpumask;
+
+    rcu_pending_cpus(&cpumask);
+    __cpumask_clear_cpu(smp_processor_id(), &cpumask);
+    cpumask_raise_softirq(&cpumask, RCU_SOFTIRQ);
+}
+
 static void force_quiescent_state(struct rcu_data *rdp,
                                   struct rcu_ctrlblk *rcp)
 {
-    cpumask_t cpumask;
     raise_softirq(RCU_SOFTIRQ);
     if (unlikely(rdp->qlen - rdp->last_rs_qlen > rsinterval)) {
         rdp->last_rs_qlen = rdp->qlen;
@@ -256,8 +327,7 @@ static void force_quiescent_state(struct rcu_data *rdp,
          * Don't send IPI to itself. With irqs disabled,
          * rdp->cpu is the current cpu.
          */
-        cpumask_andnot(&cpumask, &rcp->cpumask, cpumask_of(rdp->cpu));
-        cpumask_raise_softirq(&cpumask, RCU_SOFTIRQ);
+        rcu_kick_pending_cpus();
     }
 }
 
@@ -291,6 +361,26 @@ void call_rcu(struct rcu_head *head,
     local_irq_restore(flags);
 }
 
+/**
+ * rcu_expedite - Speed up invocation of the callbacks queued so far.
+ *
+ * The grace periods the callbacks already queued on this CPU wait for are
+ * expedited: when they start, all CPUs not idle are kicked to report a
+ * quiescent state right away, and this CPU is kicked once they complete,
+ * instead of waiting for all of them to notice on their own.  Sending IPIs
+ * to all CPUs is expensive on large hosts, so this is meant for the few
+ * cases where callback latency is visible to the toolstack, like domain
+ * destruction.
+ */
+void rcu_expedite(void)
+{
+    struct rcu_data *rdp = &this_cpu(rcu_data);
+
+    rdp->expedite = true;
+    rdp->process_callbacks = true;
+    raise_softirq(RCU_SOFTIRQ);
+}
+
 /*
  * Invoke the completed RCU callbacks. They are expected to be in
  * a per-cpu list.
@@ -326,18 +416,65 @@ static void rcu_do_batch(struct rcu_data *rdp)
  * - A new grace period is started.
  *   This is done by rcu_start_batch. The start is not broadcasted to
  *   all cpus, they must pick this up by comparing rcp->cur with
- *   rdp->quiescbatch. All cpus are recorded  in the
- *   rcu_ctrlblk.cpumask bitmap.
+ *   rdp->quiescbatch. All cpus not idle are recorded in the qsmask of
+ *   their rcu_node, and the number of nodes with any cpu recorded in
+ *   rcu_ctrlblk.nodes_pending.
  * - All cpus must go through a quiescent state.
  *   Since the start of the grace period is not broadcasted, at least two
  *   calls to rcu_check_quiescent_state are required:
  *   The first call just notices that a new grace period is running. The
  *   following calls check if there was a quiescent state since the beginning
- *   of the grace period. If so, it updates rcu_ctrlblk.cpumask. If
- *   the bitmap is empty, then the grace period is completed.
- *   rcu_check_quiescent_state calls rcu_start_batch(0) to start the next grace
+ *   of the grace period. If so, it clears the cpu in its node's qsmask. If
+ *   that is empty, nodes_pending is decremented, and once it drops to zero
+ *   the grace period is completed.
+ *   rcu_check_quiescent_state calls rcu_start_batch to start the next grace
  *   period (if necessary).
+ * Grace periods are expedited by kicking all cpus recorded when starting
+ * them, see rcu_expedite().
+ */
+/*
+ * Clear @mask in the qsmask of @rnp for grace period @batch.  Returns true
+ * if this completed the grace period, in which case the caller has to call
+ * rcu_batch_completed().
  */
+static bool rcu_report_qs(struct rcu_ctrlblk *rcp, struct rcu_node *rnp,
+                          unsigned long mask, long batch)
+{
+    bool node_done;
+
+    spin_lock(&rnp->lock);
+    /*
+     * rdp->quiescbatch/rcp->cur and the node can come out of sync during
+     * cpu startup.  Ignore the quiescent state then.
+     */
+    if ( rnp->batch != batch || !(rnp->qsmask & mask) )
+    {
+        spin_unlock(&rnp->lock);
+        return false;
+    }
+    rnp->qsmask &= ~mask;
+    node_done = !rnp->qsmask;
+    spin_unlock(&rnp->lock);
+
+    return node_done && atomic_dec_and_test(&rcp->nodes_pending);
+}
+
+/*
+ * The current grace period has completed: kick the cpus waiting for it to be
+ * expedited.  Caller must hold rcu_ctrlblk.lock.
+ */
+static void rcu_batch_completed(struct rcu_ctrlblk *rcp)
+{
+    rcp->completed = rcp->cur;
+
+    if ( unlikely(!cpumask_empty(&rcp->expedite_cpumask)) &&
+         !rcu_batch_before(rcp->completed, rcp->expedited) )
+    {
+        cpumask_raise_softirq(&rcp->expedite_cpumask, RCU_SOFTIRQ);
+        cpumask_clear(&rcp->expedite_cpumask);
+    }
+}
+
 /*
  * Register a new batch of callbacks, and start it up if there is currently no
  * active batch and the batch to be registered has not already occurred.
@@ -345,41 +482,86 @@ static void rcu_do_batch(struct rcu_data *rdp)
  */
 static void rcu_start_batch(struct rcu_ctrlblk *rcp)
 {
-    if (rcp->next_pending &&
-        rcp->completed == rcp->cur) {
+    while (rcp->next_pending &&
+           rcp->completed == rcp->cur) {
+        long batch = rcp->cur + 1;
+        unsigned int i;
+
         rcp->next_pending = 0;
+
+        /* Hold off completion until the idle cpus have been accounted. */
+        atomic_set(&rcp->nodes_pending, 1);
+        for ( i = 0; i < rcu_nr_nodes(); i++ )
+        {
+            struct rcu_node *rnp = &rcu_nodes[i];
+            unsigned long qsmask = rcu_node_bits(rnp, &cpu_online_map);
+
+            spin_lock(&rnp->lock);
+            rnp->batch = batch;
+            rnp->qsmask = qsmask;
+            spin_unlock(&rnp->lock);
+
+            if ( qsmask )
+                atomic_inc(&rcp->nodes_pending);
+        }
+
         /*
-         * next_pending == 0 must be visible in
+         * next_pending == 0 and the nodes must be visible in
          * __rcu_process_callbacks() before it can see new value of cur.
          */
         smp_wmb();
-        rcp->cur++;
+        rcp->cur = batch;
 
        /*
         * Make sure the increment of rcp->cur is visible so, even if a
-        * CPU that is about to go idle, is captured inside rcp->cpumask,
+        * CPU that is about to go idle, is not seen in rcp->idle_cpumask,
         * rcu_pending() will return false, which then means cpu_quiet()
         * will be invoked, before the CPU would actually enter idle.
         *
         * This barrier is paired with the one in rcu_idle_enter().
         */
         smp_mb();
-        cpumask_andnot(&rcp->cpumask, &cpu_online_map, &rcp->idle_cpumask);
+        for ( i = 0; i < rcu_nr_nodes(); i++ )
+        {
+            struct rcu_node *rnp = &rcu_nodes[i];
+            unsigned long idle = rcu_node_bits(rnp, &rcp->idle_cpumask);
+
+            if ( idle )
+                rcu_report_qs(rcp, rnp, idle, batch);
+        }
+
+        if ( !atomic_dec_and_test(&rcp->nodes_pending) )
+        {
+            if ( unlikely(!rcu_batch_before(rcp->expedited, batch)) )
+            {
+                perfc_incr(rcu_expedited);
+                rcu_kick_pending_cpus();
+            }
+            break;
+        }
+
+        /* All cpus were idle: batch completed already. */
+        rcu_batch_completed(rcp);
     }
 }
 
 /*
- * cpu went through a quiescent state since the beginning of the grace period.
- * Clear it from the cpu mask and complete the grace period if it was the last
- * cpu. Start another grace period if someone has further entries pending
+ * cpu went through a quiescent state since the beginning of grace period
+ * @batch.  Clear it from its node, and complete the grace period if it was
+ * the last cpu. Start another grace period if someone has further entries
+ * pending.
  */
-static void cpu_quiet(int cpu, struct rcu_ctrlblk *rcp)
+static void cpu_quiet(unsigned int cpu, struct rcu_ctrlblk *rcp, long batch)
 {
-    cpumask_clear_cpu(cpu, &rcp->cpumask);
-    if (cpumask_empty(&rcp->cpumask)) {
+    struct rcu_node *rnp = rcu_node_of(cpu);
+
+    if ( rcu_report_qs(rcp, rnp, 1UL << (cpu % RCU_FANOUT), batch) )
+    {
         /* batch completed ! */
-        rcp->completed = rcp->cur;
+        spin_lock(&rcp->lock);
+        rcu_batch_completed(rcp);
         rcu_start_batch(rcp);
+        spin_unlock(&rcp->lock);
     }
 }
 
@@ -407,14 +589,45 @@ static void rcu_check_quiescent_state(struct rcu_ctrlblk *rcp,
 
     rdp->qs_pending = 0;
 
+    cpu_quiet(rdp->cpu, rcp, rdp->quiescbatch);
+}
+
+/*
+ * Callbacks queued while the batch of this cpu has not started yet are
+ * added to that batch, instead of waiting for a grace period of their own.
+ */
+static void rcu_merge_batch(struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
+{
     spin_lock(&rcp->lock);
-    /*
-     * rdp->quiescbatch/rcp->cur and the cpu bitmap can come out of sync
-     * during cpu startup. Ignore the quiescent state.
-     */
-    if (likely(rdp->quiescbatch == rcp->cur))
-        cpu_quiet(rdp->cpu, rcp);
+    if ( rcu_batch_before(rcp->cur, rdp->batch) )
+    {
+        local_irq_disable();
+        *rdp->curtail = rdp->nxtlist;
+        rdp->curtail = rdp->nxttail;
+        rdp->nxtlist = NULL;
+        rdp->nxttail = &rdp->nxtlist;
+        local_irq_enable();
+    }
+    spin_unlock(&rcp->lock);
+}
+
+/* Have the batch of this cpu expedited, and kick this cpu once it is done. */
+static void rcu_expedite_batch(struct rcu_ctrlblk *rcp, struct rcu_data *rdp)
+{
+    spin_lock(&rcp->lock);
+    if ( rcu_batch_before(rcp->completed, rdp->batch) )
+    {
+        if ( rcu_batch_before(rcp->expedited, rdp->batch) )
+            rcp->expedited = rdp->batch;
+        cpumask_set_cpu(rdp->cpu, &rcp->expedite_cpumask);
 
+        /* The grace period in progress has to complete first. */
+        if ( rcp->cur != rcp->completed )
+        {
+            perfc_incr(rcu_expedited);
+            rcu_kick_pending_cpus();
+        }
+    }
     spin_unlock(&rcp->lock);
 }
 
@@ -458,9 +671,20 @@ static void __rcu_process_callbacks(struct rcu_ctrlblk *rcp,
             rcu_start_batch(rcp);
             spin_unlock(&rcp->lock);
         }
+    } else if (rdp->nxtlist && rcu_batch_before(rcp->cur, rdp->batch)) {
+        local_irq_enable();
+        rcu_merge_batch(rcp, rdp);
     } else {
         local_irq_enable();
     }
+
+    if (unlikely(rdp->expedite)) {
+        if (rdp->curlist)
+            rcu_expedite_batch(rcp, rdp);
+        /* Callbacks not in a batch yet still need to be expedited. */
+        rdp->expedite = rdp->nxtlist != NULL;
+    }
+
     rcu_check_quiescent_state(rcp, rdp);
     if (rdp->donelist)
         rcu_do_batch(rdp);
@@ -579,7 +803,7 @@ static void cf_check rcu_idle_timer_handler(void* data)
 {
     perfc_incr(rcu_idle_timer);
 
-    if ( !cpumask_empty(&rcu_ctrlblk.cpumask) )
+    if ( rcu_ctrlblk.cur != rcu_ctrlblk.completed )
         idle_timer_period = min(idle_timer_period + IDLE_TIMER_PERIOD_INCR,
                                 IDLE_TIMER_PERIOD_MAX);
     else
@@ -614,8 +838,12 @@ static void rcu_offline_cpu(struct rcu_data *this_rdp,
      * indefinitely waiting for it, so flush it here.
      */
     spin_lock(&rcp->lock);
-    if (rcp->cur != rcp->completed)
-        cpu_quiet(rdp->cpu, rcp);
+    if (rcp->cur != rcp->completed &&
+        rcu_report_qs(rcp, rcu_node_of(rdp->cpu),
+                      1UL << (rdp->cpu % RCU_FANOUT), rcp->cur)) {
+        rcu_batch_completed(rcp);
+        rcu_start_batch(rcp);
+    }
     spin_unlock(&rcp->lock);
 
     rcu_move_batch(this_rdp, rdp->donelist, rdp->donetail);
@@ -670,6 +898,7 @@ static struct notifier_block cpu_nfb = {
 void __init rcu_init(void)
 {
     void *cpu = (void *)(long)smp_processor_id();
+    unsigned int i;
     static unsigned int __initdata idle_timer_period_ms =
                                     IDLE_TIMER_PERIOD_DEFAULT / MILLISECS(1);
     integer_param("rcu-idle-timer-period-ms", idle_timer_period_ms);
@@ -685,6 +914,14 @@ void __init rcu_init(void)
     }
     idle_timer_period = MILLISECS(idle_timer_period_ms);
 
+    BUILD_BUG_ON(BITS_PER_LONG % RCU_FANOUT);
+    for ( i = 0; i < ARRAY_SIZE(rcu_nodes); i++ )
+    {
+        spin_lock_init(&rcu_nodes[i].lock);
+        rcu_nodes[i].batch = rcu_ctrlblk.completed;
+        rcu_nodes[i].first = i * RCU_FANOUT;
+    }
+
     cpumask_clear(&rcu_ctrlblk.idle_cpumask);
     cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
     register_cpu_notifier(&cpu_nfb);
@@ -703,7 +940,7 @@ void rcu_idle_enter(unsigned int cpu)
      * If some other CPU is starting a new grace period, we'll notice that
      * by seeing a new value in rcp->cur (different than our quiescbatch).
      * That will force us all the way until cpu_quiet(), clearing our bit
-     * in rcp->cpumask, even in case we managed to get in there.
+     * in our node's qsmask, even in case we managed to get in there.
      *
      * Se the comment before cpumask_andnot() in  rcu_start_batch().
      */
@@ -87,6 +87,76 @@ DEFINE_PER_CPU(cpumask_t, cpumask_scratch);
 /* How many urgent vcpus. */
 DEFINE_PER_CPU(atomic_t, sched_urgent_count);
 
+/* Exit latency of the current idle state. */
+DEFINE_PER_CPU(unsigned int, cpu_idle_latency);
+
+#ifdef CONFIG_HYPFS
+/*
+ * Latency histograms of a scheduling resource.  Updated only by the master
+ * cpu of the resource with the schedule lock held, read without locking.
+ */
+struct sched_lat_stats {
+    uint64_t hist[SCHED_LAT_NR][SCHED_LAT_BUCKETS];
+};
+static DEFINE_PER_CPU(struct sched_lat_stats, sched_lat);
+
+static void sched_lat_account(unsigned int cpu, enum sched_lat_type type,
+                              s_time_t delta)
+{
+    unsigned int bucket = 0;
+
+    if ( delta > 0 )
+        bucket = min_t(unsigned int, fls64(delta >> 10),
+                       SCHED_LAT_BUCKETS - 1);
+
+    per_cpu(sched_lat, cpu).hist[type][bucket]++;
+}
+
+static void sched_lat_reset(unsigned int cpu)
+{
+    memset(&per_cpu(sched_lat, cpu), 0, sizeof(struct sched_lat_stats));
+}
+
+int sched_lat_read(const struct cpupool *c, enum sched_lat_type type,
+                   XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    char line[SCHED_LAT_LINE_LEN + 1];
+    unsigned int bucket, cpu;
+
+    for ( bucket = 0; bucket < SCHED_LAT_BUCKETS; bucket++ )
+    {
+        uint64_t cnt = 0;
+
+        for_each_cpu ( cpu, c->res_valid )
+            cnt += read_atomic(&per_cpu(sched_lat, cpu).hist[type][bucket]);
+
+        if ( bucket < SCHED_LAT_BUCKETS - 1 )
+            snprintf(line, sizeof(line), "%10"PRIu64" %20"PRIu64"\n",
+                     (uint64_t)1 << (bucket + 10), cnt);
+        else
+            snprintf(line, sizeof(line), "%10s %20"PRIu64"\n", "inf", cnt);
+
+        if ( copy_to_guest(uaddr, line, SCHED_LAT_LINE_LEN) )
+            return -EFAULT;
+        guest_handle_add_offset(uaddr, SCHED_LAT_LINE_LEN);
+    }
+
+    return copy_to_guest(uaddr, "", 1) ? -EFAULT : 0;
+}
+
+#else /* CONFIG_HYPFS */
+
+static void sched_lat_account(unsigned int cpu, enum sched_lat_type type,
+                              s_time_t delta)
+{
+}
+
+static void sched_lat_reset(unsigned int cpu)
+{
+}
+
+#endif /* CONFIG_HYPFS */
+
 extern const struct scheduler *__start_schedulers_array[], *__end_schedulers_array[];
 #define NUM_SCHEDULERS (__end_schedulers_array - __start_schedulers_array)
 #define schedulers __start_schedulers_array
@@ -343,6 +413,28 @@ uint64_t get_cpu_idle_time(unsigned int cpu)
     return state.time[RUNSTATE_running];
 }
 
+/*
+ * How long the scheduler expects the current cpu to stay idle, STIME_MAX if
+ * it can't tell.  Called by the idle loop with interrupts disabled, so the
+ * scheduler's hook mustn't take any locks.
+ */
+s_time_t sched_expected_idle_time(void)
+{
+    unsigned int cpu = smp_processor_id();
+    const struct sched_resource *sr;
+    s_time_t expected = STIME_MAX;
+
+    rcu_read_lock(&sched_res_rculock);
+
+    sr = get_sched_res(cpu);
+    if ( sr && sr->scheduler )
+        expected = sched_expected_idle(sr->scheduler, cpu);
+
+    rcu_read_unlock(&sched_res_rculock);
+
+    return expected;
+}
+
 /*
  * If locks are different, take the one with the lower address first.
  * This avoids dead- or live-locks when this code is running on both
@@ -963,7 +1055,11 @@ void vcpu_wake(struct vcpu *v)
     if ( likely(vcpu_runnable(v)) )
     {
         if ( v->runstate.state >= RUNSTATE_blocked )
+        {
             vcpu_runstate_change(v, RUNSTATE_runnable, NOW());
+            if ( !unit->is_running )
+                unit->woken = true;
+        }
         /*
          * Call sched_wake() unconditionally, even if unit is running already.
          * We might have not been de-scheduled after vcpu_sleep_nosync_locked()
@@ -1520,6 +1616,80 @@ long vcpu_yield(void)
     return 0;
 }
 
+/* Have the scheduler favour v, if it has been preempted. */
+static bool vcpu_boost(struct vcpu *v)
+{
+    struct sched_unit *unit = v->sched_unit;
+    spinlock_t *lock;
+    bool boosted = false;
+
+    rcu_read_lock(&sched_res_rculock);
+
+    lock = unit_schedule_lock_irq(unit);
+    if ( v->runstate.state == RUNSTATE_runnable && !unit->is_running )
+    {
+        sched_boost(unit_scheduler(unit), unit);
+        boosted = true;
+    }
+    unit_schedule_unlock_irq(lock, unit);
+
+    rcu_read_unlock(&sched_res_rculock);
+
+    if ( boosted )
+        SCHED_STAT_CRANK(vcpu_boost);
+
+    return boosted;
+}
+
+/* Directed yield to vcpu vcpu_id of the current domain. */
+static long vcpu_yield_to(unsigned int vcpu_id)
+{
+    struct vcpu *curr = current;
+    struct vcpu *v = domain_vcpu(curr->domain, vcpu_id);
+
+    if ( !v )
+        return -ENOENT;
+
+    if ( v->sched_unit != curr->sched_unit )
+        vcpu_boost(v);
+
+    return vcpu_yield();
+}
+
+/*
+ * The current vcpu is spinning (e.g. a pause loop exit was detected), most
+ * likely waiting for a lock held by a preempted vcpu of its domain.  Boost
+ * one of the preempted vcpus, going round robin in order to not always pick
+ * the same one, and yield.
+ */
+void vcpu_yield_on_spin(void)
+{
+    struct vcpu *curr = current;
+    struct domain *d = curr->domain;
+    unsigned int i, id = read_atomic(&d->last_boosted_vcpu);
+
+    for ( i = 1; i < d->max_vcpus; i++ )
+    {
+        struct vcpu *v;
+
+        if ( ++id >= d->max_vcpus )
+            id = 0;
+
+        v = d->vcpu[id];
+        if ( !v || v->sched_unit == curr->sched_unit ||
+             v->runstate.state != RUNSTATE_runnable )
+            continue;
+
+        if ( vcpu_boost(v) )
+        {
+            write_atomic(&d->last_boosted_vcpu, id);
+            break;
+        }
+    }
+
+    vcpu_yield();
+}
+
 static void cf_check domain_watchdog_timeout(void *data)
 {
     struct domain *d = data;
@@ -1994,6 +2164,19 @@ ret_t do_sched_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case SCHEDOP_yield_to:
+    {
+        struct sched_yield_to sched_yield_to;
+
+        ret = -EFAULT;
+        if ( copy_from_guest(&sched_yield_to, arg, 1) )
+            break;
+
+        ret = vcpu_yield_to(sched_yield_to.vcpu);
+
+        break;
+    }
+
     default:
         ret = -ENOSYS;
     }
@@ -2046,6 +2229,15 @@ int sched_id(void)
     return ops.sched_id;
 }
 
+/*
+ * Is @cpu running its idle vCPU?  This is only a snapshot, useful for
+ * picking CPUs to hand background work to.
+ */
+bool sched_cpu_is_idle(unsigned int cpu)
+{
+    return cpu_online(cpu) && is_idle_unit(curr_on_cpu(cpu));
+}
+
 /* Adjust scheduling parameter for a given domain. */
 long sched_adjust(struct domain *d, struct xen_domctl_scheduler_op *op)
 {
@@ -2178,6 +2370,20 @@ static void sched_switch_units(struct sched_resource *sr,
         TRACE_4D(TRC_SCHED_SWITCH, prev->domain->domain_id, prev->unit_id,
                  next->domain->domain_id, next->unit_id);
 
+        if ( !is_idle_unit(prev) )
+            sched_lat_account(sr->master_cpu, SCHED_LAT_SLICE,
+                              now - prev->state_entry_time);
+        if ( !is_idle_unit(next) &&
+             next->vcpu_list->runstate.state == RUNSTATE_runnable )
+        {
+            s_time_t wait = now - next->vcpu_list->runstate.state_entry_time;
+
+            sched_lat_account(sr->master_cpu, SCHED_LAT_RUNQ, wait);
+            if ( next->woken )
+                sched_lat_account(sr->master_cpu, SCHED_LAT_WAKEUP, wait);
+        }
+        next->woken = false;
+
         ASSERT(!unit_running(next));
 
         /*
@@ -2475,6 +2681,14 @@ static struct vcpu *sched_force_context_switch(struct vcpu *vprev,
  * Either returns the new unit to run, or NULL if no context switch is
  * required or (on Arm) has already been performed. If NULL is returned
  * sched_res_rculock has been dropped.
+ * While waiting the counter is only read, and the lock is taken again only
+ * when the counter dropped to zero or there is something else to handle,
+ * so the waiting cpus don't slow down the arrival of the others.
+ * The rendezvous for leaving context_switch() must be done even if the unit
+ * doesn't change: the vcpus of a unit can still switch (e.g. between guest
+ * vcpu and idle), and it guarantees that no cpu starts the next rendezvous
+ * (setting the counter again) before all others have seen it dropping to
+ * zero in the lockless wait loop.
  */
 static struct sched_unit *sched_wait_rendezvous_in(struct sched_unit *prev,
                                                    spinlock_t **lock, int cpu,
@@ -2547,7 +2761,13 @@ static struct sched_unit *sched_wait_rendezvous_in(struct sched_unit *prev,
 
         pcpu_schedule_unlock_irq(*lock, cpu);
 
-        cpu_relax();
+        do {
+            cpu_relax();
+        } while ( read_atomic(&prev->rendezvous_in_cnt) &&
+                  !(v && v->force_context_switch) && !rcu_pending(cpu) &&
+                  !(is_idle_unit(prev) &&
+                    (per_cpu(tasklet_work_to_do, cpu) & TASKLET_enqueued)) &&
+                  sr == get_sched_res(cpu) && scheduler_active );
 
         *lock = pcpu_schedule_lock_irq(cpu);
 
@@ -3122,6 +3342,9 @@ int schedule_cpu_add(unsigned int cpu, struct cpupool *c)
      */
     old_lock = pcpu_schedule_lock_irqsave(cpu, &flags);
 
+    /* Don't account the history of the cpu to its new cpupool. */
+    sched_lat_reset(cpu);
+
     if ( cpupool_get_granularity(c) > 1 )
     {
         const cpumask_t *mask;
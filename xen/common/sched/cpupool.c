@@ -1251,6 +1251,52 @@ static char granstr[SCHED_GRAN_NAME_LEN] = {
     [SCHED_GRAN_NAME_LEN - 1] = 0
 };
 
+static int cf_check cpupool_lat_read(
+    const struct hypfs_entry *entry, XEN_GUEST_HANDLE_PARAM(void) uaddr);
+
+static unsigned int cf_check cpupool_lat_getsize(
+    const struct hypfs_entry *entry)
+{
+    return SCHED_LAT_STR_LEN;
+}
+
+static const struct hypfs_funcs cpupool_lat_funcs = {
+    .enter = hypfs_node_enter,
+    .exit = hypfs_node_exit,
+    .read = cpupool_lat_read,
+    .write = hypfs_write_deny,
+    .getsize = cpupool_lat_getsize,
+    .findentry = hypfs_leaf_findentry,
+};
+
+static HYPFS_VARSIZE_INIT(cpupool_lat_wakeup, XEN_HYPFS_TYPE_STRING,
+                          "sched-latency-wakeup", 0, &cpupool_lat_funcs);
+static HYPFS_VARSIZE_INIT(cpupool_lat_runq, XEN_HYPFS_TYPE_STRING,
+                          "sched-latency-runq", 0, &cpupool_lat_funcs);
+static HYPFS_VARSIZE_INIT(cpupool_lat_slice, XEN_HYPFS_TYPE_STRING,
+                          "sched-latency-slice", 0, &cpupool_lat_funcs);
+
+static int cf_check cpupool_lat_read(
+    const struct hypfs_entry *entry, XEN_GUEST_HANDLE_PARAM(void) uaddr)
+{
+    const struct hypfs_dyndir_id *data;
+    const struct cpupool *cpupool;
+    enum sched_lat_type type;
+
+    data = hypfs_get_dyndata();
+    cpupool = data->data;
+    ASSERT(cpupool);
+
+    if ( entry == &cpupool_lat_wakeup.e )
+        type = SCHED_LAT_WAKEUP;
+    else if ( entry == &cpupool_lat_runq.e )
+        type = SCHED_LAT_RUNQ;
+    else
+        type = SCHED_LAT_SLICE;
+
+    return sched_lat_read(cpupool, type, uaddr);
+}
+
 static const struct hypfs_funcs cpupool_dir_funcs = {
     .enter = cpupool_dir_enter,
     .exit = cpupool_dir_exit,
@@ -1268,6 +1314,13 @@ static void cpupool_hypfs_init(void)
     hypfs_add_dyndir(&cpupool_dir, &cpupool_pooldir);
     hypfs_string_set_reference(&cpupool_gran, granstr);
     hypfs_add_leaf(&cpupool_pooldir, &cpupool_gran, true);
+    /* The contents are generated by cpupool_lat_read(). */
+    hypfs_string_set_reference(&cpupool_lat_wakeup, "");
+    hypfs_string_set_reference(&cpupool_lat_runq, "");
+    hypfs_string_set_reference(&cpupool_lat_slice, "");
+    hypfs_add_leaf(&cpupool_pooldir, &cpupool_lat_wakeup, true);
+    hypfs_add_leaf(&cpupool_pooldir, &cpupool_lat_runq, true);
+    hypfs_add_leaf(&cpupool_pooldir, &cpupool_lat_slice, true);
 }
 
 #else /* CONFIG_HYPFS */
@@ -1176,6 +1176,29 @@ csched_unit_yield(const struct scheduler *ops, struct sched_unit *unit)
     set_bit(CSCHED_FLAG_UNIT_YIELD, &svc->flags);
 }
 
+static void cf_check
+csched_unit_boost(const struct scheduler *ops, struct sched_unit *unit)
+{
+    struct csched_unit * const svc = CSCHED_UNIT(unit);
+
+    /*
+     * Like when waking up, temporarily boost the UNIT, so it preempts UNITs
+     * which are not boosted themselves.  Again, this is reset in the credit
+     * accounting if the UNIT keeps on running.
+     */
+    if ( !__unit_on_runq(svc) || svc->pri != CSCHED_PRI_TS_UNDER ||
+         test_bit(CSCHED_FLAG_UNIT_PARKED, &svc->flags) )
+        return;
+
+    TRACE_2D(TRC_CSCHED_BOOST_START, unit->domain->domain_id, unit->unit_id);
+    SCHED_STAT_CRANK(unit_boost);
+    svc->pri = CSCHED_PRI_TS_BOOST;
+
+    runq_remove(svc);
+    runq_insert(svc);
+    __runq_tickle(svc);
+}
+
 static int cf_check
 csched_dom_cntl(
     const struct scheduler *ops,
@@ -2256,6 +2279,7 @@ static const struct scheduler sched_credit_def = {
     .sleep          = csched_unit_sleep,
     .wake           = csched_unit_wake,
     .yield          = csched_unit_yield,
+    .boost          = csched_unit_boost,
 
     .adjust         = csched_dom_cntl,
     .adjust_affinity= csched_aff_cntl,
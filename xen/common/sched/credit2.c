@@ -19,6 +19,7 @@
 #include <xen/event.h>
 #include <xen/time.h>
 #include <xen/perfc.h>
+#include <xen/rbtree.h>
 #include <xen/softirq.h>
 #include <asm/div64.h>
 #include <xen/errno.h>
@@ -257,6 +258,11 @@
  * MIN_TIMER.
  */
 #define CSCHED2_MIGRATE_RESIST       ((opt_migrate_resist)*MICROSECS(1))
+/*
+ * Cross-LLC migration resistance: moving to a pcpu not sharing the last level
+ * cache means refilling it from memory, which costs more.
+ */
+#define CSCHED2_LLC_MIGRATE_RESIST   (2 * CSCHED2_MIGRATE_RESIST)
 /* How much to "compensate" an unit for L2 migration. */
 #define CSCHED2_MIGRATE_COMPENSATION MICROSECS(50)
 /* How tolerant we should be when peeking at runtime of units on other cpus */
@@ -267,6 +273,13 @@
 #define CSCHED2_MAX_TIMER            CSCHED2_CREDIT_INIT
 /* Period of the cap replenishment timer. */
 #define CSCHED2_BDGT_REPL_PERIOD     ((opt_cap_period)*MILLISECS(1))
+/*
+ * Wakeup intervals longer than this don't matter for the choice of C-states,
+ * and aren't tracked.
+ */
+#define CSCHED2_WAKE_INTERVAL_MAX    MILLISECS(50)
+/* Weight of the last interval in the decaying average, as a shift. */
+#define CSCHED2_WAKE_INTERVAL_SHIFT  3
 
 /*
  * Flags
@@ -313,6 +326,16 @@
  */
 #define __CSFLAG_pinned 5
 #define CSFLAG_pinned (1U<<__CSFLAG_pinned)
+/*
+ * CSFLAG_boosted: this unit was preempted while another unit of its domain
+ * is waiting for it (see csched2_unit_boost()). It is sorted in front of all
+ * the not boosted units of its runqueue, until it is taken off it. Hence,
+ * runq_first() is not necessarily the unit with the most credit. Where that
+ * matters, i.e. for deciding about credit resets, runq_first_unboosted() is
+ * used instead.
+ */
+#define __CSFLAG_boosted 6
+#define CSFLAG_boosted (1U<<__CSFLAG_boosted)
 
 static unsigned int __read_mostly opt_migrate_resist = 500;
 integer_param("sched_credit2_migrate_resist", opt_migrate_resist);
@@ -425,6 +448,10 @@ integer_param("credit2_cap_period_ms", opt_cap_period);
  *             core of the host. This will happen if the opt_runqueue
  *             parameter is set to 'core';
  *
+ * - per-llc: meaning that there will be one runqueue per each last level
+ *            cache (e.g., each CCX of an AMD EPYC socket) of the host. This
+ *            will happen if the opt_runqueue parameter is set to 'llc';
+ *
  * - per-socket: meaning that there will be one runqueue per each physical
  *               socket (AKA package, which often, but not always, also
  *               matches a NUMA node) of the host; This will happen if
@@ -439,17 +466,20 @@ integer_param("credit2_cap_period_ms", opt_cap_period);
  *           the opt_runqueue parameter is set to 'all'.
  *
  * Depending on the value of opt_runqueue, therefore, cpus that are part of
- * either the same physical core, the same physical socket, the same NUMA
- * node, or just all of them, will be put together to form runqueues.
+ * either the same physical core, the same last level cache, the same physical
+ * socket, the same NUMA node, or just all of them, will be put together to
+ * form runqueues.
  */
 #define OPT_RUNQUEUE_CPU    0
 #define OPT_RUNQUEUE_CORE   1
-#define OPT_RUNQUEUE_SOCKET 2
-#define OPT_RUNQUEUE_NODE   3
-#define OPT_RUNQUEUE_ALL    4
+#define OPT_RUNQUEUE_LLC    2
+#define OPT_RUNQUEUE_SOCKET 3
+#define OPT_RUNQUEUE_NODE   4
+#define OPT_RUNQUEUE_ALL    5
 static const char *const opt_runqueue_str[] = {
     [OPT_RUNQUEUE_CPU] = "cpu",
     [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_LLC] = "llc",
     [OPT_RUNQUEUE_SOCKET] = "socket",
     [OPT_RUNQUEUE_NODE] = "node",
     [OPT_RUNQUEUE_ALL] = "all"
@@ -496,7 +526,8 @@ struct csched2_runqueue_data {
     spinlock_t lock;           /* Lock for this runqueue                     */
 
     struct list_head rql;      /* List of runqueues                          */
-    struct list_head runq;     /* Ordered list of runnable vms               */
+    struct rb_root runq;       /* Runnable units, ordered by credit          */
+    struct rb_node *runq_first; /* Leftmost (highest credit) entry of runq   */
     unsigned int refcnt;       /* How many CPUs reference this runqueue      */
                                /* (including not yet active ones)            */
     unsigned int nr_cpus;      /* How many CPUs are sharing this runqueue    */
@@ -516,6 +547,8 @@ struct csched2_runqueue_data {
     struct list_head svc;      /* List of all units assigned to the runqueue */
     unsigned int max_weight;   /* Max weight of the units in this runqueue   */
     unsigned int pick_bias;    /* Last picked pcpu. Start from it next time  */
+    s_time_t last_wake;        /* Time of the last wakeup of an unit         */
+    s_time_t wake_interval;    /* Decaying average time between wakeups      */
 };
 
 /*
@@ -565,7 +598,7 @@ struct csched2_unit {
     s_time_t load_last_update;         /* Last time average was updated       */
     s_time_t avgload;                  /* Decaying queue load                 */
 
-    struct list_head runq_elem;        /* On the runqueue (rqd->runq)         */
+    struct rb_node runq_elem;          /* On the runqueue (rqd->runq)         */
     struct list_head parked_elem;      /* On the parked_units list            */
     struct list_head rqd_elem;         /* On csched2_runqueue_data's svc list */
     struct csched2_runqueue_data *migrate_rqd; /* Pre-determined migr. target */
@@ -832,12 +865,35 @@ static s_time_t c2t(const struct csched2_runqueue_data *rqd, s_time_t credit,
 
 static inline int unit_on_runq(const struct csched2_unit *svc)
 {
-    return !list_empty(&svc->runq_elem);
+    return !RB_EMPTY_NODE(&svc->runq_elem);
 }
 
-static inline struct csched2_unit * runq_elem(struct list_head *elem)
+static inline struct csched2_unit * runq_elem(struct rb_node *elem)
 {
-    return list_entry(elem, struct csched2_unit, runq_elem);
+    return rb_entry(elem, struct csched2_unit, runq_elem);
+}
+
+/* The unit with the most credit in the runqueue, or NULL if it is empty. */
+static inline struct csched2_unit *
+runq_first(const struct csched2_runqueue_data *rqd)
+{
+    return rqd->runq_first ? runq_elem(rqd->runq_first) : NULL;
+}
+
+/*
+ * The unit with the most credit among the not boosted ones, or NULL.  Boosted
+ * units sit in front of it, but there are rarely more than a few of them.
+ */
+static struct csched2_unit *
+runq_first_unboosted(const struct csched2_runqueue_data *rqd)
+{
+    struct rb_node *iter;
+
+    for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
+        if ( !(runq_elem(iter)->flags & CSFLAG_boosted) )
+            return runq_elem(iter);
+
+    return NULL;
 }
 
 static inline bool same_node(unsigned int cpua, unsigned int cpub)
@@ -850,12 +906,100 @@ static inline bool same_socket(unsigned int cpua, unsigned int cpub)
     return cpu_to_socket(cpua) == cpu_to_socket(cpub);
 }
 
+static inline bool same_llc(unsigned int cpua, unsigned int cpub)
+{
+    return same_socket(cpua, cpub) &&
+           cpu_to_llc(cpua) == cpu_to_llc(cpub);
+}
+
 static inline bool same_core(unsigned int cpua, unsigned int cpub)
 {
     return same_socket(cpua, cpub) &&
            cpu_to_core(cpua) == cpu_to_core(cpub);
 }
 
+/* How much more credit a unit needs for being moved from one pcpu to another. */
+static inline s_time_t migrate_resist(unsigned int from, unsigned int to)
+{
+    if ( from == to )
+        return 0;
+
+    return same_llc(from, to) ? CSCHED2_MIGRATE_RESIST
+                              : CSCHED2_LLC_MIGRATE_RESIST;
+}
+
+/*
+ * How much load moving a unit from cpu to the runqueue rqd must save for it to
+ * be worth it: if they don't share the last level cache, as much as the least
+ * imbalance load balancing acts on when overloaded.  Whether they do is judged
+ * by one pcpu of rqd, which is exact unless runqueues had to be split to
+ * respect sched_credit2_max_cpus_runqueue.
+ */
+static inline s_time_t llc_migrate_load(const struct csched2_private *prv,
+                                        unsigned int cpu,
+                                        const struct csched2_runqueue_data *rqd)
+{
+    if ( cpumask_test_cpu(cpu, &rqd->active) ||
+         same_llc(cpu, rqd->pick_bias) )
+        return 0;
+
+    return 1LL << (prv->load_precision_shift + opt_overload_balance_tolerance);
+}
+
+/*
+ * Like cpumask_test_or_cycle(), but if cpu isn't in mask, prefer the pcpus
+ * sharing its last level cache.  That only matters when runqueues span more
+ * than one LLC.
+ */
+static unsigned int cpumask_test_or_llc(unsigned int cpu, const cpumask_t *mask)
+{
+    unsigned int i;
+
+    if ( opt_runqueue <= OPT_RUNQUEUE_LLC || cpumask_test_cpu(cpu, mask) )
+        return cpumask_test_or_cycle(cpu, mask);
+
+    for_each_cpu ( i, mask )
+        if ( same_llc(cpu, i) )
+            return i;
+
+    return cpumask_cycle(cpu, mask);
+}
+
+/*
+ * Pick an idle pcpu from mask, as cpumask_test_or_llc() would, unless that
+ * one is in a deep C-state and another one sharing its LLC is in a shallower
+ * one.  Waking up the latter is faster, and lets the former save more power.
+ */
+static unsigned int pick_idle_cpu(unsigned int cpu, const cpumask_t *mask)
+{
+    unsigned int i, lat, best = cpumask_test_or_llc(cpu, mask), best_lat;
+
+    if ( best >= nr_cpu_ids )
+        return best;
+
+    best_lat = read_atomic(&per_cpu(cpu_idle_latency, best));
+    if ( !best_lat )
+        return best;
+
+    for_each_cpu ( i, mask )
+    {
+        if ( !same_llc(i, best) )
+            continue;
+
+        lat = read_atomic(&per_cpu(cpu_idle_latency, i));
+        if ( lat < best_lat )
+        {
+            SCHED_STAT_CRANK(tickled_idle_shallow);
+            best = i;
+            best_lat = lat;
+            if ( !lat )
+                break;
+        }
+    }
+
+    return best;
+}
+
 static inline bool
 cpu_runqueue_match(const struct csched2_runqueue_data *rqd, unsigned int cpu)
 {
@@ -866,6 +1010,7 @@ cpu_runqueue_match(const struct csched2_runqueue_data *rqd, unsigned int cpu)
     /* OPT_RUNQUEUE_CPU will never find an existing runqueue. */
     return opt_runqueue == OPT_RUNQUEUE_ALL ||
            (opt_runqueue == OPT_RUNQUEUE_CORE && same_core(peer_cpu, cpu)) ||
+           (opt_runqueue == OPT_RUNQUEUE_LLC && same_llc(peer_cpu, cpu)) ||
            (opt_runqueue == OPT_RUNQUEUE_SOCKET && same_socket(peer_cpu, cpu)) ||
            (opt_runqueue == OPT_RUNQUEUE_NODE && same_node(peer_cpu, cpu));
 }
@@ -1431,43 +1576,97 @@ update_load(const struct scheduler *ops,
         update_svc_load(ops, svc, change, now);
 }
 
+/*
+ * Keep a decaying average of the time between wakeups on a runqueue, from
+ * which csched2_expected_idle() tells the idle governor how long the idle
+ * pcpus of the runqueue can expect to stay idle.  It is read without holding
+ * the runqueue lock.
+ */
+static void update_wake_interval(struct csched2_runqueue_data *rqd,
+                                 s_time_t now)
+{
+    s_time_t delta = now - rqd->last_wake;
+
+    if ( delta < 0 )
+        delta = 0;
+    else if ( delta > CSCHED2_WAKE_INTERVAL_MAX )
+        delta = CSCHED2_WAKE_INTERVAL_MAX;
+
+    write_atomic(&rqd->last_wake, now);
+    write_atomic(&rqd->wake_interval, rqd->wake_interval +
+                 (delta - rqd->wake_interval) /
+                 (1 << CSCHED2_WAKE_INTERVAL_SHIFT));
+}
+
+/*
+ * The runqueue is a red-black tree ordered by credit, so that inserting and
+ * removing a unit is O(log n) in the number of runnable units, rather than
+ * requiring a walk of a sorted list with the runqueue lock held.  Units with
+ * more credit sit to the left, and units with equal credit are kept in the
+ * order they were inserted.  The leftmost entry is cached, as that is the
+ * one looked at most often.
+ *
+ * Boosted units are kept in front of all the others, see runq_candidate().
+ */
+static inline bool runq_before(const struct csched2_unit *svc,
+                               const struct csched2_unit *other)
+{
+    bool boosted = svc->flags & CSFLAG_boosted;
+
+    if ( boosted != !!(other->flags & CSFLAG_boosted) )
+        return boosted;
+
+    return svc->credit > other->credit;
+}
+
 static void runq_insert(struct csched2_unit *svc)
 {
-    struct list_head *iter;
     unsigned int cpu = sched_unit_master(svc->unit);
-    struct list_head *runq = &c2rqd(cpu)->runq;
-    int pos = 0;
+    struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+    bool leftmost = true;
 
     ASSERT(spin_is_locked(get_sched_res(cpu)->schedule_lock));
 
     ASSERT(!unit_on_runq(svc));
     ASSERT(c2r(cpu) == c2r(sched_unit_master(svc->unit)));
 
-    ASSERT(&svc->rqd->runq == runq);
+    ASSERT(svc->rqd == rqd);
     ASSERT(!is_idle_unit(svc->unit));
     ASSERT(!svc->unit->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    while ( *link )
     {
-        struct csched2_unit * iter_svc = runq_elem(iter);
+        parent = *link;
 
-        if ( svc->credit > iter_svc->credit )
-            break;
-
-        pos++;
+        if ( runq_before(svc, runq_elem(parent)) )
+            link = &parent->rb_left;
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
     }
-    list_add_tail(&svc->runq_elem, iter);
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+    if ( leftmost )
+        rqd->runq_first = &svc->runq_elem;
 
     if ( unlikely(tb_init_done) )
     {
+        struct rb_node *iter = &svc->runq_elem;
         struct {
             unsigned unit:16, dom:16;
             unsigned pos;
         } d;
         d.dom = svc->unit->domain->domain_id;
         d.unit = svc->unit->unit_id;
-        d.pos = pos;
+        /* The position isn't known from the insertion, count it. */
+        d.pos = 0;
+        while ( (iter = rb_prev(iter)) != NULL )
+            d.pos++;
         __trace_var(TRC_CSCHED2_RUNQ_POS, 1,
                     sizeof(d),
                     (unsigned char *)&d);
@@ -1476,8 +1675,15 @@ static void runq_insert(struct csched2_unit *svc)
 
 static inline void runq_remove(struct csched2_unit *svc)
 {
+    struct csched2_runqueue_data *rqd = svc->rqd;
+
     ASSERT(unit_on_runq(svc));
-    list_del_init(&svc->runq_elem);
+
+    if ( rqd->runq_first == &svc->runq_elem )
+        rqd->runq_first = rb_next(&svc->runq_elem);
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    RB_CLEAR_NODE(&svc->runq_elem);
+    __clear_bit(__CSFLAG_boosted, &svc->flags);
 }
 
 void burn_credits(struct csched2_runqueue_data *rqd, struct csched2_unit *, s_time_t);
@@ -1541,8 +1747,7 @@ static s_time_t tickle_score(const struct scheduler *ops, s_time_t now,
     burn_credits(rqd, cur, now);
 
     score = new->credit - cur->credit;
-    if ( sched_unit_master(new->unit) != cpu )
-        score -= CSCHED2_MIGRATE_RESIST;
+    score -= migrate_resist(sched_unit_master(new->unit), cpu);
 
     /*
      * If score is positive, it means new has enough credits (i.e.,
@@ -1666,7 +1871,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_unit *new, s_time_t now)
         else
             cpumask_and(&mask, &rqd->smt_idle, online);
         cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
-        i = cpumask_test_or_cycle(cpu, &mask);
+        i = pick_idle_cpu(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
             SCHED_STAT_CRANK(tickled_idle_cpu);
@@ -1682,7 +1887,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_unit *new, s_time_t now)
         cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu), online);
         cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
-        i = cpumask_test_or_cycle(cpu, &mask);
+        i = pick_idle_cpu(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
             SCHED_STAT_CRANK(tickled_idle_cpu);
@@ -2187,7 +2392,7 @@ csched2_alloc_udata(const struct scheduler *ops, struct sched_unit *unit,
         return NULL;
 
     INIT_LIST_HEAD(&svc->rqd_elem);
-    INIT_LIST_HEAD(&svc->runq_elem);
+    RB_CLEAR_NODE(&svc->runq_elem);
 
     svc->sdom = dd;
     svc->unit = unit;
@@ -2287,6 +2492,7 @@ csched2_unit_wake(const struct scheduler *ops, struct sched_unit *unit)
     now = NOW();
 
     update_load(ops, svc->rqd, svc, 1, now);
+    update_wake_interval(svc->rqd, now);
 
     /* Put the UNIT on the runq */
     runq_insert(svc);
@@ -2296,6 +2502,20 @@ out:
     return;
 }
 
+static s_time_t cf_check
+csched2_expected_idle(const struct scheduler *ops, unsigned int cpu)
+{
+    const struct csched2_runqueue_data *rqd = c2rqd(cpu);
+    s_time_t interval = read_atomic(&rqd->wake_interval);
+
+    if ( interval >= CSCHED2_WAKE_INTERVAL_MAX ||
+         NOW() - read_atomic(&rqd->last_wake) >= CSCHED2_WAKE_INTERVAL_MAX )
+        return STIME_MAX;
+
+    /* The wakeups are spread over all idle pcpus of the runqueue. */
+    return interval * max(cpumask_weight(&rqd->idle), 1);
+}
+
 static void cf_check
 csched2_unit_yield(const struct scheduler *ops, struct sched_unit *unit)
 {
@@ -2304,6 +2524,24 @@ csched2_unit_yield(const struct scheduler *ops, struct sched_unit *unit)
     __set_bit(__CSFLAG_unit_yield, &svc->flags);
 }
 
+static void cf_check
+csched2_unit_boost(const struct scheduler *ops, struct sched_unit *unit)
+{
+    struct csched2_unit * const svc = csched2_unit(unit);
+
+    /*
+     * Move the unit to the front of its runqueue. It is not given any extra
+     * credit, but it will be picked up by the next cpu of the runqueue that
+     * yields, which is likely the one of the unit waiting for it.
+     */
+    if ( !unit_on_runq(svc) || (svc->flags & CSFLAG_boosted) )
+        return;
+
+    runq_remove(svc);
+    __set_bit(__CSFLAG_boosted, &svc->flags);
+    runq_insert(svc);
+}
+
 static void cf_check
 csched2_context_saved(const struct scheduler *ops, struct sched_unit *unit)
 {
@@ -2451,7 +2689,8 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
 
         /*
          * If checking a different runqueue, grab the lock, read the avg,
-         * and then release the lock.
+         * and then release the lock. Moving away from our last level cache
+         * counts as extra load there.
          *
          * If on our own runqueue, don't grab or release the lock;
          * but subtract our own load from the runqueue load to simulate
@@ -2463,7 +2702,7 @@ csched2_res_pick(const struct scheduler *ops, const struct sched_unit *unit)
         }
         else if ( spin_trylock(&rqd->lock) )
         {
-            rqd_avgload = rqd->b_avgload;
+            rqd_avgload = rqd->b_avgload + llc_migrate_load(prv, cpu, rqd);
             spin_unlock(&rqd->lock);
         }
 
@@ -2739,6 +2978,13 @@ retry:
         if ( delta < 0 )
             delta = -delta;
 
+        /*
+         * Balancing with a runqueue not sharing our last level cache needs
+         * a larger imbalance, and consider() then only picks moves which
+         * reduce it by more than the cost of refilling the cache.
+         */
+        delta -= llc_migrate_load(prv, cpu, st.orqd);
+
         if ( delta > st.load_delta )
         {
             st.load_delta = delta;
@@ -3221,7 +3467,7 @@ csched2_unit_insert(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     /* csched2_res_pick() expects the pcpu lock to be held */
     lock = unit_schedule_lock_irq(unit);
@@ -3259,7 +3505,7 @@ csched2_unit_remove(const struct scheduler *ops, struct sched_unit *unit)
     spinlock_t *lock;
 
     ASSERT(!is_idle_unit(unit));
-    ASSERT(list_empty(&svc->runq_elem));
+    ASSERT(!unit_on_runq(svc));
 
     SCHED_STAT_CRANK(unit_remove);
 
@@ -3281,7 +3527,7 @@ csched2_runtime(const struct scheduler *ops, int cpu,
     s_time_t time, min_time;
     int rt_credit; /* Proposed runtime measured in credits */
     struct csched2_runqueue_data *rqd = c2rqd(cpu);
-    struct list_head *runq = &rqd->runq;
+    struct csched2_unit *swait = runq_first(rqd);
     const struct csched2_private *prv = csched2_priv(ops);
 
     /*
@@ -3319,10 +3565,8 @@ csched2_runtime(const struct scheduler *ops, int cpu,
      * 2) If there's someone waiting whose credit is positive,
      *    run until your credit ~= his.
      */
-    if ( ! list_empty(runq) )
+    if ( swait )
     {
-        struct csched2_unit *swait = runq_elem(runq->next);
-
         if ( ! is_idle_unit(swait->unit)
              && swait->credit > 0 )
         {
@@ -3377,7 +3621,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_unit *scurr,
                int cpu, s_time_t now)
 {
-    struct list_head *iter, *temp;
+    struct rb_node *iter;
     const struct sched_resource *sr = get_sched_res(cpu);
     struct csched2_unit *snext = NULL;
     struct csched2_private *prv = csched2_priv(sr->scheduler);
@@ -3460,9 +3704,9 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         snext = csched2_unit(sched_idle_unit(cpu));
 
  check_runq:
-    list_for_each_safe( iter, temp, &rqd->runq )
+    for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
     {
-        struct csched2_unit * svc = list_entry(iter, struct csched2_unit, runq_elem);
+        struct csched2_unit * svc = runq_elem(iter);
 
         if ( unlikely(tb_init_done) )
         {
@@ -3483,7 +3727,12 @@ runq_candidate(struct csched2_runqueue_data *rqd,
          * runqueue any further.
          */
         if ( !yield && svc->credit <= snext->credit )
+        {
+            /* Boosted units are not sorted by credit. */
+            if ( svc->flags & CSFLAG_boosted )
+                continue;
             break;
+        }
 
         /* Skip non runnable units that we (temporarily) have in the runq */
         if ( unlikely(!unit_runnable_state(svc->unit)) )
@@ -3506,10 +3755,13 @@ runq_candidate(struct csched2_runqueue_data *rqd,
 
         /*
          * If this is on a different processor, don't pull it unless
-         * its credit is at least CSCHED2_MIGRATE_RESIST higher.
+         * its credit is at least CSCHED2_MIGRATE_RESIST higher (or
+         * CSCHED2_LLC_MIGRATE_RESIST, if the processor doesn't share our
+         * last level cache).
          */
         if ( sched_unit_master(svc->unit) != cpu
-             && snext->credit + CSCHED2_MIGRATE_RESIST > svc->credit )
+             && snext->credit + migrate_resist(sched_unit_master(svc->unit),
+                                               cpu) > svc->credit )
         {
             SCHED_STAT_CRANK(migrate_resisted);
             continue;
@@ -3669,6 +3921,7 @@ static void cf_check csched2_schedule(
     /* Accounting for non-idle tasks */
     if ( !is_idle_unit(snext->unit) )
     {
+        const struct csched2_unit *swait;
         int top_credit;
 
         /* If switching, remove this from the runqueue and mark it scheduled */
@@ -3702,12 +3955,14 @@ static void cf_check csched2_schedule(
          * Here, where we want to check for reset, we need to make sure the
          * proper unit is being used. In fact, runq_candidate() may have not
          * returned the first unit in the runqueue, for various reasons
-         * (e.g., affinity). Only trigger a reset when it does.
+         * (e.g., affinity). Only trigger a reset when it does.  Boosted
+         * units are not sorted by credit, so they don't count here.
          */
-        if ( list_empty(&rqd->runq) )
+        swait = runq_first_unboosted(rqd);
+        if ( !swait )
             top_credit = snext->credit;
         else
-            top_credit = max(snext->credit, runq_elem(rqd->runq.next)->credit);
+            top_credit = max(snext->credit, swait->credit);
         if ( top_credit <= CSCHED2_CREDIT_RESET )
         {
             reset_credit(sched_cpu, now, snext);
@@ -3883,7 +4138,7 @@ csched2_dump(const struct scheduler *ops)
 
     list_for_each_entry ( rqd, &prv->rql, rql )
     {
-        struct list_head *iter, *runq = &rqd->runq;
+        struct rb_node *iter;
         int loop = 0;
 
         /* We need the lock to scan the runqueue. */
@@ -3895,7 +4150,7 @@ csched2_dump(const struct scheduler *ops)
             dump_pcpu(ops, j);
 
         printk("RUNQ:\n");
-        list_for_each( iter, runq )
+        for ( iter = rqd->runq_first; iter; iter = rb_next(iter) )
         {
             const struct csched2_unit *svc = runq_elem(iter);
 
@@ -3955,7 +4210,9 @@ init_cpu_runqueue(struct csched2_private *prv, struct csched2_pcpu *spc,
         BUG_ON(!cpumask_empty(&rqd->active));
         rqd->max_weight = 1;
         INIT_LIST_HEAD(&rqd->svc);
-        INIT_LIST_HEAD(&rqd->runq);
+        rqd->runq = RB_ROOT;
+        rqd->runq_first = NULL;
+        rqd->wake_interval = CSCHED2_WAKE_INTERVAL_MAX;
         spin_lock_init(&rqd->lock);
         prv->active_queues++;
     }
@@ -4227,6 +4484,8 @@ static const struct scheduler sched_credit2_def = {
     .sleep          = csched2_unit_sleep,
     .wake           = csched2_unit_wake,
     .yield          = csched2_unit_yield,
+    .boost          = csched2_unit_boost,
+    .expected_idle  = csched2_expected_idle,
 
     .adjust         = csched2_dom_cntl,
     .adjust_affinity= csched2_aff_cntl,
@@ -310,6 +310,9 @@ struct scheduler {
                                     struct sched_unit *);
     void         (*yield)          (const struct scheduler *,
                                     struct sched_unit *);
+    void         (*boost)          (const struct scheduler *,
+                                    struct sched_unit *);
+    s_time_t     (*expected_idle)  (const struct scheduler *, unsigned int);
     void         (*context_saved)  (const struct scheduler *,
                                     struct sched_unit *);
 
@@ -444,6 +447,23 @@ static inline void sched_yield(const struct scheduler *s,
         s->yield(s, unit);
 }
 
+/*
+ * A preempted unit is likely holding a resource another unit of its domain
+ * is waiting for: let it run as soon as possible.
+ */
+static inline void sched_boost(const struct scheduler *s,
+                               struct sched_unit *unit)
+{
+    if ( s->boost )
+        s->boost(s, unit);
+}
+
+static inline s_time_t sched_expected_idle(const struct scheduler *s,
+                                           unsigned int cpu)
+{
+    return s->expected_idle ? s->expected_idle(s, cpu) : STIME_MAX;
+}
+
 static inline void sched_context_saved(const struct scheduler *s,
                                        struct sched_unit *unit)
 {
@@ -540,6 +560,28 @@ static inline cpumask_t *cpupool_domain_master_cpumask(const struct domain *d)
 
 unsigned int cpupool_get_granularity(const struct cpupool *c);
 
+/*
+ * Scheduling latency histograms, kept per scheduling resource and reported
+ * summed up per cpupool.  Bucket 0 counts values below 1024ns, bucket i
+ * values in [2^(i+9), 2^(i+10)) ns, the last bucket everything above.
+ */
+enum sched_lat_type {
+    SCHED_LAT_WAKEUP,   /* Wakeup to running. */
+    SCHED_LAT_RUNQ,     /* Runnable to running, any reason. */
+    SCHED_LAT_SLICE,    /* Length of time slices. */
+    SCHED_LAT_NR
+};
+
+#define SCHED_LAT_BUCKETS   24
+/* Each bucket is one line "<upper bound in ns> <count>\n" of fixed width. */
+#define SCHED_LAT_LINE_LEN  32
+#define SCHED_LAT_STR_LEN   (SCHED_LAT_BUCKETS * SCHED_LAT_LINE_LEN + 1)
+
+#ifdef CONFIG_HYPFS
+int sched_lat_read(const struct cpupool *c, enum sched_lat_type type,
+                   XEN_GUEST_HANDLE_PARAM(void) uaddr);
+#endif
+
 /*
  * Hard and soft affinity load balancing.
  *
@@ -29,10 +29,30 @@
 static unsigned int timer_slop __read_mostly = 50000; /* 50 us */
 integer_param("timer_slop", timer_slop);
 
+/*
+ * Timer wheel geometry: level n has WHEEL_SLOTS slots of WHEEL_SLOTS^n ticks
+ * each, a tick being 2^WHEEL_TICK_SHIFT ns (~1ms).  The four levels cover
+ * ~4.9 hours; timers expiring later are parked in the last slot in reach.
+ */
+#define WHEEL_TICK_SHIFT 20
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SLOTS      (1U << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS     4
+#define WHEEL_RANGE      (1ULL << (WHEEL_LEVELS * WHEEL_LEVEL_BITS))
+
+struct timer_wheel {
+    /* Timers expiring before the end of tick clk are not on the wheel. */
+    uint64_t clk;
+    /* Bitmaps of the non-empty slots of each level. */
+    uint64_t pending[WHEEL_LEVELS];
+    struct hlist_head slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
 struct timers {
     spinlock_t     lock;
     struct timer **heap;
     struct timer  *list;
+    struct timer_wheel *wheel;
     struct timer  *running;
     struct list_head inactive;
 } __cacheline_aligned;
@@ -176,6 +196,141 @@ static int add_to_list(struct timer **pprev, struct timer *t)
 }
 
 
+/****************************************************************************
+ * TIMER WHEEL OPERATIONS.
+ *
+ * Timers which don't expire within the current tick of the wheel are kept on
+ * a hierarchical timer wheel rather than in the heap, so adding and removing
+ * them is O(1).  When the wheel's clock reaches the start of a slot, all its
+ * timers are moved a level down, or into the heap for those expiring within
+ * the new current tick.  The heap thus only ever holds the timers due next,
+ * and these still expire at their exact time.
+ */
+
+static unsigned int wheel_shift(unsigned int lvl)
+{
+    return lvl * WHEEL_LEVEL_BITS;
+}
+
+static struct hlist_head *wheel_slot(struct timer_wheel *w, unsigned int slot)
+{
+    return &w->slot[slot / WHEEL_SLOTS][slot % WHEEL_SLOTS];
+}
+
+/* Is @expires too close for the wheel? */
+static bool wheel_is_near(const struct timer_wheel *w, s_time_t expires)
+{
+    return expires < (s_time_t)((w->clk + 1) << WHEEL_TICK_SHIFT);
+}
+
+/* Add @t to @w. Return the tick at which its slot is going to be processed. */
+static uint64_t add_to_wheel(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t tick = (uint64_t)t->expires >> WHEEL_TICK_SHIFT;
+    unsigned int lvl, idx;
+
+    ASSERT(tick > w->clk);
+
+    if ( tick - w->clk >= WHEEL_RANGE )
+        tick = w->clk + WHEEL_RANGE - 1;
+
+    for ( lvl = 0; (tick - w->clk) >> wheel_shift(lvl + 1); lvl++ )
+        continue;
+
+    idx = (tick >> wheel_shift(lvl)) & (WHEEL_SLOTS - 1);
+    t->wheel_slot = lvl * WHEEL_SLOTS + idx;
+    hlist_add_head(&t->wheel, &w->slot[lvl][idx]);
+    w->pending[lvl] |= 1ULL << idx;
+
+    return (tick >> wheel_shift(lvl)) << wheel_shift(lvl);
+}
+
+static void remove_from_wheel(struct timer_wheel *w, struct timer *t)
+{
+    unsigned int slot = t->wheel_slot;
+
+    hlist_del(&t->wheel);
+    if ( hlist_empty(wheel_slot(w, slot)) )
+        w->pending[slot / WHEEL_SLOTS] &= ~(1ULL << (slot % WHEEL_SLOTS));
+}
+
+/* First tick at which a slot of @w needs processing, 0 if the wheel is empty. */
+static uint64_t wheel_next_tick(const struct timer_wheel *w)
+{
+    uint64_t next = 0, pending, tick;
+    unsigned int lvl, cur;
+
+    BUILD_BUG_ON(WHEEL_SLOTS != 8 * sizeof(w->pending[0]));
+
+    for ( lvl = 0; lvl < WHEEL_LEVELS; lvl++ )
+    {
+        if ( !w->pending[lvl] )
+            continue;
+
+        /* Rotate the bitmap such that bit 0 is the slot after the current. */
+        cur = ((w->clk >> wheel_shift(lvl)) + 1) & (WHEEL_SLOTS - 1);
+        pending = (w->pending[lvl] >> cur) |
+                  (w->pending[lvl] << ((WHEEL_SLOTS - cur) & (WHEEL_SLOTS - 1)));
+
+        tick = ((w->clk >> wheel_shift(lvl)) + ffs64(pending)) <<
+               wheel_shift(lvl);
+        if ( !next || tick < next )
+            next = tick;
+    }
+
+    return next;
+}
+
+/* Any timer on @w, NULL if the wheel is empty. */
+static struct timer *wheel_any(struct timer_wheel *w)
+{
+    unsigned int lvl;
+
+    for ( lvl = 0; w && lvl < WHEEL_LEVELS; lvl++ )
+        if ( w->pending[lvl] )
+            return hlist_entry(
+                w->slot[lvl][ffs64(w->pending[lvl]) - 1].first,
+                struct timer, wheel);
+
+    return NULL;
+}
+
+static int add_entry(struct timer *t);
+
+/* Advance the wheel's clock to @now, processing all slots due until then. */
+static void wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+    struct hlist_head *head;
+    struct timer *t;
+    uint64_t next;
+    unsigned int lvl, idx;
+
+    while ( (next = wheel_next_tick(w)) != 0 && next <= now )
+    {
+        w->clk = next;
+
+        for ( lvl = 0; lvl < WHEEL_LEVELS; lvl++ )
+        {
+            if ( next & ((1ULL << wheel_shift(lvl)) - 1) )
+                break;
+
+            idx = (next >> wheel_shift(lvl)) & (WHEEL_SLOTS - 1);
+            head = &w->slot[lvl][idx];
+            while ( !hlist_empty(head) )
+            {
+                t = hlist_entry(head->first, struct timer, wheel);
+                remove_from_wheel(w, t);
+                t->status = TIMER_STATUS_invalid;
+                add_entry(t);
+            }
+        }
+    }
+
+    if ( w->clk < now )
+        w->clk = now;
+}
+
+
 /****************************************************************************
  * TIMER OPERATIONS.
  */
@@ -193,6 +348,10 @@ static int remove_entry(struct timer *t)
     case TIMER_STATUS_in_list:
         rc = remove_from_list(&timers->list, t);
         break;
+    case TIMER_STATUS_in_wheel:
+        remove_from_wheel(timers->wheel, t);
+        rc = 0;
+        break;
     default:
         rc = 0;
         BUG();
@@ -209,6 +368,16 @@ static int add_entry(struct timer *t)
 
     ASSERT(t->status == TIMER_STATUS_invalid);
 
+    /* Timers not about to expire go onto the wheel. */
+    if ( timers->wheel && !wheel_is_near(timers->wheel, t->expires) )
+    {
+        s_time_t deadline = per_cpu(timer_deadline, t->cpu);
+        s_time_t when = add_to_wheel(timers->wheel, t) << WHEEL_TICK_SHIFT;
+
+        t->status = TIMER_STATUS_in_wheel;
+        return !deadline || when < deadline;
+    }
+
     /* Try to add to heap. t->heap_offset indicates whether we succeed. */
     t->heap_offset = 0;
     t->status = TIMER_STATUS_in_heap;
@@ -455,10 +624,25 @@ static void cf_check timer_softirq_action(void)
     struct timer  *t, **heap, *next;
     struct timers *ts;
     s_time_t       now, deadline;
+    uint64_t       tick;
 
     ts = &this_cpu(timers);
     heap = ts->heap;
 
+    /* Set up the timer wheel, unless done already. */
+    if ( unlikely(!ts->wheel) )
+    {
+        struct timer_wheel *wheel = xzalloc(struct timer_wheel);
+
+        if ( wheel != NULL )
+        {
+            spin_lock_irq(&ts->lock);
+            wheel->clk = NOW() >> WHEEL_TICK_SHIFT;
+            ts->wheel = wheel;
+            spin_unlock_irq(&ts->lock);
+        }
+    }
+
     /* If we overflowed the heap, try to allocate a larger heap. */
     if ( unlikely(ts->list != NULL) )
     {
@@ -491,6 +675,10 @@ static void cf_check timer_softirq_action(void)
 
     now = NOW();
 
+    /* Move the timers due next from the wheel to the heap. */
+    if ( ts->wheel )
+        wheel_advance(ts->wheel, now >> WHEEL_TICK_SHIFT);
+
     /* Execute ready heap timers. */
     while ( (heap_metadata(heap)->size != 0) &&
             ((t = heap[1])->expires < now) )
@@ -516,12 +704,18 @@ static void cf_check timer_softirq_action(void)
         add_entry(t);
     }
 
-    /* Find earliest deadline from head of linked list and top of heap. */
+    /*
+     * Find earliest deadline from head of linked list, top of heap, and the
+     * next slot of the wheel to process.
+     */
     deadline = STIME_MAX;
     if ( heap_metadata(heap)->size != 0 )
         deadline = heap[1]->expires;
     if ( (ts->list != NULL) && (ts->list->expires < deadline) )
         deadline = ts->list->expires;
+    if ( ts->wheel && (tick = wheel_next_tick(ts->wheel)) != 0 &&
+         (s_time_t)(tick << WHEEL_TICK_SHIFT) < deadline )
+        deadline = tick << WHEEL_TICK_SHIFT;
     now = NOW();
     this_cpu(timer_deadline) =
         (deadline == STIME_MAX) ? 0 : MAX(deadline, now + timer_slop);
@@ -553,6 +747,7 @@ static void cf_check dump_timerq(unsigned char key)
     unsigned long  flags;
     s_time_t       now = NOW();
     unsigned int   i, j;
+    struct hlist_node *n;
 
     printk("Dumping timer queues:\n");
 
@@ -566,6 +761,9 @@ static void cf_check dump_timerq(unsigned char key)
             dump_timer(ts->heap[j], now);
         for ( t = ts->list; t != NULL; t = t->list_next )
             dump_timer(t, now);
+        for ( j = 0; ts->wheel && j < WHEEL_LEVELS * WHEEL_SLOTS; j++ )
+            for ( n = wheel_slot(ts->wheel, j)->first; n; n = n->next )
+                dump_timer(hlist_entry(n, struct timer, wheel), now);
         spin_unlock_irqrestore(&ts->lock, flags);
     }
 }
@@ -593,8 +791,9 @@ static void migrate_timers_from_cpu(unsigned int old_cpu)
         spin_lock(&old_ts->lock);
     }
 
-    while ( (t = heap_metadata(old_ts->heap)->size
-             ? old_ts->heap[1] : old_ts->list) != NULL )
+    while ( (t = heap_metadata(old_ts->heap)->size ? old_ts->heap[1]
+                                                   : old_ts->list) != NULL ||
+            (t = wheel_any(old_ts->wheel)) != NULL )
     {
         remove_entry(t);
         write_atomic(&t->cpu, new_cpu);
@@ -628,6 +827,8 @@ static void free_percpu_timers(unsigned int cpu)
     struct timers *ts = &per_cpu(timers, cpu);
 
     ASSERT(heap_metadata(ts->heap)->size == 0);
+    ASSERT(!wheel_any(ts->wheel));
+    XFREE(ts->wheel);
     if ( heap_metadata(ts->heap)->limit )
     {
         xfree(ts->heap);
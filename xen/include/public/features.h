@@ -111,6 +111,13 @@
 #define XENFEAT_not_direct_mapped         16
 #define XENFEAT_direct_mapped             17
 
+/*
+ * If set, GNTMAP_persistent, GNTTABOP_revalidate and
+ * GNTTABOP_revoke_persistent are available.  Older hypervisors ignore
+ * GNTMAP_persistent and create an ordinary mapping.
+ */
+#define XENFEAT_gnttab_persistent         18
+
 #define XENFEAT_NR_SUBMAPS 1
 
 #endif /* __XEN_PUBLIC_FEATURES_H__ */
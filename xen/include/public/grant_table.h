@@ -160,6 +160,8 @@ typedef struct grant_entry_v1 grant_entry_v1_t;
  *  GTF_sub_page: Grant access to only a subrange of the page.  @domid
  *                will only be allowed to copy from the grant, and not
  *                map it. [GST]
+ *  GTF_persistent: @domid may keep the grant mapped across uses, see
+ *                  GNTMAP_persistent and GNTTABOP_revoke_persistent. [GST]
  */
 #define _GTF_readonly       (2)
 #define GTF_readonly        (1U<<_GTF_readonly)
@@ -175,6 +177,8 @@ typedef struct grant_entry_v1 grant_entry_v1_t;
 #define GTF_PAT             (1U<<_GTF_PAT)
 #define _GTF_sub_page       (8)
 #define GTF_sub_page        (1U<<_GTF_sub_page)
+#define _GTF_persistent     (9)
+#define GTF_persistent      (1U<<_GTF_persistent)
 
 /*
  * Subflags for GTF_accept_transfer:
@@ -298,6 +302,8 @@ typedef uint16_t grant_status_t;
 #define GNTTABOP_get_version          10
 #define GNTTABOP_swap_grant_ref	      11
 #define GNTTABOP_cache_flush	      12
+#define GNTTABOP_revalidate           13
+#define GNTTABOP_revoke_persistent    14
 #endif /* __XEN_INTERFACE_VERSION__ */
 /* ` } */
 
@@ -582,6 +588,33 @@ struct gnttab_cache_flush {
 typedef struct gnttab_cache_flush gnttab_cache_flush_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
 
+/*
+ * GNTTABOP_revalidate: Check that mappings created with GNTMAP_persistent
+ * have not been revoked by the granting domain since.  This is much cheaper
+ * than unmapping and re-mapping the grants for each use: no page references
+ * are taken and no TLB or IOMMU flushes are needed.  Mappings reported as
+ * GNTST_revoked are still in place and need to be unmapped as usual.
+ */
+struct gnttab_revalidate {
+    /* IN parameters */
+    grant_handle_t handle;
+    /* OUT parameters */
+    int16_t status;             /* => enum grant_status */
+};
+typedef struct gnttab_revalidate gnttab_revalidate_t;
+DEFINE_XEN_GUEST_HANDLE(gnttab_revalidate_t);
+
+/*
+ * GNTTABOP_revoke_persistent: Revoke persistent mappings of the calling
+ * domain's grant entries which have had GTF_persistent cleared.  Mappings of
+ * such entries fail GNTTABOP_revalidate afterwards.
+ * Revocation is advisory: Xen neither removes the mappings nor prevents
+ * their use, it is up to the mapping domain to revalidate them and unmap
+ * the revoked ones.  The entries must therefore not be reused before
+ * GTF_reading and GTF_writing are clear, as usual.
+ * Takes no arguments, @count must be zero.
+ */
+
 #endif /* __XEN_INTERFACE_VERSION__ */
 
 /*
@@ -612,6 +645,15 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
 #define _GNTMAP_contains_pte    (4)
 #define GNTMAP_contains_pte     (1<<_GNTMAP_contains_pte)
 
+ /*
+  * Map a grant entry with GTF_persistent set, to be kept across uses.  Use
+  * GNTTABOP_revalidate to check whether the mapping has been revoked.
+  * Only supported when XENFEAT_gnttab_persistent is set: older hypervisors
+  * silently ignore this flag.
+  */
+#define _GNTMAP_persistent      (5)
+#define GNTMAP_persistent       (1<<_GNTMAP_persistent)
+
 /*
  * Bits to be placed in guest kernel available PTE bits (architecture
  * dependent; only supported when XENFEAT_gnttab_map_avail_bits is set).
@@ -637,6 +679,7 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
 #define GNTST_address_too_big (-11) /* transfer page address too large.      */
 #define GNTST_eagain          (-12) /* Operation not done; try again.        */
 #define GNTST_no_space        (-13) /* Out of space (handles etc).           */
+#define GNTST_revoked         (-14) /* Persistent mapping revoked.           */
 /* ` } */
 
 #define GNTTABOP_error_msgs {                   \
@@ -654,6 +697,7 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_cache_flush_t);
     "page address size too large",              \
     "operation not done; try again",            \
     "out of space",                             \
+    "persistent mapping revoked",               \
 }
 
 #endif /* __XEN_PUBLIC_GRANT_TABLE_H__ */
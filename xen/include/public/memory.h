@@ -381,10 +381,18 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+/*
+ * Enter the @nr gfns starting at @gfn into the paged-out state, evicting any
+ * memory currently backing them.  Used when restoring a domain whose memory
+ * is to be supplied on demand through the paging ring (post-copy migration).
+ */
+#define XENMEM_paging_op_populate_evicted   3
 
 struct xen_mem_paging_op {
     uint8_t     op;         /* XENMEM_paging_op_* */
     domid_t     domain;
+    /* IN: (XENMEM_paging_op_populate_evicted) number of gfns */
+    uint32_t    nr;
 
     /* IN: (XENMEM_paging_op_prep) buffer to immediately fill page from */
     XEN_GUEST_HANDLE_64(const_uint8) buffer;
@@ -113,6 +113,14 @@
  * to be part of the domain's cpupool.
  */
 #define SCHEDOP_pin_override 7
+
+/*
+ * Voluntarily yield the CPU in favour of another vcpu of the calling domain,
+ * e.g. one holding a lock the caller is spinning on.  The scheduler is asked
+ * to run the target vcpu soon, if it is runnable but has been preempted.
+ * @arg == pointer to sched_yield_to_t structure.
+ */
+#define SCHEDOP_yield_to    8
 /* ` } */
 
 struct sched_shutdown {
@@ -149,6 +157,12 @@ struct sched_pin_override {
 typedef struct sched_pin_override sched_pin_override_t;
 DEFINE_XEN_GUEST_HANDLE(sched_pin_override_t);
 
+struct sched_yield_to {
+    uint32_t vcpu;              /* vcpu id of the target */
+};
+typedef struct sched_yield_to sched_yield_to_t;
+DEFINE_XEN_GUEST_HANDLE(sched_yield_to_t);
+
 /*
  * Reason codes for SCHEDOP_shutdown. These may be interpreted by control
  * software to determine the appropriate action. For the most part, Xen does
@@ -221,6 +221,20 @@ struct vcpu_register_time_memory_area {
 typedef struct vcpu_register_time_memory_area vcpu_register_time_memory_area_t;
 DEFINE_XEN_GUEST_HANDLE(vcpu_register_time_memory_area_t);
 
+/*
+ * Like VCPUOP_register_runstate_memory_area, but the area is specified by
+ * its guest physical address (addr.p), and it must not cross a page
+ * boundary.  The area is updated each time the VCPU is scheduled or
+ * de-scheduled, independent of the guest's page tables.  Thus other VCPUs
+ * of the guest can reliably tell from runstate.state being
+ * RUNSTATE_runnable that the VCPU has been preempted, e.g. to stop spinning
+ * on a lock held by it.  A value of ~0 for addr.p unregisters the area.
+ *
+ * This may be used in addition to VCPUOP_register_runstate_memory_area.
+ * @extra_arg == pointer to vcpu_register_runstate_memory_area structure.
+ */
+#define VCPUOP_register_runstate_phys_area      14
+
 #endif /* __XEN_PUBLIC_VCPU_H__ */
 
 /*
@@ -76,6 +76,8 @@ void arch_vcpu_destroy(struct vcpu *v);
 
 int map_vcpu_info(struct vcpu *v, unsigned long gfn, unsigned int offset);
 void unmap_vcpu_info(struct vcpu *v);
+int map_runstate_area(struct vcpu *v, paddr_t gaddr);
+void unmap_runstate_area(struct vcpu *v);
 
 int arch_domain_create(struct domain *d,
                        struct xen_domctl_createdomain *config,
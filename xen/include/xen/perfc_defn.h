@@ -12,6 +12,11 @@ PERFCOUNTER(irqs,                   "#interrupts")
 PERFCOUNTER(ipis,                   "#IPIs")
 
 PERFCOUNTER(rcu_idle_timer,         "RCU: idle_timer")
+PERFCOUNTER(rcu_expedited,          "RCU: expedite kicks")
+
+PERFCOUNTER(gnttab_copy,            "gnttab: copy ops")
+PERFCOUNTER(gnttab_copy_buf_hit,    "gnttab: copy buffer reused")
+PERFCOUNTER(gnttab_copy_buf_claim,  "gnttab: copy buffer claimed")
 
 /* Generic scheduler counters (applicable to all schedulers) */
 PERFCOUNTER(sched_irq,              "sched: timer")
@@ -21,6 +26,7 @@ PERFCOUNTER(schedule,               "sched: specific scheduler")
 PERFCOUNTER(dom_init,               "sched: dom_init")
 PERFCOUNTER(dom_destroy,            "sched: dom_destroy")
 PERFCOUNTER(vcpu_yield,             "sched: vcpu_yield")
+PERFCOUNTER(vcpu_boost,             "sched: vcpu_boost")
 PERFCOUNTER(unit_alloc,             "sched: unit_alloc")
 PERFCOUNTER(unit_insert,            "sched: unit_insert")
 PERFCOUNTER(unit_remove,            "sched: unit_remove")
@@ -32,6 +38,7 @@ PERFCOUNTER(unit_wake_not_runnable, "sched: unit_wake_not_runnable")
 PERFCOUNTER(tickled_no_cpu,         "sched: tickled_no_cpu")
 PERFCOUNTER(tickled_idle_cpu,       "sched: tickled_idle_cpu")
 PERFCOUNTER(tickled_idle_cpu_excl,  "sched: tickled_idle_cpu_exclusive")
+PERFCOUNTER(tickled_idle_shallow,   "sched: tickled_idle_shallow")
 PERFCOUNTER(tickled_busy_cpu,       "sched: tickled_busy_cpu")
 PERFCOUNTER(unit_check,             "sched: unit_check")
 PERFCOUNTER(migrate_running,        "sched: migrate_running")
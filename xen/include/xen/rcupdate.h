@@ -177,6 +177,8 @@ void call_rcu(struct rcu_head *head,
 
 void rcu_barrier(void);
 
+void rcu_expedite(void);
+
 void rcu_idle_enter(unsigned int cpu);
 void rcu_idle_exit(unsigned int cpu);
 
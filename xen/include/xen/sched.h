@@ -202,6 +202,9 @@ struct vcpu
         XEN_GUEST_HANDLE(vcpu_runstate_info_compat_t) compat;
     } runstate_guest; /* guest address */
 #endif
+    /* Runstate area registered by guest physical address, if any. */
+    struct page_info *runstate_pg;
+    void            *runstate_map;
     unsigned int     new_state;
 
     /* Has the FPU been initialised? */
@@ -267,11 +270,12 @@ struct vcpu
      * protects:
      *  - entries in the freelist
      *  - maptrack_head
-     *  - maptrack_tail
+     * maptrack_remote is the head of a lock-free stack of entries freed
+     * back to this vCPU, which is taken as a whole to refill the freelist.
      */
     spinlock_t       maptrack_freelist_lock;
     unsigned int     maptrack_head;
-    unsigned int     maptrack_tail;
+    unsigned int     maptrack_remote;
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];
@@ -318,6 +322,8 @@ struct sched_unit {
     bool                   soft_aff_effective;
     /* Item has been migrated to other cpu(s). */
     bool                   migrated;
+    /* Became runnable by a wakeup (for latency statistics). */
+    bool                   woken;
 
     /* Last time unit got (de-)scheduled. */
     uint64_t               state_entry_time;
@@ -408,6 +414,7 @@ struct domain
     void            *sched_priv;    /* scheduler-specific data */
     struct sched_unit *sched_unit_list;
     struct cpupool  *cpupool;
+    unsigned int     last_boosted_vcpu; /* for vcpu_yield_on_spin() */
 
     struct domain   *next_in_list;
     struct domain   *next_in_hashbucket;
@@ -792,6 +799,7 @@ void sched_destroy_domain(struct domain *d);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
 int  sched_id(void);
+bool sched_cpu_is_idle(unsigned int cpu);
 
 /*
  * sched_get_id_by_name - retrieves a scheduler id given a scheduler name
@@ -805,6 +813,7 @@ int sched_get_id_by_name(const char *sched_name);
 
 void vcpu_wake(struct vcpu *v);
 long vcpu_yield(void);
+void vcpu_yield_on_spin(void);
 void vcpu_sleep_nosync(struct vcpu *v);
 void vcpu_sleep_sync(struct vcpu *v);
 
@@ -1025,6 +1034,14 @@ static inline bool sched_has_urgent_vcpu(void)
     return atomic_read(&this_cpu(sched_urgent_count));
 }
 
+/*
+ * Exit latency (in microseconds) of the idle state a cpu is in, 0 if it is
+ * running or in a state without measurable exit latency.  Maintained by the
+ * arch specific idle code, used by schedulers to prefer waking up cpus in
+ * shallow idle states.
+ */
+DECLARE_PER_CPU(unsigned int, cpu_idle_latency);
+
 void vcpu_set_periodic_timer(struct vcpu *v, s_time_t value);
 void sched_setup_dom0_vcpus(struct domain *d);
 int vcpu_temporary_affinity(struct vcpu *v, unsigned int cpu, uint8_t reason);
@@ -1035,6 +1052,7 @@ int vcpu_affinity_domctl(struct domain *d, uint32_t cmd,
 void vcpu_runstate_get(const struct vcpu *v,
                        struct vcpu_runstate_info *runstate);
 uint64_t get_cpu_idle_time(unsigned int cpu);
+s_time_t sched_expected_idle_time(void);
 void sched_guest_idle(void (*idle) (void), unsigned int cpu);
 void scheduler_enable(void);
 void scheduler_disable(void);
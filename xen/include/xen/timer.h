@@ -24,6 +24,8 @@ struct timer {
         unsigned int heap_offset;
         /* Linked list (TIMER_STATUS_in_list). */
         struct timer *list_next;
+        /* Timer-wheel slot list (TIMER_STATUS_in_wheel). */
+        struct hlist_node wheel;
         /* Linked list of inactive timers (TIMER_STATUS_inactive). */
         struct list_head inactive;
     };
@@ -42,7 +44,11 @@ struct timer {
 #define TIMER_STATUS_killed   2 /* Not in use; cannot be activated. */
 #define TIMER_STATUS_in_heap  3 /* In use; on timer heap.           */
 #define TIMER_STATUS_in_list  4 /* In use; on overflow linked list. */
+#define TIMER_STATUS_in_wheel 5 /* In use; on timer wheel.          */
     uint8_t status;
+
+    /* Timer-wheel slot (TIMER_STATUS_in_wheel). */
+    uint8_t wheel_slot;
 };
 
 /*
@@ -84,7 +90,7 @@ bool timer_expires_before(struct timer *timer, s_time_t t);
  */
 static inline bool timer_is_active(const struct timer *timer)
 {
-    ASSERT(timer->status <= TIMER_STATUS_in_list);
+    ASSERT(timer->status <= TIMER_STATUS_in_wheel);
     return timer->status >= TIMER_STATUS_in_heap;
 }
 